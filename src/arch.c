@@ -19,7 +19,7 @@
     University College London, Gower Street, London WC1E 6BT, England
 */
 
-#include "bpp-tools.h"
+#include "libbpptools.h"
 
 uint64_t arch_get_memused()
 {
@@ -47,6 +47,7 @@ uint64_t arch_get_memused()
 #endif
 }
 
+/* returns 0 if the amount of RAM cannot be determined */
 uint64_t arch_get_memtotal()
 {
 #ifdef _WIN32
@@ -62,7 +63,7 @@ uint64_t arch_get_memtotal()
   int64_t ram = 0;
   size_t length = sizeof(ram);
   if(sysctl(mib, 2, &ram, &length, NULL, 0) == -1)
-    fatal("Cannot determine amount of RAM");
+    goto l_unknown;
   return ram;
 
 #elif defined(_SC_PHYS_PAGES) && defined(_SC_PAGESIZE)
@@ -70,17 +71,24 @@ uint64_t arch_get_memtotal()
   int64_t phys_pages = sysconf(_SC_PHYS_PAGES);
   int64_t pagesize = sysconf(_SC_PAGESIZE);
   if ((phys_pages == -1) || (pagesize == -1))
-    fatal("Cannot determine amount of RAM");
+    goto l_unknown;
   return pagesize * phys_pages;
 
 #else
 
   struct sysinfo si;
   if (sysinfo(&si))
-    fatal("Cannot determine amount of RAM");
+    goto l_unknown;
   return si.totalram * si.mem_unit;
 
 #endif
+
+#ifndef _WIN32
+l_unknown:
+  bpp_errno = ERROR_ARCH;
+  snprintf(bpp_errmsg, 200, "Cannot determine amount of RAM");
+  return 0;
+#endif
 }
 
 long arch_get_cores()
@@ -119,21 +127,37 @@ void arch_get_user_system_time(double * user_time, double * system_time)
 #endif
 }
 
-void arch_srandom()
+void arch_get_thread_time(double * user_time, double * system_time)
+{
+#if defined(__linux__) && defined(RUSAGE_THREAD)
+  struct rusage r_usage;
+  getrusage(RUSAGE_THREAD, & r_usage);
+  * user_time = r_usage.ru_utime.tv_sec * 1.0 
+    + r_usage.ru_utime.tv_usec * 1.0e-6;
+  * system_time = r_usage.ru_stime.tv_sec * 1.0 
+    + r_usage.ru_stime.tv_usec * 1.0e-6;
+#else
+  /* no per-thread accounting, fall back to process times */
+  arch_get_user_system_time(user_time, system_time);
+#endif
+}
+
+void arch_srandom(long user_seed)
 {
-  /* initialize pseudo-random number generator */
-  unsigned int seed = opt_seed;
+  /* initialize pseudo-random number generator; a zero seed is replaced by
+     a random one, or by one derived from the time and process id if
+     /dev/urandom cannot be read */
+  unsigned int seed = (unsigned int)user_seed;
   if (seed == 0)
     {
 #ifdef _WIN32
       srand(GetTickCount());
 #else
       int fd = open("/dev/urandom", O_RDONLY);
-      if (fd < 0)
-        fatal("Unable to open /dev/urandom");
-      if (read(fd, & seed, sizeof(seed)) < 0)
-        fatal("Unable to read from /dev/urandom");
-      close(fd);
+      if (fd < 0 || read(fd, & seed, sizeof(seed)) != sizeof(seed))
+        seed = (unsigned int)(getusec() ^ ((long)getpid() << 16));
+      if (fd >= 0)
+        close(fd);
       srandom(seed);
 #endif
     }
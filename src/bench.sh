@@ -0,0 +1,264 @@
+#!/bin/sh
+#
+# Copyright (C) 2022-2023 Tomas Flouri
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Affero General Public License as
+# published by the Free Software Foundation, either version 3 of the
+# License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Affero General Public License for more details.
+#
+# You should have received a copy of the GNU Affero General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+# Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+# Department of Genetics, Evolution and Environment,
+# University College London, Gower Street, London WC1E 6BT, England
+
+# Benchmark harness: generates synthetic datasets over a size sweep, runs
+# each command on them and collects wall time, throughput and peak RSS from
+# the --report JSON output into a CSV file. The inner kernels are timed
+# separately for every instruction set by kernbench.
+#
+# Environment variables:
+#   BENCH_OUT      output CSV file (default: bench.csv)
+#   BENCH_KERNELS  kernel benchmark CSV file (default: bench-kernels.csv)
+#   BENCH_DIR      directory for generated data (default: bench-data)
+#   BENCH_LOCI     loci counts to sweep (default: "100 1000 10000")
+#   BENCH_LENGTHS  locus lengths to sweep (default: "500 5000")
+#   BENCH_SEQS     sequences per locus (default: 16)
+#   BENCH_THREADS  thread counts to sweep (default: "1 <cores>")
+#   BENCH_SEED     seed for the generator (default: 1)
+#   BENCH_SMALL    loci in the short-locus dataset (default: 50000)
+#   BENCH_LD_MAX   largest dataset, in total sites, for --ld whose output
+#                  grows with the square of the locus length
+#                  (default: 1000000)
+
+PROG=./bpp-tools
+GEN=./gendata
+KERNBENCH=./kernbench
+
+OUT=${BENCH_OUT:-bench.csv}
+KERNOUT=${BENCH_KERNELS:-bench-kernels.csv}
+DIR=${BENCH_DIR:-bench-data}
+LOCI=${BENCH_LOCI:-"100 1000 10000"}
+LENGTHS=${BENCH_LENGTHS:-"500 5000"}
+SEQS=${BENCH_SEQS:-16}
+CORES=$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 1)
+if [ "$CORES" -gt 1 ]; then
+  THREADS=${BENCH_THREADS:-"1 $CORES"}
+else
+  THREADS=${BENCH_THREADS:-1}
+fi
+SEED=${BENCH_SEED:-1}
+SMALL=${BENCH_SMALL:-50000}
+LDMAX=${BENCH_LD_MAX:-1000000}
+
+if [ ! -x "$PROG" ] || [ ! -x "$GEN" ] || [ ! -x "$KERNBENCH" ]; then
+  echo "Build bpp-tools, gendata and kernbench first (make bench)" >&2
+  exit 1
+fi
+
+mkdir -p "$DIR"
+
+# extract a top-level numeric field from a report
+field()
+{
+  sed -n "s/^  \"$1\": \([0-9.eE+-]*\),*$/\1/p" "$2"
+}
+
+# extract a numeric field of a named phase from a report
+phase_field()
+{
+  sed -n "s/.*\"name\": \"$1\".*\"$2\": \([0-9.eE+-]*\).*/\1/p" "$3"
+}
+
+# run one command on an input of the given size and append one CSV row
+measure()
+{
+  name=$1; bytes=$2; loci=$3; len=$4; seqs=$5; threads=$6
+  shift 6
+
+  report="$DIR/report.json"
+  rm -f "$report"
+  if ! $PROG "$@" --threads "$threads" --quiet \
+       --report "$report" > /dev/null 2>&1; then
+    echo "$name failed" >&2
+    return
+  fi
+
+  wall=$(field wall "$report")
+  user=$(field user "$report")
+  sys=$(field sys "$report")
+  rss=$(field peak_rss "$report")
+  parse_mbs=$(phase_field parse mb_per_sec "$report")
+  lps=$(awk -v l="$loci" -v w="$wall" \
+        'BEGIN { printf "%.3f", (w > 0 ? l/w : 0) }')
+  mbs=$(awk -v b="$bytes" -v w="$wall" \
+        'BEGIN { printf "%.3f", (w > 0 ? b/w/1048576 : 0) }')
+
+  echo "$name,$loci,$seqs,$len,$bytes,$threads,$wall,$user,$sys,$rss,$mbs,$lps,${parse_mbs:-0}" >> "$OUT"
+}
+
+# run one command on an --msa file
+run()
+{
+  name=$1; data=$2; loci=$3; len=$4; seqs=$5; threads=$6
+  shift 6
+
+  measure "$name" "$(wc -c < "$data" | tr -d ' ')" "$loci" "$len" "$seqs" \
+          "$threads" "$@" --msa "$data"
+}
+
+# total size in bytes of a list of files
+bytes_of()
+{
+  cat "$@" | wc -c | tr -d ' '
+}
+
+# write a reference, VCF, BED and Imap for --from-vcf: one chromosome made
+# of LOCI intervals of LEN bases, with a biallelic SNP every 20 bases
+# genotyped in SEQS diploid individuals
+vcf_data()
+{
+  prefix=$1; loci=$2; len=$3; seqs=$4
+  awk -v p="$prefix" -v loci="$loci" -v len="$len" -v n="$seqs" \
+      -v seed="$SEED" '
+    BEGIN {
+      srand(seed)
+      split("A C G T", base, " ")
+      total = loci * len
+      printf ">chr1\n" > (p ".fa")
+      line = ""
+      for (i = 1; i <= total; ++i)
+      {
+        ref[i] = base[int(rand()*4) + 1]
+        line = line ref[i]
+        if (length(line) == 80 || i == total)
+        {
+          print line > (p ".fa")
+          line = ""
+        }
+      }
+      for (i = 0; i < loci; ++i)
+        printf "chr1\t%d\t%d\n", i*len, (i+1)*len > (p ".bed")
+      hdr = "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT"
+      for (k = 1; k <= n; ++k)
+      {
+        hdr = hdr "\ti" k
+        printf "i%d\tS%d\n", k, (k-1)%4 + 1 > (p ".imap")
+      }
+      print "##fileformat=VCFv4.2" > (p ".vcf")
+      print hdr > (p ".vcf")
+      for (i = 10; i <= total; i += 20)
+      {
+        alt = ref[i]
+        while (alt == ref[i])
+          alt = base[int(rand()*4) + 1]
+        rec = "chr1\t" i "\t.\t" ref[i] "\t" alt "\t.\tPASS\t.\tGT"
+        for (k = 1; k <= n; ++k)
+          rec = rec "\t" (rand() < 0.2) "|" (rand() < 0.2)
+        print rec > (p ".vcf")
+      }
+    }'
+}
+
+echo "command,loci,seqs,length,bytes,threads,wall,user,sys,peak_rss,mb_per_sec,loci_per_sec,parse_mb_per_sec" > "$OUT"
+
+for len in $LENGTHS; do
+  for loci in $LOCI; do
+    data="$DIR/data_${loci}_${len}.txt"
+    [ -f "$data" ] || $GEN --loci "$loci" --seqs "$SEQS" --minlen "$len" \
+                           --seed "$SEED" --out "$data"
+
+    fasta="$DIR/fasta_${loci}_${len}"
+    if [ ! -d "$fasta" ]; then
+      mkdir -p "$fasta"
+      $PROG --export fasta --msa "$data" --out "$fasta/locus" --quiet \
+            > /dev/null
+    fi
+
+    vcf="$DIR/vcf_${loci}_${len}"
+    [ -f "$vcf.vcf" ] || vcf_data "$vcf" "$loci" "$len" "$SEQS"
+
+    for t in $THREADS; do
+      run check "$data" "$loci" "$len" "$SEQS" "$t" --check
+      run extract "$data" "$loci" "$len" "$SEQS" "$t" \
+          --extract ^S1,^S2 --out "$DIR/out.txt"
+      run remove  "$data" "$loci" "$len" "$SEQS" "$t" \
+          --remove ^S1 --out "$DIR/out.txt"
+      run explode "$data" "$loci" "$len" "$SEQS" "$t" \
+          --explode --out "$DIR/out"
+      run export "$data" "$loci" "$len" "$SEQS" "$t" \
+          --export nexus --out "$DIR/out"
+      run stats "$data" "$loci" "$len" "$SEQS" "$t" \
+          --stats tsv --out "$DIR/out.txt"
+      run diversity "$data" "$loci" "$len" "$SEQS" "$t" \
+          --diversity --out "$DIR/out.txt"
+      run distances-p "$data" "$loci" "$len" "$SEQS" "$t" \
+          --distances p --out "$DIR/out.txt"
+      run distances-jc69 "$data" "$loci" "$len" "$SEQS" "$t" \
+          --distances jc69 --out "$DIR/out.txt"
+      run sfs "$data" "$loci" "$len" "$SEQS" "$t" \
+          --sfs folded --out "$DIR/out.txt"
+      run composition "$data" "$loci" "$len" "$SEQS" "$t" \
+          --composition pooled --out "$DIR/out.txt"
+      run four-gamete "$data" "$loci" "$len" "$SEQS" "$t" \
+          --four-gamete --out "$DIR/out.txt"
+      if [ $((loci * len)) -le "$LDMAX" ]; then
+        run ld "$data" "$loci" "$len" "$SEQS" "$t" \
+            --ld tsv --out "$DIR/out.txt"
+      fi
+      run collapse-haplotypes "$data" "$loci" "$len" "$SEQS" "$t" \
+          --collapse-haplotypes --out "$DIR/out.txt"
+      run dedup "$data" "$loci" "$len" "$SEQS" "$t" \
+          --dedup ordered --out "$DIR/out.txt"
+      run filter-missing "$data" "$loci" "$len" "$SEQS" "$t" \
+          --filter-missing --out "$DIR/out.txt"
+      measure from-fasta "$(bytes_of "$fasta"/*)" "$loci" "$len" "$SEQS" \
+              "$t" --from-fasta "$fasta" --out "$DIR/out.txt"
+      measure from-vcf "$(bytes_of "$vcf.vcf")" "$loci" "$len" "$SEQS" \
+              "$t" --from-vcf "$vcf.vcf" --ref "$vcf.fa" --bed "$vcf.bed" \
+              --imap "$vcf.imap" --out "$DIR/out.txt"
+      rm -f "$DIR"/out*
+    done
+  done
+
+  # D-statistic on a single four-sequence locus of increasing length
+  for loci in $LOCI; do
+    dlen=$((len * loci))
+    data="$DIR/dstat_${dlen}.txt"
+    [ -f "$data" ] || $GEN --loci 1 --seqs 4 --species 4 --minlen "$dlen" \
+                           --seed "$SEED" --out "$data"
+    for t in $THREADS; do
+      run dstat "$data" 1 "$dlen" 4 "$t" --dstat ^S1,^S2,^S3,^S4
+    done
+  done
+done
+
+# many short four-sequence loci, where per-locus overhead dominates and
+# dstat concatenates all loci into one alignment
+data="$DIR/small_${SMALL}.txt"
+[ -f "$data" ] || $GEN --loci "$SMALL" --seqs 4 --species 4 --minlen 50 \
+                       --maxlen 300 --seed "$SEED" --out "$data"
+for t in $THREADS; do
+  run extract-small "$data" "$SMALL" 175 4 "$t" \
+      --extract ^S1,^S2 --out "$DIR/out.txt"
+  run remove-small  "$data" "$SMALL" 175 4 "$t" \
+      --remove ^S1 --out "$DIR/out.txt"
+  run dstat-small   "$data" "$SMALL" 175 4 "$t" --dstat ^S1,^S2,^S3,^S4
+  rm -f "$DIR"/out*
+done
+
+# kernel microbenchmarks; fails if a SIMD variant disagrees with the scalar
+# reference
+if ! $KERNBENCH --seed "$SEED" --csv "$KERNOUT"; then
+  echo "Kernel check failed" >&2
+  exit 1
+fi
+
+echo "Results written to $OUT and $KERNOUT"
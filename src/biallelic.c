@@ -0,0 +1,119 @@
+/*
+    Copyright (C) 2022-2023 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London, Gower Street, London WC1E 6BT, England
+*/
+
+
+#include "libbpptools.h"
+
+/* Biallelic sites of a locus as bitsets over sequences: for each site, the
+   sequences carrying an unambiguous nucleotide and those among them carrying
+   the first (lower) of the two states. Sites are selected with
+   kernel_site_states; with 'informative' set, both states must be carried
+   by at least two sequences. Bit j stands for sequence order[j] of the
+   locus, or for no sequence if negative, such that the sites of two loci
+   can be compared over the same individuals; without an order bit j stands
+   for sequence j. */
+
+static kernel_map_t bi_kmap;
+static pthread_once_t bi_once = PTHREAD_ONCE_INIT;
+
+static void bi_init()
+{
+  kernel_map_init(&bi_kmap, pll_map_nt);
+}
+
+biallelic_t * biallelic_create(const msa_t * msa,
+                               long informative,
+                               const long * order,
+                               long order_count)
+{
+  long i,j,k;
+  long len = msa->length;
+  long count = order ? order_count : msa->count;
+
+  pthread_once(&bi_once, bi_init);
+
+  biallelic_t * bi = (biallelic_t *)bpp_calloc(1, sizeof(biallelic_t));
+  if (!bi)
+    return NULL;
+  bi->count = count;
+  bi->words = (count + 63) / 64;
+
+  /* once, twice and amb in one block */
+  unsigned char * once = (unsigned char *)bpp_malloc(3*(size_t)MAX(len,1));
+  bi->cols = (long *)bpp_malloc((size_t)MAX(len,1) * sizeof(long));
+  if (!once || !bi->cols)
+    goto l_unwind;
+
+  unsigned char * twice = once + MAX(len,1);
+  unsigned char * amb = twice + MAX(len,1);
+
+  kernel_site_states(msa->sequence, msa->count, len, &bi_kmap, once, twice,
+                     amb);
+
+  for (i = 0; i < len; ++i)
+    if (PLL_POPCOUNT(once[i]) == 2 && (!informative || twice[i] == once[i]))
+      bi->cols[bi->sites++] = i;
+
+  size_t size = (size_t)MAX(bi->sites*bi->words,1);
+  bi->present = (unsigned long *)bpp_calloc(size, sizeof(unsigned long));
+  bi->allele = (unsigned long *)bpp_calloc(size, sizeof(unsigned long));
+  if (!bi->present || !bi->allele)
+    goto l_unwind;
+
+  for (j = 0; j < count; ++j)
+  {
+    long seq = order ? order[j] : j;
+    unsigned long bit = 1ul << (j & 63);
+
+    if (seq < 0) continue;
+
+    const unsigned char * s = (const unsigned char *)msa->sequence[seq];
+
+    for (k = 0; k < bi->sites; ++k)
+    {
+      long c = bi->cols[k];
+      unsigned int code = pll_map_nt[s[c]] & 0xf;
+
+      if (!kernel_nt_single[code]) continue;
+
+      bi->present[k*bi->words + j/64] |= bit;
+      if (code == (unsigned int)(once[c] & -once[c]))
+        bi->allele[k*bi->words + j/64] |= bit;
+    }
+  }
+
+  free(once);
+
+  return bi;
+
+l_unwind:
+  free(once);
+  biallelic_destroy(bi);
+  return NULL;
+}
+
+void biallelic_destroy(biallelic_t * bi)
+{
+  free(bi->cols);
+  free(bi->present);
+  free(bi->allele);
+  free(bi);
+}
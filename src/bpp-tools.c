@@ -29,34 +29,53 @@ static char * progname;
 static char progheader[80];
 char * cmdline;
 
-/* global error message buffer */
-__THREAD int bpp_errno;
-__THREAD char bpp_errmsg[200] = {0};
-
 /* options */
 long opt_arch;
 long opt_explode;
 long opt_help;
 long opt_quiet;
 long opt_seed;
+long opt_threads;
+long opt_timing;
 long opt_version;
 char * opt_msafile;
 char * opt_outfile;
 char * opt_dstat;
 char * opt_extract;
 char * opt_remove;
-
-long mmx_present;
-long sse_present;
-long sse2_present;
-long sse3_present;
-long ssse3_present;
-long sse41_present;
-long sse42_present;
-long popcnt_present;
-long avx_present;
-long avx2_present;
-long altivec_present;
+char * opt_report;
+char * opt_serve;
+char * opt_cache;
+char * opt_manifest;
+char * opt_from_fasta;
+char * opt_export;
+char * opt_from_vcf;
+char * opt_ref;
+char * opt_bed;
+char * opt_imap;
+long opt_phased;
+long opt_check;
+char * opt_stats;
+long opt_diversity;
+long opt_iupac_half;
+char * opt_distances;
+char * opt_dist_format;
+char * opt_sfs;
+char * opt_outgroup;
+char * opt_composition;
+long opt_four_gamete;
+char * opt_ld;
+double opt_ld_min_r2;
+long opt_ld_between;
+long opt_collapse_haplotypes;
+char * opt_haplotypes;
+char * opt_dedup;
+long opt_filter_missing;
+double opt_seq_missing;
+double opt_site_missing;
+long opt_min_seqs;
+long opt_min_sites;
+long opt_cache_verify;
 
 static struct option long_options[] =
 {
@@ -69,9 +88,73 @@ static struct option long_options[] =
   {"explode",      no_argument,       0, 0 },  /*  6 */
   {"extract",      required_argument, 0, 0 },  /*  7 */
   {"remove",       required_argument, 0, 0 },  /*  8 */
+  {"threads",      required_argument, 0, 0 },  /*  9 */
+  {"timing",       no_argument,       0, 0 },  /* 10 */
+  {"report",       required_argument, 0, 0 },  /* 11 */
+  {"arch",         required_argument, 0, 0 },  /* 12 */
+  {"serve",        required_argument, 0, 0 },  /* 13 */
+  {"cache",        required_argument, 0, 0 },  /* 14 */
+  {"manifest",     required_argument, 0, 0 },  /* 15 */
+  {"from-fasta",   required_argument, 0, 0 },  /* 16 */
+  {"export",       required_argument, 0, 0 },  /* 17 */
+  {"from-vcf",     required_argument, 0, 0 },  /* 18 */
+  {"ref",          required_argument, 0, 0 },  /* 19 */
+  {"bed",          required_argument, 0, 0 },  /* 20 */
+  {"imap",         required_argument, 0, 0 },  /* 21 */
+  {"phased",       no_argument,       0, 0 },  /* 22 */
+  {"check",        no_argument,       0, 0 },  /* 23 */
+  {"stats",        required_argument, 0, 0 },  /* 24 */
+  {"diversity",    no_argument,       0, 0 },  /* 25 */
+  {"iupac-half",   no_argument,       0, 0 },  /* 26 */
+  {"distances",    required_argument, 0, 0 },  /* 27 */
+  {"dist-format",  required_argument, 0, 0 },  /* 28 */
+  {"sfs",          required_argument, 0, 0 },  /* 29 */
+  {"outgroup",     required_argument, 0, 0 },  /* 30 */
+  {"composition",  required_argument, 0, 0 },  /* 31 */
+  {"four-gamete",  no_argument,       0, 0 },  /* 32 */
+  {"ld",           required_argument, 0, 0 },  /* 33 */
+  {"ld-min-r2",    required_argument, 0, 0 },  /* 34 */
+  {"ld-between",   no_argument,       0, 0 },  /* 35 */
+  {"collapse-haplotypes", no_argument, 0, 0 },  /* 36 */
+  {"haplotypes",   required_argument, 0, 0 },  /* 37 */
+  {"dedup",        required_argument, 0, 0 },  /* 38 */
+  {"filter-missing", no_argument,     0, 0 },  /* 39 */
+  {"seq-missing",  required_argument, 0, 0 },  /* 40 */
+  {"site-missing", required_argument, 0, 0 },  /* 41 */
+  {"min-seqs",     required_argument, 0, 0 },  /* 42 */
+  {"min-sites",    required_argument, 0, 0 },  /* 43 */
+  {"cache-verify", no_argument,       0, 0 },  /* 44 */
   { 0, 0, 0, 0 }
 };
 
+/* the whole argument must be a positive integer */
+static long positive_integer(const char * arg, const char * option)
+{
+  char * end;
+  long value;
+
+  errno = 0;
+  value = strtol(arg, &end, 10);
+  if (errno || end == arg || *end || value < 1)
+    fatal("Option --%s requires a positive integer (%s)", option, arg);
+
+  return value;
+}
+
+/* the whole argument must be a number between 0 and 1 */
+static double fraction(const char * arg, const char * option)
+{
+  char * end;
+  double value;
+
+  errno = 0;
+  value = strtod(arg, &end);
+  if (errno || end == arg || *end || !(value >= 0 && value <= 1))
+    fatal("Option --%s requires a number between 0 and 1 (%s)", option, arg);
+
+  return value;
+}
+
 void args_init(int argc, char ** argv)
 {
   int option_index = 0;
@@ -89,6 +172,41 @@ void args_init(int argc, char ** argv)
   opt_outfile = NULL;
   opt_quiet = 0;
   opt_seed = -1;
+  opt_threads = 0;
+  opt_timing = 0;
+  opt_report = NULL;
+  opt_serve = NULL;
+  opt_cache = NULL;
+  opt_manifest = NULL;
+  opt_from_fasta = NULL;
+  opt_export = NULL;
+  opt_from_vcf = NULL;
+  opt_ref = NULL;
+  opt_bed = NULL;
+  opt_imap = NULL;
+  opt_phased = 0;
+  opt_check = 0;
+  opt_stats = NULL;
+  opt_diversity = 0;
+  opt_iupac_half = 0;
+  opt_distances = NULL;
+  opt_dist_format = NULL;
+  opt_sfs = NULL;
+  opt_outgroup = NULL;
+  opt_composition = NULL;
+  opt_four_gamete = 0;
+  opt_ld = NULL;
+  opt_ld_min_r2 = 0;
+  opt_ld_between = 0;
+  opt_collapse_haplotypes = 0;
+  opt_haplotypes = NULL;
+  opt_dedup = NULL;
+  opt_filter_missing = 0;
+  opt_seq_missing = 1;
+  opt_site_missing = 1;
+  opt_min_seqs = 1;
+  opt_min_sites = 1;
+  opt_cache_verify = 0;
   opt_version = 0;
 
 
@@ -132,6 +250,177 @@ void args_init(int argc, char ** argv)
         opt_remove = xstrdup(optarg);
         break;
 
+      case 9:
+        opt_threads = atol(optarg);
+        if (opt_threads < 1)
+          fatal("Option --threads requires a positive integer");
+        break;
+
+      case 10:
+        opt_timing = 1;
+        break;
+
+      case 11:
+        opt_report = xstrdup(optarg);
+        break;
+
+      case 12:
+        if (!strcasecmp(optarg,"cpu"))
+          opt_arch = PLL_ATTRIB_ARCH_CPU;
+        else if (!strcasecmp(optarg,"sse"))
+          opt_arch = PLL_ATTRIB_ARCH_SSE;
+        else if (!strcasecmp(optarg,"avx"))
+          opt_arch = PLL_ATTRIB_ARCH_AVX;
+        else if (!strcasecmp(optarg,"avx2"))
+          opt_arch = PLL_ATTRIB_ARCH_AVX2;
+        else
+          fatal("Invalid instruction set (%s) in --arch", optarg);
+        break;
+
+      case 13:
+        opt_serve = xstrdup(optarg);
+        break;
+
+      case 14:
+        opt_cache = xstrdup(optarg);
+        break;
+
+      case 15:
+        opt_manifest = xstrdup(optarg);
+        break;
+
+      case 16:
+        opt_from_fasta = xstrdup(optarg);
+        break;
+
+      case 17:
+        if (strcasecmp(optarg,"fasta") && strcasecmp(optarg,"nexus"))
+          fatal("Invalid format (%s) in --export", optarg);
+        opt_export = xstrdup(optarg);
+        break;
+
+      case 18:
+        opt_from_vcf = xstrdup(optarg);
+        break;
+
+      case 19:
+        opt_ref = xstrdup(optarg);
+        break;
+
+      case 20:
+        opt_bed = xstrdup(optarg);
+        break;
+
+      case 21:
+        opt_imap = xstrdup(optarg);
+        break;
+
+      case 22:
+        opt_phased = 1;
+        break;
+
+      case 23:
+        opt_check = 1;
+        break;
+
+      case 24:
+        if (strcasecmp(optarg,"tsv") && strcasecmp(optarg,"json"))
+          fatal("Invalid format (%s) in --stats", optarg);
+        opt_stats = xstrdup(optarg);
+        break;
+
+      case 25:
+        opt_diversity = 1;
+        break;
+
+      case 26:
+        opt_iupac_half = 1;
+        break;
+
+      case 27:
+        if (strcasecmp(optarg,"p") && strcasecmp(optarg,"jc69") &&
+            !aa_model_find(optarg))
+          fatal("Invalid model (%s) in --distances", optarg);
+        opt_distances = xstrdup(optarg);
+        break;
+
+      case 28:
+        if (strcasecmp(optarg,"phylip") && strcasecmp(optarg,"binary"))
+          fatal("Invalid format (%s) in --dist-format", optarg);
+        opt_dist_format = xstrdup(optarg);
+        break;
+
+      case 29:
+        if (strcasecmp(optarg,"folded") && strcasecmp(optarg,"unfolded"))
+          fatal("Invalid spectrum (%s) in --sfs", optarg);
+        opt_sfs = xstrdup(optarg);
+        break;
+
+      case 30:
+        opt_outgroup = xstrdup(optarg);
+        break;
+
+      case 31:
+        if (strcasecmp(optarg,"pooled") && !aa_model_find(optarg))
+          fatal("Invalid frequencies (%s) in --composition", optarg);
+        opt_composition = xstrdup(optarg);
+        break;
+
+      case 32:
+        opt_four_gamete = 1;
+        break;
+
+      case 33:
+        if (strcasecmp(optarg,"tsv") && strcasecmp(optarg,"binary"))
+          fatal("Invalid format (%s) in --ld", optarg);
+        opt_ld = xstrdup(optarg);
+        break;
+
+      case 34:
+        opt_ld_min_r2 = fraction(optarg, "ld-min-r2");
+        break;
+
+      case 35:
+        opt_ld_between = 1;
+        break;
+
+      case 36:
+        opt_collapse_haplotypes = 1;
+        break;
+
+      case 37:
+        opt_haplotypes = xstrdup(optarg);
+        break;
+
+      case 38:
+        if (strcasecmp(optarg,"ordered") && strcasecmp(optarg,"unordered"))
+          fatal("Invalid mode (%s) in --dedup", optarg);
+        opt_dedup = xstrdup(optarg);
+        break;
+
+      case 39:
+        opt_filter_missing = 1;
+        break;
+
+      case 40:
+        opt_seq_missing = fraction(optarg, "seq-missing");
+        break;
+
+      case 41:
+        opt_site_missing = fraction(optarg, "site-missing");
+        break;
+
+      case 42:
+        opt_min_seqs = positive_integer(optarg, "min-seqs");
+        break;
+
+      case 43:
+        opt_min_sites = positive_integer(optarg, "min-sites");
+        break;
+
+      case 44:
+        opt_cache_verify = 1;
+        break;
 
       default:
         fatal("Internal error in option parsing");
@@ -141,6 +430,10 @@ void args_init(int argc, char ** argv)
   if (c != -1)
     exit(EXIT_FAILURE);
 
+  /* default to one worker thread per core */
+  if (!opt_threads)
+    opt_threads = arch_get_cores();
+
   int commands  = 0;
 
   /* check for number of independent commands selected */
@@ -156,6 +449,38 @@ void args_init(int argc, char ** argv)
     commands++;
   if (opt_remove)
     commands++;
+  if (opt_serve)
+    commands++;
+  if (opt_manifest)
+    commands++;
+  if (opt_from_fasta)
+    commands++;
+  if (opt_export)
+    commands++;
+  if (opt_from_vcf)
+    commands++;
+  if (opt_check)
+    commands++;
+  if (opt_stats)
+    commands++;
+  if (opt_diversity)
+    commands++;
+  if (opt_distances)
+    commands++;
+  if (opt_sfs)
+    commands++;
+  if (opt_composition)
+    commands++;
+  if (opt_four_gamete)
+    commands++;
+  if (opt_ld)
+    commands++;
+  if (opt_collapse_haplotypes)
+    commands++;
+  if (opt_dedup)
+    commands++;
+  if (opt_filter_missing)
+    commands++;
 
   /* if more than one independent command, fail */
   if (commands > 1)
@@ -178,6 +503,25 @@ static void dealloc_switches()
   if (opt_outfile) free(opt_outfile);
   if (opt_extract) free(opt_extract);
   if (opt_remove) free(opt_remove);
+  if (opt_report) free(opt_report);
+  if (opt_serve) free(opt_serve);
+  if (opt_cache) free(opt_cache);
+  if (opt_manifest) free(opt_manifest);
+  if (opt_from_fasta) free(opt_from_fasta);
+  if (opt_export) free(opt_export);
+  if (opt_from_vcf) free(opt_from_vcf);
+  if (opt_ref) free(opt_ref);
+  if (opt_bed) free(opt_bed);
+  if (opt_imap) free(opt_imap);
+  if (opt_stats) free(opt_stats);
+  if (opt_distances) free(opt_distances);
+  if (opt_dist_format) free(opt_dist_format);
+  if (opt_sfs) free(opt_sfs);
+  if (opt_outgroup) free(opt_outgroup);
+  if (opt_composition) free(opt_composition);
+  if (opt_ld) free(opt_ld);
+  if (opt_haplotypes) free(opt_haplotypes);
+  if (opt_dedup) free(opt_dedup);
 }
 
 void cmd_none()
@@ -195,6 +539,24 @@ void cmd_none()
             "bpp-tools --remove CSV --msa FILENAME --output FILENAME\n"
             "bpp-tools --subsample CSV --msa FILENAME --output FILENAME\n"
             "bpp-tools --dstat CSV --msa FILENAME\n"
+            "bpp-tools --serve SOCKET --msa FILENAME\n"
+            "bpp-tools --manifest FILENAME\n"
+            "bpp-tools --from-fasta DIRECTORY --output FILENAME\n"
+            "bpp-tools --export nexus --msa FILENAME --output FILENAME\n"
+            "bpp-tools --from-vcf FILENAME --ref FILENAME --bed FILENAME "
+            "--imap FILENAME --output FILENAME\n"
+            "bpp-tools --check --msa FILENAME\n"
+            "bpp-tools --stats tsv --msa FILENAME --output FILENAME\n"
+            "bpp-tools --diversity --msa FILENAME --output FILENAME\n"
+            "bpp-tools --distances jc69 --msa FILENAME --output FILENAME\n"
+            "bpp-tools --sfs unfolded --outgroup STRING --msa FILENAME\n"
+            "bpp-tools --composition pooled --msa FILENAME --output FILENAME\n"
+            "bpp-tools --four-gamete --msa FILENAME --output FILENAME\n"
+            "bpp-tools --ld tsv --ld-min-r2 0.2 --msa FILENAME --output FILENAME\n"
+            "bpp-tools --collapse-haplotypes --haplotypes FILENAME --msa FILENAME\n"
+            "bpp-tools --dedup ordered --msa FILENAME --output FILENAME\n"
+            "bpp-tools --filter-missing --seq-missing 0.5 --site-missing 0.2 "
+            "--msa FILENAME --output FILENAME\n"
             "\n",
             progname);
 }
@@ -213,6 +575,48 @@ void cmd_help()
           "  --version          display version information\n"
           "  --quiet            only output warnings and fatal errors to stderr\n"
           "  --dstat taxa       run dstatistics\n"
+          "  --threads INT      number of worker threads (default: all cores)\n"
+          "  --timing           print per-phase timing and memory usage\n"
+          "  --report FILE      write per-phase timing report in JSON format\n"
+          "  --arch STRING      instruction set: cpu, sse, avx or avx2 (default: best)\n"
+          "  --serve SOCKET     load --msa once and serve queries on a Unix socket\n"
+          "  --cache DIR        keep parsed datasets in DIR and reuse them; commands\n"
+          "                     that stream --msa then hold all loci in memory\n"
+          "  --cache-verify     reuse a cached dataset only if the file contents\n"
+          "                     are unchanged, not just its size and time (--cache)\n"
+          "  --manifest FILE    process the (input, output, command) rows of FILE\n"
+          "  --from-fasta PATH  convert a directory of per-locus FASTA files\n"
+          "  --export STRING    write each locus of --msa as fasta or nexus\n"
+          "  --from-vcf FILE    build one locus per --bed interval from a VCF\n"
+          "  --ref FILE         reference FASTA for --from-vcf\n"
+          "  --bed FILE         locus intervals for --from-vcf\n"
+          "  --imap FILE        individual to species map for --from-vcf\n"
+          "  --phased           write two haplotypes per individual (--from-vcf)\n"
+          "  --check            validate --msa and report all errors\n"
+          "  --stats STRING     per-locus summary of --msa as tsv or json\n"
+          "  --diversity        pi and Watterson's theta per locus and species\n"
+          "  --iupac-half       two-fold codes are heterozygotes (--diversity, --sfs)\n"
+          "  --distances STRING p or jc69 distances per locus and concatenated, or\n"
+          "                     ML distances per locus under an AA model (e.g. lg)\n"
+          "  --dist-format STR  phylip or binary output of --distances\n"
+          "  --sfs STRING       folded or unfolded site frequency spectra\n"
+          "  --outgroup STRING  species of the ancestral state (--sfs unfolded)\n"
+          "  --composition STR  state frequencies tested against pooled or an AA model\n"
+          "  --four-gamete      recombination screen (Hudson-Kaplan Rm) per locus\n"
+          "  --ld STRING        r2 and D' of site pairs within loci as tsv or binary\n"
+          "  --ld-min-r2 REAL   only report pairs with r2 of at least REAL (--ld)\n"
+          "  --ld-between       also pair the sites of adjacent loci (--ld)\n"
+          "  --collapse-haplotypes\n"
+          "                     map each sequence to its haplotype per locus\n"
+          "  --haplotypes FILE  write the unique haplotypes (--collapse-haplotypes)\n"
+          "  --dedup STRING     drop repeated labels and ordered or unordered\n"
+          "                     duplicate loci\n"
+          "  --filter-missing   drop sequences, sites and loci with missing data\n"
+          "  --seq-missing REAL max fraction of missing data per sequence (default: 1)\n"
+          "  --site-missing REAL\n"
+          "                     max fraction of missing data per site (default: 1)\n"
+          "  --min-seqs INT     min sequences left in a locus (default: 1)\n"
+          "  --min-sites INT    min sites left in a locus (default: 1)\n"
           "\n"
          );
 
@@ -247,11 +651,26 @@ void fillheader()
            arch_get_cores());
 }
 
+/* the header is the output of --version; otherwise it goes to stderr, such
+   that it is not mixed with results written to stdout */
 void show_header()
 {
-  fprintf(stdout, "%s\n", progheader);
-  fprintf(stdout, "https://github.com/xflouris/bpp-tools\n");
-  fprintf(stdout,"\n");
+  FILE * fp = opt_version ? stdout : stderr;
+
+  fprintf(fp, "%s\n", progheader);
+  fprintf(fp, "https://github.com/xflouris/bpp-tools\n");
+  fprintf(fp, "\n");
+}
+
+static const char * arch_name(long arch)
+{
+  if (arch == PLL_ATTRIB_ARCH_SSE)
+    return "SSE";
+  if (arch == PLL_ATTRIB_ARCH_AVX)
+    return "AVX";
+  if (arch == PLL_ATTRIB_ARCH_AVX2)
+    return "AVX2";
+  return "CPU";
 }
 
 int main (int argc, char * argv[])
@@ -260,13 +679,30 @@ int main (int argc, char * argv[])
   getentirecommandline(argc, argv);
 
   args_init(argc, argv);
+  progress_setquiet(opt_quiet);
 
-  show_header();
+  if (!opt_quiet || opt_version || opt_help)
+    show_header();
 
   cpu_features_detect();
-  cpu_features_show();
+  if (!opt_quiet)
+    cpu_features_show();
   if (!opt_version && !opt_help)
-    cpu_setarch();
+  {
+    long user_arch = opt_arch;
+
+    if ((opt_arch = cpu_setarch(opt_arch)) == -1)
+      fatal("%s", bpp_errmsg);
+    kernel_setarch(opt_arch);
+
+    if (!opt_quiet)
+      fprintf(stderr, "%s SIMD ISA: %s\n\n",
+              user_arch == -1 ? "Auto-selected" : "User specified",
+              arch_name(opt_arch));
+  }
+
+  if (opt_timing || opt_report)
+    timing_init();
 
   if (opt_help)
   {
@@ -292,9 +728,78 @@ int main (int argc, char * argv[])
   {
     cmd_remove();
   }
+  else if (opt_serve)
+  {
+    cmd_serve();
+  }
+  else if (opt_manifest)
+  {
+    cmd_manifest();
+  }
+  else if (opt_from_fasta)
+  {
+    cmd_from_fasta();
+  }
+  else if (opt_export)
+  {
+    cmd_export();
+  }
+  else if (opt_from_vcf)
+  {
+    cmd_from_vcf();
+  }
+  else if (opt_check)
+  {
+    cmd_check();
+  }
+  else if (opt_stats)
+  {
+    cmd_stats();
+  }
+  else if (opt_diversity)
+  {
+    cmd_diversity();
+  }
+  else if (opt_distances)
+  {
+    cmd_distances();
+  }
+  else if (opt_sfs)
+  {
+    cmd_sfs();
+  }
+  else if (opt_composition)
+  {
+    cmd_composition();
+  }
+  else if (opt_four_gamete)
+  {
+    cmd_four_gamete();
+  }
+  else if (opt_ld)
+  {
+    cmd_ld();
+  }
+  else if (opt_collapse_haplotypes)
+  {
+    cmd_collapse_haplotypes();
+  }
+  else if (opt_dedup)
+  {
+    cmd_dedup();
+  }
+  else if (opt_filter_missing)
+  {
+    cmd_filter_missing();
+  }
   else
     cmd_none();
 
+  output_commit();
+
+  if (!timing_report(opt_timing, opt_report, cmdline, opt_threads))
+    fatal("%s", bpp_errmsg);
+
   dealloc_switches();
   free(cmdline);
   return (0);
@@ -0,0 +1,409 @@
+/*
+    Copyright (C) 2022-2023 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London, Gower Street, London WC1E 6BT, England
+*/
+
+#include "libbpptools.h"
+
+/* Persistent cache of parsed datasets. A dataset is stored packed in
+   DIR/<key>.bppc, where the key is a hash of the absolute path of the
+   PHYLIP file. The header records the path, size and modification time of
+   the file, and a cache entry is used only if these match the file on disk;
+   otherwise the file is parsed and the entry overwritten. The header also
+   holds a hash of the file contents, which is checked on a hit only when
+   verification is requested, as hashing reads the whole file.
+
+   Since the key depends only on the path, there is at most one entry per
+   input file and changed files replace their entry. Entries of files that
+   were moved or deleted are never removed; the directory may be cleared at
+   any time. Cache files are in native byte order. */
+
+#define CACHE_MAGIC     "BPPCACHE"
+#define CACHE_VERSION   2
+#define CACHE_BLOCK     (1 << 20)
+
+typedef struct cache_header_s
+{
+  char magic[8];
+  long version;
+  long size;
+  long mtime_sec;
+  long mtime_nsec;
+  unsigned long content_hash;
+  long path_length;
+  long loci;
+} cache_header_t;
+
+typedef struct cache_locus_s
+{
+  long count;
+  long length;
+  long amb_sites_count;
+  long original_length;
+  int dtype;
+  int model;
+  int original_index;
+} cache_locus_t;
+
+/* makes temporary file names unique among threads of the process */
+static long cache_tmp_counter = 0;
+
+static int cache_error(const char * format, const char * arg)
+{
+  bpp_errno = ERROR_CACHE;
+  snprintf(bpp_errmsg, 200, format, arg, strerror(errno));
+  return BPP_FAILURE;
+}
+
+static int hash_file(const char * filename, unsigned long * hash)
+{
+  size_t n;
+  FILE * fp;
+  char * buffer;
+
+  if (!(fp = fopen(filename, "r")))
+  {
+    bpp_errno = ERROR_FILE_OPEN;
+    snprintf(bpp_errmsg, 200, "Unable to open file (%s)", filename);
+    return BPP_FAILURE;
+  }
+
+  if (!(buffer = (char *)bpp_malloc(CACHE_BLOCK)))
+  {
+    fclose(fp);
+    return BPP_FAILURE;
+  }
+
+  *hash = 14695981039346656037UL;
+  while ((n = fread(buffer, 1, CACHE_BLOCK, fp)))
+    *hash = hash_bytes(buffer, n, *hash);
+
+  free(buffer);
+  fclose(fp);
+
+  return BPP_SUCCESS;
+}
+
+/* read the next n bytes of the cache file; fails on truncated files before
+   anything is allocated for them */
+static int unpack(FILE * fp, long * left, void * dst, size_t n)
+{
+  if ((size_t)*left < n || fread(dst, 1, n, fp) != n)
+    return 0;
+
+  *left -= (long)n;
+
+  return 1;
+}
+
+static msa_t ** unpack_loci(FILE * fp, long left, long count)
+{
+  long i,j;
+  msa_t ** msa_list = (msa_t **)bpp_calloc((size_t)MAX(count,1),
+                                           sizeof(msa_t *));
+
+  if (!msa_list)
+    return NULL;
+
+  for (i = 0; i < count; ++i)
+  {
+    int label_length;
+    cache_locus_t locus;
+    msa_t * msa;
+
+    if (!unpack(fp, &left, &locus, sizeof(cache_locus_t)) ||
+        locus.count < 0 || locus.length < 0 ||
+        (locus.length && locus.count > left / locus.length))
+      goto l_unwind;
+
+    msa = msa_list[i] = (msa_t *)bpp_calloc(1, sizeof(msa_t));
+    if (!msa)
+      goto l_unwind;
+    msa->count = locus.count;
+    msa->length = locus.length;
+    msa->dtype = locus.dtype;
+    msa->amb_sites_count = locus.amb_sites_count;
+    msa->original_length = locus.original_length;
+    msa->model = locus.model;
+    msa->original_index = locus.original_index;
+    msa->label = (char **)bpp_calloc((size_t)MAX(msa->count,1),
+                                     sizeof(char *));
+    msa->sequence = (char **)bpp_calloc((size_t)MAX(msa->count,1),
+                                        sizeof(char *));
+    if (!msa->label || !msa->sequence)
+      goto l_unwind;
+
+    for (j = 0; j < msa->count; ++j)
+    {
+      if (!unpack(fp, &left, &label_length, sizeof(int)) ||
+          label_length < 0 || label_length > left)
+        goto l_unwind;
+
+      msa->label[j] = (char *)bpp_malloc((size_t)label_length+1);
+      if (!msa->label[j] || !unpack(fp, &left, msa->label[j], (size_t)label_length))
+        goto l_unwind;
+      msa->label[j][label_length] = 0;
+    }
+
+    for (j = 0; j < msa->count; ++j)
+    {
+      msa->sequence[j] = (char *)bpp_malloc((size_t)msa->length+1);
+      if (!msa->sequence[j] || !unpack(fp, &left, msa->sequence[j], (size_t)msa->length))
+        goto l_unwind;
+      msa->sequence[j][msa->length] = 0;
+    }
+  }
+
+  if (!left)
+    return msa_list;
+
+l_unwind:
+  for (i = 0; i < count; ++i)
+    if (msa_list[i])
+      msa_destroy(msa_list[i]);
+  free(msa_list);
+  return NULL;
+}
+
+/* load a cache entry; returns NULL if the entry does not exist, is stale
+   or damaged, or if memory runs out while loading it */
+static msa_t ** cache_load(const char * cachefile,
+                           const char * path,
+                           const cache_header_t * key,
+                           int verify,
+                           long * count)
+{
+  long left;
+  FILE * fp;
+  char * stored_path;
+  struct stat st;
+  msa_t ** msa_list = NULL;
+  cache_header_t header;
+
+  if (!(fp = fopen(cachefile, "r")))
+    return NULL;
+
+  if (fstat(fileno(fp), &st) ||
+      fread(&header, sizeof(cache_header_t), 1, fp) != 1 ||
+      memcmp(header.magic, CACHE_MAGIC, 8) ||
+      header.version != CACHE_VERSION ||
+      header.size != key->size ||
+      header.mtime_sec != key->mtime_sec ||
+      header.mtime_nsec != key->mtime_nsec ||
+      (verify && header.content_hash != key->content_hash) ||
+      header.path_length != key->path_length ||
+      header.loci < 0)
+  {
+    fclose(fp);
+    return NULL;
+  }
+
+  left = (long)st.st_size - (long)sizeof(cache_header_t);
+
+  stored_path = (char *)bpp_malloc((size_t)MAX(header.path_length,1));
+  if (stored_path && unpack(fp, &left, stored_path, (size_t)header.path_length) &&
+      !memcmp(stored_path, path, (size_t)header.path_length))
+  {
+    msa_list = unpack_loci(fp, left, header.loci);
+    *count = header.loci;
+  }
+
+  free(stored_path);
+  fclose(fp);
+
+  return msa_list;
+}
+
+/* write the cache entry to a temporary file which is then renamed, such
+   that concurrent runs never see a partially written entry */
+static int cache_store(const char * cachefile,
+                       const char * path,
+                       const cache_header_t * header,
+                       msa_t ** msa_list,
+                       long count)
+{
+  long i,j;
+  int ok;
+  char * tmpfile;
+  FILE * fp;
+
+  tmpfile = bpp_asprintf("%s.%ld.%ld.tmp", cachefile, (long)getpid(),
+                         __atomic_add_fetch(&cache_tmp_counter, 1,
+                                            __ATOMIC_RELAXED));
+  if (!tmpfile)
+    return BPP_FAILURE;
+
+  if (!(fp = fopen(tmpfile, "w")))
+  {
+    cache_error("Unable to create cache file %s (%s)", tmpfile);
+    free(tmpfile);
+    return BPP_FAILURE;
+  }
+
+  fwrite(header, sizeof(cache_header_t), 1, fp);
+  fwrite(path, 1, (size_t)header->path_length, fp);
+
+  for (i = 0; i < count; ++i)
+  {
+    msa_t * msa = msa_list[i];
+    cache_locus_t locus;
+
+    memset(&locus, 0, sizeof(cache_locus_t));
+    locus.count = msa->count;
+    locus.length = msa->length;
+    locus.dtype = msa->dtype;
+    locus.amb_sites_count = msa->amb_sites_count;
+    locus.original_length = msa->original_length;
+    locus.model = msa->model;
+    locus.original_index = msa->original_index;
+    fwrite(&locus, sizeof(cache_locus_t), 1, fp);
+
+    for (j = 0; j < msa->count; ++j)
+    {
+      int label_length = (int)strlen(msa->label[j]);
+
+      fwrite(&label_length, sizeof(int), 1, fp);
+      fwrite(msa->label[j], 1, (size_t)label_length, fp);
+    }
+
+    for (j = 0; j < msa->count; ++j)
+      fwrite(msa->sequence[j], 1, (size_t)msa->length, fp);
+  }
+
+  ok = !ferror(fp);
+  ok = !fclose(fp) && ok;
+
+  if (!ok || rename(tmpfile, cachefile))
+  {
+    cache_error("Unable to write cache file %s (%s)", tmpfile);
+    unlink(tmpfile);
+    free(tmpfile);
+    return BPP_FAILURE;
+  }
+
+  free(tmpfile);
+  return BPP_SUCCESS;
+}
+
+/* return all loci of a PHYLIP file, from the cache in 'dir' if it holds an
+   up to date entry, otherwise by parsing the file and storing the result.
+   With 'verify' set, an entry is used only if the contents of the file hash
+   to the stored value. If the parsed loci cannot be stored, they are still
+   returned, with bpp_errno set to ERROR_CACHE such that the caller may warn */
+static msa_t ** parse_file(const char * path, long * count)
+{
+  msa_t ** msa_list = NULL;
+  phylip_t * fd = phylip_open(path, pll_map_fasta);
+
+  if (fd)
+  {
+    msa_list = phylip_parse_multisequential(fd, count);
+    phylip_close(fd);
+  }
+
+  return msa_list;
+}
+
+msa_t ** cache_parse(const char * dir,
+                     const char * filename,
+                     int verify,
+                     long * count)
+{
+  char * path;
+  char * cachefile;
+  struct stat st;
+  msa_t ** msa_list;
+  cache_header_t header;
+  timing_mark_t mark;
+
+  if (!(path = realpath(filename, NULL)) || stat(path, &st))
+  {
+    bpp_errno = ERROR_FILE_OPEN;
+    snprintf(bpp_errmsg, 200, "Unable to open file (%s)", filename);
+    free(path);
+    return NULL;
+  }
+
+  /* without a cache directory the file is parsed, as on a cache miss */
+  if (mkdir(dir, 0777) && errno != EEXIST)
+  {
+    char errmsg[200];
+
+    cache_error("Unable to create cache directory %s (%s)", dir);
+    memcpy(errmsg, bpp_errmsg, 200);
+
+    msa_list = parse_file(path, count);
+    free(path);
+    if (msa_list)
+    {
+      bpp_errno = ERROR_CACHE;
+      memcpy(bpp_errmsg, errmsg, 200);
+    }
+    return msa_list;
+  }
+
+  memset(&header, 0, sizeof(cache_header_t));
+  memcpy(header.magic, CACHE_MAGIC, 8);
+  header.version = CACHE_VERSION;
+  header.size = (long)st.st_size;
+  header.mtime_sec = (long)st.st_mtim.tv_sec;
+  header.mtime_nsec = (long)st.st_mtim.tv_nsec;
+  header.path_length = (long)strlen(path);
+
+  if (!(cachefile = bpp_asprintf("%s/%016lx.bppc", dir, hash_fnv(path))))
+  {
+    free(path);
+    return NULL;
+  }
+
+  timing_start(&mark);
+  if (verify && !hash_file(path, &header.content_hash))
+  {
+    free(cachefile);
+    free(path);
+    return NULL;
+  }
+
+  msa_list = cache_load(cachefile, path, &header, verify, count);
+  timing_stop(TIMING_PHASE_OPEN, &mark, msa_list ? header.size : 0, 0);
+
+  if (!msa_list)
+  {
+    /* cache miss */
+    if (!(msa_list = parse_file(path, count)))
+    {
+      free(cachefile);
+      free(path);
+      return NULL;
+    }
+
+    header.loci = *count;
+
+    /* a failure to store the entry only costs a parse on the next run */
+    bpp_errno = 0;
+    if ((!verify && !hash_file(path, &header.content_hash)) ||
+        !cache_store(cachefile, path, &header, msa_list, *count))
+      bpp_errno = ERROR_CACHE;
+  }
+
+  free(cachefile);
+  free(path);
+
+  return msa_list;
+}
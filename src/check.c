@@ -0,0 +1,797 @@
+/*
+    Copyright (C) 2022-2023 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London, Gower Street, London WC1E 6BT, England
+*/
+
+
+#include "libbpptools.h"
+
+/* Validation-only pass over a multi-locus PHYLIP file. The file is mapped
+   into memory and split into equal chunks that are scanned concurrently.
+   A chunk other than the first starts at the first line that parses as a
+   locus header, and is responsible for all loci whose header starts inside
+   it. Loci are checked with the same rules as the parser in phylip.c but
+   nothing is copied or allocated. Since a scan may start on a line inside a
+   locus that happens to look like a header, chunks are stitched afterwards:
+   a chunk is accepted only if it started exactly where the previous one
+   stopped, and is scanned again sequentially otherwise.
+
+   After an error, scanning resumes at the next line that parses as a
+   header, hence every error in the file is reported and the loci following
+   a broken one are still counted. */
+
+#define CHECK_SEQUENTIAL   1
+#define CHECK_INTERLEAVED  2
+
+#define CHECK_CHUNK_MIN    (1l << 20)
+
+typedef struct cursor_s
+{
+  const char * p;         /* start of the next line */
+  const char * end;       /* end of data */
+  const char * line;      /* current line */
+  const char * eol;       /* end of current line, without the newline */
+} cursor_t;
+
+typedef struct attempt_s
+{
+  const char * at;        /* position of the error */
+  long trailer;           /* locus is valid but not followed by a header */
+  long stripped[256];
+  char msg[200];
+} attempt_t;
+
+typedef struct scan_s
+{
+  long begin;             /* offset of the first locus */
+  long end;               /* offset of the first locus not scanned */
+  long layout_in;         /* layout assumed for the first locus, or zero */
+  long layout_out;        /* layout of the last locus */
+  long loci;
+  long stripped[256];
+  long errors_count;
+  long errors_max;
+  long failed;            /* an error could not be recorded */
+  check_error_t * errors; /* locus numbers are local to the scan */
+} scan_t;
+
+typedef struct check_ctx_s
+{
+  const char * data;
+  long size;
+  long chunk;
+  const unsigned int * map;
+  kernel_lut_t legal;
+  scan_t * scans;
+} check_ctx_t;
+
+static int next_line(cursor_t * c)
+{
+  if (c->p >= c->end)
+  {
+    c->line = c->eol = c->end;
+    return 0;
+  }
+
+  c->line = c->p;
+  c->eol = (const char *)memchr(c->p, '\n', (size_t)(c->end - c->p));
+  if (!c->eol)
+    c->eol = c->end;
+  c->p = c->eol < c->end ? c->eol+1 : c->end;
+
+  return 1;
+}
+
+static int whitespace(char c)
+{
+  if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+    return 1;
+  return 0;
+}
+
+static const char * skip_whitespace(const char * p, const char * end)
+{
+  while (p < end && whitespace(*p)) ++p;
+  return p;
+}
+
+static int next_nonblank(cursor_t * c)
+{
+  while (next_line(c))
+    if (skip_whitespace(c->line, c->eol) < c->eol)
+      return 1;
+
+  return 0;
+}
+
+/* same semantics as sscanf("%ld") in phylip.c, zero if invalid */
+static long header_long(const char ** s, const char * end)
+{
+  long v = 0;
+  const char * p = *s;
+
+  while (p < end && isspace((unsigned char)*p)) ++p;
+  if (p < end && *p == '+') ++p;
+  if (p == end || !isdigit((unsigned char)*p))
+    return 0;
+
+  for (; p < end && isdigit((unsigned char)*p); ++p)
+    v = v < LONG_MAX/10 ? 10*v + (*p - '0') : LONG_MAX;
+
+  *s = p;
+  return v;
+}
+
+static int parse_header(const char * p,
+                        const char * end,
+                        long * count,
+                        long * length,
+                        long * format,
+                        const char ** msg)
+{
+  *format = 0;
+
+  if (!(*count = header_long(&p,end)))
+  {
+    *msg = "Invalid number of sequences in header";
+    return 0;
+  }
+
+  if (!(*length = header_long(&p,end)))
+  {
+    *msg = "Invalid sequence length in header";
+    return 0;
+  }
+
+  p = skip_whitespace(p,end);
+  if (p == end)
+    return 1;
+
+  if (*p == 's' || *p == 'S')
+    *format = CHECK_SEQUENTIAL;
+  else if (*p == 'i' || *p == 'I')
+    *format = CHECK_INTERLEAVED;
+
+  if (*format && skip_whitespace(p+1,end) == end)
+    return 1;
+
+  *msg = "Invalid characters after header";
+  return 0;
+}
+
+static int is_header(const char * p, const char * end)
+{
+  long count, length, format;
+  const char * msg;
+
+  return parse_header(p, end, &count, &length, &format, &msg);
+}
+
+/* advance such that the next line is the next locus header */
+static void resync(cursor_t * c)
+{
+  while (next_line(c))
+    if (is_header(c->line, c->eol))
+    {
+      c->p = c->line;
+      return;
+    }
+}
+
+static int fail(attempt_t * a, const char * at, const char * format, ...)
+  __attribute__((format(printf,3,4)));
+
+static int fail(attempt_t * a, const char * at, const char * format, ...)
+{
+  va_list args;
+
+  va_start(args, format);
+  vsnprintf(a->msg, 200, format, args);
+  va_end(args);
+
+  a->at = at;
+  return 0;
+}
+
+/* label of a sequence in messages; labels are only known in the first
+   block of interleaved loci */
+static void seqname(char * buf, long seqno, const char * label, long len)
+{
+  if (label)
+    snprintf(buf, 160, "Sequence %ld (%.*s)", seqno+1, (int)MIN(len,100), label);
+  else
+    snprintf(buf, 160, "Sequence %ld", seqno+1);
+}
+
+/* validate the data in [p,end) of which at most 'room' characters may be
+   legal; returns the number of legal characters, or -1 on error */
+static long check_data(const check_ctx_t * ctx,
+                       const char * p,
+                       const char * end,
+                       long room,
+                       attempt_t * a,
+                       long seqno,
+                       const char * label,
+                       long label_len)
+{
+  long j = 0;
+  long k;
+  char name[160];
+
+  while (p < end)
+  {
+    k = kernel_legal_prefix(p, end-p, &ctx->legal);
+    if (k)
+    {
+      if (j + k > room)
+        break;
+      j += k;
+      p += k;
+      continue;
+    }
+
+    unsigned char c = (unsigned char)*p;
+    switch (ctx->map[c])
+    {
+      case 0:
+        a->stripped[c]++;
+        break;
+
+      case 1:
+        if (j == room)
+          goto longseq;
+        ++j;
+        break;
+
+      case 2:
+        seqname(name, seqno, label, label_len);
+        if (c >= 32)
+          fail(a, p, "Illegal character '%c' in %s", c, name);
+        else
+          fail(a, p, "Illegal unprintable character %#.2x (hexadecimal) in %s",
+               c, name);
+        return -1;
+    }
+    ++p;
+  }
+
+  if (p == end)
+    return j;
+
+longseq:
+  seqname(name, seqno, label, label_len);
+  fail(a, p, "%s longer than expected", name);
+  return -1;
+}
+
+/* length of the label at p, as in phylip.c */
+static long label_length(const char * p, const char * end)
+{
+  const char * q;
+
+  if ((q = (const char *)memchr(p, ' ', (size_t)(end-p))) ||
+      (q = (const char *)memchr(p, '\t', (size_t)(end-p))) ||
+      (q = (const char *)memchr(p, '\r', (size_t)(end-p))))
+    return q - p;
+
+  return end - p;
+}
+
+static int check_sequential(const check_ctx_t * ctx,
+                            cursor_t * c,
+                            long count,
+                            long length,
+                            attempt_t * a)
+{
+  long seqno, j, k;
+
+  for (seqno = 0; seqno < count; ++seqno)
+  {
+    if (!next_nonblank(c))
+      return fail(a, c->end, "Found %ld sequence(s) but expected %ld",
+                  seqno, count);
+
+    const char * label = skip_whitespace(c->line, c->eol);
+    long label_len = label_length(label, c->eol);
+    const char * p = label + label_len;
+
+    /* data may continue on the following lines */
+    for (j = 0; ; p = c->line)
+    {
+      if ((k = check_data(ctx, p, c->eol, length-j, a,
+                          seqno, label, label_len)) < 0)
+        return 0;
+
+      j += k;
+      if (j == length)
+        break;
+
+      if (!next_line(c))
+        return fail(a, c->end,
+                    "Sequence %ld (%.*s) has %ld characters but expected %ld",
+                    seqno+1, (int)MIN(label_len,100), label, j, length);
+    }
+  }
+
+  return 1;
+}
+
+static int check_interleaved(const check_ctx_t * ctx,
+                             cursor_t * c,
+                             long count,
+                             long length,
+                             attempt_t * a)
+{
+  long seqno, n;
+  long aln_len = 0;
+  long sumlen;
+  long block;
+
+  /* first block, with labels */
+  for (seqno = 0; seqno < count; ++seqno)
+  {
+    if (!next_nonblank(c))
+      return fail(a, c->end, "Found %ld sequence(s) but expected %ld",
+                  seqno, count);
+
+    const char * label = skip_whitespace(c->line, c->eol);
+    long label_len = label_length(label, c->eol);
+    const char * p = label + label_len;
+
+    /* data start at the first line with at least one character */
+    while (!(n = check_data(ctx, p, c->eol, length, a,
+                            seqno, label, label_len)))
+    {
+      if (!next_line(c))
+        return fail(a, c->end, "Found %ld sequence(s) but expected %ld",
+                    seqno, count);
+      p = c->line;
+    }
+
+    if (n < 0)
+      return 0;
+
+    if (!aln_len)
+      aln_len = n;
+    else if (n != aln_len)
+      return fail(a, c->line, "Sequence %ld (%.*s) data out of alignment",
+                  seqno+1, (int)MIN(label_len,100), label);
+  }
+
+  /* remaining blocks, up to the declared length */
+  for (sumlen = aln_len, block = 2; sumlen < length; sumlen += aln_len, ++block)
+  {
+    aln_len = 0;
+    for (seqno = 0; seqno < count; ++seqno)
+    {
+      n = 0;
+      while (!n)
+      {
+        if (!next_line(c))
+        {
+          if (seqno)
+            return fail(a, c->end,
+                        "Found %ld sequences in block %ld but expected %ld",
+                        seqno, block, count);
+          return fail(a, c->end, "Sequence length is %ld but expected %ld",
+                      sumlen, length);
+        }
+
+        if ((n = check_data(ctx, c->line, c->eol, length-sumlen, a,
+                            seqno, NULL, 0)) < 0)
+          return 0;
+      }
+
+      if (!aln_len)
+        aln_len = n;
+      else if (n != aln_len)
+        return fail(a, c->line, "Sequence %ld data out of alignment", seqno+1);
+    }
+  }
+
+  return 1;
+}
+
+static int check_layout(const check_ctx_t * ctx,
+                        cursor_t * c,
+                        long layout,
+                        long count,
+                        long length,
+                        attempt_t * a)
+{
+  memset(a->stripped, 0, 256*sizeof(long));
+  a->trailer = 0;
+
+  if (layout == CHECK_INTERLEAVED)
+    return check_interleaved(ctx, c, count, length, a);
+
+  return check_sequential(ctx, c, count, length, a);
+}
+
+/* a locus without layout flag is accepted only if it is followed by another
+   header or by the end of the file, as in phylip_parse_next() */
+static int check_guess(const check_ctx_t * ctx,
+                       cursor_t * c,
+                       long layout,
+                       long count,
+                       long length,
+                       attempt_t * a)
+{
+  long format;
+  const char * msg;
+
+  if (!check_layout(ctx, c, layout, count, length, a))
+    return 0;
+
+  cursor_t peek = *c;
+  if (next_nonblank(&peek) &&
+      !parse_header(peek.line, peek.eol, &count, &length, &format, &msg))
+  {
+    a->trailer = 1;
+    return fail(a, peek.line, "%s", msg);
+  }
+
+  return 1;
+}
+
+static void scan_error(scan_t * scan,
+                       const check_ctx_t * ctx,
+                       long locus,
+                       const char * at,
+                       const char * msg)
+{
+  if (scan->errors_count == scan->errors_max)
+  {
+    long max = scan->errors_max ? 2*scan->errors_max : 16;
+    check_error_t * errors;
+
+    errors = (check_error_t *)bpp_realloc(scan->errors,
+                                          (size_t)max * sizeof(check_error_t));
+    if (!errors)
+    {
+      scan->failed = 1;
+      return;
+    }
+    scan->errors = errors;
+    scan->errors_max = max;
+  }
+
+  check_error_t * e = scan->errors + scan->errors_count++;
+  e->locus = locus;
+  e->offset = at - ctx->data;
+  e->line = 0;
+  snprintf(e->msg, 200, "%s", msg);
+}
+
+/* check all loci whose header starts before 'stop'. A speculative scan
+   starts at an arbitrary byte and first looks for a header */
+static void scan_range(const check_ctx_t * ctx,
+                       const char * start,
+                       const char * stop,
+                       long layout,
+                       long speculative,
+                       scan_t * scan)
+{
+  long i;
+  long count, length, format;
+  int ok;
+  const char * msg;
+  attempt_t a[2];
+  attempt_t * best;
+  cursor_t c;
+
+  memset(scan, 0, sizeof(scan_t));
+
+  c.p = start;
+  c.end = ctx->data + ctx->size;
+
+  if (speculative)
+  {
+    /* skip the partial line */
+    if (start > ctx->data && start[-1] != '\n')
+      next_line(&c);
+    resync(&c);
+  }
+
+  /* loci start at non-blank lines */
+  cursor_t peek = c;
+  scan->begin = next_nonblank(&peek) ? peek.line - ctx->data : ctx->size;
+
+  while (1)
+  {
+    if (!next_nonblank(&c))
+    {
+      scan->end = ctx->size;
+      break;
+    }
+
+    if (c.line >= stop)
+    {
+      scan->end = c.line - ctx->data;
+      break;
+    }
+
+    long locus = scan->loci++;
+
+    if (!parse_header(c.line, c.eol, &count, &length, &format, &msg))
+    {
+      scan_error(scan, ctx, locus, c.line, msg);
+      resync(&c);
+      continue;
+    }
+
+    cursor_t header = c;
+
+    if (format)
+    {
+      ok = check_layout(ctx, &c, format, count, length, a);
+      best = a;
+    }
+    else
+    {
+      long other = (layout == CHECK_INTERLEAVED) ?
+                     CHECK_SEQUENTIAL : CHECK_INTERLEAVED;
+      cursor_t second = header;
+      int ok_other = 0;
+
+      ok = check_guess(ctx, &c, layout, count, length, a);
+
+      /* the first locus of a speculative scan is checked with both layouts,
+         since the outcome depends on the layout of the previous locus if
+         both succeed or both fail */
+      if (!ok || (speculative && !locus))
+      {
+        ok_other = check_guess(ctx, &second, other, count, length, a+1);
+        if (speculative && !locus && ok == ok_other)
+          scan->layout_in = layout;
+      }
+
+      /* a locus that is only followed by a broken header is accepted, and
+         the header is reported as the next locus */
+      best = a;
+      if (!ok && (ok_other || (a[1].trailer && !a[0].trailer)))
+      {
+        c = second;
+        best = a+1;
+        layout = other;
+        ok = 1;
+      }
+      else if (!ok && a[0].trailer)
+        ok = 1;
+      else if (!ok && a[1].at > a[0].at)
+        best = a+1;
+    }
+
+    if (!ok)
+    {
+      scan_error(scan, ctx, locus, best->at, best->msg);
+      c = header;
+      resync(&c);
+      continue;
+    }
+
+    for (i = 0; i < 256; ++i)
+      scan->stripped[i] += best->stripped[i];
+  }
+
+  scan->layout_out = layout;
+}
+
+static void cb_check_chunks(long first, long last, void * arg)
+{
+  long i;
+  check_ctx_t * ctx = (check_ctx_t *)arg;
+
+  for (i = first; i < last; ++i)
+  {
+    const char * start = ctx->data + i*ctx->chunk;
+    const char * stop = ctx->data + MIN((i+1)*ctx->chunk, ctx->size);
+
+    scan_range(ctx, start, stop, CHECK_SEQUENTIAL, i > 0, ctx->scans+i);
+  }
+}
+
+static void scan_discard(scan_t * scan)
+{
+  free(scan->errors);
+  memset(scan, 0, sizeof(scan_t));
+}
+
+check_report_t * check_phylip(const char * filename,
+                              const unsigned int * map,
+                              sched_t * sched)
+{
+  long i,j,k;
+  long chunks;
+  long threads;
+  struct stat st;
+  check_ctx_t ctx;
+  timing_mark_t mark;
+
+  timing_start(&mark);
+  kernel_init();
+
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1)
+  {
+    bpp_errno = ERROR_FILE_OPEN;
+    snprintf(bpp_errmsg, 200, "Unable to open file (%.150s)", filename);
+    return NULL;
+  }
+
+  if (fstat(fd, &st) || !S_ISREG(st.st_mode))
+  {
+    bpp_errno = ERROR_FILE_SEEK;
+    snprintf(bpp_errmsg, 200, "Unable to map file (%.150s)", filename);
+    close(fd);
+    return NULL;
+  }
+
+  if (!st.st_size)
+  {
+    bpp_errno = ERROR_PHYLIP_SYNTAX;
+    snprintf(bpp_errmsg, 200, "File (%.150s) is empty", filename);
+    close(fd);
+    return NULL;
+  }
+
+  ctx.size = (long)st.st_size;
+  void * mem = mmap(NULL, (size_t)ctx.size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED)
+  {
+    bpp_errno = ERROR_FILE_SEEK;
+    snprintf(bpp_errmsg, 200, "Unable to map file (%.150s)", filename);
+    return NULL;
+  }
+  madvise(mem, (size_t)ctx.size, MADV_SEQUENTIAL);
+
+  ctx.data = (const char *)mem;
+  ctx.map = map;
+  kernel_lut_init(&ctx.legal, map, 1);
+
+  /* a few chunks per thread balance the load; chunks are not made too small
+     such that most of them contain many loci */
+  threads = sched ? sched_threads(sched) : 1;
+  ctx.chunk = MAX(CHECK_CHUNK_MIN, (ctx.size + 4*threads - 1) / (4*threads));
+  chunks = (ctx.size + ctx.chunk - 1) / ctx.chunk;
+  ctx.scans = (scan_t *)bpp_calloc((size_t)chunks, sizeof(scan_t));
+  if (!ctx.scans)
+  {
+    munmap(mem, (size_t)ctx.size);
+    return NULL;
+  }
+
+  int rc = BPP_SUCCESS;
+  if (sched)
+  {
+    rc = sched_parallel_for(sched, 0, chunks, 1, cb_check_chunks,
+                            (void *)&ctx);
+    sched_wait(sched);
+  }
+  else
+    cb_check_chunks(0, chunks, (void *)&ctx);
+
+  /* stitch: the first chunk always starts at a locus; any other chunk is
+     scanned again from where the previous one stopped, unless it started
+     there with the same layout */
+  for (i = 1; i < chunks; ++i)
+  {
+    scan_t * prev = ctx.scans + i-1;
+    scan_t * scan = ctx.scans + i;
+    long stop = MIN((i+1)*ctx.chunk, ctx.size);
+
+    if (scan->begin == prev->end &&
+        (!scan->layout_in || scan->layout_in == prev->layout_out))
+      continue;
+
+    scan_discard(scan);
+    if (prev->end < stop)
+      scan_range(&ctx, ctx.data + prev->end, ctx.data + stop,
+                 prev->layout_out, 0, scan);
+    else
+    {
+      /* a single locus spans the whole chunk */
+      scan->begin = scan->end = prev->end;
+      scan->layout_out = prev->layout_out;
+    }
+  }
+
+  /* assemble the report */
+  check_report_t * report = NULL;
+  for (i = 0; i < chunks; ++i)
+    if (ctx.scans[i].failed)
+      rc = BPP_FAILURE;
+  if (rc)
+    report = (check_report_t *)bpp_calloc(1, sizeof(check_report_t));
+  if (report)
+  {
+    for (i = 0; i < chunks; ++i)
+      report->errors_count += ctx.scans[i].errors_count;
+    report->errors = (check_error_t *)bpp_malloc(
+                       (size_t)(report->errors_count+1) *
+                       sizeof(check_error_t));
+    if (!report->errors)
+    {
+      free(report);
+      report = NULL;
+    }
+  }
+  if (!report)
+  {
+    for (i = 0; i < chunks; ++i)
+      free(ctx.scans[i].errors);
+    free(ctx.scans);
+    munmap(mem, (size_t)ctx.size);
+    bpp_errno = ERROR_MEMORY;
+    snprintf(bpp_errmsg, 200, "Unable to allocate enough memory.");
+    return NULL;
+  }
+  report->bytes = ctx.size;
+
+  for (i = 0, k = 0; i < chunks; ++i)
+  {
+    scan_t * scan = ctx.scans + i;
+
+    for (j = 0; j < scan->errors_count; ++j, ++k)
+    {
+      report->errors[k] = scan->errors[j];
+      report->errors[k].locus += report->loci + 1;
+    }
+
+    report->loci += scan->loci;
+    for (j = 0; j < 256; ++j)
+      report->stripped[j] += scan->stripped[j];
+    free(scan->errors);
+  }
+
+  for (i = 0; i < 256; ++i)
+    report->stripped_count += report->stripped[i];
+
+  /* line numbers of errors, which are in file order */
+  const char * p = ctx.data;
+  long lineno = 1;
+  for (i = 0; i < report->errors_count; ++i)
+  {
+    const char * at = ctx.data + report->errors[i].offset;
+    const char * nl;
+
+    while (p < at && (nl = (const char *)memchr(p, '\n', (size_t)(at-p))))
+    {
+      ++lineno;
+      p = nl+1;
+    }
+    if (p < at)
+      p = at;
+    report->errors[i].line = lineno;
+  }
+
+  free(ctx.scans);
+  munmap(mem, (size_t)ctx.size);
+
+  timing_stop(TIMING_PHASE_PARSE, &mark, ctx.size, report->loci);
+
+  return report;
+}
+
+void check_report_destroy(check_report_t * report)
+{
+  free(report->errors);
+  free(report);
+}
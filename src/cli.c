@@ -0,0 +1,96 @@
+/*
+    Copyright (C) 2022-2023 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London, Gower Street, London WC1E 6BT, England
+*/
+
+#include "bpp-tools.h"
+
+/* helpers of the command line programs, which exit on failure; the library
+   itself reports errors through bpp_errno and never calls these */
+
+void fatal(const char * format, ...)
+{
+  va_list argptr;
+  va_start(argptr, format);
+  vfprintf(stderr, format, argptr);
+  va_end(argptr);
+  fprintf(stderr, "\n");
+  exit(1);
+}
+
+void * xmalloc(size_t size)
+{
+  void * t;
+  t = malloc(size);
+  if (!t)
+    fatal("Unable to allocate enough memory.");
+
+  return t;
+}
+
+void * xcalloc(size_t nmemb, size_t size)
+{
+  void * t;
+  t = calloc(nmemb,size);
+  if (!t)
+    fatal("Unable to allocate enough memory.");
+
+  return t;
+}
+
+void * xrealloc(void *ptr, size_t size)
+{
+  void * t = realloc(ptr, size);
+  if (!t)
+    fatal("Unable to allocate enough memory.");
+  return t;
+}
+
+char * xstrdup(const char * s)
+{
+  size_t len = strlen(s);
+  char * p = (char *)xmalloc(len+1);
+  return strcpy(p,s);
+}
+
+char * xstrndup(const char * s, size_t len)
+{
+  char * p = (char *)xmalloc(len+1);
+  strncpy(p,s,len);
+  p[len] = 0;
+  return p;
+}
+
+FILE * xopen(const char * filename, const char * mode)
+{
+  FILE * out = fopen(filename, mode);
+  if (!out)
+    fatal("Cannot open file %s", filename);
+
+  return out;
+}
+
+sched_t * xsched_create(long threads)
+{
+  sched_t * sched = sched_create(threads);
+  if (!sched)
+    fatal("%s", bpp_errmsg);
+
+  return sched;
+}
@@ -0,0 +1,1773 @@
+/*
+    Copyright (C) 2022-2023 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London, Gower Street, London WC1E 6BT, England
+*/
+
+#include "bpp-tools.h"
+
+/* Command line front-ends of the library functions. Options are read from
+   the opt_* globals and library errors are turned into fatal errors. */
+
+/* Output files are written under temporary names and renamed by
+   output_commit once the command has finished; the temporary files of a
+   command that fails are removed at exit, such that no truncated output
+   is left behind that looks complete. Only new paths and regular files
+   are replaced this way, keeping the mode of the old file; symbolic links,
+   devices and pipes such as /dev/stdout are written directly. */
+typedef struct output_s
+{
+  char * filename;
+  char * tmpfile;
+} output_t;
+
+static output_t * output_list = NULL;
+static long output_count = 0;
+static long output_alloc = 0;
+static long output_committed = 0;
+static pthread_mutex_t output_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void output_cleanup(void)
+{
+  long i;
+
+  if (output_committed)
+    return;
+
+  for (i = 0; i < output_count; ++i)
+    unlink(output_list[i].tmpfile);
+}
+
+/* open an output file; returns NULL and sets bpp_errmsg on failure */
+FILE * output_create(const char * filename)
+{
+  char * tmpfile;
+  FILE * fp;
+  struct stat st;
+
+  if (lstat(filename, &st))
+  {
+    if (errno != ENOENT)
+    {
+      bpp_errno = ERROR_FILE_OPEN;
+      snprintf(bpp_errmsg, 200, "Unable to access output file %.120s (%s)",
+               filename, strerror(errno));
+      return NULL;
+    }
+    st.st_mode = 0;
+  }
+  else if (!S_ISREG(st.st_mode))
+  {
+    if (!(fp = fopen(filename, "w")))
+    {
+      bpp_errno = ERROR_FILE_OPEN;
+      snprintf(bpp_errmsg, 200, "Cannot open file %.150s", filename);
+    }
+    return fp;
+  }
+
+  xasprintf(&tmpfile, "%s.%ld.tmp", filename, (long)getpid());
+  if (!(fp = fopen(tmpfile, "w")))
+  {
+    bpp_errno = ERROR_FILE_OPEN;
+    snprintf(bpp_errmsg, 200, "Cannot open file %.150s", tmpfile);
+    free(tmpfile);
+    return NULL;
+  }
+  if (st.st_mode && fchmod(fileno(fp), st.st_mode & 07777))
+  {
+    bpp_errno = ERROR_FILE_OPEN;
+    snprintf(bpp_errmsg, 200, "Unable to set the mode of %.120s (%s)",
+             tmpfile, strerror(errno));
+    fclose(fp);
+    unlink(tmpfile);
+    free(tmpfile);
+    return NULL;
+  }
+
+  /* writers of per-locus files may run in pipeline threads */
+  pthread_mutex_lock(&output_mutex);
+  if (!output_alloc)
+    atexit(output_cleanup);
+  if (output_count == output_alloc)
+  {
+    output_alloc = output_alloc ? 2*output_alloc : 16;
+    output_list = (output_t *)xrealloc(output_list,
+                                       (size_t)output_alloc*sizeof(output_t));
+  }
+  output_list[output_count].filename = xstrdup(filename);
+  output_list[output_count].tmpfile = tmpfile;
+  output_count++;
+  pthread_mutex_unlock(&output_mutex);
+
+  return fp;
+}
+
+static FILE * output_open(const char * filename)
+{
+  FILE * fp = output_create(filename);
+
+  if (!fp)
+    fatal("%s", bpp_errmsg);
+
+  return fp;
+}
+
+/* close an output file; returns BPP_FAILURE and sets bpp_errmsg on write
+   errors, e.g. a full disk */
+int output_finish(FILE * fp)
+{
+  int ok = !ferror(fp);
+
+  ok = !fclose(fp) && ok;
+  if (!ok)
+  {
+    bpp_errno = ERROR_FILE_OPEN;
+    snprintf(bpp_errmsg, 200, "Unable to write output file (%s)",
+             strerror(errno));
+    return BPP_FAILURE;
+  }
+
+  return BPP_SUCCESS;
+}
+
+static void output_close(FILE * fp)
+{
+  if (!output_finish(fp))
+    fatal("%s", bpp_errmsg);
+}
+
+/* remove the temporary file of a closed output, which is then not
+   committed; outputs written directly are left as they are */
+void output_discard(const char * filename)
+{
+  long i;
+
+  pthread_mutex_lock(&output_mutex);
+  for (i = 0; i < output_count; ++i)
+    if (!strcmp(output_list[i].filename, filename))
+    {
+      unlink(output_list[i].tmpfile);
+      free(output_list[i].filename);
+      free(output_list[i].tmpfile);
+      output_list[i] = output_list[--output_count];
+      break;
+    }
+  pthread_mutex_unlock(&output_mutex);
+}
+
+/* move the output files of a successful command to their names; if a
+   rename fails, the files not yet in place are removed */
+void output_commit()
+{
+  long i;
+
+  for (i = 0; i < output_count; ++i)
+    if (rename(output_list[i].tmpfile, output_list[i].filename))
+    {
+      long done = i;
+
+      fprintf(stderr, "Unable to write %s (%s)\n",
+              output_list[i].filename, strerror(errno));
+      for (; i < output_count; ++i)
+        unlink(output_list[i].tmpfile);
+      output_committed = 1;
+      fatal("Only %ld of %ld output files were written", done, output_count);
+    }
+
+  for (i = 0; i < output_count; ++i)
+  {
+    free(output_list[i].filename);
+    free(output_list[i].tmpfile);
+  }
+  free(output_list);
+
+  output_list = NULL;
+  output_count = 0;
+  output_committed = 1;
+}
+
+/* analyses of nucleotide sites reject protein loci instead of reading
+   residues as nucleotide codes */
+static void require_dna(msa_t * msa, long index, const char * option)
+{
+  msa_detect_dtype(msa);
+  if (msa->dtype != BPP_DATA_DNA)
+    fatal("Locus %ld is not a nucleotide alignment (%s)", index+1, option);
+}
+
+static void * cb_explode(void * item, long index, void * data)
+{
+  (void) index;
+  (void) data;
+
+  /* loci are written as they are */
+  return item;
+}
+
+static long cb_explode_write(void * result, long index, void * data)
+{
+  long bytes;
+  char * filename;
+  FILE * fp_out;
+  msa_t * msa = (msa_t *)result;
+  char * outfile = (char *)data;
+
+  xasprintf(&filename, "%s.%ld", outfile, index);
+  fp_out = output_open(filename);
+  phylip_print(fp_out, msa);
+  bytes = bpp_ftell(fp_out);
+
+  msa_destroy(msa);
+  free(filename);
+  output_close(fp_out);
+
+  return bytes;
+}
+
+/* read all loci of the input file, from the parse cache with --cache */
+static msa_t ** load_msa(long * msa_count)
+{
+  phylip_t * fd;
+  msa_t ** msa_list;
+
+  if (opt_cache)
+  {
+    if (!(msa_list = cache_parse(opt_cache,
+                                 opt_msafile,
+                                 opt_cache_verify,
+                                 msa_count)))
+      fatal("%s", bpp_errmsg);
+    if (bpp_errno == ERROR_CACHE)
+      fprintf(stderr, "WARNING: %s\n", bpp_errmsg);
+    return msa_list;
+  }
+
+  /* open phylip file */
+  fd = phylip_open(opt_msafile, pll_map_fasta);
+  if (!fd)
+    fatal("%s", bpp_errmsg);
+
+  /* read alignment */
+  msa_list = phylip_parse_multisequential(fd, msa_count);
+  if (!msa_list)
+    fatal("%s", bpp_errmsg);
+
+  phylip_close(fd);
+
+  return msa_list;
+}
+
+/* source of the loci of --msa: streamed from the PHYLIP file, or the loci
+   loaded with --cache */
+typedef struct msa_source_s
+{
+  phylip_t * fd;
+  pipeline_list_t list;
+} msa_source_t;
+
+static void source_open(msa_source_t * src)
+{
+  memset(src, 0, sizeof(msa_source_t));
+
+  if (opt_cache)
+    src->list.msa_list = load_msa(&src->list.count);
+  else if (!(src->fd = phylip_open(opt_msafile, pll_map_fasta)))
+    fatal("%s", bpp_errmsg);
+}
+
+/* pipeline reader over either kind of source */
+static void * source_read(void * data)
+{
+  msa_source_t * src = (msa_source_t *)data;
+
+  if (src->fd)
+    return pipeline_cb_phylip((void *)src->fd);
+
+  return pipeline_cb_list((void *)&src->list);
+}
+
+static void source_close(msa_source_t * src)
+{
+  long i;
+
+  if (src->fd)
+    phylip_close(src->fd);
+
+  /* loci not consumed due to an error */
+  for (i = src->list.next; i < src->list.count; ++i)
+    msa_destroy(src->list.msa_list[i]);
+  free(src->list.msa_list);
+}
+
+/* process the loci of --msa with the worker and writer callbacks in the
+   pipeline and fail on errors */
+static void run_msa_pipeline(void * (*cb_work)(void *, long, void *),
+                             long (*cb_write)(void *, long, void *),
+                             void * data)
+{
+  int rc;
+  msa_source_t src;
+
+  source_open(&src);
+  rc = pipeline_run(opt_threads, source_read, (void *)&src,
+                    cb_work, cb_write, data);
+  source_close(&src);
+
+  if (!rc)
+    fatal("%s", bpp_errmsg);
+}
+
+void cmd_explode()
+{
+  char * outfile;
+
+  /* read alignments and write separate files */
+  outfile = opt_outfile ? xstrdup(opt_outfile) : xstrdup(opt_msafile);
+  run_msa_pipeline(cb_explode, cb_explode_write, (void *)outfile);
+
+  free(outfile);
+}
+
+static void run_filter(long type, const char * list)
+{
+  filter_t * filter = filter_create(type, list);
+  if (!filter)
+    fatal("%s", bpp_errmsg);
+
+  FILE * fpout = opt_outfile ? output_open(opt_outfile) : stdout;
+
+  /* read, filter sequences and write loci in input order */
+  if (opt_cache)
+  {
+    long msa_count;
+    msa_t ** msa_list = load_msa(&msa_count);
+
+    if (!filter_list(filter, msa_list, msa_count, fpout, opt_threads))
+      fatal("%s", bpp_errmsg);
+    free(msa_list);
+  }
+  else if (!filter_file(filter, opt_msafile, fpout, opt_threads))
+    fatal("%s", bpp_errmsg);
+
+  if (opt_outfile)
+    output_close(fpout);
+
+  filter_destroy(filter);
+}
+
+void cmd_extract()
+{
+  run_filter(FILTER_EXTRACT, opt_extract);
+}
+
+void cmd_remove()
+{
+  run_filter(FILTER_REMOVE, opt_remove);
+}
+
+void cmd_dstat()
+{
+  long i;
+  long msa_count;
+  msa_t ** msa_list;
+  dstat_t * ds;
+  dstat_result_t result;
+  timing_mark_t mark;
+
+  printf("Pre-computing table for site scores...\n");
+  if (!(ds = dstat_create(opt_dstat)))
+    fatal("%s", bpp_errmsg);
+
+  msa_list = load_msa(&msa_count);
+
+  printf("Tree: (((%s,%s),%s),%s);\n",
+         ds->taxa[0], ds->taxa[1], ds->taxa[2], ds->taxa[3]);
+  printf("Testing introgression between %s and %s, and between %s and %s\n",
+         ds->taxa[0], ds->taxa[2], ds->taxa[1], ds->taxa[2]);
+
+  timing_start(&mark);
+
+  printf("--------\n");
+
+  sched_t * sched = xsched_create(opt_threads);
+  if (!dstat_compute(ds, msa_list, msa_count, sched, &result))
+    fatal("%s", bpp_errmsg);
+  sched_destroy(sched);
+
+  printf("abba: %f\n", result.abba);
+  printf("baba: %f\n", result.baba);
+  printf("D: %f\n", result.d);
+
+  timing_stop(TIMING_PHASE_PROCESS, &mark, 0, msa_count);
+
+  for (i = 0; i < msa_count; ++i)
+    msa_destroy(msa_list[i]);
+  free(msa_list);
+
+  dstat_destroy(ds);
+}
+
+void cmd_serve()
+{
+  long i;
+  long msa_count;
+  msa_t ** msa_list;
+
+  if (!opt_msafile)
+    fatal("Option --serve requires an alignment file (--msa)");
+
+  /* load the whole dataset once */
+  msa_list = load_msa(&msa_count);
+
+  printf("Serving %ld loci from %s on %s\n", msa_count, opt_msafile, opt_serve);
+  fflush(stdout);
+
+  if (!server_run(opt_serve, msa_list, msa_count))
+    fatal("%s", bpp_errmsg);
+
+  for (i = 0; i < msa_count; ++i)
+    msa_destroy(msa_list[i]);
+  free(msa_list);
+}
+
+static int cb_strcmp(const void * a, const void * b)
+{
+  return strverscmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* regular files of directory 'path' in natural order (x.2 before x.10), or
+   'path' itself if it is a file; hidden files are skipped */
+static char ** list_files(const char * path, long * count)
+{
+  long maxcount = 64;
+  char ** files;
+  struct stat st;
+  struct dirent * entry;
+
+  if (stat(path, &st))
+    fatal("Unable to access %s", path);
+
+  files = (char **)xmalloc((size_t)maxcount * sizeof(char *));
+  *count = 0;
+
+  if (!S_ISDIR(st.st_mode))
+  {
+    files[(*count)++] = xstrdup(path);
+    return files;
+  }
+
+  DIR * dir = opendir(path);
+  if (!dir)
+    fatal("Unable to open directory %s", path);
+
+  while ((entry = readdir(dir)))
+  {
+    char * filename;
+
+    if (entry->d_name[0] == '.')
+      continue;
+
+    xasprintf(&filename, "%s/%s", path, entry->d_name);
+    if (stat(filename, &st) || !S_ISREG(st.st_mode))
+    {
+      free(filename);
+      continue;
+    }
+
+    if (*count == maxcount)
+    {
+      maxcount *= 2;
+      files = (char **)xrealloc(files, (size_t)maxcount * sizeof(char *));
+    }
+    files[(*count)++] = filename;
+  }
+  closedir(dir);
+
+  if (!*count)
+    fatal("No files found in directory %s", path);
+
+  qsort(files, (size_t)*count, sizeof(char *), cb_strcmp);
+
+  return files;
+}
+
+void cmd_from_fasta()
+{
+  long i;
+  long count;
+  long individuals;
+  char ** files = list_files(opt_from_fasta, &count);
+
+  FILE * fpout = opt_outfile ? output_open(opt_outfile) : stdout;
+
+  if (!fasta_import(files, count, pll_map_fasta, fpout, opt_threads,
+                    &individuals))
+    fatal("%s", bpp_errmsg);
+
+  if (opt_outfile)
+  {
+    output_close(fpout);
+    printf("Converted %ld loci with %ld individuals into %s\n",
+           count, individuals, opt_outfile);
+  }
+
+  for (i = 0; i < count; ++i)
+    free(files[i]);
+  free(files);
+}
+
+static void * cb_export(void * item, long index, void * data)
+{
+  (void) index;
+  (void) data;
+
+  /* the NEXUS header states the data type */
+  msa_detect_dtype((msa_t *)item);
+  return item;
+}
+
+static long cb_export_write(void * result, long index, void * data)
+{
+  char * filename;
+  FILE * fp_out;
+  msa_t * msa = (msa_t *)result;
+  char * outfile = (char *)data;
+  long nexus = !strcasecmp(opt_export, "nexus");
+  long bytes;
+
+  xasprintf(&filename, "%s.%ld.%s", outfile, index, nexus ? "nex" : "fa");
+  fp_out = output_open(filename);
+  if (nexus)
+    nexus_print(fp_out, msa);
+  else
+    fasta_print(fp_out, msa);
+  bytes = bpp_ftell(fp_out);
+
+  msa_destroy(msa);
+  free(filename);
+  output_close(fp_out);
+
+  return bytes;
+}
+
+/* stream the loci of --msa into one FASTA or NEXUS file per locus */
+void cmd_export()
+{
+  char * outfile;
+
+  if (!opt_msafile)
+    fatal("Option --export requires an alignment file (--msa)");
+
+  outfile = opt_outfile ? xstrdup(opt_outfile) : xstrdup(opt_msafile);
+  run_msa_pipeline(cb_export, cb_export_write, (void *)outfile);
+
+  free(outfile);
+}
+
+static void * cb_stats(void * item, long index, void * data)
+{
+  msa_t * msa = (msa_t *)item;
+  msa_stats_t * stats = (msa_stats_t *)xmalloc(sizeof(msa_stats_t));
+
+  (void) index;
+  (void) data;
+
+  /* missing data and ambiguity are scored by the codes of the data type */
+  msa_detect_dtype(msa);
+  if (!msa_stats(msa, stats))
+    fatal("%s", bpp_errmsg);
+  msa_destroy(msa);
+
+  return (void *)stats;
+}
+
+static long cb_stats_write(void * result, long index, void * data)
+{
+  (void) index;
+
+  /* the report is written once all loci are summarized */
+  msa_stats_add((msa_stats_report_t *)data, (msa_stats_t *)result);
+  free(result);
+
+  return 0;
+}
+
+void cmd_stats()
+{
+  FILE * fp;
+  msa_stats_report_t report;
+
+  if (!opt_msafile)
+    fatal("Option --stats requires an alignment file (--msa)");
+
+  fp = opt_outfile ? output_open(opt_outfile) : stdout;
+
+  msa_stats_begin(&report, fp, !strcasecmp(opt_stats, "json"));
+  run_msa_pipeline(cb_stats, cb_stats_write, (void *)&report);
+  msa_stats_end(&report);
+
+  if (opt_outfile)
+    output_close(fp);
+}
+
+typedef struct diversity_item_s
+{
+  diversity_t * div;
+  long count;
+} diversity_item_t;
+
+static void * cb_diversity(void * item, long index, void * data)
+{
+  msa_t * msa = (msa_t *)item;
+  diversity_item_t * d = (diversity_item_t *)xmalloc(sizeof(diversity_item_t));
+
+  (void) data;
+
+  require_dna(msa, index, "--diversity");
+  if (!(d->div = diversity_compute(msa, opt_iupac_half, &d->count)))
+    fatal("%s", bpp_errmsg);
+  msa_destroy(msa);
+
+  return (void *)d;
+}
+
+static long cb_diversity_write(void * result, long index, void * data)
+{
+  long i;
+  diversity_item_t * d = (diversity_item_t *)result;
+  FILE * fp = (FILE *)data;
+  long bytes = bpp_ftell(fp);
+
+  for (i = 0; i < d->count; ++i)
+  {
+    diversity_t * div = d->div+i;
+
+    fprintf(fp, "%ld\t%s\t%ld\t%ld\t%ld\t%.6f\t%ld\t%.6f\n",
+            index+1, div->group ? div->group : "all", div->sequences,
+            div->sites, div->pairs, div->pi, div->segregating, div->theta_w);
+  }
+
+  diversity_destroy(d->div, d->count);
+  free(d);
+
+  return bpp_ftell(fp) - bytes;
+}
+
+/* one row for all sequences of each locus followed by one row per species */
+void cmd_diversity()
+{
+
+  if (!opt_msafile)
+    fatal("Option --diversity requires an alignment file (--msa)");
+
+  FILE * fp = opt_outfile ? output_open(opt_outfile) : stdout;
+
+  fprintf(fp, "locus\tgroup\tsequences\tsites\tpairs\tpi\tsegregating\t"
+              "theta_w\n");
+
+  run_msa_pipeline(cb_diversity, cb_diversity_write, (void *)fp);
+
+  if (opt_outfile)
+    output_close(fp);
+}
+
+#define DIST_MAGIC      "BPPDIST"
+#define DIST_VERSION    1
+
+typedef struct dist_writer_s
+{
+  FILE * fp;
+  long binary;
+  long model;
+
+  /* counts over all loci, indexed by label */
+  hashtable_t * ht;
+  char ** labels;
+  long count;
+  long capacity;
+  long * diffs;
+  long * sites;
+} dist_writer_t;
+
+/* distances from counts with rows of the count matrices stride apart */
+static double * dist_matrix(const long * diffs,
+                            const long * sites,
+                            long n,
+                            long stride,
+                            long model)
+{
+  long i,j;
+  double * dist = (double *)xmalloc((size_t)MAX(n*n,1) * sizeof(double));
+
+  for (i = 0; i < n; ++i)
+    for (j = 0; j < n; ++j)
+      dist[i*n+j] = distance_value(diffs[i*stride+j], sites[i*stride+j],
+                                   model);
+
+  return dist;
+}
+
+/* PHYLIP square matrix, or in binary: locus index (0 for the concatenated
+   matrix), number of sequences, labels as length and characters, and the
+   matrix as doubles in row-major order */
+static void dist_print(dist_writer_t * w,
+                       long locus,
+                       char ** labels,
+                       long n,
+                       const double * dist)
+{
+  long i,j;
+  int width = 10;
+
+  if (w->binary)
+  {
+    fwrite(&locus, sizeof(long), 1, w->fp);
+    fwrite(&n, sizeof(long), 1, w->fp);
+    for (i = 0; i < n; ++i)
+    {
+      int label_length = (int)strlen(labels[i]);
+      fwrite(&label_length, sizeof(int), 1, w->fp);
+      fwrite(labels[i], 1, (size_t)label_length, w->fp);
+    }
+    fwrite(dist, sizeof(double), (size_t)(n*n), w->fp);
+    return;
+  }
+
+  for (i = 0; i < n; ++i)
+    width = MAX(width, (int)strlen(labels[i]));
+
+  fprintf(w->fp, "%ld\n", n);
+  for (i = 0; i < n; ++i)
+  {
+    fprintf(w->fp, "%-*s", width, labels[i]);
+    for (j = 0; j < n; ++j)
+      fprintf(w->fp, " %.6f", dist[i*n+j]);
+    fprintf(w->fp, "\n");
+  }
+}
+
+static long dist_label_index(dist_writer_t * w, char * label)
+{
+  long i;
+  unsigned long hash = hash_fnv(label);
+  pair_t * pair = (pair_t *)hashtable_find(w->ht, label, hash,
+                                           cb_cmp_pairlabel);
+
+  if (pair)
+    return (long)(size_t)pair->data;
+
+  if (w->count == w->capacity)
+  {
+    long capacity = MAX(64, 2*w->capacity);
+    long * diffs = (long *)xcalloc((size_t)(capacity*capacity), sizeof(long));
+    long * sites = (long *)xcalloc((size_t)(capacity*capacity), sizeof(long));
+
+    for (i = 0; i < w->count; ++i)
+    {
+      memcpy(diffs + i*capacity, w->diffs + i*w->capacity,
+             (size_t)w->count * sizeof(long));
+      memcpy(sites + i*capacity, w->sites + i*w->capacity,
+             (size_t)w->count * sizeof(long));
+    }
+    free(w->diffs);
+    free(w->sites);
+    w->diffs = diffs;
+    w->sites = sites;
+    w->capacity = capacity;
+    w->labels = (char **)xrealloc(w->labels,
+                                  (size_t)capacity * sizeof(char *));
+  }
+
+  pair = (pair_t *)xmalloc(sizeof(pair_t));
+  pair->label = w->labels[w->count] = xstrdup(label);
+  pair->data = (void *)(size_t)w->count;
+  if (!hashtable_insert_force(w->ht, pair, hash))
+    fatal("%s", bpp_errmsg);
+
+  return w->count++;
+}
+
+/* one matrix per locus in input order, followed by the matrix of the
+   concatenated loci, in which sequences are matched by label; ML distances
+   of protein loci are written per locus only. The model field of the binary
+   header is DISTANCE_P, DISTANCE_JC69, or DISTANCE_ML plus the index of the
+   model in bpp_aa_models */
+void cmd_distances()
+{
+  long i,j,k;
+  long msa_count;
+  long bytes;
+  dist_writer_t w;
+  timing_mark_t mark;
+  mldist_t * ml = NULL;
+
+  if (!opt_msafile)
+    fatal("Option --distances requires an alignment file (--msa)");
+
+  memset(&w, 0, sizeof(dist_writer_t));
+  if (!strcasecmp(opt_distances, "p"))
+    w.model = DISTANCE_P;
+  else if (!strcasecmp(opt_distances, "jc69"))
+    w.model = DISTANCE_JC69;
+  else
+  {
+    const aa_model_t * model = aa_model_find(opt_distances);
+
+    if (!(ml = mldist_create(model)))
+      fatal("%s", bpp_errmsg);
+    w.model = DISTANCE_ML + (long)(model - bpp_aa_models);
+  }
+  w.binary = opt_dist_format && !strcasecmp(opt_dist_format, "binary");
+  if (w.binary && !opt_outfile)
+    fatal("Binary output of --distances requires an output file (--out)");
+  w.fp = opt_outfile ? output_open(opt_outfile) : stdout;
+
+  msa_t ** msa_list = load_msa(&msa_count);
+
+  if (!(w.ht = hashtable_create((unsigned long)MAX(msa_count,64))))
+    fatal("%s", bpp_errmsg);
+
+  if (w.binary)
+  {
+    long version = DIST_VERSION;
+    fwrite(DIST_MAGIC, 1, 8, w.fp);
+    fwrite(&version, sizeof(long), 1, w.fp);
+    fwrite(&w.model, sizeof(long), 1, w.fp);
+  }
+
+  sched_t * sched = xsched_create(opt_threads);
+
+  for (k = 0; k < msa_count; ++k)
+  {
+    msa_t * msa = msa_list[k];
+    long n = msa->count;
+    double * dist;
+
+    if (ml)
+    {
+      msa_detect_dtype(msa);
+      if (msa->dtype != BPP_DATA_AA)
+        fatal("Locus %ld is not a protein alignment (--distances %s)",
+              k+1, opt_distances);
+
+      dist = (double *)xmalloc((size_t)MAX(n*n,1) * sizeof(double));
+
+      timing_start(&mark);
+      if (!mldist_compute(ml, msa, sched, dist))
+        fatal("%s", bpp_errmsg);
+      timing_stop(TIMING_PHASE_PROCESS, &mark, 0, 1);
+
+      timing_start(&mark);
+      bytes = bpp_ftell(w.fp);
+      dist_print(&w, k+1, msa->label, n, dist);
+      timing_stop(TIMING_PHASE_WRITE, &mark, bpp_ftell(w.fp) - bytes, 1);
+
+      free(dist);
+      msa_destroy(msa);
+      continue;
+    }
+
+    /* p and JC69 distances compare nucleotides; protein loci need a model */
+    if (w.model == DISTANCE_P)
+      require_dna(msa, k, "--distances p");
+    else
+      require_dna(msa, k, "--distances jc69");
+
+    long * diffs = (long *)xmalloc((size_t)(n*n) * sizeof(long));
+    long * sites = (long *)xmalloc((size_t)(n*n) * sizeof(long));
+    long * index = (long *)xmalloc((size_t)n * sizeof(long));
+
+    timing_start(&mark);
+    if (!distance_counts(msa, sched, diffs, sites))
+      fatal("%s", bpp_errmsg);
+    timing_stop(TIMING_PHASE_PROCESS, &mark, 0, 1);
+
+    timing_start(&mark);
+    bytes = bpp_ftell(w.fp);
+    dist = dist_matrix(diffs, sites, n, n, w.model);
+    dist_print(&w, k+1, msa->label, n, dist);
+    free(dist);
+    timing_stop(TIMING_PHASE_WRITE, &mark, bpp_ftell(w.fp) - bytes, 1);
+
+    for (i = 0; i < n; ++i)
+      index[i] = dist_label_index(&w, msa->label[i]);
+
+    for (i = 0; i < n; ++i)
+      for (j = 0; j < n; ++j)
+      {
+        w.diffs[index[i]*w.capacity+index[j]] += diffs[i*n+j];
+        w.sites[index[i]*w.capacity+index[j]] += sites[i*n+j];
+      }
+
+    free(index);
+    free(diffs);
+    free(sites);
+    msa_destroy(msa);
+  }
+
+  sched_destroy(sched);
+
+  if (ml)
+    mldist_destroy(ml);
+  else
+  {
+    double * dist = dist_matrix(w.diffs, w.sites, w.count, w.capacity,
+                                w.model);
+    dist_print(&w, 0, w.labels, w.count, dist);
+    free(dist);
+  }
+
+  hashtable_destroy(w.ht, free);
+  for (i = 0; i < w.count; ++i)
+    free(w.labels[i]);
+  free(w.labels);
+  free(w.diffs);
+  free(w.sites);
+  free(msa_list);
+
+  if (opt_outfile)
+    output_close(w.fp);
+}
+
+static void sfs_print(FILE * fp, const unsigned long * h, long bins)
+{
+  long i;
+
+  for (i = 0; i < bins; ++i)
+    fprintf(fp, "%s%lu", i ? " " : "", h[i]);
+  fprintf(fp, "\n");
+}
+
+/* one row per species and one per pair of species, the counts of a joint
+   spectrum in row-major order */
+void cmd_sfs()
+{
+  long i,j,p;
+  long msa_count;
+  timing_mark_t mark;
+  const char * outgroup = NULL;
+
+  if (!opt_msafile)
+    fatal("Option --sfs requires an alignment file (--msa)");
+
+  if (!strcasecmp(opt_sfs, "unfolded"))
+  {
+    if (!opt_outgroup)
+      fatal("Unfolded spectra (--sfs unfolded) require an --outgroup");
+    outgroup = opt_outgroup[0] == '^' ? opt_outgroup+1 : opt_outgroup;
+  }
+
+  FILE * fp = opt_outfile ? output_open(opt_outfile) : stdout;
+
+  msa_t ** msa_list = load_msa(&msa_count);
+  for (i = 0; i < msa_count; ++i)
+    require_dna(msa_list[i], i, "--sfs");
+
+  sched_t * sched = xsched_create(opt_threads);
+  timing_start(&mark);
+  sfs_t * sfs = sfs_compute(msa_list, msa_count, outgroup, opt_iupac_half,
+                            sched);
+  timing_stop(TIMING_PHASE_PROCESS, &mark, 0, msa_count);
+  sched_destroy(sched);
+
+  if (!sfs)
+    fatal("%s", bpp_errmsg);
+
+  /* sample sizes are fixed per species; loci with fewer copies are left
+     out of its spectra */
+  for (i = 0; i < sfs->species_count; ++i)
+    if (sfs->loci_incomplete[i])
+      fprintf(stderr,
+              "WARNING: species %s has fewer than %ld copies in %ld of %ld "
+              "loci, which are left out of its spectra (%lu sites without "
+              "all copies)\n",
+              sfs->species[i], sfs->samples[i], sfs->loci_incomplete[i],
+              msa_count, sfs->sites_incomplete[i]);
+
+  fprintf(fp, "species\tsamples\tcounts\n");
+  for (i = 0; i < sfs->species_count; ++i)
+  {
+    fprintf(fp, "%s\t%ld\t", sfs->species[i], sfs->samples[i]);
+    sfs_print(fp, sfs->sfs[i], sfs->samples[i]+1);
+  }
+  for (i = 0, p = 0; i < sfs->species_count; ++i)
+    for (j = i+1; j < sfs->species_count; ++j, ++p)
+    {
+      fprintf(fp, "%s,%s\t%ld,%ld\t", sfs->species[i], sfs->species[j],
+              sfs->samples[i], sfs->samples[j]);
+      sfs_print(fp, sfs->joint[p], (sfs->samples[i]+1)*(sfs->samples[j]+1));
+    }
+
+  sfs_destroy(sfs);
+  for (i = 0; i < msa_count; ++i)
+    msa_destroy(msa_list[i]);
+  free(msa_list);
+
+  if (opt_outfile)
+    output_close(fp);
+}
+
+typedef struct composition_item_s
+{
+  msa_t * msa;
+  composition_t * comp;
+} composition_item_t;
+
+typedef struct composition_writer_s
+{
+  FILE * fp;
+  const aa_model_t * model;
+} composition_writer_t;
+
+static void * cb_composition(void * item, long index, void * data)
+{
+  msa_t * msa = (msa_t *)item;
+  const aa_model_t * model = ((composition_writer_t *)data)->model;
+  composition_item_t * c;
+
+  /* model frequencies only apply to protein loci */
+  msa_detect_dtype(msa);
+  if (model && msa->dtype != BPP_DATA_AA)
+    fatal("Locus %ld is not a protein alignment (--composition %s)",
+          index+1, model->name);
+
+  c = (composition_item_t *)xmalloc(sizeof(composition_item_t));
+  c->msa = msa;
+  c->comp = composition_compute(msa, model ? model->freqs : NULL);
+  if (!c->comp)
+    fatal("%s", bpp_errmsg);
+
+  return (void *)c;
+}
+
+static void composition_print(FILE * fp,
+                              long index,
+                              const char * label,
+                              const char * datatype,
+                              long chars,
+                              const double * freqs,
+                              long states,
+                              double chi2,
+                              long df)
+{
+  long i;
+
+  fprintf(fp, "%ld\t%s\t%s\t%ld\t", index+1, label, datatype, chars);
+  for (i = 0; i < states; ++i)
+    fprintf(fp, "%s%.6f", i ? "," : "", freqs[i]);
+  fprintf(fp, "\t%.6f\t%ld\t%.6g\n", chi2, df, composition_pvalue(chi2,df));
+}
+
+static long cb_composition_write(void * result, long index, void * data)
+{
+  long i;
+  long chars = 0;
+  composition_item_t * c = (composition_item_t *)result;
+  composition_t * comp = c->comp;
+  FILE * fp = ((composition_writer_t *)data)->fp;
+  long bytes = bpp_ftell(fp);
+  const char * datatype = c->msa->dtype == BPP_DATA_AA ? "aa" : "dna";
+
+  for (i = 0; i < comp->count; ++i)
+    chars += comp->chars[i];
+
+  composition_print(fp, index, "all", datatype, chars, c->msa->freqs,
+                    comp->states, comp->chi2_total, comp->df_total);
+
+  for (i = 0; i < comp->count; ++i)
+  {
+    if (!comp->chars[i]) continue;
+
+    composition_print(fp, index, c->msa->label[i], datatype, comp->chars[i],
+                      comp->freqs + i*comp->states, comp->states,
+                      comp->chi2[i], comp->df);
+  }
+
+  composition_destroy(comp);
+  msa_destroy(c->msa);
+  free(c);
+
+  return bpp_ftell(fp) - bytes;
+}
+
+/* one row with the pooled frequencies and the locus statistic followed by
+   one row per sequence with data */
+void cmd_composition()
+{
+  composition_writer_t w;
+
+  if (!opt_msafile)
+    fatal("Option --composition requires an alignment file (--msa)");
+
+  w.model = NULL;
+  if (strcasecmp(opt_composition, "pooled"))
+    w.model = aa_model_find(opt_composition);
+
+  w.fp = opt_outfile ? output_open(opt_outfile) : stdout;
+
+  fprintf(w.fp, "locus\tsequence\tdatatype\tchars\tfreqs\tchi2\tdf\t"
+                "pvalue\n");
+
+  run_msa_pipeline(cb_composition, cb_composition_write, (void *)&w);
+
+  if (opt_outfile)
+    output_close(w.fp);
+}
+
+static void * cb_four_gamete(void * item, long index, void * data)
+{
+  msa_t * msa = (msa_t *)item;
+  fourgamete_t * fg;
+
+  (void) data;
+
+  require_dna(msa, index, "--four-gamete");
+  if (!(fg = fourgamete_compute(msa)))
+    fatal("%s", bpp_errmsg);
+  msa_destroy(msa);
+
+  return (void *)fg;
+}
+
+static long cb_four_gamete_write(void * result, long index, void * data)
+{
+  long i;
+  fourgamete_t * fg = (fourgamete_t *)result;
+  FILE * fp = (FILE *)data;
+  long bytes = bpp_ftell(fp);
+
+  fprintf(fp, "%ld\t%ld\t%ld\t%ld\t%ld\t%ld\t%ld\t",
+          index+1, fg->sequences, fg->length, fg->sites, fg->pairs,
+          fg->incompatible, fg->rm);
+
+  if (!fg->rm)
+    fprintf(fp, "-\t-");
+  else
+  {
+    for (i = 0; i < fg->rm; ++i)
+      fprintf(fp, "%s%ld-%ld", i ? "," : "",
+              fg->intervals[2*i]+1, fg->intervals[2*i+1]+1);
+    fprintf(fp, "\t");
+    for (i = 0; i < fg->rm; ++i)
+      fprintf(fp, "%s%ld", i ? "," : "", fg->splits[i]+1);
+  }
+  fprintf(fp, "\n");
+
+  fourgamete_destroy(fg);
+
+  return bpp_ftell(fp) - bytes;
+}
+
+/* one row per locus; intervals are the disjoint pairs of incompatible
+   sites counted by Rm and splits the first column of each segment after
+   the suggested cuts, all 1-based */
+void cmd_four_gamete()
+{
+
+  if (!opt_msafile)
+    fatal("Option --four-gamete requires an alignment file (--msa)");
+
+  FILE * fp = opt_outfile ? output_open(opt_outfile) : stdout;
+
+  fprintf(fp, "locus\tsequences\tlength\tinformative\tpairs\tincompatible\t"
+              "rm\tintervals\tsplits\n");
+
+  run_msa_pipeline(cb_four_gamete, cb_four_gamete_write, (void *)fp);
+
+  if (opt_outfile)
+    output_close(fp);
+}
+
+#define LD_MAGIC        "BPPLD\0\0"
+#define LD_VERSION      1
+
+typedef struct ld_reader_s
+{
+  void * (*cb_read)(void *);
+  void * data;
+  long between;
+  msa_t * prev;
+} ld_reader_t;
+
+typedef struct ld_item_s
+{
+  msa_t * prev;
+  msa_t * msa;
+} ld_item_t;
+
+typedef struct ld_result_s
+{
+  msa_t * prev;
+  ld_pair_t * between;
+  long between_count;
+  ld_pair_t * within;
+  long within_count;
+} ld_result_t;
+
+typedef struct ld_writer_s
+{
+  FILE * fp;
+  long binary;
+  long between;
+  double min_r2;
+} ld_writer_t;
+
+/* pairs each locus with its predecessor in the input */
+static void * cb_ld_read(void * data)
+{
+  ld_reader_t * reader = (ld_reader_t *)data;
+  msa_t * msa;
+
+  if (!(msa = (msa_t *)reader->cb_read(reader->data)))
+    return NULL;
+
+  ld_item_t * item = (ld_item_t *)xmalloc(sizeof(ld_item_t));
+  item->prev = reader->between ? reader->prev : NULL;
+  item->msa = msa;
+  reader->prev = msa;
+
+  return (void *)item;
+}
+
+/* sites of the previous locus against those of the current one, over the
+   sequences found in both by label */
+static ld_pair_t * ld_between(msa_t * prev,
+                              msa_t * msa,
+                              double min_r2,
+                              long * count)
+{
+  long i;
+  ld_pair_t * pairs;
+  hashtable_t * ht = hashtable_create((unsigned long)MAX(msa->count,64));
+  long * order = (long *)xmalloc((size_t)MAX(prev->count,1) * sizeof(long));
+
+  if (!ht)
+    fatal("%s", bpp_errmsg);
+
+  for (i = 0; i < msa->count; ++i)
+  {
+    pair_t * pair = (pair_t *)xmalloc(sizeof(pair_t));
+    pair->label = msa->label[i];
+    pair->data = (void *)(size_t)i;
+    if (!hashtable_insert_force(ht, pair, hash_fnv(msa->label[i])))
+      fatal("%s", bpp_errmsg);
+  }
+
+  for (i = 0; i < prev->count; ++i)
+  {
+    pair_t * pair = (pair_t *)hashtable_find(ht, prev->label[i],
+                                             hash_fnv(prev->label[i]),
+                                             cb_cmp_pairlabel);
+    order[i] = pair ? (long)(size_t)pair->data : -1;
+  }
+
+  biallelic_t * a = biallelic_create(prev, 0, NULL, 0);
+  biallelic_t * b = biallelic_create(msa, 0, order, prev->count);
+
+  if (!a || !b)
+    fatal("%s", bpp_errmsg);
+
+  pairs = ld_compute(a, b, min_r2, count);
+  if (*count < 0)
+    fatal("%s", bpp_errmsg);
+
+  biallelic_destroy(a);
+  biallelic_destroy(b);
+  hashtable_destroy(ht, free);
+  free(order);
+
+  return pairs;
+}
+
+static void * cb_ld(void * item, long index, void * data)
+{
+  ld_item_t * ld = (ld_item_t *)item;
+  ld_writer_t * w = (ld_writer_t *)data;
+  ld_result_t * result = (ld_result_t *)xcalloc(1, sizeof(ld_result_t));
+
+  /* the previous locus was checked by its own worker */
+  require_dna(ld->msa, index, "--ld");
+
+  if (ld->prev)
+    result->between = ld_between(ld->prev, ld->msa, w->min_r2,
+                                 &result->between_count);
+
+  biallelic_t * bi = biallelic_create(ld->msa, 0, NULL, 0);
+  if (!bi)
+    fatal("%s", bpp_errmsg);
+  result->within = ld_compute(bi, NULL, w->min_r2, &result->within_count);
+  if (result->within_count < 0)
+    fatal("%s", bpp_errmsg);
+  biallelic_destroy(bi);
+
+  /* with --ld-between a locus is also read by the next worker, hence it is
+     freed by the writer once the next locus is written */
+  result->prev = ld->prev;
+  if (!w->between)
+    msa_destroy(ld->msa);
+  free(ld);
+
+  return (void *)result;
+}
+
+static void ld_print(ld_writer_t * w,
+                     long locus_i,
+                     long locus_j,
+                     const ld_pair_t * pairs,
+                     long count)
+{
+  long i;
+
+  for (i = 0; i < count; ++i)
+  {
+    const ld_pair_t * p = pairs + i;
+
+    if (w->binary)
+    {
+      long fields[5] = {locus_i, p->site_i+1, locus_j, p->site_j+1, p->n};
+      double values[2] = {p->r2, p->dprime};
+
+      fwrite(fields, sizeof(long), 5, w->fp);
+      fwrite(values, sizeof(double), 2, w->fp);
+    }
+    else
+      fprintf(w->fp, "%ld\t%ld\t%ld\t%ld\t%ld\t%.6f\t%.6f\n",
+              locus_i, p->site_i+1, locus_j, p->site_j+1, p->n, p->r2,
+              p->dprime);
+  }
+}
+
+static long cb_ld_write(void * result, long index, void * data)
+{
+  ld_result_t * ld = (ld_result_t *)result;
+  ld_writer_t * w = (ld_writer_t *)data;
+  long bytes = bpp_ftell(w->fp);
+
+  ld_print(w, index, index+1, ld->between, ld->between_count);
+  ld_print(w, index+1, index+1, ld->within, ld->within_count);
+
+  if (ld->prev)
+    msa_destroy(ld->prev);
+
+  free(ld->between);
+  free(ld->within);
+  free(ld);
+
+  return bpp_ftell(w->fp) - bytes;
+}
+
+/* r^2 and |D'| of pairs of biallelic sites within each locus and, with
+   --ld-between, between each locus and the next, with pairs below
+   --ld-min-r2 left out. Each row or record is (locus, site, locus, site, n,
+   r2, dprime) with 1-based loci and columns; the binary records hold five
+   longs followed by two doubles, after the magic and version */
+void cmd_ld()
+{
+  int rc;
+  ld_reader_t reader;
+  ld_writer_t w;
+  msa_source_t src;
+
+  if (!opt_msafile)
+    fatal("Option --ld requires an alignment file (--msa)");
+
+  memset(&w, 0, sizeof(ld_writer_t));
+  w.binary = !strcasecmp(opt_ld, "binary");
+  w.between = opt_ld_between;
+  w.min_r2 = opt_ld_min_r2;
+  if (w.binary && !opt_outfile)
+    fatal("Binary output of --ld requires an output file (--out)");
+  w.fp = opt_outfile ? output_open(opt_outfile) : stdout;
+
+  if (w.binary)
+  {
+    long version = LD_VERSION;
+    fwrite(LD_MAGIC, 1, 8, w.fp);
+    fwrite(&version, sizeof(long), 1, w.fp);
+  }
+  else
+    fprintf(w.fp, "locus1\tsite1\tlocus2\tsite2\tn\tr2\tdprime\n");
+
+  memset(&reader, 0, sizeof(ld_reader_t));
+  reader.between = opt_ld_between;
+
+  source_open(&src);
+  reader.cb_read = source_read;
+  reader.data = (void *)&src;
+
+  rc = pipeline_run(opt_threads,
+                    cb_ld_read, (void *)&reader,
+                    cb_ld, cb_ld_write, (void *)&w);
+  source_close(&src);
+
+  if (!rc)
+    fatal("%s", bpp_errmsg);
+
+  if (w.between && reader.prev)
+    msa_destroy(reader.prev);
+
+  if (opt_outfile)
+    output_close(w.fp);
+}
+
+typedef struct haplotypes_writer_s
+{
+  FILE * fp;
+  FILE * fp_hap;
+} haplotypes_writer_t;
+
+typedef struct haplotypes_result_s
+{
+  msa_t * msa;
+  haplotypes_t * hap;
+} haplotypes_result_t;
+
+static void * cb_haplotypes(void * item, long index, void * data)
+{
+  haplotypes_result_t * result;
+
+  (void) index;
+  (void) data;
+
+  result = (haplotypes_result_t *)xmalloc(sizeof(haplotypes_result_t));
+  result->msa = (msa_t *)item;
+  if (!(result->hap = haplotypes_compute(result->msa)))
+    fatal("%s", bpp_errmsg);
+
+  return (void *)result;
+}
+
+static long cb_haplotypes_write(void * result, long index, void * data)
+{
+  long i;
+  haplotypes_result_t * r = (haplotypes_result_t *)result;
+  haplotypes_writer_t * w = (haplotypes_writer_t *)data;
+  msa_t * msa = r->msa;
+  haplotypes_t * hap = r->hap;
+  long bytes = bpp_ftell(w->fp) + (w->fp_hap ? bpp_ftell(w->fp_hap) : 0);
+
+  for (i = 0; i < msa->count; ++i)
+    fprintf(w->fp, "%ld\t%s\t%ld\t%ld\n", index+1, msa->label[i],
+            hap->map[i]+1, hap->weight[hap->map[i]]);
+
+  if (w->fp_hap)
+  {
+    fprintf(w->fp_hap, "%ld %ld\n", hap->count, msa->length);
+    for (i = 0; i < hap->count; ++i)
+      fprintf(w->fp_hap, "%s %s\n", msa->label[hap->first[i]],
+              msa->sequence[hap->first[i]]);
+    fprintf(w->fp_hap, "\n");
+  }
+
+  haplotypes_destroy(hap);
+  msa_destroy(msa);
+  free(r);
+
+  return bpp_ftell(w->fp) + (w->fp_hap ? bpp_ftell(w->fp_hap) : 0) - bytes;
+}
+
+/* one row per sequence with its haplotype, numbered from 1 in order of first
+   occurrence within the locus, and the number of sequences carrying it. With
+   --haplotypes the unique haplotypes of each locus are also written as a
+   PHYLIP locus, each under the label of its first carrier */
+void cmd_collapse_haplotypes()
+{
+  haplotypes_writer_t w;
+
+  if (!opt_msafile)
+    fatal("Option --collapse-haplotypes requires an alignment file (--msa)");
+
+  w.fp = opt_outfile ? output_open(opt_outfile) : stdout;
+  w.fp_hap = opt_haplotypes ? output_open(opt_haplotypes) : NULL;
+
+  fprintf(w.fp, "locus\tsequence\thaplotype\tmultiplicity\n");
+
+  run_msa_pipeline(cb_haplotypes, cb_haplotypes_write, (void *)&w);
+
+  if (w.fp_hap)
+    output_close(w.fp_hap);
+  if (opt_outfile)
+    output_close(w.fp);
+}
+
+typedef struct dedup_writer_s
+{
+  FILE * fp;
+  dedup_t * dedup;
+  long written;
+  long loci;
+  long sequences;
+} dedup_writer_t;
+
+typedef struct dedup_result_s
+{
+  msa_t * msa;
+  unsigned long hash;
+  long * dropped;
+  long dropped_count;
+} dedup_result_t;
+
+static void * cb_dedup(void * item, long index, void * data)
+{
+  dedup_writer_t * w = (dedup_writer_t *)data;
+  dedup_result_t * result;
+  msa_t * msa = (msa_t *)item;
+
+  (void) index;
+
+  result = (dedup_result_t *)xmalloc(sizeof(dedup_result_t));
+  result->msa = msa;
+  result->dropped = (long *)xmalloc((size_t)MAX(3*msa->count,1) *
+                                    sizeof(long));
+  if ((result->dropped_count = dedup_labels(msa, result->dropped)) < 0)
+    fatal("%s", bpp_errmsg);
+  result->hash = dedup_hash(w->dedup, msa);
+
+  return (void *)result;
+}
+
+static long cb_dedup_write(void * result, long index, void * data)
+{
+  long i;
+  dedup_result_t * r = (dedup_result_t *)result;
+  dedup_writer_t * w = (dedup_writer_t *)data;
+  msa_t * msa = r->msa;
+  long bytes = bpp_ftell(w->fp);
+
+  for (i = 0; i < r->dropped_count; ++i)
+    if (!opt_quiet)
+      fprintf(stderr, "Locus %ld: sequence %ld repeats the label of sequence "
+              "%ld with %s data\n", index+1, r->dropped[3*i]+1,
+              r->dropped[3*i+1]+1, r->dropped[3*i+2] ? "identical" :
+              "different");
+  w->sequences += r->dropped_count;
+
+  long first = dedup_locus(w->dedup, msa, r->hash, index);
+  if (first == -2)
+    fatal("%s", bpp_errmsg);
+  if (first >= 0)
+  {
+    if (!opt_quiet)
+      fprintf(stderr, "Locus %ld duplicates locus %ld\n", index+1, first+1);
+    w->loci++;
+  }
+  else
+  {
+    phylip_print(w->fp, msa);
+    w->written++;
+  }
+
+  msa_destroy(msa);
+  free(r->dropped);
+  free(r);
+
+  return bpp_ftell(w->fp) - bytes;
+}
+
+/* write the loci of --msa without duplicates in one streaming pass: within
+   each locus only the first sequence with a given label is kept, and loci
+   identical to an earlier locus (in labels and sequences, in any order of
+   the sequences with --dedup unordered) are dropped. Dropped sequences and
+   loci are reported on stderr */
+void cmd_dedup()
+{
+  dedup_writer_t w;
+
+  if (!opt_msafile)
+    fatal("Option --dedup requires an alignment file (--msa)");
+
+  memset(&w, 0, sizeof(dedup_writer_t));
+  if (!(w.dedup = dedup_create(!strcasecmp(opt_dedup, "unordered"))))
+    fatal("%s", bpp_errmsg);
+  w.fp = opt_outfile ? output_open(opt_outfile) : stdout;
+
+  run_msa_pipeline(cb_dedup, cb_dedup_write, (void *)&w);
+
+  dedup_destroy(w.dedup);
+
+  if (opt_outfile)
+  {
+    output_close(w.fp);
+    if (!opt_quiet)
+      printf("Wrote %ld loci into %s, dropped %ld duplicated loci and %ld "
+             "sequences with repeated labels\n",
+             w.written, opt_outfile, w.loci, w.sequences);
+  }
+}
+
+typedef struct missing_writer_s
+{
+  FILE * fp;
+  long written;
+  long loci;
+  long sequences;
+  long sites;
+} missing_writer_t;
+
+typedef struct missing_result_s
+{
+  msa_t * msa;
+  long sequences;
+  long sites;
+} missing_result_t;
+
+static void * cb_filter_missing(void * item, long index, void * data)
+{
+  missing_result_t * result;
+  msa_t * msa = (msa_t *)item;
+
+  (void) index;
+  (void) data;
+
+  result = (missing_result_t *)xmalloc(sizeof(missing_result_t));
+  result->msa = msa;
+
+  msa_detect_dtype(msa);
+  result->sequences = msa_filter_missing(msa, opt_seq_missing,
+                                         opt_site_missing, &result->sites);
+  if (result->sequences < 0)
+    fatal("%s", bpp_errmsg);
+
+  return (void *)result;
+}
+
+static long cb_filter_missing_write(void * result, long index, void * data)
+{
+  missing_result_t * r = (missing_result_t *)result;
+  missing_writer_t * w = (missing_writer_t *)data;
+  msa_t * msa = r->msa;
+  long bytes = bpp_ftell(w->fp);
+
+  w->sequences += r->sequences;
+  w->sites += r->sites;
+
+  if (msa->count < opt_min_seqs || msa->length < opt_min_sites)
+  {
+    if (!opt_quiet)
+      fprintf(stderr, "Locus %ld dropped with %ld sequences and %ld sites "
+              "left\n", index+1, msa->count, msa->length);
+    w->loci++;
+  }
+  else
+  {
+    phylip_print(w->fp, msa);
+    w->written++;
+  }
+
+  msa_destroy(msa);
+  free(r);
+
+  return bpp_ftell(w->fp) - bytes;
+}
+
+/* write the loci of --msa without sequences and sites above the thresholds
+   of missing data, and without loci left with fewer than --min-seqs
+   sequences or --min-sites sites */
+void cmd_filter_missing()
+{
+  missing_writer_t w;
+
+  if (!opt_msafile)
+    fatal("Option --filter-missing requires an alignment file (--msa)");
+
+  memset(&w, 0, sizeof(missing_writer_t));
+  w.fp = opt_outfile ? output_open(opt_outfile) : stdout;
+
+  run_msa_pipeline(cb_filter_missing, cb_filter_missing_write, (void *)&w);
+
+  if (opt_outfile)
+  {
+    output_close(w.fp);
+    if (!opt_quiet)
+      printf("Wrote %ld loci into %s, dropped %ld loci, %ld sequences and %ld "
+             "sites\n", w.written, opt_outfile, w.loci, w.sequences, w.sites);
+  }
+}
+
+void cmd_from_vcf()
+{
+  vcf_stats_t stats;
+
+  if (!opt_ref || !opt_bed || !opt_imap)
+    fatal("Option --from-vcf requires --ref, --bed and --imap");
+
+  FILE * fpout = opt_outfile ? output_open(opt_outfile) : stdout;
+
+  if (!vcf_convert(opt_from_vcf, opt_ref, opt_bed, opt_imap, opt_phased,
+                   fpout, opt_threads, &stats))
+    fatal("%s", bpp_errmsg);
+
+  if (opt_outfile)
+  {
+    output_close(fpout);
+    printf("Wrote %ld loci with %ld SNPs into %s\n",
+           stats.loci, stats.variants, opt_outfile);
+    if (stats.skipped)
+      printf("Skipped %ld records that are not SNPs\n", stats.skipped);
+    if (stats.filtered)
+      printf("Skipped %ld records that did not pass filters\n", stats.filtered);
+    if (opt_phased && stats.unphased)
+      printf("WARNING: %ld heterozygous genotypes are unphased\n",
+             stats.unphased);
+  }
+}
+
+void cmd_check()
+{
+  long i;
+  check_report_t * report;
+
+  if (!opt_msafile)
+    fatal("Option --check requires an alignment file (--msa)");
+
+  sched_t * sched = xsched_create(opt_threads);
+  if (!(report = check_phylip(opt_msafile, pll_map_fasta, sched)))
+    fatal("%s", bpp_errmsg);
+  sched_destroy(sched);
+
+  for (i = 0; i < report->errors_count; ++i)
+  {
+    check_error_t * e = report->errors + i;
+    printf("ERROR: locus %ld, line %ld, offset %ld: %s\n",
+           e->locus, e->line, e->offset, e->msg);
+  }
+
+  printf("Checked %ld loci (%ld bytes) in %s\n",
+         report->loci, report->bytes, opt_msafile);
+
+  if (report->stripped_count)
+  {
+    printf("Stripped %ld characters:\n", report->stripped_count);
+    for (i = 0; i < 256; ++i)
+    {
+      if (!report->stripped[i]) continue;
+
+      if (i > 32 && i < 127)
+        printf("  '%c' %12ld\n", (char)i, report->stripped[i]);
+      else
+        printf("  %#.2lx %12ld\n", i, report->stripped[i]);
+    }
+  }
+
+  long errors = report->errors_count;
+  check_report_destroy(report);
+
+  if (errors)
+    fatal("Found %ld error(s) in %s", errors, opt_msafile);
+}
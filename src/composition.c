@@ -0,0 +1,257 @@
+/*
+    Copyright (C) 2022-2023 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London, Gower Street, London WC1E 6BT, England
+*/
+
+
+#include "libbpptools.h"
+
+/* Empirical state frequencies of a locus and a chi-square test of
+   compositional homogeneity. Characters are histogrammed by their code in
+   pll_map_nt or pll_map_aa (see kernel_class_counts), and an ambiguous code
+   adds an equal fraction to each of its states; fully ambiguous characters
+   such as gaps are not counted. Each sequence is tested against the pooled
+   frequencies of the locus or those of an empirical model, and the locus
+   statistic is the sum over sequences with degrees of freedom reduced by
+   one per estimated state when testing against the pooled frequencies. */
+
+#define COMP_MAX_CLASSES 32
+
+static kernel_map_t nt_kmap;
+static kernel_map_t aa_kmap;
+static unsigned int aa_class[256];
+static unsigned int aa_codes[COMP_MAX_CLASSES];
+static long aa_classes;
+static pthread_once_t comp_once = PTHREAD_ONCE_INIT;
+
+static void comp_init()
+{
+  long c,k;
+
+  /* nucleotide codes are used as classes directly */
+  kernel_map_init(&nt_kmap, pll_map_nt);
+
+  /* amino acid codes have 20 bits, number the distinct ones instead */
+  aa_classes = 1;
+  for (c = 0; c < 256; ++c)
+  {
+    aa_class[c] = 0;
+    if (!pll_map_aa[c]) continue;
+
+    for (k = 1; k < aa_classes; ++k)
+      if (aa_codes[k] == pll_map_aa[c])
+        break;
+    if (k == aa_classes)
+    {
+      assert(aa_classes < COMP_MAX_CLASSES);
+      aa_codes[aa_classes++] = pll_map_aa[c];
+    }
+    aa_class[c] = (unsigned int)k;
+  }
+
+  kernel_map_init(&aa_kmap, aa_class);
+}
+
+/* regularized upper incomplete gamma function Q(a,x), by its series for
+   x < a+1 and by its continued fraction otherwise */
+static double gamma_q(double a, double x)
+{
+  long i;
+
+  if (x <= 0)
+    return 1;
+
+  double lfactor = -x + a*log(x) - lgamma(a);
+
+  if (x < a+1)
+  {
+    double ap = a;
+    double del = 1/a;
+    double sum = del;
+
+    for (i = 0; i < 1000; ++i)
+    {
+      ap += 1;
+      del *= x/ap;
+      sum += del;
+      if (fabs(del) < fabs(sum)*1e-15)
+        break;
+    }
+    return MAX(0, 1 - sum*exp(lfactor));
+  }
+
+  double b = x + 1 - a;
+  double c = 1e300;
+  double d = 1/b;
+  double h = d;
+
+  for (i = 1; i < 1000; ++i)
+  {
+    double an = -i*(i-a);
+
+    b += 2;
+    d = an*d + b;
+    if (fabs(d) < 1e-300) d = 1e-300;
+    c = b + an/c;
+    if (fabs(c) < 1e-300) c = 1e-300;
+    d = 1/d;
+    h *= d*c;
+    if (fabs(d*c - 1) < 1e-15)
+      break;
+  }
+  return exp(lfactor) * h;
+}
+
+double composition_pvalue(double chi2, long df)
+{
+  return df > 0 ? gamma_q(df / 2.0, chi2 / 2.0) : 1;
+}
+
+/* Fill msa->freqs with the pooled frequencies of the locus, according to
+   msa->dtype, and return the composition of each sequence with the test
+   against model_freqs, or against the pooled frequencies if NULL */
+composition_t * composition_compute(msa_t * msa, const double * model_freqs)
+{
+  long i,k,s;
+  long classes;
+  long states;
+  long with_data = 0;
+  unsigned int full;
+  unsigned long counts[COMP_MAX_CLASSES];
+  const kernel_map_t * kmap;
+  static const unsigned int nt_codes[16] = {0,1,2,3,4,5,6,7,
+                                            8,9,10,11,12,13,14,15};
+  const unsigned int * codes;
+
+  pthread_once(&comp_once, comp_init);
+
+  if (msa->dtype == BPP_DATA_DNA)
+  {
+    states = 4;
+    classes = 16;
+    codes = nt_codes;
+    kmap = &nt_kmap;
+    full = 0xf;
+  }
+  else
+  {
+    states = 20;
+    classes = aa_classes;
+    codes = aa_codes;
+    kmap = &aa_kmap;
+    full = 0xfffff;
+  }
+
+  composition_t * comp = (composition_t *)bpp_calloc(1,
+                                                     sizeof(composition_t));
+  double * freqs = (double *)bpp_calloc((size_t)states, sizeof(double));
+  if (!comp || !freqs)
+  {
+    free(comp);
+    free(freqs);
+    return NULL;
+  }
+  comp->states = states;
+  comp->count = msa->count;
+  comp->freqs = (double *)bpp_calloc((size_t)MAX(msa->count*states,1),
+                                     sizeof(double));
+  comp->chars = (long *)bpp_calloc((size_t)MAX(msa->count,1), sizeof(long));
+  comp->chi2 = (double *)bpp_calloc((size_t)MAX(msa->count,1),
+                                    sizeof(double));
+  if (!comp->freqs || !comp->chars || !comp->chi2)
+  {
+    free(freqs);
+    composition_destroy(comp);
+    return NULL;
+  }
+
+  if (msa->freqs)
+    free(msa->freqs);
+  msa->freqs = freqs;
+
+  /* state counts of each sequence and of the locus */
+  long total = 0;
+  for (i = 0; i < msa->count; ++i)
+  {
+    double * f = comp->freqs + i*states;
+
+    memset(counts, 0, COMP_MAX_CLASSES*sizeof(unsigned long));
+    kernel_class_counts(msa->sequence[i], msa->length, kmap, classes, counts);
+
+    for (k = 1; k < classes; ++k)
+    {
+      if (!counts[k] || codes[k] == full) continue;
+
+      double share = (double)counts[k] / PLL_POPCOUNT(codes[k]);
+      for (s = 0; s < states; ++s)
+        if (codes[k] & (1u << s))
+          f[s] += share;
+      comp->chars[i] += (long)counts[k];
+    }
+
+    for (s = 0; s < states; ++s)
+      msa->freqs[s] += f[s];
+    total += comp->chars[i];
+    if (comp->chars[i])
+      ++with_data;
+  }
+
+  if (total)
+    for (s = 0; s < states; ++s)
+      msa->freqs[s] /= total;
+
+  const double * expected = model_freqs ? model_freqs : msa->freqs;
+
+  long nonzero = 0;
+  for (s = 0; s < states; ++s)
+    if (expected[s] > 0)
+      ++nonzero;
+  comp->df = MAX(nonzero-1, 0);
+
+  for (i = 0; i < msa->count; ++i)
+  {
+    double * f = comp->freqs + i*states;
+    long n = comp->chars[i];
+
+    if (!n) continue;
+
+    for (s = 0; s < states; ++s)
+    {
+      if (expected[s] > 0)
+      {
+        double e = n * expected[s];
+        comp->chi2[i] += (f[s] - e) * (f[s] - e) / e;
+      }
+      f[s] /= n;
+    }
+    comp->chi2_total += comp->chi2[i];
+  }
+
+  comp->df_total = comp->df * (model_freqs ? with_data : MAX(with_data-1,0));
+
+  return comp;
+}
+
+void composition_destroy(composition_t * comp)
+{
+  free(comp->freqs);
+  free(comp->chars);
+  free(comp->chi2);
+  free(comp);
+}
@@ -0,0 +1,207 @@
+/*
+    Copyright (C) 2022-2023 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London, Gower Street, London WC1E 6BT, England
+*/
+
+
+#include "libbpptools.h"
+
+/* Duplicated sequences and loci. Within a locus, a sequence whose label was
+   already seen is dropped. Each locus is then reduced to a 64-bit content
+   hash over its labels and sequences, optionally insensitive to the order
+   of its sequences, and a locus with the same hash, number of sequences and
+   length as an earlier one is reported as its duplicate. Hashing runs per
+   locus and in parallel; only the lookup of the hash needs the loci in
+   order. Loci are not kept in memory, hence equal hashes are not confirmed
+   by comparing the data. */
+
+typedef struct dedup_locus_s
+{
+  long index;
+  long count;
+  long length;
+} dedup_locus_t;
+
+static unsigned long mix(unsigned long x)
+{
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9UL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebUL;
+  x ^= x >> 31;
+
+  return x;
+}
+
+static int cb_cmp_locus(void * a, void * b)
+{
+  dedup_locus_t * x = (dedup_locus_t *)a;
+  dedup_locus_t * y = (dedup_locus_t *)b;
+
+  return x->count == y->count && x->length == y->length;
+}
+
+dedup_t * dedup_create(long unordered)
+{
+  dedup_t * d = (dedup_t *)bpp_calloc(1, sizeof(dedup_t));
+  if (!d)
+    return NULL;
+
+  d->unordered = unordered;
+  if (!(d->ht = hashtable_create(1024)))
+  {
+    free(d);
+    return NULL;
+  }
+
+  return d;
+}
+
+void dedup_destroy(dedup_t * d)
+{
+  hashtable_destroy(d->ht, free);
+  free(d);
+}
+
+/* remove the sequences of a locus whose label repeats that of an earlier
+   sequence; for each, dropped receives its index, the index of the first
+   sequence with the label, and whether the two are identical. Returns the
+   number of sequences removed, or -1 if memory runs out */
+long dedup_labels(msa_t * msa, long * dropped)
+{
+  long i,k;
+  long removed = 0;
+  hashtable_t * ht = hashtable_create((unsigned long)MAX(msa->count,1));
+
+  if (!ht)
+    return -1;
+
+  for (i = 0; i < msa->count; ++i)
+  {
+    unsigned long hash = hash_fnv(msa->label[i]);
+    pair_t * pair = (pair_t *)hashtable_find(ht, msa->label[i], hash,
+                                             cb_cmp_pairlabel);
+
+    if (pair)
+    {
+      long first = (long)(size_t)pair->data;
+
+      dropped[3*removed]   = i;
+      dropped[3*removed+1] = first;
+      dropped[3*removed+2] = kernel_memeq(msa->sequence[i],
+                                          msa->sequence[first], msa->length);
+      removed++;
+      continue;
+    }
+
+    pair = (pair_t *)bpp_malloc(sizeof(pair_t));
+    if (!pair)
+    {
+      hashtable_destroy(ht, free);
+      return -1;
+    }
+    pair->label = msa->label[i];
+    pair->data = (void *)(size_t)i;
+    if (!hashtable_insert_force(ht, pair, hash))
+    {
+      free(pair);
+      hashtable_destroy(ht, free);
+      return -1;
+    }
+  }
+
+  hashtable_destroy(ht, free);
+
+  if (!removed) return 0;
+
+  /* compact the locus; dropped indices are in increasing order */
+  for (i = 0, k = 0; i < msa->count; ++i)
+  {
+    if (k < removed && dropped[3*k] == i)
+    {
+      free(msa->label[i]);
+      free(msa->sequence[i]);
+      k++;
+      continue;
+    }
+    msa->label[i-k] = msa->label[i];
+    msa->sequence[i-k] = msa->sequence[i];
+  }
+  msa->count -= removed;
+
+  return removed;
+}
+
+/* content hash of a locus over (label, sequence) records */
+unsigned long dedup_hash(const dedup_t * d, const msa_t * msa)
+{
+  long i;
+  unsigned long hash = mix((unsigned long)msa->count ^
+                           mix((unsigned long)msa->length));
+  unsigned long sum = 0;
+
+  for (i = 0; i < msa->count; ++i)
+  {
+    unsigned long record = mix(hash_fnv(msa->label[i]) ^
+                               kernel_hash(msa->sequence[i], msa->length));
+
+    /* a sum of the record hashes does not depend on their order */
+    if (d->unordered)
+      sum += record;
+    else
+      hash = mix(hash ^ record);
+  }
+
+  return d->unordered ? mix(hash ^ sum) : hash;
+}
+
+/* look up a locus by its hash; returns the index of the earlier locus it
+   duplicates, or records it under index and returns -1; returns -2 if
+   memory runs out. Loci must be looked up in input order, by one thread at
+   a time */
+long dedup_locus(dedup_t * d, const msa_t * msa, unsigned long hash, long index)
+{
+  dedup_locus_t key;
+
+  key.count = msa->count;
+  key.length = msa->length;
+
+  dedup_locus_t * locus = (dedup_locus_t *)hashtable_find(d->ht, &key, hash,
+                                                          cb_cmp_locus);
+  if (locus)
+    return locus->index;
+
+  /* a table that cannot grow keeps working with longer chains */
+  if (d->ht->entries_count >= d->ht->table_size)
+    hashtable_grow(d->ht);
+
+  locus = (dedup_locus_t *)bpp_malloc(sizeof(dedup_locus_t));
+  if (!locus)
+    return -2;
+  locus->index = index;
+  locus->count = msa->count;
+  locus->length = msa->length;
+  if (!hashtable_insert_force(d->ht, locus, hash))
+  {
+    free(locus);
+    return -2;
+  }
+
+  return -1;
+}
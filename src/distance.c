@@ -0,0 +1,195 @@
+/*
+    Copyright (C) 2022-2023 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London, Gower Street, London WC1E 6BT, England
+*/
+
+
+#include "libbpptools.h"
+
+/* Pairwise p-distances and JC69 distances. Characters not valid under JC69
+   (see pll_map_validjc69), i.e. ambiguities, are masked as gaps and a site
+   is compared for a pair of sequences only if both carry a nucleotide.
+   Sequences are bit-sliced and the upper triangle of the matrix is cut
+   into tiles of DIST_TILE x DIST_TILE pairs, each processed by one task
+   over chunks of DIST_CHUNK sites such that the data of two tiles stays
+   in cache. */
+
+#define DIST_TILE  32
+#define DIST_CHUNK 4096
+
+typedef struct dist_job_s
+{
+  const unsigned long * bits;
+  long count;
+  long words;
+  long tiles;
+  long * diffs;
+  long * sites;
+} dist_job_t;
+
+static unsigned int dist_map[256];
+static kernel_map_t dist_kmap;
+static pthread_once_t dist_once = PTHREAD_ONCE_INIT;
+
+static void dist_init()
+{
+  long i;
+
+  for (i = 0; i < 256; ++i)
+    dist_map[i] = pll_map_validjc69[pll_map_nt[i]] ? pll_map_nt[i] : 15;
+  dist_map[0] = 0;
+
+  kernel_map_init(&dist_kmap, dist_map);
+}
+
+static void dist_tile(dist_job_t * job, long ti, long tj)
+{
+  long i,j,w;
+  long d4, sites;
+  long chunk = 6 * DIST_CHUNK / 64;
+  long iend = MIN((ti+1)*DIST_TILE, job->count);
+  long jend = MIN((tj+1)*DIST_TILE, job->count);
+
+  for (w = 0; w < job->words; w += chunk)
+  {
+    long words = MIN(chunk, job->words - w);
+
+    for (i = ti*DIST_TILE; i < iend; ++i)
+    {
+      const unsigned long * a = job->bits + i*job->words + w;
+
+      for (j = (ti == tj) ? i+1 : tj*DIST_TILE; j < jend; ++j)
+      {
+        kernel_pair_diffs(a, job->bits + j*job->words + w, words, 0,
+                          &d4, &sites);
+        job->diffs[i*job->count+j] += d4 / 4;
+        job->sites[i*job->count+j] += sites;
+      }
+    }
+  }
+}
+
+static void cb_dist_tiles(long begin, long end, void * arg)
+{
+  long p;
+  dist_job_t * job = (dist_job_t *)arg;
+
+  for (p = begin; p < end; ++p)
+  {
+    /* p-th tile of the upper triangle in row-major order */
+    long ti = 0;
+    long q = p;
+
+    while (q >= job->tiles - ti)
+    {
+      q -= job->tiles - ti;
+      ++ti;
+    }
+
+    dist_tile(job, ti, ti+q);
+  }
+}
+
+/* Count the differences and compared sites for all pairs of sequences of
+   msa into count x count matrices; both triangles are filled and the
+   diagonal holds the number of nucleotides of each sequence */
+int distance_counts(const msa_t * msa,
+                    sched_t * sched,
+                    long * diffs,
+                    long * sites)
+{
+  long i,j;
+  long n = msa->count;
+  dist_job_t job;
+
+  pthread_once(&dist_once, dist_init);
+
+  job.count = n;
+  job.words = 6 * ((msa->length + 63) / 64);
+  job.tiles = (n + DIST_TILE - 1) / DIST_TILE;
+  job.diffs = diffs;
+  job.sites = sites;
+
+  unsigned long * bits =
+    (unsigned long *)bpp_malloc((size_t)MAX(n*job.words,1) *
+                                sizeof(unsigned long));
+  if (!bits)
+    return BPP_FAILURE;
+  for (i = 0; i < n; ++i)
+    kernel_bitslice(msa->sequence[i], msa->length, &dist_kmap,
+                    bits + i*job.words);
+  job.bits = bits;
+
+  memset(diffs, 0, (size_t)(n*n) * sizeof(long));
+  memset(sites, 0, (size_t)(n*n) * sizeof(long));
+
+  long pairs = job.tiles * (job.tiles + 1) / 2;
+  if (sched && pairs > 1)
+  {
+    if (!sched_parallel_for(sched, 0, pairs, 1, cb_dist_tiles, (void *)&job))
+    {
+      free(bits);
+      return BPP_FAILURE;
+    }
+    sched_wait(sched);
+  }
+  else
+    cb_dist_tiles(0, pairs, (void *)&job);
+
+  for (i = 0; i < n; ++i)
+  {
+    long w;
+    long count = 0;
+
+    for (w = 4; w < job.words; w += 6)
+      count += PLL_POPCOUNTL(bits[i*job.words+w]);
+    sites[i*n+i] = count;
+
+    for (j = i+1; j < n; ++j)
+    {
+      diffs[j*n+i] = diffs[i*n+j];
+      sites[j*n+i] = sites[i*n+j];
+    }
+  }
+
+  free(bits);
+  return BPP_SUCCESS;
+}
+
+/* distance from counts; negative if undefined, i.e. no sites in common or
+   saturated JC69 distance */
+double distance_value(long diffs, long sites, long model)
+{
+  if (!sites)
+    return -1;
+
+  double p = (double)diffs / sites;
+
+  if (model == DISTANCE_P)
+    return p;
+
+  if (p >= 0.75)
+    return -1;
+
+  /* avoid printing -0 for identical sequences */
+  if (!diffs)
+    return 0;
+
+  return -0.75 * log(1 - 4.0/3.0 * p);
+}
@@ -0,0 +1,209 @@
+/*
+    Copyright (C) 2022-2023 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London, Gower Street, London WC1E 6BT, England
+*/
+
+
+#include "libbpptools.h"
+
+/* Nucleotide diversity (pi) and Watterson's theta for all sequences of a
+   locus and for each ^species group. Sequences are bit-sliced into 4-bit
+   codes (see kernel_bitslice) such that the differences between a pair of
+   sequences are counted for 64 sites at a time with popcount. */
+
+static kernel_map_t div_kmap;
+static pthread_once_t div_once = PTHREAD_ONCE_INIT;
+
+static void div_init()
+{
+  kernel_map_init(&div_kmap, pll_map_nt);
+}
+
+/* harmonic number a_n = sum of 1/i for i = 1..n-1 */
+static double harmonic(long n)
+{
+  long i;
+  double a = 0;
+
+  for (i = 1; i < n; ++i)
+    a += 1.0 / i;
+
+  return a;
+}
+
+/* count sites with data in at least two members of a group, and sites at
+   which the union of the codes of those members has at least two states */
+static void group_sites(const unsigned long * bits,
+                        long words,
+                        const long * members,
+                        long count,
+                        long half,
+                        long * sites,
+                        long * segregating)
+{
+  long i,w;
+
+  *sites = 0;
+  *segregating = 0;
+
+  for (w = 0; w < words; w += 6)
+  {
+    unsigned long v1 = 0, v2 = 0;
+    unsigned long o0 = 0, o1 = 0, o2 = 0, o3 = 0;
+
+    for (i = 0; i < count; ++i)
+    {
+      const unsigned long * b = bits + members[i]*words + w;
+      unsigned long m = half ? b[4] | b[5] : b[4];
+
+      v2 |= v1 & m;
+      v1 |= m;
+      o0 |= b[0] & m;
+      o1 |= b[1] & m;
+      o2 |= b[2] & m;
+      o3 |= b[3] & m;
+    }
+
+    unsigned long seg = (o0 & (o1|o2|o3)) | (o1 & (o2|o3)) | (o2 & o3);
+
+    *sites += PLL_POPCOUNTL(v2);
+    *segregating += PLL_POPCOUNTL(seg & v2);
+  }
+}
+
+/* Returns an array of diversity_t, the first element for all sequences and
+   one element per species in order of first appearance. pi is the mean
+   over pairs of the proportion of differences among sites compared, pairs
+   without common sites are ignored. Watterson's estimator is per site,
+   taking the group size as the sample size. If 'half' is set, two-fold
+   ambiguities are treated as heterozygotes and a site contributes the
+   probability that two alleles drawn from the two codes differ; otherwise
+   only unambiguous nucleotides are compared. */
+diversity_t * diversity_compute(const msa_t * msa, long half, long * count)
+{
+  long i,j,k;
+  long d4, sites;
+  long groups = 1;
+
+  pthread_once(&div_once, div_init);
+
+  diversity_t * div = NULL;
+  long words = 6 * ((msa->length + 63) / 64);
+  long * gid = (long *)bpp_malloc((size_t)MAX(msa->count,1) * sizeof(long));
+  long * members = (long *)bpp_malloc((size_t)MAX(msa->count,1) *
+                                      sizeof(long));
+  char ** names = (char **)bpp_malloc((size_t)(msa->count+1) * sizeof(char *));
+  unsigned long * bits =
+    (unsigned long *)bpp_malloc((size_t)MAX(msa->count*words,1) *
+                                sizeof(unsigned long));
+
+  if (!gid || !members || !names || !bits)
+    goto l_done;
+
+  /* assign sequences to species, group 0 stands for all sequences */
+  names[0] = NULL;
+  for (i = 0; i < msa->count; ++i)
+  {
+    char * tag = strchr(msa->label[i], '^');
+
+    gid[i] = 0;
+    if (!tag) continue;
+
+    for (k = 1; k < groups; ++k)
+      if (!strcmp(names[k], tag+1))
+        break;
+    if (k == groups)
+      names[groups++] = tag+1;
+    gid[i] = k;
+  }
+
+  for (i = 0; i < msa->count; ++i)
+    kernel_bitslice(msa->sequence[i], msa->length, &div_kmap, bits+i*words);
+
+  div = (diversity_t *)bpp_calloc((size_t)groups, sizeof(diversity_t));
+  if (!div)
+    goto l_done;
+
+  for (i = 0; i < msa->count; ++i)
+  {
+    div[0].sequences++;
+    if (gid[i])
+      div[gid[i]].sequences++;
+
+    for (j = i+1; j < msa->count; ++j)
+    {
+      kernel_pair_diffs(bits+i*words, bits+j*words, words, half, &d4, &sites);
+      if (!sites) continue;
+
+      double p = d4 / (4.0 * sites);
+
+      div[0].pi += p;
+      div[0].pairs++;
+      if (gid[i] && gid[i] == gid[j])
+      {
+        div[gid[i]].pi += p;
+        div[gid[i]].pairs++;
+      }
+    }
+  }
+
+  for (k = 0; k < groups; ++k)
+  {
+    diversity_t * d = div+k;
+    long n = 0;
+
+    for (i = 0; i < msa->count; ++i)
+      if (!k || gid[i] == k)
+        members[n++] = i;
+
+    group_sites(bits, words, members, n, half, &d->sites, &d->segregating);
+
+    if (k && !(d->group = bpp_strdup(names[k])))
+    {
+      diversity_destroy(div, groups);
+      div = NULL;
+      goto l_done;
+    }
+    if (d->pairs)
+      d->pi /= d->pairs;
+    if (n > 1 && d->sites)
+      d->theta_w = d->segregating / (harmonic(n) * d->sites);
+  }
+
+  *count = groups;
+
+l_done:
+  free(members);
+  free(bits);
+  free(names);
+  free(gid);
+
+  return div;
+}
+
+void diversity_destroy(diversity_t * div, long count)
+{
+  long i;
+
+  for (i = 0; i < count; ++i)
+    if (div[i].group)
+      free(div[i].group);
+
+  free(div);
+}
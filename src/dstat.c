@@ -19,11 +19,30 @@
     University College London, Gower Street, London WC1E 6BT, England
 */
 
-#include "bpp-tools.h"
+#include "libbpptools.h"
 
-static double * abba_tbl = NULL;
-static double * baba_tbl = NULL;
-static long * patt_count = NULL;
+/* ABBA-BABA (D-statistic) test. Site scores for all 15^4 combinations of
+   nucleotide codes are computed once per process and shared read-only by
+   all threads and contexts. */
+
+/* number of sites scored by one task */
+#define DSTAT_CHUNK 65536
+
+typedef struct dstat_job_s
+{
+  char * seq[4];
+  long length;
+  double * abba;
+  double * baba;
+  long failed;
+} dstat_job_t;
+
+/* static such that the once-only initialization cannot fail */
+static double abba_tbl[65536];
+static double baba_tbl[65536];
+static long patt_count[65536];
+static kernel_map_t nt_kmap;
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
 
 static void abba_baba_score(unsigned int * s,
                             double * abbaptr,
@@ -67,63 +86,95 @@ static void abba_baba_score(unsigned int * s,
   *patsptr = pats;
 }
 
-static void calculate_d(msa_t * msa)
+static void cb_dstat_chunks(long begin, long end, void * arg)
+{
+  long c;
+  dstat_job_t * job = (dstat_job_t *)arg;
+  unsigned short * pats;
+
+  pats = (unsigned short *)bpp_malloc(DSTAT_CHUNK * sizeof(unsigned short));
+  if (!pats)
+  {
+    __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  for (c = begin; c < end; ++c)
+  {
+    long i;
+    long first = c*DSTAT_CHUNK;
+    long last  = MIN(first+DSTAT_CHUNK, job->length);
+    char * seq[4];
+
+    for (i = 0; i < 4; ++i)
+      seq[i] = job->seq[i] + first;
+
+    kernel_site_patterns(seq, last-first, &nt_kmap, pats);
+    kernel_dstat_accumulate(pats, last-first, abba_tbl, baba_tbl,
+                            job->abba+c, job->baba+c);
+  }
+
+  free(pats);
+}
+
+static int calculate_d(msa_t * msa, sched_t * sched, dstat_result_t * result)
 {
   long i;
-  long * pats = NULL;
   double abba = 0;
   double baba = 0;
-  
-  printf("--------\n");
-
-  /* change order according to CSV options */
-  char * s1 = msa->sequence[0];
-  char * s2 = msa->sequence[1];
-  char * s3 = msa->sequence[2];
-  char * s4 = msa->sequence[3];
+  dstat_job_t job;
 
-  pats = (long *)xcalloc(msa->length,sizeof(long));
-  for (i = 0; i < msa->length; ++i)
+  /* sequences are in the order P1, P2, P3, O */
+  for (i = 0; i < 4; ++i)
+    job.seq[i] = msa->sequence[i];
+  job.length = msa->length;
+  job.failed = 0;
+
+  /* score fixed-size chunks of sites in parallel; partial sums are added up
+     in chunk order such that the result does not depend on the number of
+     threads */
+  long chunks = (msa->length + DSTAT_CHUNK - 1) / DSTAT_CHUNK;
+  job.abba = (double *)bpp_calloc((size_t)chunks, sizeof(double));
+  job.baba = (double *)bpp_calloc((size_t)chunks, sizeof(double));
+  if (!job.abba || !job.baba)
+    job.failed = 1;
+  else if (sched)
   {
-    long i1 = pll_map_nt[(int)s1[i]];
-    long i2 = pll_map_nt[(int)s2[i]];
-    long i3 = pll_map_nt[(int)s3[i]];
-    long i4 = pll_map_nt[(int)s4[i]];
+    if (!sched_parallel_for(sched, 0, chunks, 1, cb_dstat_chunks,
+                            (void *)&job))
+      job.failed = 1;
+    sched_wait(sched);
+  }
+  else
+    cb_dstat_chunks(0, chunks, (void *)&job);
 
-    pats[i] = i1 | (i2 << 4) | (i3 << 8) | (i4 << 12);
+  if (job.failed)
+  {
+    bpp_errno = ERROR_MEMORY;
+    snprintf(bpp_errmsg, 200, "Unable to allocate enough memory.");
+    free(job.abba);
+    free(job.baba);
+    return BPP_FAILURE;
   }
 
-  #if 0
-  printf("Total number of sites: %d\n", msa->length);
-  for (i = 0; i < msa->length; ++i)
+  for (i = 0; i < chunks; ++i)
   {
-    long s = pats[i];
-    printf(" pattern: %c%c%c%c code: %5ld abba: %f babba: %f  pats: %ld\n",
-           msa->sequence[0][i],
-           msa->sequence[1][i],
-           msa->sequence[2][i],
-           msa->sequence[3][i],
-           s, abba_tbl[s], baba_tbl[s], patt_count[s]);
-    abba += abba_tbl[s];
-    baba += baba_tbl[s];
+    abba += job.abba[i];
+    baba += job.baba[i];
   }
-  #endif
 
-  printf("abba: %f\n", abba);
-  printf("baba: %f\n", baba);
+  result->abba = abba;
+  result->baba = baba;
+  result->d = (abba + baba > 0) ? (abba - baba) / (abba + baba) : 0;
+  result->sites = msa->length;
 
-  free(pats);
-  /* 
-  decode_site(s);
-
-  printf("Checking from precomputed table:\n");
-  index = s[0] | (s[1] << 4) | (s[2] << 8) | (s[3] << 12);
-  printf("abba: %f\n", abba_tbl[index]);
-  printf("baba: %f\n", baba_tbl[index]);
-  */
+  free(job.abba);
+  free(job.baba);
+
+  return BPP_SUCCESS;
 }
 
-static void precompute_table()
+static void precompute_table(void)
 {
   char nt[15] = "ACGTRYSWKMBDHVN";
   int ii[4] = {0,0,0,0};
@@ -133,9 +184,7 @@ static void precompute_table()
   long index;
   long pats;
 
-  abba_tbl = (double *)xcalloc(65536,sizeof(double));
-  baba_tbl = (double *)xcalloc(65536,sizeof(double));
-  patt_count = (long *)xcalloc(65536,sizeof(long));
+  kernel_map_init(&nt_kmap, pll_map_nt);
 
   site[4] = 0;
   for (ii[0] = 0; ii[0] < 0xf; ++ii[0])
@@ -221,7 +270,7 @@ int debug_decode_site(unsigned int * s)
                   printf("T");
                   break;
                 default:
-                  fatal("Internal error");
+                  assert(0);
               }
             }
             printf("\n");
@@ -253,9 +302,15 @@ static char ** split4(const char * s)
       ++commas_count;
   
   if (commas_count+1 != 4)
-    fatal("ABBA-BABA test requires exactly four taxa");
+  {
+    bpp_errno = ERROR_INVALID_ARGUMENT;
+    snprintf(bpp_errmsg, 200, "ABBA-BABA test requires exactly four taxa");
+    return NULL;
+  }
 
-  taxa = (char **)xmalloc((size_t)(commas_count+1) * sizeof(char *));
+  taxa = (char **)bpp_calloc((size_t)(commas_count+1), sizeof(char *));
+  if (!taxa)
+    return NULL;
 
   k = 0;
   while (*s)
@@ -263,9 +318,11 @@ static char ** split4(const char * s)
     /* get next taxon */
     size_t taxon_len = strcspn(s,",");
     if (!taxon_len)
-      fatal("Erroneous format in --dstat (taxon missing)");
+      break;
 
-    taxa[k++] = xstrndup(s, taxon_len);
+    if (!(taxa[k] = bpp_strndup(s, taxon_len)))
+      goto l_unwind;
+    k++;
 
     s += taxon_len;
     assert(*s == ',' || *s == '\0');
@@ -273,12 +330,41 @@ static char ** split4(const char * s)
       ++s;
   }
 
-  return taxa;
+  if (k == 4)
+    return taxa;
+
+  bpp_errno = ERROR_INVALID_ARGUMENT;
+  snprintf(bpp_errmsg, 200, "Erroneous format in --dstat (taxon missing)");
+
+l_unwind:
+  for (i = 0; i < k; ++i)
+    free(taxa[i]);
+  free(taxa);
+  return NULL;
+}
+
+/* a taxon is either a sequence label, or a species tag starting with '^'
+   that matches the labels ending with it */
+static long taxon_match(const char * taxon, const char * label)
+{
+  size_t tlen = strlen(taxon);
+  size_t llen = strlen(label);
+
+  if (taxon[0] != '^')
+    return !strcmp(taxon, label);
+
+  return tlen <= llen && !strcmp(label + llen - tlen, taxon);
 }
 
-msa_t * phylip_concat(msa_t ** msa_list, long msa_count)
+/* concatenate the sequences of the quartet in the order P1, P2, P3, O of
+   ds->taxa. Each taxon must match exactly one sequence label over all loci;
+   other sequences are ignored and loci lacking a taxon contribute missing
+   data for it */
+static msa_t * phylip_concat(const dstat_t * ds,
+                             msa_t ** msa_list,
+                             long msa_count)
 {
-  long i,j,k,m;
+  long i,j,m;
   msa_t * msa = NULL;
   long total_length = 0;
 
@@ -288,43 +374,73 @@ msa_t * phylip_concat(msa_t ** msa_list, long msa_count)
     total_length += msa_list[i]->length;
   }
 
-  msa = (msa_t *)xcalloc(1, sizeof(msa_t));
+  msa = (msa_t *)bpp_calloc(1, sizeof(msa_t));
+  if (!msa)
+    return NULL;
   msa->count  = 4;
   msa->length = total_length;
-  msa->sequence = (char **)xmalloc(4*sizeof(char *));
-  msa->label = (char **)xmalloc(4*sizeof(char *));
+  msa->sequence = (char **)bpp_calloc(4, sizeof(char *));
+  msa->label = (char **)bpp_calloc(4, sizeof(char *));
+  if (!msa->sequence || !msa->label)
+    goto l_unwind;
   for (i = 0; i < 4; ++i)
-    msa->sequence[i] = (char *)xmalloc((size_t)(total_length+1) * sizeof(char));
+    if (!(msa->sequence[i] = (char *)bpp_malloc((size_t)(total_length+1))))
+      goto l_unwind;
 
-  /* naive check of species labels */
-  for (k=0, i = 0; i < msa_count; ++i)
+  /* assign the labels to the taxa */
+  for (i = 0; i < msa_count; ++i)
   {
-    if (msa_list[i]->count > 4)
-      fatal("More than 4 sequences in alignment %ld", i);
-
     for (j = 0; j < msa_list[i]->count; ++j)
     {
-      /* check that label is in the concenated alignment structure */
-      for (m = 0; m < k; ++m)
-        if (!strcmp(msa_list[i]->label[j],msa->label[m]))
-          break;
-      if (m == k)
+      const char * label = msa_list[i]->label[j];
+      long taxon = -1;
+
+      for (m = 0; m < 4; ++m)
+      {
+        if (!taxon_match(ds->taxa[m], label))
+          continue;
+
+        if (taxon >= 0)
+        {
+          bpp_errno = ERROR_DSTAT_SEQUENCES;
+          snprintf(bpp_errmsg, 200, "Sequence %s matches taxa %s and %s",
+                   label, ds->taxa[taxon], ds->taxa[m]);
+          goto l_unwind;
+        }
+        taxon = m;
+      }
+
+      if (taxon < 0) continue;
+
+      if (!msa->label[taxon])
+      {
+        if (!(msa->label[taxon] = bpp_strdup(label)))
+          goto l_unwind;
+      }
+      else if (strcmp(msa->label[taxon], label))
       {
-        if (k == 4)
-          fatal("More than 4 sequences in full alignment");
-        msa->label[k++] = xstrdup(msa_list[i]->label[j]);
+        bpp_errno = ERROR_DSTAT_SEQUENCES;
+        snprintf(bpp_errmsg, 200, "Taxon %s is ambiguous (%s and %s)",
+                 ds->taxa[taxon], msa->label[taxon], label);
+        goto l_unwind;
       }
     }
   }
 
-  if (k != 4)
-    fatal("Error: only %ld sequences in alignments. Need 4 sequences.", k);
+  for (m = 0; m < 4; ++m)
+    if (!msa->label[m])
+    {
+      bpp_errno = ERROR_DSTAT_SEQUENCES;
+      snprintf(bpp_errmsg, 200, "Taxon %s not found in alignments",
+               ds->taxa[m]);
+      goto l_unwind;
+    }
 
   /* create concatenated alignment */
   long offset = 0;
   for (i = 0; i < msa_count; ++i)
   {
-    for (m = 0; m < k; ++m)
+    for (m = 0; m < 4; ++m)
     {
       for (j = 0; j < msa_list[i]->count; ++j)
         if (!strcmp(msa_list[i]->label[j],msa->label[m]))
@@ -351,117 +467,65 @@ msa_t * phylip_concat(msa_t ** msa_list, long msa_count)
   for (i = 0; i < msa->count; ++i)
     msa->sequence[i][total_length] = 0;
   return msa;
+
+l_unwind:
+  msa_destroy(msa);
+  return NULL;
 }
 
-void cmd_dstat()
+dstat_t * dstat_create(const char * taxa)
 {
-  long i,j,k,m;
-  long msa_count;
-  phylip_t * fd;
-  msa_t ** msa_list;
-
-  printf("Pre-computing table for site scores...\n");
-  precompute_table();
-  #if 0
-  char site[5] = "NRRN\0";
-  unsigned int s[4] = {pll_map_nt[(int)site[0]],pll_map_nt[(int)site[1]],pll_map_nt[(int)site[2]],pll_map_nt[(int)site[3]]};
-  printf("Decoding site: %s\n", site);
-  decode_site(s);
-
-  printf("Checking from precomputed table:\n");
-  index = s[0] | (s[1] << 4) | (s[2] << 8) | (s[3] << 12);
-  printf("abba: %f\n", abba_tbl[index]);
-  printf("baba: %f\n", baba_tbl[index]);
-  #endif
+  long i;
+  char ** list;
 
-  /* open phylip file */
-  fd = phylip_open(opt_msafile, pll_map_fasta);
-  if (!fd)
-    fatal("Cannot open file %s", opt_msafile);
+  kernel_init();
+  pthread_once(&tables_once, precompute_table);
 
-  /* read alignment */
-  msa_list = phylip_parse_multisequential(fd, &msa_count);
-  assert(msa_list);
+  if (!(list = split4(taxa)))
+    return NULL;
 
-  #if 0
-  for (i = 0; i < msa_count; ++i)
+  dstat_t * ds = (dstat_t *)bpp_malloc(sizeof(dstat_t));
+  if (!ds)
   {
-    printf("MSA %ld\n", i);
-    for (j = 0; j < msa_list[i]->count; ++j)
-    {
-      printf("  %s  %s\n", msa_list[i]->label[j], msa_list[i]->sequence[j]);
-    }
+    for (i = 0; i < 4; ++i)
+      free(list[i]);
+    free(list);
+    return NULL;
   }
-  #endif
-
-  phylip_close(fd);
-
-  /* TODO: For now we only allow one alignment */
-  assert(msa_count == 1);
-
-  char ** taxa = split4(opt_dstat);
+  for (i = 0; i < 4; ++i)
+    ds->taxa[i] = list[i];
+  free(list);
 
-  printf("Tree: (((%s,%s),%s),%s);\n", taxa[0], taxa[1], taxa[2], taxa[3]);
-  printf("Testing introgression between %s and %s, and between %s and %s\n",
-         taxa[0], taxa[2], taxa[1], taxa[2]);
+  return ds;
+}
 
+void dstat_destroy(dstat_t * ds)
+{
+  long i;
 
-  /* check for duplicate taxa */
-  char ** labels = (char **)xcalloc(4,sizeof(char *));
-  m = 0;
-  for (i = 0; i < msa_count; ++i)
-  {
-    if (msa_list[i]->count > 4)
-      fatal("More than 4 sequences found in alignment %ld.", i);
-    for (j = 0; j < msa_list[i]->count; ++j)
-    {
-      for (k = 0; k < m; ++k)
-        if (!strcmp(msa_list[i]->label[j],labels[k]))
-          break;
-      if (k == m)
-      {
-        if (m == 4)
-          fatal("More than 4 sequences found in the dataset");
+  for (i = 0; i < 4; ++i)
+    free(ds->taxa[i]);
+  free(ds);
+}
 
-        labels[m++] = xstrdup(msa_list[i]->label[j]);
-      }
-    }
-  }
-  assert(m == 4);
-  for (i = 0; i < 4; ++i) free(labels[i]);
-  free(labels);
+/* compute the D-statistic over the concatenation of the given loci; sched
+   may be NULL for a single-threaded computation */
+int dstat_compute(const dstat_t * ds,
+                  msa_t ** msa_list,
+                  long msa_count,
+                  sched_t * sched,
+                  dstat_result_t * result)
+{
+  int rc;
+  msa_t * concat;
 
   /* concatenate (possibly) multiple alignments and fill in missing data */
-  msa_t * concat = phylip_concat(msa_list, msa_count);
+  if (!(concat = phylip_concat(ds, msa_list, msa_count)))
+    return BPP_FAILURE;
 
-  #if 0
-  phylip_print(stdout, concat);
-  #endif
-
-  calculate_d(concat);
-
-  for (i = 0; i < concat->count; ++i)
-  {
-    free(concat->label[i]);
-    free(concat->sequence[i]);
-  }
-  free(concat->label);
-  free(concat->sequence);
-  free(concat);
-
-  for (i = 0; i < 4; ++i)
-    free(taxa[i]);
-  free(taxa);
-
-  for (i = 0; i < msa_count; ++i)
-    msa_destroy(msa_list[i]);
-  free(msa_list);
+  rc = calculate_d(concat, sched, result);
 
-  if (abba_tbl)
-    free(abba_tbl);
-  if (baba_tbl)
-    free(baba_tbl);
-  if (patt_count)
-    free(patt_count);
+  msa_destroy(concat);
 
+  return rc;
 }
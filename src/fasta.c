@@ -0,0 +1,552 @@
+/*
+    Copyright (C) 2022-2023 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London, Gower Street, London WC1E 6BT, England
+*/
+
+
+#include "libbpptools.h"
+
+/* FASTA import. Each FASTA file holds the aligned sequences of one locus;
+   the first word of a header is the sequence label. Files are read whole
+   and scanned in place, and files are parsed in parallel by the pipeline
+   workers while the writer emits the loci in input order, such that at
+   most one locus per worker is held in memory. */
+
+typedef struct fasta_item_s
+{
+  msa_t * msa;
+  int error;
+  char errmsg[200];
+} fasta_item_t;
+
+typedef struct fasta_reader_s
+{
+  char ** files;
+  long count;
+  long next;
+} fasta_reader_t;
+
+/* an individual is a label without its ^species tag */
+typedef struct fasta_individual_s
+{
+  char * name;
+  char * tag;
+  long locus;
+} fasta_individual_t;
+
+typedef struct fasta_job_s
+{
+  const unsigned int * map;
+  char ** files;
+  FILE * fp;
+  hashtable_t * individuals;
+  long loci;
+  int error;
+  char errmsg[200];
+} fasta_job_t;
+
+static long line_number(const char * buffer, const char * p)
+{
+  long lineno = 1;
+
+  while ((buffer = (const char *)memchr(buffer, '\n', (size_t)(p - buffer))))
+  {
+    ++lineno;
+    ++buffer;
+  }
+
+  return lineno;
+}
+
+static char * read_file(const char * filename, long * size)
+{
+  FILE * fp = fopen(filename, "r");
+  char * buffer;
+
+  if (!fp)
+  {
+    bpp_errno = ERROR_FILE_OPEN;
+    snprintf(bpp_errmsg, 200, "Unable to open file (%.150s)", filename);
+    return NULL;
+  }
+
+  if (fseek(fp, 0, SEEK_END) || (*size = ftell(fp)) < 0)
+  {
+    bpp_errno = ERROR_FILE_SEEK;
+    snprintf(bpp_errmsg, 200, "Unable to seek in file (%.150s)", filename);
+    fclose(fp);
+    return NULL;
+  }
+  rewind(fp);
+
+  buffer = (char *)bpp_malloc((size_t)*size + 1);
+  if (!buffer)
+  {
+    fclose(fp);
+    return NULL;
+  }
+  if (fread(buffer, 1, (size_t)*size, fp) != (size_t)*size)
+  {
+    bpp_errno = ERROR_FILE_OPEN;
+    snprintf(bpp_errmsg, 200, "Unable to read file (%.150s)", filename);
+    free(buffer);
+    fclose(fp);
+    return NULL;
+  }
+  buffer[*size] = 0;
+  fclose(fp);
+
+  return buffer;
+}
+
+/* copy the sequence data between p and end into s, and return its length
+   or -1 if an illegal character is found */
+static long parse_data(const char * buffer,
+                       const char * p,
+                       const char * end,
+                       const unsigned int * map,
+                       const kernel_lut_t * legal,
+                       char * s,
+                       const char * filename)
+{
+  long j = 0;
+  long k;
+
+  while (p < end)
+  {
+    /* copy runs of legal characters in one go */
+    k = kernel_legal_prefix(p, end-p, legal);
+    if (k)
+    {
+      memcpy(s+j, p, (size_t)k);
+      j += k;
+      p += k;
+      continue;
+    }
+
+    unsigned char c = (unsigned char)*p;
+    if (map[c] == 2)
+    {
+      bpp_errno = ERROR_FASTA_SYNTAX;
+      if (c >= 32)
+        snprintf(bpp_errmsg, 200, "Illegal character '%c' on line %ld of %.100s",
+                 c, line_number(buffer,p), filename);
+      else
+        snprintf(bpp_errmsg, 200, "Illegal unprintable character %#.2x "
+                 "(hexadecimal) on line %ld of %.100s",
+                 c, line_number(buffer,p), filename);
+      return -1;
+    }
+
+    /* stripped characters, including newlines */
+    ++p;
+  }
+
+  return j;
+}
+
+/* parse a FASTA file containing one aligned locus */
+msa_t * fasta_parse(const char * filename, const unsigned int * map)
+{
+  long i;
+  long size;
+  long maxcount = 16;
+  char * buffer;
+  char * p;
+  char * end;
+  kernel_lut_t legal;
+  timing_mark_t mark;
+
+  timing_start(&mark);
+  kernel_init();
+
+  if (!(buffer = read_file(filename, &size)))
+    return NULL;
+
+  kernel_lut_init(&legal, map, 1);
+
+  msa_t * msa = (msa_t *)bpp_calloc(1,sizeof(msa_t));
+  if (!msa)
+  {
+    free(buffer);
+    return NULL;
+  }
+  msa->sequence = (char **)bpp_malloc((size_t)maxcount*sizeof(char *));
+  msa->label = (char **)bpp_malloc((size_t)maxcount*sizeof(char *));
+  if (!msa->sequence || !msa->label)
+    goto failure;
+
+  p = buffer;
+  end = buffer + size;
+
+  /* skip blank lines before the first header */
+  while (p < end && isspace((unsigned char)*p)) ++p;
+
+  if (p == end)
+  {
+    bpp_errno = ERROR_FASTA_SYNTAX;
+    snprintf(bpp_errmsg, 200, "File (%.150s) is empty", filename);
+    goto failure;
+  }
+
+  while (p < end)
+  {
+    char * label;
+    char * data;
+    char * next;
+    long len;
+
+    if (*p != '>')
+    {
+      bpp_errno = ERROR_FASTA_SYNTAX;
+      snprintf(bpp_errmsg, 200, "Expected '>' on line %ld of %.150s",
+               line_number(buffer,p), filename);
+      goto failure;
+    }
+
+    /* label is the first word of the header */
+    label = ++p;
+    while (p < end && !isspace((unsigned char)*p)) ++p;
+    if (p == label)
+    {
+      bpp_errno = ERROR_FASTA_SYNTAX;
+      snprintf(bpp_errmsg, 200, "Missing label on line %ld of %.150s",
+               line_number(buffer,p), filename);
+      goto failure;
+    }
+    len = p - label;
+
+    /* sequence data span up to the next header */
+    data = (char *)memchr(p, '\n', (size_t)(end - p));
+    data = data ? data+1 : end;
+    next = data;
+    while (next < end && *next != '>')
+    {
+      next = (char *)memchr(next, '\n', (size_t)(end - next));
+      next = next ? next+1 : end;
+    }
+
+    if (msa->count == maxcount)
+    {
+      char ** temp;
+
+      maxcount *= 2;
+      temp = (char **)bpp_realloc(msa->sequence,
+                                  (size_t)maxcount*sizeof(char *));
+      if (!temp)
+        goto failure;
+      msa->sequence = temp;
+      temp = (char **)bpp_realloc(msa->label,
+                                  (size_t)maxcount*sizeof(char *));
+      if (!temp)
+        goto failure;
+      msa->label = temp;
+    }
+
+    msa->label[msa->count] = bpp_strndup(label, (size_t)len);
+    msa->sequence[msa->count] = (char *)bpp_malloc((size_t)(next - data + 1));
+    msa->count++;
+    if (!msa->label[msa->count-1] || !msa->sequence[msa->count-1])
+      goto failure;
+
+    len = parse_data(buffer, data, next, map, &legal,
+                     msa->sequence[msa->count-1], filename);
+    if (len < 0)
+      goto failure;
+    msa->sequence[msa->count-1][len] = 0;
+
+    if (msa->count == 1)
+      msa->length = len;
+    else if (len != msa->length)
+    {
+      bpp_errno = ERROR_FASTA_SYNTAX;
+      snprintf(bpp_errmsg, 200, "Sequence %ld (%.50s) of %.80s has %ld "
+               "characters but expected %ld",
+               msa->count, msa->label[msa->count-1], filename, len,
+               msa->length);
+      goto failure;
+    }
+
+    p = next;
+  }
+
+  if (!msa->length)
+  {
+    bpp_errno = ERROR_FASTA_SYNTAX;
+    snprintf(bpp_errmsg, 200, "No sequence data in %.150s", filename);
+    goto failure;
+  }
+
+  free(buffer);
+
+  timing_stop(TIMING_PHASE_PARSE, &mark, size, 1);
+
+  return msa;
+
+failure:
+  for (i = 0; i < msa->count; ++i)
+  {
+    free(msa->label[i]);
+    free(msa->sequence[i]);
+  }
+  free(msa->label);
+  free(msa->sequence);
+  free(msa);
+  free(buffer);
+  return NULL;
+}
+
+static int cb_cmp_individual(void * x, void * y)
+{
+  return !strcmp(((fasta_individual_t *)x)->name, (char *)y);
+}
+
+static void cb_dealloc_individual(void * data)
+{
+  fasta_individual_t * ind = (fasta_individual_t *)data;
+
+  free(ind->name);
+  free(ind->tag);
+  free(ind);
+}
+
+/* check that labels within a locus are unique */
+static int check_duplicates(const msa_t * msa, const char * filename)
+{
+  long i;
+  int rc = BPP_SUCCESS;
+  int inserted;
+  hashtable_t * ht = hashtable_create((unsigned long)msa->count);
+
+  if (!ht)
+    return BPP_FAILURE;
+
+  for (i = 0; i < msa->count; ++i)
+  {
+    inserted = hashtable_insert(ht, msa->label[i], hash_fnv(msa->label[i]),
+                                hashtable_strcmp);
+    if (inserted < 0)
+    {
+      rc = BPP_FAILURE;
+      break;
+    }
+    if (!inserted)
+    {
+      bpp_errno = ERROR_LABEL_MISMATCH;
+      snprintf(bpp_errmsg, 200, "Duplicate label %.50s in %.120s",
+               msa->label[i], filename);
+      rc = BPP_FAILURE;
+      break;
+    }
+  }
+
+  hashtable_destroy(ht, NULL);
+  return rc;
+}
+
+/* check that each individual is assigned to the same species in all loci;
+   individuals are looked up by the hash of their name */
+static int check_individuals(fasta_job_t * job, const msa_t * msa, long index)
+{
+  long i;
+
+  for (i = 0; i < msa->count; ++i)
+  {
+    char * label = msa->label[i];
+    char * tag = strchr(label, '^');
+    size_t len = tag ? (size_t)(tag - label) : strlen(label);
+    char * name = bpp_strndup(label, len);
+    if (!name)
+      return BPP_FAILURE;
+    unsigned long hash = hash_fnv(name);
+
+    tag = tag ? tag+1 : label+len;
+
+    fasta_individual_t * ind =
+      (fasta_individual_t *)hashtable_find(job->individuals, name, hash,
+                                           cb_cmp_individual);
+    if (!ind)
+    {
+      ind = (fasta_individual_t *)bpp_malloc(sizeof(fasta_individual_t));
+      if (!ind)
+      {
+        free(name);
+        return BPP_FAILURE;
+      }
+      ind->name = name;
+      ind->tag = bpp_strdup(tag);
+      ind->locus = index;
+      if (!ind->tag || !hashtable_insert_force(job->individuals, ind, hash))
+      {
+        cb_dealloc_individual(ind);
+        return BPP_FAILURE;
+      }
+      continue;
+    }
+    free(name);
+
+    if (strcmp(ind->tag, tag))
+    {
+      bpp_errno = ERROR_LABEL_MISMATCH;
+      snprintf(bpp_errmsg, 200, "Individual %.40s has tag '%.15s' in %.40s "
+               "but '%.15s' in %.40s",
+               ind->name, ind->tag, job->files[ind->locus], tag,
+               job->files[index]);
+      return BPP_FAILURE;
+    }
+  }
+
+  return BPP_SUCCESS;
+}
+
+static void * cb_read(void * data)
+{
+  fasta_reader_t * reader = (fasta_reader_t *)data;
+
+  if (reader->next == reader->count)
+    return NULL;
+
+  return (void *)reader->files[reader->next++];
+}
+
+static void * cb_parse(void * item, long index, void * data)
+{
+  const char * filename = (const char *)item;
+  fasta_job_t * job = (fasta_job_t *)data;
+  fasta_item_t * result = (fasta_item_t *)bpp_calloc(1,sizeof(fasta_item_t));
+
+  (void) index;
+
+  /* the writer reports a missing result as an allocation failure */
+  if (!result)
+    return NULL;
+
+  result->msa = fasta_parse(filename, job->map);
+  if (result->msa && !check_duplicates(result->msa, filename))
+  {
+    msa_destroy(result->msa);
+    result->msa = NULL;
+  }
+
+  if (!result->msa)
+  {
+    result->error = bpp_errno;
+    memcpy(result->errmsg, bpp_errmsg, 200);
+  }
+
+  return (void *)result;
+}
+
+static long cb_write(void * result, long index, void * data)
+{
+  long bytes = 0;
+  fasta_item_t * item = (fasta_item_t *)result;
+  fasta_job_t * job = (fasta_job_t *)data;
+
+  if (!item)
+  {
+    if (!job->error)
+    {
+      job->error = ERROR_MEMORY;
+      snprintf(job->errmsg, 200, "Unable to allocate enough memory.");
+    }
+    return 0;
+  }
+
+  /* after the first error the remaining loci are only released */
+  if (!job->error)
+  {
+    if (!item->msa)
+    {
+      job->error = item->error;
+      memcpy(job->errmsg, item->errmsg, 200);
+    }
+    else if (!check_individuals(job, item->msa, index))
+    {
+      job->error = bpp_errno;
+      memcpy(job->errmsg, bpp_errmsg, 200);
+    }
+    else
+    {
+      bytes = bpp_ftell(job->fp);
+      if (job->loci)
+        fprintf(job->fp, "\n");
+      phylip_print(job->fp, item->msa);
+      bytes = bpp_ftell(job->fp) - bytes;
+      job->loci++;
+    }
+  }
+
+  if (item->msa)
+    msa_destroy(item->msa);
+  free(item);
+
+  return bytes;
+}
+
+/* convert FASTA files, one locus each, to a multi-locus file written to fp;
+   the number of distinct individuals is stored in 'individuals' */
+int fasta_import(char ** files,
+                 long count,
+                 const unsigned int * map,
+                 FILE * fp,
+                 long threads,
+                 long * individuals)
+{
+  int rc;
+  fasta_reader_t reader;
+  fasta_job_t job;
+
+  reader.files = files;
+  reader.count = count;
+  reader.next = 0;
+
+  memset(&job, 0, sizeof(fasta_job_t));
+  job.map = map;
+  job.files = files;
+  job.fp = fp;
+  job.individuals = hashtable_create(1024);
+  if (!job.individuals)
+    return BPP_FAILURE;
+
+  rc = pipeline_run(threads, cb_read, (void *)&reader,
+                    cb_parse, cb_write, (void *)&job);
+
+  if (rc && job.error)
+  {
+    bpp_errno = job.error;
+    memcpy(bpp_errmsg, job.errmsg, 200);
+    rc = BPP_FAILURE;
+  }
+
+  if (individuals)
+    *individuals = (long)job.individuals->entries_count;
+
+  hashtable_destroy(job.individuals, cb_dealloc_individual);
+
+  return rc;
+}
+
+void fasta_print(FILE * fp, const msa_t * msa)
+{
+  long i;
+
+  for (i = 0; i < msa->count; ++i)
+    fprintf(fp, ">%s\n%s\n", msa->label[i], msa->sequence[i]);
+}
@@ -0,0 +1,451 @@
+/*
+    Copyright (C) 2022-2023 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London, Gower Street, London WC1E 6BT, England
+*/
+
+#include "libbpptools.h"
+
+/* Sequence selection shared by --extract and --remove. A filter is built
+   from a comma-separated list of tokens: tokens starting with '^' select
+   sequences whose label ends with the token (species tag), all other tokens
+   select sequences whose label starts with the token. Filters are immutable
+   once created and may be used by several threads at the same time. */
+
+/* returns NULL for a malformed list, or with bpp_errno set if memory runs
+   out */
+static char ** split(const char * s, const char * d, long * token_count)
+{
+  long i,k;
+  long del_count = 0;
+  char ** tokens = NULL;
+
+  assert(strlen(d) == 1);
+
+  /* compute number of commas in list of tips */
+  for (i = 0; i < (long)strlen(s); ++i)
+    if (s[i] == *d)
+      ++del_count;
+  
+  tokens = (char **)bpp_malloc((size_t)(del_count+1) * sizeof(char *));
+  if (!tokens)
+    return NULL;
+
+  k = 0;
+  while (*s)
+  {
+    /* get next taxon */
+    size_t token_len = strcspn(s,d);
+    if (!token_len || !(tokens[k] = bpp_strndup(s, token_len)))
+    {
+      for (i = 0; i < k; ++i)
+        free(tokens[i]);
+      free(tokens);
+      return NULL;
+    }
+    k++;
+
+    s += token_len;
+    assert(*s == d[0] || *s == '\0');
+    if (*s == d[0])
+      ++s;
+  }
+
+  /* empty list or trailing delimiter */
+  if (k != del_count+1)
+  {
+    for (i = 0; i < k; ++i)
+      free(tokens[i]);
+    free(tokens);
+    return NULL;
+  }
+
+  *token_count = k;
+
+  return tokens;
+}
+
+static long ends_with(const char * x, const char * suffix)
+{
+  size_t xlen, slen;
+  const char * p;
+
+  xlen = strlen(x);
+  slen = strlen(suffix);
+
+  if (slen > xlen)
+    return 0;
+
+  p = x + xlen - slen;
+  if (kernel_memeq(p,suffix,(long)slen))
+    return 1;
+
+  return 0;
+}
+
+static long starts_with(const char * x, const char * prefix)
+{
+  size_t xlen, plen;
+
+  xlen = strlen(x);
+  plen = strlen(prefix);
+
+  if (plen > xlen)
+    return 0;
+
+  if (kernel_memeq(x,prefix,(long)plen))
+    return 1;
+
+  return 0;
+}
+
+filter_t * filter_create(long type, const char * list)
+{
+  long i,k;
+  long token_count;
+  char ** tokens;
+
+  kernel_init();
+
+  if (type != FILTER_EXTRACT && type != FILTER_REMOVE)
+  {
+    bpp_errno = ERROR_INVALID_ARGUMENT;
+    snprintf(bpp_errmsg, 200, "Invalid filter type %ld", type);
+    return NULL;
+  }
+
+  bpp_errno = 0;
+  tokens = split(list, ",", &token_count);
+  if (!tokens)
+  {
+    if (!bpp_errno)
+    {
+      bpp_errno = ERROR_INVALID_ARGUMENT;
+      snprintf(bpp_errmsg, 200, "Cannot parse tokens");
+    }
+    return NULL;
+  }
+
+  /* drop repeated tokens, which would only be tested again */
+  filter_t * f = (filter_t *)bpp_calloc(1, sizeof(filter_t));
+  hashtable_t * ht = hashtable_create((unsigned long)token_count);
+  if (!f || !ht)
+    goto l_unwind;
+  for (i = 0, k = 0; i < token_count; ++i)
+  {
+    unsigned long hash = hash_fnv(tokens[i]);
+
+    if (hashtable_find(ht, tokens[i], hash, hashtable_strcmp))
+      free(tokens[i]);
+    else
+    {
+      if (!hashtable_insert_force(ht, tokens[i], hash))
+      {
+        /* keep the tokens still owned, i.e. the first k and those from i
+           on, contiguous for the unwinding */
+        memmove(tokens+k, tokens+i, (size_t)(token_count-i)*sizeof(char *));
+        token_count = k + token_count - i;
+        goto l_unwind;
+      }
+      tokens[k++] = tokens[i];
+    }
+  }
+  token_count = k;
+  hashtable_destroy(ht, NULL);
+  ht = NULL;
+  f->type = type;
+
+  /* count number of specimens and sequences in list */
+  for (i = 0; i < token_count; ++i)
+  {
+    assert(tokens[i]);
+    if (tokens[i][0] == '^')
+      ++f->sp_count;
+    else
+      ++f->seq_count;
+  }
+
+  /* allocate arrays for storing speciments and sequences */
+  if (f->sp_count)
+    f->sp_tokens = (char **)bpp_malloc((size_t)f->sp_count * sizeof(char *));
+  if (f->seq_count)
+    f->seq_tokens = (char **)bpp_malloc((size_t)f->seq_count * sizeof(char *));
+  if ((f->sp_count && !f->sp_tokens) || (f->seq_count && !f->seq_tokens))
+    goto l_unwind;
+
+  /* separate specimen and sequences */
+  f->sp_count = f->seq_count = 0;
+  for (i = 0; i < token_count; ++i)
+    if (tokens[i][0] == '^')
+      f->sp_tokens[f->sp_count++] = tokens[i];
+    else
+      f->seq_tokens[f->seq_count++] = tokens[i];
+
+  free(tokens);
+
+  return f;
+
+l_unwind:
+  for (i = 0; i < token_count; ++i)
+    free(tokens[i]);
+  free(tokens);
+  if (ht)
+    hashtable_destroy(ht, NULL);
+  if (f)
+  {
+    free(f->sp_tokens);
+    free(f->seq_tokens);
+    free(f);
+  }
+  return NULL;
+}
+
+void filter_destroy(filter_t * f)
+{
+  long i;
+
+  for (i = 0; i < f->sp_count; ++i)
+    free(f->sp_tokens[i]);
+  for (i = 0; i < f->seq_count; ++i)
+    free(f->seq_tokens[i]);
+  if (f->sp_tokens)
+    free(f->sp_tokens);
+  if (f->seq_tokens)
+    free(f->seq_tokens);
+  free(f);
+}
+
+long filter_match(const filter_t * f, const char * label)
+{
+  long k;
+
+  for (k = 0; k < f->sp_count; ++k)
+    if (ends_with(label, f->sp_tokens[k]))
+      return 1;
+
+  for (k = 0; k < f->seq_count; ++k)
+    if (starts_with(label, f->seq_tokens[k]))
+      return 1;
+
+  return 0;
+}
+
+/* apply the filter to a locus. The input alignment is consumed; returns the
+   alignment of kept sequences, or NULL if no sequences are kept or, with
+   bpp_errno set, if memory runs out */
+msa_t * filter_msa(const filter_t * f, msa_t * msa_in)
+{
+  long j,k;
+  long keep_count = 0;
+  long * keep;
+  msa_t * msa = NULL;
+
+  bpp_errno = 0;
+
+  /* create index array for marking sequences that will be kept */
+  keep = (long *)bpp_calloc((size_t)MAX(msa_in->count,1), sizeof(long));
+  if (!keep)
+  {
+    msa_destroy(msa_in);
+    return NULL;
+  }
+
+  for (j = 0; j < msa_in->count; ++j)
+  {
+    long match = filter_match(f, msa_in->label[j]);
+
+    keep[j] = (f->type == FILTER_EXTRACT) ? match : !match;
+    if (keep[j])
+      keep_count++;
+  }
+
+  if (keep_count)
+  {
+    msa           = (msa_t *)bpp_calloc(1, sizeof(msa_t));
+    if (!msa)
+      goto l_done;
+    msa->length   = msa_in->length;
+    msa->count    = keep_count;
+    msa->label    = (char **)bpp_malloc((size_t)keep_count * sizeof(char *));
+    msa->sequence = (char **)bpp_malloc((size_t)keep_count * sizeof(char *));
+    if (!msa->label || !msa->sequence)
+    {
+      msa->count = 0;
+      msa_destroy(msa);
+      msa = NULL;
+      goto l_done;
+    }
+
+    /* move kept sequences to the new alignment */
+    k = 0;
+    for (j = 0; j < msa_in->count; ++j)
+    {
+      if (keep[j])
+      {
+        msa->label[k] = msa_in->label[j];
+        msa->sequence[k++] = msa_in->sequence[j];
+        msa_in->label[j] = NULL;
+        msa_in->sequence[j] = NULL;
+      }
+    }
+  }
+
+l_done:
+  free(keep);
+  msa_destroy(msa_in);
+
+  return msa;
+}
+
+/* print the sequences of a locus kept by the filter in the format of
+   phylip_print, without modifying the locus; returns the number of
+   sequences printed, or -1 if memory runs out */
+long filter_print(const filter_t * f, const msa_t * msa, FILE * fp)
+{
+  long j;
+  long keep_count = 0;
+  long * keep;
+
+  keep = (long *)bpp_malloc((size_t)MAX(msa->count,1) * sizeof(long));
+  if (!keep)
+    return -1;
+
+  for (j = 0; j < msa->count; ++j)
+  {
+    long match = filter_match(f, msa->label[j]);
+
+    keep[j] = (f->type == FILTER_EXTRACT) ? match : !match;
+    if (keep[j])
+      keep_count++;
+  }
+
+  if (keep_count)
+  {
+    fprintf(fp, "%ld %ld\n", keep_count, msa->length);
+    for (j = 0; j < msa->count; ++j)
+      if (keep[j])
+        fprintf(fp, "%s %s\n", msa->label[j], msa->sequence[j]);
+  }
+
+  free(keep);
+
+  return keep_count;
+}
+
+typedef struct filter_job_s
+{
+  const filter_t * filter;
+  FILE * fp;
+  long failed;          /* set if memory ran out while filtering a locus */
+} filter_job_t;
+
+static void * cb_filter(void * item, long index, void * data)
+{
+  msa_t * msa;
+  filter_job_t * job = (filter_job_t *)data;
+
+  (void) index;
+
+  if (!(msa = filter_msa(job->filter, (msa_t *)item)) && bpp_errno)
+    __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+
+  return (void *)msa;
+}
+
+/* error of a pipeline run over cb_filter */
+static int filter_done(filter_job_t * job, int rc)
+{
+  if (rc && job->failed)
+  {
+    bpp_errno = ERROR_MEMORY;
+    snprintf(bpp_errmsg, 200, "Unable to allocate enough memory.");
+    return BPP_FAILURE;
+  }
+
+  return rc;
+}
+
+static long cb_write(void * result, long index, void * data)
+{
+  long bytes;
+  msa_t * msa = (msa_t *)result;
+  filter_job_t * job = (filter_job_t *)data;
+
+  (void) index;
+
+  /* locus with no sequences left */
+  if (!msa) return 0;
+
+  bytes = bpp_ftell(job->fp);
+  phylip_print(job->fp, msa);
+  bytes = bpp_ftell(job->fp) - bytes;
+  msa_destroy(msa);
+
+  return bytes;
+}
+
+/* filter all loci of a PHYLIP file and write them to fp in input order */
+int filter_file(const filter_t * f,
+                const char * filename,
+                FILE * fp,
+                long threads)
+{
+  int rc;
+  filter_job_t job;
+
+  phylip_t * fd = phylip_open(filename, pll_map_fasta);
+  if (!fd)
+    return BPP_FAILURE;
+
+  job.filter = f;
+  job.fp = fp;
+  job.failed = 0;
+
+  rc = pipeline_run(threads,
+                    pipeline_cb_phylip, (void *)fd,
+                    cb_filter, cb_write, (void *)&job);
+
+  phylip_close(fd);
+
+  return filter_done(&job, rc);
+}
+
+/* filter loci already in memory and write them to fp in input order; the
+   loci are consumed */
+int filter_list(const filter_t * f,
+                msa_t ** msa_list,
+                long msa_count,
+                FILE * fp,
+                long threads)
+{
+  filter_job_t job;
+  pipeline_list_t reader;
+
+  reader.msa_list = msa_list;
+  reader.count = msa_count;
+  reader.next = 0;
+
+  job.filter = f;
+  job.fp = fp;
+  job.failed = 0;
+
+  return filter_done(&job,
+                     pipeline_run(threads,
+                                  pipeline_cb_list, (void *)&reader,
+                                  cb_filter, cb_write, (void *)&job));
+}
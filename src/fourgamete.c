@@ -0,0 +1,142 @@
+/*
+    Copyright (C) 2022-2023 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London, Gower Street, London WC1E 6BT, England
+*/
+
+
+#include "libbpptools.h"
+
+/* Four-gamete test and Hudson-Kaplan lower bound on the number of
+   recombination events (Rm) within a locus. Only parsimony-informative
+   biallelic sites can be incompatible; their bitsets (see biallelic.c)
+   allow the four gametes of a pair of sites to be checked for 64 sequences
+   at a time. All pairs are tested in tiles of FG_TILE x FG_TILE sites,
+   keeping for each site the closest site to its left that it is
+   incompatible with.
+
+   Rm is the largest number of disjoint intervals between incompatible
+   sites, obtained greedily by increasing right end. Cutting the locus once
+   within each chosen interval separates every incompatible pair, hence the
+   segments between cuts pass the four-gamete test and Rm is also the
+   smallest number of splits that achieves this. Cuts are suggested halfway
+   between the right end of an interval and the informative site before
+   it. */
+
+#define FG_TILE 64
+
+/* nonzero if all four gametes are present among the sequences with data at
+   both sites */
+static int fg_incompatible(const unsigned long * pi,
+                           const unsigned long * xi,
+                           const unsigned long * pj,
+                           const unsigned long * xj,
+                           long words)
+{
+  long w;
+  unsigned long g00 = 0, g01 = 0, g10 = 0, g11 = 0;
+
+  for (w = 0; w < words; ++w)
+  {
+    unsigned long v = pi[w] & pj[w];
+
+    g11 |= v & xi[w] & xj[w];
+    g10 |= v & xi[w] & ~xj[w];
+    g01 |= v & ~xi[w] & xj[w];
+    g00 |= v & ~xi[w] & ~xj[w];
+  }
+
+  return g00 && g01 && g10 && g11;
+}
+
+fourgamete_t * fourgamete_compute(const msa_t * msa)
+{
+  long i,j,k,ib,jb;
+  long last = -1;
+
+  fourgamete_t * fg = (fourgamete_t *)bpp_calloc(1, sizeof(fourgamete_t));
+  if (!fg)
+    return NULL;
+  fg->sequences = msa->count;
+  fg->length = msa->length;
+
+  biallelic_t * bi = biallelic_create(msa, 1, NULL, 0);
+  if (!bi)
+  {
+    free(fg);
+    return NULL;
+  }
+  long m = bi->sites;
+  long words = bi->words;
+  const long * cols = bi->cols;
+  const unsigned long * present = bi->present;
+  const unsigned long * allele = bi->allele;
+  long * left = (long *)bpp_malloc((size_t)MAX(m,1) * sizeof(long));
+  fg->intervals = (long *)bpp_malloc((size_t)MAX(2*m,1) * sizeof(long));
+  fg->splits = (long *)bpp_malloc((size_t)MAX(m,1) * sizeof(long));
+
+  if (!left || !fg->intervals || !fg->splits)
+  {
+    biallelic_destroy(bi);
+    free(left);
+    fourgamete_destroy(fg);
+    return NULL;
+  }
+
+  fg->sites = m;
+  fg->pairs = m*(m-1)/2;
+
+  for (k = 0; k < m; ++k)
+    left[k] = -1;
+
+  for (jb = 0; jb < m; jb += FG_TILE)
+    for (ib = 0; ib <= jb; ib += FG_TILE)
+      for (j = jb; j < MIN(jb+FG_TILE,m); ++j)
+        for (i = ib; i < MIN(ib+FG_TILE,j); ++i)
+          if (fg_incompatible(present + i*words, allele + i*words,
+                              present + j*words, allele + j*words, words))
+          {
+            fg->incompatible++;
+            left[j] = i;
+          }
+
+  /* greedy selection of disjoint intervals by increasing right end;
+     intervals sharing an end site are disjoint */
+  for (j = 0; j < m; ++j)
+  {
+    if (left[j] < 0 || left[j] < last) continue;
+
+    fg->intervals[2*fg->rm]   = cols[left[j]];
+    fg->intervals[2*fg->rm+1] = cols[j];
+    fg->splits[fg->rm] = cols[j-1] + 1 + (cols[j] - cols[j-1]) / 2;
+    fg->rm++;
+    last = j;
+  }
+
+  biallelic_destroy(bi);
+  free(left);
+
+  return fg;
+}
+
+void fourgamete_destroy(fourgamete_t * fg)
+{
+  free(fg->intervals);
+  free(fg->splits);
+  free(fg);
+}
@@ -0,0 +1,283 @@
+/*
+    Copyright (C) 2022-2023 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London, Gower Street, London WC1E 6BT, England
+*/
+
+/* Synthetic multi-locus BPP dataset generator used by the benchmark suite.
+   Each locus is derived from a random ancestral sequence by independent
+   substitutions, such that loci contain realistic numbers of segregating
+   sites. Individual i is tagged with species i % species in every locus. */
+
+#include "bpp-tools.h"
+
+#define LENDIST_UNIFORM     0
+#define LENDIST_LOGUNIFORM  1
+
+static long opt_rngseed;
+static long opt_loci;
+static long opt_seqs;
+static long opt_species;
+static long opt_minlen;
+static long opt_maxlen;
+static long opt_lendist;
+static long opt_wrap;
+static double opt_divergence;
+static double opt_ambiguity;
+static double opt_missing;
+static char * opt_output;
+
+static const char nt[4] = {'A','C','G','T'};
+
+/* two-fold ambiguity codes containing each nucleotide */
+static const char amb[4][3] = { {'R','M','W'},
+                                {'Y','M','S'},
+                                {'R','K','S'},
+                                {'Y','K','W'} };
+
+static const char missing[3] = {'N','-','?'};
+
+static struct option long_options[] =
+{
+  {"help",         no_argument,       0, 0 },  /*  0 */
+  {"loci",         required_argument, 0, 0 },  /*  1 */
+  {"seqs",         required_argument, 0, 0 },  /*  2 */
+  {"species",      required_argument, 0, 0 },  /*  3 */
+  {"minlen",       required_argument, 0, 0 },  /*  4 */
+  {"maxlen",       required_argument, 0, 0 },  /*  5 */
+  {"lendist",      required_argument, 0, 0 },  /*  6 */
+  {"divergence",   required_argument, 0, 0 },  /*  7 */
+  {"ambiguity",    required_argument, 0, 0 },  /*  8 */
+  {"missing",      required_argument, 0, 0 },  /*  9 */
+  {"wrap",         required_argument, 0, 0 },  /* 10 */
+  {"seed",         required_argument, 0, 0 },  /* 11 */
+  {"out",          required_argument, 0, 0 },  /* 12 */
+  { 0, 0, 0, 0 }
+};
+
+static void usage(const char * progname)
+{
+  fprintf(stderr,
+          "Usage: %s [OPTIONS]\n"
+          "\n"
+          "  --loci INT         number of loci (default: 100)\n"
+          "  --seqs INT         sequences per locus (default: 10)\n"
+          "  --species INT      number of ^species tags (default: 4)\n"
+          "  --minlen INT       minimum locus length (default: 500)\n"
+          "  --maxlen INT       maximum locus length (default: minlen)\n"
+          "  --lendist STRING   uniform or loguniform lengths (default: uniform)\n"
+          "  --divergence REAL  per-site substitution probability (default: 0.01)\n"
+          "  --ambiguity REAL   per-site two-fold ambiguity rate (default: 0.001)\n"
+          "  --missing REAL     per-site missing data rate (default: 0.01)\n"
+          "  --wrap INT         wrap sequence data every INT characters\n"
+          "  --seed INT         seed for the random number generator\n"
+          "  --out FILE         output file (default: stdout)\n"
+          "\n",
+          progname);
+}
+
+static double uniform()
+{
+  return arch_random() / (RAND_MAX + 1.0);
+}
+
+static long locus_length()
+{
+  if (opt_minlen == opt_maxlen)
+    return opt_minlen;
+
+  if (opt_lendist == LENDIST_LOGUNIFORM)
+    return (long)exp(log((double)opt_minlen) +
+                     uniform() * (log((double)opt_maxlen) -
+                                  log((double)opt_minlen)));
+
+  return opt_minlen + arch_random() % (opt_maxlen - opt_minlen + 1);
+}
+
+static void args_init(int argc, char ** argv)
+{
+  int option_index = 0;
+  int c;
+
+  opt_loci = 100;
+  opt_seqs = 10;
+  opt_species = 4;
+  opt_minlen = 500;
+  opt_maxlen = 0;
+  opt_lendist = LENDIST_UNIFORM;
+  opt_divergence = 0.01;
+  opt_ambiguity = 0.001;
+  opt_missing = 0.01;
+  opt_wrap = 0;
+  opt_rngseed = 0;
+  opt_output = NULL;
+
+  while ((c = getopt_long_only(argc, argv, "", long_options, &option_index)) == 0)
+  {
+    switch (option_index)
+    {
+      case 0:
+        usage(argv[0]);
+        exit(EXIT_SUCCESS);
+
+      case 1:
+        opt_loci = atol(optarg);
+        break;
+
+      case 2:
+        opt_seqs = atol(optarg);
+        break;
+
+      case 3:
+        opt_species = atol(optarg);
+        break;
+
+      case 4:
+        opt_minlen = atol(optarg);
+        break;
+
+      case 5:
+        opt_maxlen = atol(optarg);
+        break;
+
+      case 6:
+        if (!strcasecmp(optarg, "uniform"))
+          opt_lendist = LENDIST_UNIFORM;
+        else if (!strcasecmp(optarg, "loguniform"))
+          opt_lendist = LENDIST_LOGUNIFORM;
+        else
+          fatal("Unknown length distribution %s", optarg);
+        break;
+
+      case 7:
+        opt_divergence = atof(optarg);
+        break;
+
+      case 8:
+        opt_ambiguity = atof(optarg);
+        break;
+
+      case 9:
+        opt_missing = atof(optarg);
+        break;
+
+      case 10:
+        opt_wrap = atol(optarg);
+        break;
+
+      case 11:
+        opt_rngseed = atol(optarg);
+        break;
+
+      case 12:
+        opt_output = xstrdup(optarg);
+        break;
+
+      default:
+        fatal("Internal error in option parsing");
+    }
+  }
+
+  if (c != -1)
+    exit(EXIT_FAILURE);
+
+  if (!opt_maxlen)
+    opt_maxlen = opt_minlen;
+
+  if (opt_loci < 1 || opt_seqs < 1 || opt_species < 1)
+    fatal("Number of loci, sequences and species must be positive");
+  if (opt_minlen < 1 || opt_maxlen < opt_minlen)
+    fatal("Invalid locus length range %ld-%ld", opt_minlen, opt_maxlen);
+}
+
+static void write_locus(FILE * fp, char * anc, char * seq)
+{
+  long i,j;
+  long len = locus_length();
+  char label[64];
+
+  /* ancestral sequence */
+  for (j = 0; j < len; ++j)
+    anc[j] = (char)(arch_random() & 3);
+
+  fprintf(fp, "%ld %ld\n", opt_seqs, len);
+  for (i = 0; i < opt_seqs; ++i)
+  {
+    for (j = 0; j < len; ++j)
+    {
+      long state = anc[j];
+      double r = uniform();
+
+      if (r < opt_divergence)
+        state = (state + 1 + arch_random() % 3) & 3;
+
+      r = uniform();
+      if (r < opt_missing)
+        seq[j] = missing[arch_random() % 3];
+      else if (r < opt_missing + opt_ambiguity)
+        seq[j] = amb[state][arch_random() % 3];
+      else
+        seq[j] = nt[state];
+    }
+
+    snprintf(label, 64, "i%ld^S%ld", i+1, i % opt_species + 1);
+
+    fprintf(fp, "%-12s  ", label);
+    if (!opt_wrap)
+    {
+      fwrite(seq, 1, (size_t)len, fp);
+      fprintf(fp, "\n");
+      continue;
+    }
+
+    for (j = 0; j < len; j += opt_wrap)
+    {
+      fwrite(seq+j, 1, (size_t)MIN(len-j,opt_wrap), fp);
+      fprintf(fp, "\n");
+    }
+  }
+  fprintf(fp, "\n");
+}
+
+int main(int argc, char * argv[])
+{
+  long i;
+
+  args_init(argc, argv);
+
+  arch_srandom(opt_rngseed);
+
+  FILE * fp = opt_output ? xopen(opt_output, "w") : stdout;
+
+  char * anc = (char *)xmalloc((size_t)opt_maxlen);
+  char * seq = (char *)xmalloc((size_t)opt_maxlen);
+
+  for (i = 0; i < opt_loci; ++i)
+    write_locus(fp, anc, seq);
+
+  if (opt_output)
+  {
+    fclose(fp);
+    free(opt_output);
+  }
+
+  free(anc);
+  free(seq);
+
+  return 0;
+}
@@ -0,0 +1,124 @@
+/*
+    Copyright (C) 2022-2023 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London, Gower Street, London WC1E 6BT, England
+*/
+
+
+#include "libbpptools.h"
+
+/* Groups of identical sequences of a locus. Sequences are hashed with
+   kernel_hash and sorted by hash, and only sequences in the same hash group
+   are compared byte by byte, such that collisions cost a comparison but
+   never merge distinct sequences. Haplotypes are numbered in the order of
+   their first occurrence in the locus. */
+
+typedef struct seqhash_s
+{
+  unsigned long hash;
+  long index;
+} seqhash_t;
+
+static int cb_seqhash_cmp(const void * a, const void * b)
+{
+  const seqhash_t * x = (const seqhash_t *)a;
+  const seqhash_t * y = (const seqhash_t *)b;
+
+  if (x->hash != y->hash)
+    return x->hash < y->hash ? -1 : 1;
+  return x->index < y->index ? -1 : (x->index > y->index);
+}
+
+haplotypes_t * haplotypes_compute(const msa_t * msa)
+{
+  long i,j,k,m;
+  long n = msa->count;
+
+  haplotypes_t * hap = (haplotypes_t *)bpp_calloc(1, sizeof(haplotypes_t));
+  if (!hap)
+    return NULL;
+  hap->map = (long *)bpp_malloc((size_t)MAX(n,1) * sizeof(long));
+  hap->first = (long *)bpp_malloc((size_t)MAX(n,1) * sizeof(long));
+  hap->weight = (long *)bpp_calloc((size_t)MAX(n,1), sizeof(long));
+
+  seqhash_t * h = (seqhash_t *)bpp_malloc((size_t)MAX(n,1) * sizeof(seqhash_t));
+  long * rep = (long *)bpp_malloc((size_t)MAX(n,1) * sizeof(long));
+
+  if (!hap->map || !hap->first || !hap->weight || !h || !rep)
+  {
+    free(h);
+    free(rep);
+    haplotypes_destroy(hap);
+    return NULL;
+  }
+
+  for (i = 0; i < n; ++i)
+  {
+    h[i].hash = kernel_hash(msa->sequence[i], msa->length);
+    h[i].index = i;
+  }
+
+  qsort(h, (size_t)n, sizeof(seqhash_t), cb_seqhash_cmp);
+
+  for (i = 0; i < n; i = j)
+  {
+    for (j = i+1; j < n && h[j].hash == h[i].hash; ++j);
+
+    /* first occurrences within the group are moved to its front; as the
+       group is sorted by index, each is the earliest carrier */
+    long first = i;
+    for (k = i; k < j; ++k)
+    {
+      for (m = i; m < first; ++m)
+        if (kernel_memeq(msa->sequence[h[m].index],
+                         msa->sequence[h[k].index], msa->length))
+          break;
+
+      rep[h[k].index] = h[m == first ? k : m].index;
+      if (m == first)
+        h[first++] = h[k];
+    }
+  }
+
+  for (i = 0; i < n; ++i)
+  {
+    /* carriers other than the first come later in the locus */
+    if (rep[i] == i)
+    {
+      hap->first[hap->count] = i;
+      hap->map[i] = hap->count++;
+    }
+    else
+      hap->map[i] = hap->map[rep[i]];
+
+    hap->weight[hap->map[i]]++;
+  }
+
+  free(h);
+  free(rep);
+
+  return hap;
+}
+
+void haplotypes_destroy(haplotypes_t * hap)
+{
+  free(hap->map);
+  free(hap->first);
+  free(hap->weight);
+  free(hap);
+}
@@ -19,7 +19,19 @@
     University College London, Gower Street, London WC1E 6BT, England
 */
 
-#include "bpp-tools.h"
+#include "libbpptools.h"
+
+long mmx_present;
+long sse_present;
+long sse2_present;
+long sse3_present;
+long ssse3_present;
+long sse41_present;
+long sse42_present;
+long popcnt_present;
+long avx_present;
+long avx2_present;
+long altivec_present;
 
 /*
     Apple machines should always default to assembly code due to
@@ -180,49 +192,44 @@ void cpu_features_show()
   fprintf(stderr, "\n");
 }
 
-void cpu_setarch()
+long cpu_bestarch()
 {
-  /* if arch specified by user, leave it be */
-  if (opt_arch != -1)
-  {
-    if (opt_arch == PLL_ATTRIB_ARCH_CPU)
-      printf("User specified SIMD ISA: CPU\n\n");
-    else if (opt_arch == PLL_ATTRIB_ARCH_SSE)
-      printf("User specified SIMD ISA: SSE\n\n");
-    else if (opt_arch == PLL_ATTRIB_ARCH_AVX)
-      printf("User specified SIMD ISA: AVX\n\n");
-    else if (opt_arch == PLL_ATTRIB_ARCH_AVX2)
-      printf("User specified SIMD ISA: AVX2\n\n");
-    else
-      fatal("Internal error when setting arch");
-
-    return;
-  }
-
-  /* otherwise set best present SIMD */
-  opt_arch = PLL_ATTRIB_ARCH_CPU;
+  long arch = PLL_ATTRIB_ARCH_CPU;
 
   if (sse2_present)
-    opt_arch = PLL_ATTRIB_ARCH_SSE;
+    arch = PLL_ATTRIB_ARCH_SSE;
 #ifdef HAVE_AVX
   if (avx_present)
-    opt_arch = PLL_ATTRIB_ARCH_AVX;
+    arch = PLL_ATTRIB_ARCH_AVX;
 #endif
 #ifdef HAVE_AVX2
   if (avx2_present)
-    opt_arch = PLL_ATTRIB_ARCH_AVX2;
+    arch = PLL_ATTRIB_ARCH_AVX2;
 #endif
 
-  if (opt_arch == PLL_ATTRIB_ARCH_CPU)
-    printf("Auto-selected SIMD ISA: CPU\n\n");
-  else if (opt_arch == PLL_ATTRIB_ARCH_SSE)
-    printf("Auto-selected SIMD ISA: SSE\n\n");
-  else if (opt_arch == PLL_ATTRIB_ARCH_AVX)
-    printf("Auto-selected SIMD ISA: AVX\n\n");
-  else if (opt_arch == PLL_ATTRIB_ARCH_AVX2)
-    printf("Auto-selected SIMD ISA: AVX2\n\n");
-  else
-    fatal("Internal error when setting arch");
+  return arch;
+}
+
+/* returns the arch specified by the user, or the best present SIMD ISA if
+   arch is -1; returns -1 for an unknown arch */
+long cpu_setarch(long arch)
+{
+  /* if arch specified by user, leave it be */
+  if (arch != -1)
+  {
+    if (arch != PLL_ATTRIB_ARCH_CPU && arch != PLL_ATTRIB_ARCH_SSE &&
+        arch != PLL_ATTRIB_ARCH_AVX && arch != PLL_ATTRIB_ARCH_AVX2)
+    {
+      bpp_errno = ERROR_ARCH;
+      snprintf(bpp_errmsg, 200, "Unknown SIMD ISA (%ld)", arch);
+      return -1;
+    }
+
+    return arch;
+  }
+
+  /* otherwise set best present SIMD */
+  return cpu_bestarch();
 }
 
 #ifdef _MSC_VER
@@ -19,7 +19,7 @@
     University College London, Gower Street, London WC1E 6BT, England
 */
 
-#include "bpp-tools.h"
+#include "libbpptools.h"
 
 
 /* Daniel J. Bernstein 2a hash function */
@@ -49,10 +49,37 @@ unsigned long hash_fnv(char * s)
   return hash;
 }
 
+/* hash of a byte buffer, processed in 8-byte words; blocks of a stream
+   can be hashed in turn by passing the previous hash as the initial value,
+   as long as all but the last block have a size divisible by 8 */
+unsigned long hash_bytes(const void * buf, size_t size, unsigned long hash)
+{
+  size_t i;
+  uint64_t w;
+  const unsigned char * p = (const unsigned char *)buf;
+
+  for (i = 0; i + 8 <= size; i += 8)
+  {
+    memcpy(&w, p+i, 8);
+    hash = (hash ^ w) * 0x9e3779b97f4a7c15UL;
+    hash ^= hash >> 32;
+  }
+
+  for (; i < size; ++i)
+  {
+    hash ^= p[i];
+    hash *= 1099511628211UL;
+  }
+
+  return hash;
+}
+
 static ht_item_t * hashitem_create(unsigned long key, void * value)
 {
-  ht_item_t * hi = (ht_item_t *)xmalloc(sizeof(ht_item_t));
-  
+  ht_item_t * hi = (ht_item_t *)bpp_malloc(sizeof(ht_item_t));
+  if (!hi)
+    return NULL;
+
   hi->key   = key;
   hi->value = value;
 
@@ -107,41 +134,104 @@ hashtable_t * hashtable_create(unsigned long items_count)
     size <<= 1;
 
   /* allocate and init hash table */
-  hashtable_t * ht = (hashtable_t *)xmalloc(sizeof(hashtable_t));
+  hashtable_t * ht = (hashtable_t *)bpp_malloc(sizeof(hashtable_t));
+  if (!ht)
+    return NULL;
   ht->table_size = size;
   ht->entries_count = 0;
 
   /* allocate and init entries array */
-  ht->entries = (list_t **)xmalloc(size*sizeof(list_t *));
+  ht->entries = (list_t **)bpp_calloc(size,sizeof(list_t *));
+  if (!ht->entries)
+  {
+    free(ht);
+    return NULL;
+  }
   for (i = 0; i < size; ++i)
   {
-    ht->entries[i] = (list_t *)xmalloc(sizeof(list_t));
-    memset(ht->entries[i], 0, sizeof(list_t));
+    ht->entries[i] = (list_t *)bpp_calloc(1,sizeof(list_t));
+    if (!ht->entries[i])
+    {
+      ht->table_size = i;
+      hashtable_destroy(ht,NULL);
+      return NULL;
+    }
   }
 
   return ht;
 }
 
+/* returns 1 if x was inserted, 0 if an equal item is already in the table
+   and -1 if memory ran out */
 int hashtable_insert(hashtable_t * ht,
                      void * x,
                      unsigned long hash,
                      int (*cb_cmp)(void *, void *))
 {
-  /* size is always a multiple of 2 and greater than 2 */
-  unsigned long index = hash & (ht->table_size-1);
+  if (hashtable_find(ht, x, hash, cb_cmp))
+    return 0;
 
-  list_t * list = ht->entries[index];
+  if (!hashtable_insert_force(ht, x, hash))
+    return -1;
 
+  return 1;
+}
 
-  if (hashtable_find(ht, x, hash, cb_cmp))
-    return 0;
+/* doubles the number of buckets; for tables filled with more items than
+   they were created for, e.g. while streaming; the table is left
+   unchanged if memory runs out */
+int hashtable_grow(hashtable_t * ht)
+{
+  unsigned long i;
+  unsigned long size = ht->table_size << 1;
+  list_t ** entries = (list_t **)bpp_calloc(size,sizeof(list_t *));
+  list_item_t * items;
 
-  ht_item_t * item = hashitem_create(hash,x);
-  list_append(list, item);
+  if (!entries)
+    return BPP_FAILURE;
 
-  ht->entries_count++;
+  for (i = 0; i < size; ++i)
+  {
+    entries[i] = (list_t *)bpp_calloc(1, sizeof(list_t));
+    if (!entries[i])
+    {
+      while (i--)
+        free(entries[i]);
+      free(entries);
+      return BPP_FAILURE;
+    }
+  }
 
-  return 1;
+  /* move the list items themselves, so that no allocation can fail while
+     the items are redistributed */
+
+  for (i = 0; i < ht->table_size; ++i)
+  {
+    items = ht->entries[i]->head;
+
+    while (items)
+    {
+      list_item_t * li = items;
+      ht_item_t * hi = (ht_item_t *)(li->data);
+      list_t * list = entries[hi->key & (size-1)];
+
+      items = li->next;
+      li->next = NULL;
+      if (list->count)
+        list->tail->next = li;
+      else
+        list->head = li;
+      list->tail = li;
+      list->count++;
+    }
+    free(ht->entries[i]);
+  }
+
+  free(ht->entries);
+  ht->entries = entries;
+  ht->table_size = size;
+
+  return BPP_SUCCESS;
 }
 
 void hashtable_destroy(hashtable_t * ht, void (*cb_dealloc)(void *))
@@ -181,9 +271,9 @@ int cb_cmp_pairlabel(void * a, void * b)
   return (!strcmp(pair->label,label));
 }
 
-void hashtable_insert_force(hashtable_t * ht,
-                            void * x,
-                            unsigned long hash)
+int hashtable_insert_force(hashtable_t * ht,
+                           void * x,
+                           unsigned long hash)
 {
   /* size is always a multiple of 2 and greater than 2 */
   unsigned long index = hash & (ht->table_size-1);
@@ -191,7 +281,16 @@ void hashtable_insert_force(hashtable_t * ht,
   list_t * list = ht->entries[index];
 
   ht_item_t * item = hashitem_create(hash,x);
-  list_append(list, item);
+  if (!item)
+    return BPP_FAILURE;
+
+  if (!list_append(list, item))
+  {
+    free(item);
+    return BPP_FAILURE;
+  }
 
   ht->entries_count++;
+
+  return BPP_SUCCESS;
 }
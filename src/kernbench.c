@@ -0,0 +1,685 @@
+/*
+    Copyright (C) 2022-2023 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London, Gower Street, London WC1E 6BT, England
+*/
+
+/* Microbenchmark of the inner kernels in kernel*.c. Every kernel is timed in
+   isolation for each instruction set supported by the machine, on an input
+   that fits in the L1/L2 cache and on an input that has to be streamed from
+   main memory. The output of every vectorized variant is compared against
+   the scalar reference, and the program exits with an error on mismatch. */
+
+#include "bpp-tools.h"
+
+static long opt_rngseed;
+static long opt_small;
+static long opt_large;
+static double opt_mintime;
+static char * opt_csv;
+
+typedef struct kb_input_s
+{
+  long size;
+  char * text;              /* sequence data with separators */
+  char * seq[8];            /* aligned sequences */
+  long seqlen;
+  unsigned char * mask;     /* column mask for compaction */
+  char * work;              /* compaction buffer */
+  unsigned short * pats;
+  long sites;
+  char ** labels;
+  long labels_count;
+  long label_bytes;
+  unsigned char * out;
+  unsigned long * slices;   /* bit-sliced sequences */
+  long words;               /* words per bit-sliced sequence */
+  unsigned short * counts;  /* allele counters */
+} kb_input_t;
+
+typedef struct kb_kernel_s
+{
+  const char * name;
+  const char * unit;
+  /* runs the kernel once and returns a checksum of its output */
+  unsigned long (*run)(kb_input_t *);
+  /* bytes and items processed per run */
+  long (*bytes)(kb_input_t *);
+  long (*items)(kb_input_t *);
+} kb_kernel_t;
+
+static kernel_lut_t lut_legal;
+static kernel_lut_t lut_amb;
+static kernel_lut_t lut_missing;
+static kernel_map_t kmap_nt;
+static double * abba_tbl;
+static double * baba_tbl;
+static unsigned char copies_tbl[5][16];
+
+static const char * species[4] = { "^S1", "^S2", "^S3", "^S4" };
+
+static struct option long_options[] =
+{
+  {"help",         no_argument,       0, 0 },  /*  0 */
+  {"small",        required_argument, 0, 0 },  /*  1 */
+  {"large",        required_argument, 0, 0 },  /*  2 */
+  {"mintime",      required_argument, 0, 0 },  /*  3 */
+  {"seed",         required_argument, 0, 0 },  /*  4 */
+  {"csv",          required_argument, 0, 0 },  /*  5 */
+  { 0, 0, 0, 0 }
+};
+
+static void usage(const char * progname)
+{
+  fprintf(stderr,
+          "Usage: %s [OPTIONS]\n"
+          "\n"
+          "  --small INT        cache-resident input size in bytes (default: 16384)\n"
+          "  --large INT        memory-resident input size in bytes (default: 67108864)\n"
+          "  --mintime REAL     minimum measured time per kernel in seconds (default: 0.1)\n"
+          "  --seed INT         seed for the random number generator\n"
+          "  --csv FILE         also write results in CSV format to FILE\n"
+          "\n",
+          progname);
+}
+
+static void args_init(int argc, char ** argv)
+{
+  int option_index = 0;
+  int c;
+
+  opt_rngseed = 0;
+  opt_small = 16384;
+  opt_large = 64*1024*1024;
+  opt_mintime = 0.1;
+  opt_csv = NULL;
+
+  while ((c = getopt_long_only(argc, argv, "", long_options, &option_index)) == 0)
+  {
+    switch (option_index)
+    {
+      case 0:
+        usage(argv[0]);
+        exit(EXIT_SUCCESS);
+
+      case 1:
+        opt_small = atol(optarg);
+        break;
+
+      case 2:
+        opt_large = atol(optarg);
+        break;
+
+      case 3:
+        opt_mintime = atof(optarg);
+        break;
+
+      case 4:
+        opt_rngseed = atol(optarg);
+        break;
+
+      case 5:
+        opt_csv = xstrdup(optarg);
+        break;
+
+      default:
+        fatal("Internal error in option parsing");
+    }
+  }
+
+  if (c != -1)
+    exit(EXIT_FAILURE);
+
+  if (opt_small < 1024 || opt_large < opt_small)
+    fatal("Input sizes must satisfy 1024 <= small <= large");
+}
+
+static unsigned long checksum(const void * data, size_t size)
+{
+  size_t i;
+  const unsigned char * p = (const unsigned char *)data;
+  unsigned long h = 14695981039346656037UL;
+
+  for (i = 0; i < size; ++i)
+  {
+    h ^= p[i];
+    h *= 1099511628211UL;
+  }
+
+  return h;
+}
+
+static char random_state()
+{
+  static const char nt[4] = {'A','C','G','T'};
+  static const char amb[8] = {'R','Y','S','W','K','M','N','-'};
+  long r = arch_random() % 1000;
+
+  if (r < 10)
+    return amb[r & 7];
+
+  return nt[r & 3];
+}
+
+static void input_init(kb_input_t * in, long size)
+{
+  long i,j;
+
+  memset(in, 0, sizeof(kb_input_t));
+  in->size = size;
+
+  /* sequence text as found in PHYLIP files: blocks of ten characters */
+  in->text = (char *)xmalloc((size_t)size+1);
+  for (i = 0; i < size; ++i)
+    in->text[i] = (i % 11 == 10) ? ' ' : random_state();
+  in->text[size] = 0;
+
+  in->seqlen = size / 8;
+  for (j = 0; j < 8; ++j)
+  {
+    in->seq[j] = (char *)xmalloc((size_t)in->seqlen+1);
+    for (i = 0; i < in->seqlen; ++i)
+      in->seq[j][i] = random_state();
+    in->seq[j][in->seqlen] = 0;
+  }
+
+  in->mask = (unsigned char *)xmalloc((size_t)size);
+  kernel_mark_columns_cpu(in->seq, 8, in->seqlen, &lut_amb, in->mask);
+  for (i = in->seqlen; i < size; ++i)
+    in->mask[i] = (arch_random() % 100) < 5;
+
+  in->words = 6 * ((in->seqlen + 63) / 64);
+  in->slices = (unsigned long *)xmalloc((size_t)(8*in->words) *
+                                        sizeof(unsigned long));
+  for (j = 0; j < 8; ++j)
+    kernel_bitslice_cpu(in->seq[j], in->seqlen, &kmap_nt,
+                        in->slices + j*in->words);
+
+  in->counts = (unsigned short *)xmalloc((size_t)(5*in->seqlen) *
+                                         sizeof(unsigned short));
+
+  in->work = (char *)xmalloc((size_t)size);
+  in->out = (unsigned char *)xmalloc((size_t)size);
+
+  in->sites = size / 4;
+  in->pats = (unsigned short *)xmalloc((size_t)in->sites *
+                                       sizeof(unsigned short));
+  for (i = 0; i < in->sites; ++i)
+    in->pats[i] = (unsigned short)(arch_random() & 0xffff);
+
+  /* labels of the form used by BPP, e.g. i12^S3 */
+  in->labels_count = MAX(size / 64, 64);
+  in->labels = (char **)xmalloc((size_t)in->labels_count * sizeof(char *));
+  for (i = 0; i < in->labels_count; ++i)
+  {
+    if (xasprintf(in->labels+i, "individual%ld^S%ld",
+                  i+1, arch_random() % 5 + 1) == -1)
+      fatal("Unable to allocate enough memory.");
+    in->label_bytes += (long)strlen(in->labels[i]);
+  }
+}
+
+static void input_destroy(kb_input_t * in)
+{
+  long i;
+
+  for (i = 0; i < 8; ++i)
+    free(in->seq[i]);
+  for (i = 0; i < in->labels_count; ++i)
+    free(in->labels[i]);
+  free(in->labels);
+  free(in->text);
+  free(in->mask);
+  free(in->work);
+  free(in->out);
+  free(in->pats);
+  free(in->slices);
+  free(in->counts);
+}
+
+/* kernels */
+
+static unsigned long run_classify(kb_input_t * in)
+{
+  long k;
+  unsigned long h = 0;
+  const char * p = in->text;
+  const char * end = in->text + in->size;
+
+  /* same access pattern as dfa_parse: skip runs of legal characters and
+     step over the separators */
+  while (p < end)
+  {
+    k = kernel_legal_prefix(p, end-p, &lut_legal);
+    h = h*31 + (unsigned long)k;
+    p += k+1;
+  }
+
+  return h;
+}
+
+static unsigned long run_mark(kb_input_t * in)
+{
+  kernel_mark_columns(in->seq, 8, in->seqlen, &lut_amb, in->out);
+  return checksum(in->out, (size_t)in->seqlen);
+}
+
+static unsigned long run_missing(kb_input_t * in)
+{
+  long seqs[8];
+  unsigned int * sites = (unsigned int *)in->out;
+
+  kernel_missing_counts(in->seq, 8, in->seqlen, &lut_missing, sites, seqs);
+  return checksum(sites, (size_t)in->seqlen * sizeof(unsigned int)) ^
+         checksum(seqs, 8*sizeof(long));
+}
+
+static unsigned long run_compact(kb_input_t * in)
+{
+  long k;
+
+  /* compaction is done in place; the amount of work does not depend on the
+     content of the buffer, hence repeated runs need not restore it */
+  k = kernel_compact(in->work, in->size, in->mask);
+  return checksum(in->work, (size_t)k) ^ (unsigned long)k;
+}
+
+static unsigned long run_encode(kb_input_t * in)
+{
+  kernel_encode(in->text, in->size, &kmap_nt, in->out);
+  return checksum(in->out, (size_t)in->size);
+}
+
+static unsigned long run_patterns(kb_input_t * in)
+{
+  unsigned short * pats = (unsigned short *)in->out;
+  long n = MIN(in->seqlen, in->size / (long)sizeof(unsigned short));
+
+  kernel_site_patterns(in->seq, n, &kmap_nt, pats);
+  return checksum(pats, (size_t)n * sizeof(unsigned short));
+}
+
+static unsigned long run_states(kb_input_t * in)
+{
+  kernel_site_states(in->seq, 8, in->seqlen, &kmap_nt, in->out,
+                     in->out + in->seqlen, in->out + 2*in->seqlen);
+  return checksum(in->out, (size_t)(3*in->seqlen));
+}
+
+static unsigned long run_bitslice(kb_input_t * in)
+{
+  long j;
+
+  for (j = 0; j < 8; ++j)
+    kernel_bitslice(in->seq[j], in->seqlen, &kmap_nt,
+                    in->slices + j*in->words);
+  return checksum(in->slices, (size_t)(8*in->words) * sizeof(unsigned long));
+}
+
+static unsigned long run_pairdiff(kb_input_t * in)
+{
+  long i,j;
+  long d4, sites;
+  unsigned long h = 0;
+
+  for (i = 0; i < 8; ++i)
+    for (j = i+1; j < 8; ++j)
+    {
+      kernel_pair_diffs(in->slices + i*in->words, in->slices + j*in->words,
+                        in->words, 1, &d4, &sites);
+      h = h*31 + (unsigned long)(d4 ^ (sites << 32));
+    }
+
+  return h;
+}
+
+/* the first two bit-sliced words serve as the reference site, and the two
+   halves of the bit-sliced sequences as the bitsets of one-word sites */
+static long ld_sites(kb_input_t * in)
+{
+  return MIN(4*in->words, in->size / (4*(long)sizeof(unsigned int)));
+}
+
+static unsigned long run_ld(kb_input_t * in)
+{
+  long sites = ld_sites(in);
+  unsigned int * counts = (unsigned int *)in->out;
+
+  kernel_ld_counts(in->slices, in->slices + 1, in->slices,
+                   in->slices + 4*in->words, sites, 1, counts);
+  return checksum(counts, (size_t)(4*sites) * sizeof(unsigned int));
+}
+
+static unsigned long run_alleles(kb_input_t * in)
+{
+  long j;
+
+  memset(in->counts, 0, (size_t)(5*in->seqlen) * sizeof(unsigned short));
+  for (j = 0; j < 8; ++j)
+    kernel_allele_counts(in->seq[j], in->seqlen, &kmap_nt,
+                         (const unsigned char (*)[16])copies_tbl, in->counts);
+  return checksum(in->counts,
+                  (size_t)(5*in->seqlen) * sizeof(unsigned short));
+}
+
+static unsigned long run_classes(kb_input_t * in)
+{
+  unsigned long counts[16];
+
+  memset(counts, 0, 16*sizeof(unsigned long));
+  kernel_class_counts(in->text, in->size, &kmap_nt, 16, counts);
+  return checksum(counts, 16*sizeof(unsigned long));
+}
+
+static unsigned long run_mismatch(kb_input_t * in)
+{
+  long i,j;
+  static unsigned int counts[128*128];
+
+  /* raw characters serve as states */
+  memset(counts, 0, 128*128*sizeof(unsigned int));
+  for (i = 0; i < 8; ++i)
+    for (j = i+1; j < 8; ++j)
+      kernel_mismatch_histogram((const unsigned char *)in->seq[i],
+                                (const unsigned char *)in->seq[j],
+                                in->seqlen, 128, counts);
+  return checksum(counts, 128*128*sizeof(unsigned int));
+}
+
+static unsigned long run_dstat(kb_input_t * in)
+{
+  double abba, baba;
+
+  kernel_dstat_accumulate(in->pats, in->sites, abba_tbl, baba_tbl,
+                          &abba, &baba);
+  return checksum(&abba, sizeof(double)) ^ checksum(&baba, sizeof(double));
+}
+
+static unsigned long run_hash(kb_input_t * in)
+{
+  long j;
+  unsigned long h = 0;
+
+  for (j = 0; j < 8; ++j)
+    h = h*31 + kernel_hash(in->seq[j], in->seqlen - j);
+
+  return h;
+}
+
+static unsigned long run_labels(kb_input_t * in)
+{
+  long i,k;
+  unsigned long h = 0;
+
+  for (i = 0; i < in->labels_count; ++i)
+  {
+    const char * x = in->labels[i];
+    long xlen = (long)strlen(x);
+
+    for (k = 0; k < 4; ++k)
+    {
+      long slen = (long)strlen(species[k]);
+      if (slen <= xlen && kernel_memeq(x+xlen-slen, species[k], slen))
+        break;
+    }
+    h = h*5 + (unsigned long)k;
+  }
+
+  return h;
+}
+
+static long bytes_text(kb_input_t * in)   { return in->size; }
+static long bytes_mark(kb_input_t * in)   { return 8*in->seqlen; }
+static long items_mark(kb_input_t * in)   { return in->seqlen; }
+static long bytes_pats(kb_input_t * in)
+{
+  return 4*MIN(in->seqlen, in->size / (long)sizeof(unsigned short));
+}
+static long items_pats(kb_input_t * in)
+{
+  return MIN(in->seqlen, in->size / (long)sizeof(unsigned short));
+}
+static long bytes_pairs(kb_input_t * in)
+{
+  return 28*2*in->words * (long)sizeof(unsigned long);
+}
+static long items_pairs(kb_input_t * in)  { return 28*in->seqlen; }
+static long bytes_ld(kb_input_t * in)
+{
+  return 2*ld_sites(in) * (long)sizeof(unsigned long);
+}
+static long items_ld(kb_input_t * in)     { return ld_sites(in); }
+static long bytes_seqs(kb_input_t * in)   { return 2*28*in->seqlen; }
+static long bytes_dstat(kb_input_t * in)
+{
+  return in->sites * (long)sizeof(unsigned short);
+}
+static long items_dstat(kb_input_t * in)  { return in->sites; }
+static long bytes_labels(kb_input_t * in) { return in->label_bytes; }
+static long items_labels(kb_input_t * in) { return in->labels_count; }
+
+static kb_kernel_t kernels[] =
+{
+  { "classify",  "byte",  run_classify, bytes_text,   bytes_text   },
+  { "ambiguity", "site",  run_mark,     bytes_mark,   items_mark   },
+  { "missing",   "site",  run_missing,  bytes_mark,   items_mark   },
+  { "compact",   "byte",  run_compact,  bytes_text,   bytes_text   },
+  { "encode",    "byte",  run_encode,   bytes_text,   bytes_text   },
+  { "patterns",  "site",  run_patterns, bytes_pats,   items_pats   },
+  { "states",    "site",  run_states,   bytes_mark,   items_mark   },
+  { "bitslice",  "site",  run_bitslice, bytes_mark,   items_mark   },
+  { "pairdiff",  "site",  run_pairdiff, bytes_pairs,  items_pairs  },
+  { "ld",        "pair",  run_ld,       bytes_ld,     items_ld     },
+  { "alleles",   "site",  run_alleles,  bytes_mark,   items_mark   },
+  { "classes",   "byte",  run_classes,  bytes_text,   bytes_text   },
+  { "mismatch",  "site",  run_mismatch, bytes_seqs,   items_pairs  },
+  { "abbababa",  "site",  run_dstat,    bytes_dstat,  items_dstat  },
+  { "hash",      "byte",  run_hash,     bytes_mark,   bytes_mark   },
+  { "labels",    "label", run_labels,   bytes_labels, items_labels }
+};
+
+static double now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static long arch_supported(long arch)
+{
+  if (arch == PLL_ATTRIB_ARCH_CPU)
+    return 1;
+  if (arch == PLL_ATTRIB_ARCH_SSE)
+    return ssse3_present;
+#ifdef HAVE_AVX
+  if (arch == PLL_ATTRIB_ARCH_AVX)
+    return avx_present;
+#endif
+#ifdef HAVE_AVX2
+  if (arch == PLL_ATTRIB_ARCH_AVX2)
+    return avx2_present;
+#endif
+
+  return 0;
+}
+
+static const char * arch_name(long arch)
+{
+  switch (arch)
+  {
+    case PLL_ATTRIB_ARCH_CPU:
+      return "cpu";
+    case PLL_ATTRIB_ARCH_SSE:
+      return "sse";
+    case PLL_ATTRIB_ARCH_AVX:
+      return "avx";
+    case PLL_ATTRIB_ARCH_AVX2:
+      return "avx2";
+  }
+  return "unknown";
+}
+
+/* returns number of mismatches against the scalar reference */
+static long bench_input(kb_input_t * in, const char * input_name, FILE * csv)
+{
+  long i,j,r;
+  long reps;
+  long errors = 0;
+  long archs[4] = { PLL_ATTRIB_ARCH_CPU, PLL_ATTRIB_ARCH_SSE,
+                    PLL_ATTRIB_ARCH_AVX, PLL_ATTRIB_ARCH_AVX2 };
+
+  for (i = 0; i < (long)(sizeof(kernels)/sizeof(kb_kernel_t)); ++i)
+  {
+    kb_kernel_t * k = kernels + i;
+    unsigned long reference = 0;
+    double ref_time = 0;
+
+    for (j = 0; j < 4; ++j)
+    {
+      unsigned long h;
+      double t,elapsed;
+      uint64_t cycles;
+      const char * status;
+
+      if (!arch_supported(archs[j]))
+        continue;
+
+      kernel_setarch(archs[j]);
+
+      /* correctness: compaction starts from the original sequence data */
+      memcpy(in->work, in->text, (size_t)in->size);
+      h = k->run(in);
+      if (archs[j] == PLL_ATTRIB_ARCH_CPU)
+        reference = h;
+      status = (h == reference) ? "ok" : "MISMATCH";
+      if (h != reference)
+        errors++;
+
+      /* calibrate number of repetitions */
+      for (reps = 1; ; reps *= 2)
+      {
+        t = now();
+        uint64_t c0 = __rdtsc();
+        for (r = 0; r < reps; ++r)
+          k->run(in);
+        cycles = __rdtsc() - c0;
+        elapsed = now() - t;
+
+        if (elapsed >= opt_mintime)
+          break;
+      }
+
+      double bytes = (double)k->bytes(in) * reps;
+      double items = (double)k->items(in) * reps;
+
+      if (archs[j] == PLL_ATTRIB_ARCH_CPU)
+        ref_time = elapsed / reps;
+
+      printf("%-10s %-5s %-7s %12ld %10.3f %-5s %10.3f %9.3f %8.2fx  %s\n",
+             k->name, arch_name(archs[j]), input_name, k->bytes(in),
+             elapsed * 1e9 / items, k->unit, cycles / bytes,
+             bytes / elapsed / (1024*1024*1024), ref_time / (elapsed / reps),
+             status);
+
+      if (csv)
+        fprintf(csv, "%s,%s,%s,%ld,%s,%.6f,%.6f,%.6f,%s\n",
+                k->name, arch_name(archs[j]), input_name, k->bytes(in),
+                k->unit, elapsed * 1e9 / items, cycles / bytes,
+                bytes / elapsed / (1024*1024*1024), status);
+    }
+  }
+
+  return errors;
+}
+
+static void tables_init()
+{
+  long i;
+
+  kernel_lut_init(&lut_legal, pll_map_fasta, 1);
+  kernel_lut_init(&lut_amb, pll_map_amb, 1);
+  kernel_lut_init(&lut_missing, pll_map_nt_missing, 1);
+  kernel_map_init(&kmap_nt, pll_map_nt);
+
+  /* diploid allele copies, as used for site frequency spectra */
+  for (i = 0; i < 16; ++i)
+  {
+    long a;
+    long copies = PLL_POPCOUNT((unsigned int)i);
+
+    for (a = 0; a < 4; ++a)
+      if ((i & (1 << a)) && copies <= 2)
+        copies_tbl[a][i] = (unsigned char)(3 - copies);
+    copies_tbl[4][i] = copies <= 2 && copies ? 2 : 0;
+  }
+
+  /* arbitrary scores; only the summation matters here */
+  abba_tbl = (double *)xmalloc(65536 * sizeof(double));
+  baba_tbl = (double *)xmalloc(65536 * sizeof(double));
+  for (i = 0; i < 65536; ++i)
+  {
+    abba_tbl[i] = (arch_random() % 1000) / 997.0;
+    baba_tbl[i] = (arch_random() % 1000) / 991.0;
+  }
+}
+
+int main(int argc, char * argv[])
+{
+  long errors = 0;
+  FILE * csv = NULL;
+  kb_input_t in;
+
+  args_init(argc, argv);
+
+  arch_srandom(opt_rngseed);
+  cpu_features_detect();
+  tables_init();
+
+  if (opt_csv)
+  {
+    csv = xopen(opt_csv, "w");
+    fprintf(csv, "kernel,isa,input,bytes,unit,ns_per_unit,cycles_per_byte,"
+                 "gb_per_sec,status\n");
+  }
+
+  printf("%-10s %-5s %-7s %12s %10s %-5s %10s %9s %9s  %s\n",
+         "Kernel", "ISA", "Input", "Bytes", "ns", "unit", "cyc/byte",
+         "GB/s", "Speedup", "Check");
+
+  input_init(&in, opt_small);
+  errors += bench_input(&in, "cache", csv);
+  input_destroy(&in);
+
+  input_init(&in, opt_large);
+  errors += bench_input(&in, "memory", csv);
+  input_destroy(&in);
+
+  if (csv)
+    fclose(csv);
+
+  free(abba_tbl);
+  free(baba_tbl);
+  if (opt_csv)
+    free(opt_csv);
+
+  if (errors)
+    fatal("%ld kernel variants differ from the scalar reference", errors);
+
+  return 0;
+}
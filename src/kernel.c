@@ -0,0 +1,828 @@
+/*
+    Copyright (C) 2022-2023 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London, Gower Street, London WC1E 6BT, England
+*/
+
+#include "libbpptools.h"
+
+/* Inner kernels and their dispatch. The *_cpu functions are the scalar
+   reference implementations; vectorized variants live in kernel_sse.c,
+   kernel_avx.c and kernel_avx2.c and must produce identical results. */
+
+static long kernel_arch = PLL_ATTRIB_ARCH_CPU;
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+static void set_arch(long arch)
+{
+  /* the 128-bit integer kernels require pshufb */
+  if (arch == PLL_ATTRIB_ARCH_SSE && !ssse3_present)
+    arch = PLL_ATTRIB_ARCH_CPU;
+
+  kernel_arch = arch;
+}
+
+static void kernel_init_default(void)
+{
+  cpu_features_detect();
+  set_arch(cpu_bestarch());
+}
+
+/* detect the CPU and select the best instruction set, once per process */
+void kernel_init()
+{
+  pthread_once(&kernel_once, kernel_init_default);
+}
+
+/* override the instruction set; must be called before any threads use the
+   kernels */
+void kernel_setarch(long arch)
+{
+  kernel_init();
+  set_arch(arch);
+}
+
+long kernel_getarch()
+{
+  return kernel_arch;
+}
+
+/* build nibble tables such that byte c < 128 is in the class iff
+   lo[c & 0xf] & hi[c >> 4] is non-zero */
+void kernel_lut_init(kernel_lut_t * lut,
+                     const unsigned int * map,
+                     unsigned int value)
+{
+  long c;
+
+  memset(lut, 0, sizeof(kernel_lut_t));
+
+  for (c = 0; c < 8; ++c)
+    lut->hi[c] = (unsigned char)(1 << c);
+
+  for (c = 0; c < 128; ++c)
+    if (map[c] == value)
+      lut->lo[c & 0xf] |= (unsigned char)(1 << (c >> 4));
+}
+
+/* split a byte map into one 16-entry table per distinct non-zero row of
+   the upper nibble; bytes >= 128 always map to zero */
+void kernel_map_init(kernel_map_t * kmap, const unsigned int * map)
+{
+  long h,l,t;
+
+  memset(kmap, 0, sizeof(kernel_map_t));
+
+  for (h = 0; h < 8; ++h)
+  {
+    unsigned char row[16];
+    long nonzero = 0;
+
+    for (l = 0; l < 16; ++l)
+    {
+      assert(map[(h << 4) | l] < 256);
+      row[l] = (unsigned char)map[(h << 4) | l];
+      kmap->full[(h << 4) | l] = row[l];
+      nonzero |= row[l];
+    }
+
+    if (!nonzero) continue;
+
+    /* reuse identical rows, e.g. upper and lower case letters */
+    for (t = 0; t < kmap->tables; ++t)
+      if (!memcmp(kmap->table[t], row, 16))
+        break;
+
+    if (t == kmap->tables)
+      memcpy(kmap->table[kmap->tables++], row, 16);
+
+    kmap->hi_index[h] = (unsigned char)(t+1);
+  }
+}
+
+/* scalar reference implementations */
+
+long kernel_legal_prefix_cpu(const char * s, long n, const kernel_lut_t * lut)
+{
+  long i;
+
+  for (i = 0; i < n; ++i)
+  {
+    unsigned char c = (unsigned char)s[i];
+    if (!(lut->lo[c & 0xf] & lut->hi[c >> 4]))
+      break;
+  }
+
+  return i;
+}
+
+void kernel_mark_columns_cpu(char ** seq,
+                             long count,
+                             long length,
+                             const kernel_lut_t * lut,
+                             unsigned char * mask)
+{
+  long i,j;
+
+  memset(mask, 0, (size_t)length);
+
+  for (j = 0; j < count; ++j)
+    for (i = 0; i < length; ++i)
+    {
+      unsigned char c = (unsigned char)seq[j][i];
+      if (lut->lo[c & 0xf] & lut->hi[c >> 4])
+        mask[i] = 1;
+    }
+}
+
+/* number of sequences with a character of the class at each column (sites)
+   and number of such characters in each sequence (seqs) */
+void kernel_missing_counts_cpu(char ** seq,
+                               long count,
+                               long length,
+                               const kernel_lut_t * lut,
+                               unsigned int * sites,
+                               long * seqs)
+{
+  long i,j;
+
+  memset(sites, 0, (size_t)length * sizeof(unsigned int));
+
+  for (j = 0; j < count; ++j)
+  {
+    long missing = 0;
+
+    for (i = 0; i < length; ++i)
+    {
+      unsigned char c = (unsigned char)seq[j][i];
+      unsigned int m = (lut->lo[c & 0xf] & lut->hi[c >> 4]) != 0;
+
+      sites[i] += m;
+      missing += m;
+    }
+    seqs[j] = missing;
+  }
+}
+
+long kernel_compact_cpu(char * s, long length, const unsigned char * mask)
+{
+  long i,k;
+
+  for (i = 0, k = 0; i < length; ++i)
+    if (!mask[i])
+      s[k++] = s[i];
+
+  return k;
+}
+
+void kernel_encode_cpu(const char * s,
+                       long n,
+                       const kernel_map_t * kmap,
+                       unsigned char * out)
+{
+  long i;
+
+  for (i = 0; i < n; ++i)
+  {
+    unsigned char c = (unsigned char)s[i];
+    out[i] = c < 128 ? kmap->full[c] : 0;
+  }
+}
+
+void kernel_site_patterns_cpu(char ** seq,
+                              long n,
+                              const kernel_map_t * kmap,
+                              unsigned short * pats)
+{
+  long i,j;
+
+  for (i = 0; i < n; ++i)
+  {
+    unsigned int code = 0;
+    for (j = 0; j < 4; ++j)
+    {
+      unsigned char c = (unsigned char)seq[j][i];
+      code |= (unsigned int)(c < 128 ? kmap->full[c] : 0) << (4*j);
+    }
+    pats[i] = (unsigned short)code;
+  }
+}
+
+/* sites are accumulated into four lanes by index modulo 4 and the lanes are
+   added as (l0+l1)+(l2+l3); vectorized variants use the same association
+   such that results are bitwise identical */
+void kernel_dstat_accumulate_cpu(const unsigned short * pats,
+                                 long n,
+                                 const double * abba_tbl,
+                                 const double * baba_tbl,
+                                 double * abba,
+                                 double * baba)
+{
+  long i;
+  double a[4] = {0,0,0,0};
+  double b[4] = {0,0,0,0};
+
+  for (i = 0; i < n; ++i)
+  {
+    a[i & 3] += abba_tbl[pats[i]];
+    b[i & 3] += baba_tbl[pats[i]];
+  }
+
+  *abba = (a[0] + a[1]) + (a[2] + a[3]);
+  *baba = (b[0] + b[1]) + (b[2] + b[3]);
+}
+
+/* 4-bit nucleotide codes reduced to single states, and flagged if they are
+   ambiguous (more than one state) */
+const unsigned char kernel_nt_single[16] = {0,1,2,0,4,0,0,0,8,0,0,0,0,0,0,0};
+const unsigned char kernel_nt_multi[16] = {0,0,0,1,0,1,1,1,0,1,1,1,1,1,1,1};
+
+void kernel_site_states_cpu(char ** seq,
+                            long count,
+                            long length,
+                            const kernel_map_t * kmap,
+                            unsigned char * once,
+                            unsigned char * twice,
+                            unsigned char * amb)
+{
+  long i,j;
+
+  memset(once, 0, (size_t)length);
+  memset(twice, 0, (size_t)length);
+  memset(amb, 0, (size_t)length);
+
+  for (j = 0; j < count; ++j)
+    for (i = 0; i < length; ++i)
+    {
+      unsigned char c = (unsigned char)seq[j][i];
+      unsigned char e = c < 128 ? kmap->full[c] : 0;
+      unsigned char s = kernel_nt_single[e & 0xf];
+
+      twice[i] |= once[i] & s;
+      once[i] |= s;
+      amb[i] |= kernel_nt_multi[e & 0xf];
+    }
+}
+
+/* two-fold ambiguity codes, i.e. heterozygotes */
+const unsigned char kernel_nt_double[16] = {0,0,0,1,0,1,1,0,0,1,1,0,1,0,0,0};
+
+/* Bit-sliced 4-bit codes: each block of 64 sites is stored as six words,
+   the four bit planes of the codes followed by the masks of single-state
+   and of two-fold codes. Sites past the end are zero. */
+static void bitslice_block(const char * s,
+                           long n,
+                           const kernel_map_t * kmap,
+                           unsigned long * out)
+{
+  long i,b;
+
+  memset(out, 0, 6*sizeof(unsigned long));
+
+  for (i = 0; i < n; ++i)
+  {
+    unsigned char c = (unsigned char)s[i];
+    unsigned char e = c < 128 ? kmap->full[c] & 0xf : 0;
+    unsigned long bit = 1UL << i;
+
+    for (b = 0; b < 4; ++b)
+      if (e & (1 << b))
+        out[b] |= bit;
+    if (kernel_nt_single[e])
+      out[4] |= bit;
+    if (kernel_nt_double[e])
+      out[5] |= bit;
+  }
+}
+
+void kernel_bitslice_cpu(const char * s,
+                         long n,
+                         const kernel_map_t * kmap,
+                         unsigned long * out)
+{
+  long i;
+
+  for (i = 0; i < n; i += 64)
+    bitslice_block(s+i, MIN(64,n-i), kmap, out + 6*(i/64));
+}
+
+/* Differences between two bit-sliced sequences, in quarters. Without
+   'half' only single-state sites are compared; otherwise two-fold codes
+   are included and a site contributes the probability that two alleles
+   drawn from the two codes differ, e.g. 1/2 for A and R */
+void kernel_pair_diffs_cpu(const unsigned long * a,
+                           const unsigned long * b,
+                           long words,
+                           long half,
+                           long * diff4,
+                           long * sites)
+{
+  long w;
+  long d = 0;
+  long v = 0;
+
+  for (w = 0; w < words; w += 6)
+  {
+    unsigned long i0 = a[w]   & b[w];
+    unsigned long i1 = a[w+1] & b[w+1];
+    unsigned long i2 = a[w+2] & b[w+2];
+    unsigned long i3 = a[w+3] & b[w+3];
+    unsigned long s1 = i0 | i1 | i2 | i3;
+    unsigned long ss = a[w+4] & b[w+4];
+
+    d += 4*PLL_POPCOUNTL(ss & ~s1);
+    v += PLL_POPCOUNTL(ss);
+
+    if (!half) continue;
+
+    unsigned long s2 = (i0 & (i1|i2|i3)) | (i1 & (i2|i3)) | (i2 & i3);
+    unsigned long sh = (a[w+4] & b[w+5]) | (a[w+5] & b[w+4]);
+    unsigned long hh = a[w+5] & b[w+5];
+
+    d += 4*PLL_POPCOUNTL(sh) - 2*PLL_POPCOUNTL(sh & s1) +
+         4*PLL_POPCOUNTL(hh) - PLL_POPCOUNTL(hh & s1) - PLL_POPCOUNTL(hh & s2);
+    v += PLL_POPCOUNTL(sh) + PLL_POPCOUNTL(hh);
+  }
+
+  *diff4 = d;
+  *sites = v;
+}
+
+/* Add the allele copies of a sequence to per-site counters. tbl[a][e] is
+   the number of copies of nucleotide a (A,C,G,T) carried by code e and
+   tbl[4][e] the total number of copies; counts holds five rows of n
+   counters in the same order */
+void kernel_allele_counts_cpu(const char * s,
+                              long n,
+                              const kernel_map_t * kmap,
+                              const unsigned char (*tbl)[16],
+                              unsigned short * counts)
+{
+  long i,a;
+
+  for (i = 0; i < n; ++i)
+  {
+    unsigned char c = (unsigned char)s[i];
+    unsigned char e = c < 128 ? kmap->full[c] & 0xf : 0;
+
+    for (a = 0; a < 5; ++a)
+      counts[a*n+i] += tbl[a][e];
+  }
+}
+
+/* Add the number of bytes of s in each class to counts; the class of a byte
+   is its value in kmap and must be less than 'classes' */
+void kernel_class_counts_cpu(const char * s,
+                             long n,
+                             const kernel_map_t * kmap,
+                             long classes,
+                             unsigned long * counts)
+{
+  long i;
+
+  (void) classes;
+
+  for (i = 0; i < n; ++i)
+  {
+    unsigned char c = (unsigned char)s[i];
+    counts[c < 128 ? kmap->full[c] : 0]++;
+  }
+}
+
+void kernel_mismatch_histogram_cpu(const unsigned char * a,
+                                    const unsigned char * b,
+                                    long n,
+                                    long states,
+                                    unsigned int * counts)
+{
+  long i;
+
+  for (i = 0; i < n; ++i)
+    counts[a[i]*states + b[i]] += (a[i] != b[i]);
+}
+
+/* Allele counts of site i against each of 'sites' consecutive sites, both
+   given as bitsets over sequences of those with data (p) and those with the
+   first allele (x): sequences with data at both sites, first allele at i,
+   first allele at j, and first allele at both */
+void kernel_ld_counts_cpu(const unsigned long * pi,
+                          const unsigned long * xi,
+                          const unsigned long * p,
+                          const unsigned long * x,
+                          long sites,
+                          long words,
+                          unsigned int * counts)
+{
+  long j,w;
+
+  for (j = 0; j < sites; ++j)
+  {
+    const unsigned long * pj = p + j*words;
+    const unsigned long * xj = x + j*words;
+    unsigned int n = 0, na = 0, nb = 0, nab = 0;
+
+    for (w = 0; w < words; ++w)
+    {
+      unsigned long v = pi[w] & pj[w];
+
+      n   += (unsigned int)PLL_POPCOUNTL(v);
+      na  += (unsigned int)PLL_POPCOUNTL(v & xi[w]);
+      nb  += (unsigned int)PLL_POPCOUNTL(v & xj[w]);
+      nab += (unsigned int)PLL_POPCOUNTL(v & xi[w] & xj[w]);
+    }
+
+    counts[4*j]   = n;
+    counts[4*j+1] = na;
+    counts[4*j+2] = nb;
+    counts[4*j+3] = nab;
+  }
+}
+
+/* 64-bit hash of a byte string in four independent lanes of 8 bytes, such
+   that the lanes map onto the elements of a vector register. Each lane adds
+   its data and the 32x32-bit product of the two halves of the data mixed
+   with a per-lane key, which is advanced after every 32-byte block so that
+   swapped blocks do not hash alike. The lanes and the remaining bytes are
+   folded by kernel_hash_finish. Not a cryptographic hash; equal hashes must
+   be confirmed by comparing the strings. */
+const unsigned long kernel_hash_keys[4] = { 0x243f6a8885a308d3UL,
+                                            0x13198a2e03707344UL,
+                                            0xa4093822299f31d0UL,
+                                            0x082efa98ec4e6c89UL };
+
+unsigned long kernel_hash_finish(const unsigned long * acc,
+                                 const char * s,
+                                 long n,
+                                 long length)
+{
+  long k;
+  unsigned long hash = (unsigned long)length;
+
+  for (k = 0; k < 4; ++k)
+  {
+    hash = (hash ^ acc[k]) * 0x9e3779b97f4a7c15UL;
+    hash ^= hash >> 32;
+  }
+
+  return hash_bytes(s, (size_t)n, hash);
+}
+
+unsigned long kernel_hash_cpu(const char * s, long n)
+{
+  long i,k;
+  unsigned long w,x;
+  unsigned long acc[4];
+  unsigned long key[4];
+
+  for (k = 0; k < 4; ++k)
+    acc[k] = key[k] = kernel_hash_keys[k];
+
+  for (i = 0; i + 32 <= n; i += 32)
+  {
+    for (k = 0; k < 4; ++k)
+    {
+      memcpy(&w, s+i+8*k, 8);
+      x = w ^ key[k];
+      acc[k] += w + (x & 0xffffffff) * (x >> 32);
+      key[k] += KERNEL_HASH_STEP;
+    }
+  }
+
+  return kernel_hash_finish(acc, s+i, n-i, n);
+}
+
+long kernel_memeq_cpu(const char * a, const char * b, long n)
+{
+  long i;
+
+  for (i = 0; i < n; ++i)
+    if (a[i] != b[i])
+      return 0;
+
+  return 1;
+}
+
+/* dispatch */
+
+long kernel_legal_prefix(const char * s, long n, const kernel_lut_t * lut)
+{
+#ifdef HAVE_AVX2
+  if (kernel_arch == PLL_ATTRIB_ARCH_AVX2)
+    return kernel_legal_prefix_avx2(s,n,lut);
+#endif
+  if (kernel_arch == PLL_ATTRIB_ARCH_SSE || kernel_arch == PLL_ATTRIB_ARCH_AVX)
+    return kernel_legal_prefix_sse(s,n,lut);
+
+  return kernel_legal_prefix_cpu(s,n,lut);
+}
+
+void kernel_mark_columns(char ** seq,
+                         long count,
+                         long length,
+                         const kernel_lut_t * lut,
+                         unsigned char * mask)
+{
+#ifdef HAVE_AVX2
+  if (kernel_arch == PLL_ATTRIB_ARCH_AVX2)
+  {
+    kernel_mark_columns_avx2(seq,count,length,lut,mask);
+    return;
+  }
+#endif
+  if (kernel_arch == PLL_ATTRIB_ARCH_SSE || kernel_arch == PLL_ATTRIB_ARCH_AVX)
+  {
+    kernel_mark_columns_sse(seq,count,length,lut,mask);
+    return;
+  }
+
+  kernel_mark_columns_cpu(seq,count,length,lut,mask);
+}
+
+void kernel_missing_counts(char ** seq,
+                           long count,
+                           long length,
+                           const kernel_lut_t * lut,
+                           unsigned int * sites,
+                           long * seqs)
+{
+#ifdef HAVE_AVX2
+  if (kernel_arch == PLL_ATTRIB_ARCH_AVX2)
+  {
+    kernel_missing_counts_avx2(seq,count,length,lut,sites,seqs);
+    return;
+  }
+#endif
+  kernel_missing_counts_cpu(seq,count,length,lut,sites,seqs);
+}
+
+long kernel_compact(char * s, long length, const unsigned char * mask)
+{
+#ifdef HAVE_AVX2
+  if (kernel_arch == PLL_ATTRIB_ARCH_AVX2)
+    return kernel_compact_avx2(s,length,mask);
+#endif
+  if (kernel_arch == PLL_ATTRIB_ARCH_SSE || kernel_arch == PLL_ATTRIB_ARCH_AVX)
+    return kernel_compact_sse(s,length,mask);
+
+  return kernel_compact_cpu(s,length,mask);
+}
+
+void kernel_encode(const char * s,
+                   long n,
+                   const kernel_map_t * kmap,
+                   unsigned char * out)
+{
+#ifdef HAVE_AVX2
+  if (kernel_arch == PLL_ATTRIB_ARCH_AVX2)
+  {
+    kernel_encode_avx2(s,n,kmap,out);
+    return;
+  }
+#endif
+  if (kernel_arch == PLL_ATTRIB_ARCH_SSE || kernel_arch == PLL_ATTRIB_ARCH_AVX)
+  {
+    kernel_encode_sse(s,n,kmap,out);
+    return;
+  }
+
+  kernel_encode_cpu(s,n,kmap,out);
+}
+
+void kernel_site_patterns(char ** seq,
+                          long n,
+                          const kernel_map_t * kmap,
+                          unsigned short * pats)
+{
+#ifdef HAVE_AVX2
+  if (kernel_arch == PLL_ATTRIB_ARCH_AVX2)
+  {
+    kernel_site_patterns_avx2(seq,n,kmap,pats);
+    return;
+  }
+#endif
+  if (kernel_arch == PLL_ATTRIB_ARCH_SSE || kernel_arch == PLL_ATTRIB_ARCH_AVX)
+  {
+    kernel_site_patterns_sse(seq,n,kmap,pats);
+    return;
+  }
+
+  kernel_site_patterns_cpu(seq,n,kmap,pats);
+}
+
+void kernel_dstat_accumulate(const unsigned short * pats,
+                             long n,
+                             const double * abba_tbl,
+                             const double * baba_tbl,
+                             double * abba,
+                             double * baba)
+{
+#ifdef HAVE_AVX2
+  if (kernel_arch == PLL_ATTRIB_ARCH_AVX2)
+  {
+    kernel_dstat_accumulate_avx2(pats,n,abba_tbl,baba_tbl,abba,baba);
+    return;
+  }
+#endif
+#ifdef HAVE_AVX
+  if (kernel_arch == PLL_ATTRIB_ARCH_AVX)
+  {
+    kernel_dstat_accumulate_avx(pats,n,abba_tbl,baba_tbl,abba,baba);
+    return;
+  }
+#endif
+  if (kernel_arch == PLL_ATTRIB_ARCH_SSE)
+  {
+    kernel_dstat_accumulate_sse(pats,n,abba_tbl,baba_tbl,abba,baba);
+    return;
+  }
+
+  kernel_dstat_accumulate_cpu(pats,n,abba_tbl,baba_tbl,abba,baba);
+}
+
+void kernel_site_states(char ** seq,
+                        long count,
+                        long length,
+                        const kernel_map_t * kmap,
+                        unsigned char * once,
+                        unsigned char * twice,
+                        unsigned char * amb)
+{
+#ifdef HAVE_AVX2
+  if (kernel_arch == PLL_ATTRIB_ARCH_AVX2)
+  {
+    kernel_site_states_avx2(seq,count,length,kmap,once,twice,amb);
+    return;
+  }
+#endif
+  if (kernel_arch == PLL_ATTRIB_ARCH_SSE || kernel_arch == PLL_ATTRIB_ARCH_AVX)
+  {
+    kernel_site_states_sse(seq,count,length,kmap,once,twice,amb);
+    return;
+  }
+
+  kernel_site_states_cpu(seq,count,length,kmap,once,twice,amb);
+}
+
+void kernel_bitslice(const char * s,
+                     long n,
+                     const kernel_map_t * kmap,
+                     unsigned long * out)
+{
+#ifdef HAVE_AVX2
+  if (kernel_arch == PLL_ATTRIB_ARCH_AVX2)
+  {
+    kernel_bitslice_avx2(s,n,kmap,out);
+    return;
+  }
+#endif
+  if (kernel_arch == PLL_ATTRIB_ARCH_SSE || kernel_arch == PLL_ATTRIB_ARCH_AVX)
+  {
+    kernel_bitslice_sse(s,n,kmap,out);
+    return;
+  }
+
+  kernel_bitslice_cpu(s,n,kmap,out);
+}
+
+/* the vectorized variant only differs in using the popcnt instruction */
+void kernel_pair_diffs(const unsigned long * a,
+                       const unsigned long * b,
+                       long words,
+                       long half,
+                       long * diff4,
+                       long * sites)
+{
+#ifdef HAVE_AVX2
+  if (kernel_arch == PLL_ATTRIB_ARCH_AVX2)
+  {
+    kernel_pair_diffs_avx2(a,b,words,half,diff4,sites);
+    return;
+  }
+#endif
+
+  kernel_pair_diffs_cpu(a,b,words,half,diff4,sites);
+}
+
+void kernel_ld_counts(const unsigned long * pi,
+                      const unsigned long * xi,
+                      const unsigned long * p,
+                      const unsigned long * x,
+                      long sites,
+                      long words,
+                      unsigned int * counts)
+{
+#ifdef HAVE_AVX2
+  if (kernel_arch == PLL_ATTRIB_ARCH_AVX2)
+  {
+    kernel_ld_counts_avx2(pi,xi,p,x,sites,words,counts);
+    return;
+  }
+#endif
+
+  kernel_ld_counts_cpu(pi,xi,p,x,sites,words,counts);
+}
+
+void kernel_allele_counts(const char * s,
+                          long n,
+                          const kernel_map_t * kmap,
+                          const unsigned char (*tbl)[16],
+                          unsigned short * counts)
+{
+#ifdef HAVE_AVX2
+  if (kernel_arch == PLL_ATTRIB_ARCH_AVX2)
+  {
+    kernel_allele_counts_avx2(s,n,kmap,tbl,counts);
+    return;
+  }
+#endif
+  if (kernel_arch == PLL_ATTRIB_ARCH_SSE || kernel_arch == PLL_ATTRIB_ARCH_AVX)
+  {
+    kernel_allele_counts_sse(s,n,kmap,tbl,counts);
+    return;
+  }
+
+  kernel_allele_counts_cpu(s,n,kmap,tbl,counts);
+}
+
+void kernel_class_counts(const char * s,
+                         long n,
+                         const kernel_map_t * kmap,
+                         long classes,
+                         unsigned long * counts)
+{
+#ifdef HAVE_AVX2
+  if (kernel_arch == PLL_ATTRIB_ARCH_AVX2)
+  {
+    kernel_class_counts_avx2(s,n,kmap,classes,counts);
+    return;
+  }
+#endif
+  if (kernel_arch == PLL_ATTRIB_ARCH_SSE || kernel_arch == PLL_ATTRIB_ARCH_AVX)
+  {
+    kernel_class_counts_sse(s,n,kmap,classes,counts);
+    return;
+  }
+
+  kernel_class_counts_cpu(s,n,kmap,classes,counts);
+}
+
+/* Histogram of the state pairs (a[i],b[i]) at the sites where the two
+   encoded sequences differ; pairs of identical states are left to the
+   caller, who can derive them from the state counts of each sequence */
+void kernel_mismatch_histogram(const unsigned char * a,
+                               const unsigned char * b,
+                               long n,
+                               long states,
+                               unsigned int * counts)
+{
+#ifdef HAVE_AVX2
+  if (kernel_arch == PLL_ATTRIB_ARCH_AVX2)
+  {
+    kernel_mismatch_histogram_avx2(a,b,n,states,counts);
+    return;
+  }
+#endif
+  if (kernel_arch == PLL_ATTRIB_ARCH_SSE || kernel_arch == PLL_ATTRIB_ARCH_AVX)
+  {
+    kernel_mismatch_histogram_sse(a,b,n,states,counts);
+    return;
+  }
+
+  kernel_mismatch_histogram_cpu(a,b,n,states,counts);
+}
+
+unsigned long kernel_hash(const char * s, long n)
+{
+#ifdef HAVE_AVX2
+  if (kernel_arch == PLL_ATTRIB_ARCH_AVX2)
+    return kernel_hash_avx2(s,n);
+#endif
+  return kernel_hash_cpu(s,n);
+}
+
+long kernel_memeq(const char * a, const char * b, long n)
+{
+#ifdef HAVE_AVX2
+  if (kernel_arch == PLL_ATTRIB_ARCH_AVX2)
+    return kernel_memeq_avx2(a,b,n);
+#endif
+  if (kernel_arch == PLL_ATTRIB_ARCH_SSE || kernel_arch == PLL_ATTRIB_ARCH_AVX)
+    return kernel_memeq_sse(a,b,n);
+
+  return kernel_memeq_cpu(a,b,n);
+}
@@ -0,0 +1,63 @@
+/*
+    Copyright (C) 2022-2023 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London, Gower Street, London WC1E 6BT, England
+*/
+
+#include "libbpptools.h"
+
+/* AVX has no 256-bit integer instructions, so only the floating point
+   accumulation has a dedicated kernel; the byte kernels use the 128-bit
+   versions (see kernel.c) */
+
+void kernel_dstat_accumulate_avx(const unsigned short * pats,
+                                 long n,
+                                 const double * abba_tbl,
+                                 const double * baba_tbl,
+                                 double * abba,
+                                 double * baba)
+{
+  long i;
+  double a[4], b[4];
+  __m256d va = _mm256_setzero_pd();
+  __m256d vb = _mm256_setzero_pd();
+
+  for (i = 0; i + 4 <= n; i += 4)
+  {
+    va = _mm256_add_pd(va, _mm256_set_pd(abba_tbl[pats[i+3]],
+                                         abba_tbl[pats[i+2]],
+                                         abba_tbl[pats[i+1]],
+                                         abba_tbl[pats[i]]));
+    vb = _mm256_add_pd(vb, _mm256_set_pd(baba_tbl[pats[i+3]],
+                                         baba_tbl[pats[i+2]],
+                                         baba_tbl[pats[i+1]],
+                                         baba_tbl[pats[i]]));
+  }
+
+  _mm256_storeu_pd(a, va);
+  _mm256_storeu_pd(b, vb);
+
+  for (; i < n; ++i)
+  {
+    a[i & 3] += abba_tbl[pats[i]];
+    b[i & 3] += baba_tbl[pats[i]];
+  }
+
+  *abba = (a[0] + a[1]) + (a[2] + a[3]);
+  *baba = (b[0] + b[1]) + (b[2] + b[3]);
+}
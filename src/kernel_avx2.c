@@ -0,0 +1,684 @@
+/*
+    Copyright (C) 2022-2023 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London, Gower Street, London WC1E 6BT, England
+*/
+
+#include "libbpptools.h"
+
+/* 256-bit kernels; pshufb operates within 128-bit lanes, hence all nibble
+   tables are broadcast to both lanes */
+
+#define KERNEL_TILE 4096
+
+static inline __m256i classify32(__m256i v, __m256i lo_tbl, __m256i hi_tbl)
+{
+  __m256i nibble = _mm256_set1_epi8(0x0f);
+  __m256i lo = _mm256_and_si256(v, nibble);
+  __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v,4), nibble);
+
+  return _mm256_and_si256(_mm256_shuffle_epi8(lo_tbl,lo),
+                          _mm256_shuffle_epi8(hi_tbl,hi));
+}
+
+static inline __m256i load_table(const unsigned char * t)
+{
+  return _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)t));
+}
+
+long kernel_legal_prefix_avx2(const char * s, long n, const kernel_lut_t * lut)
+{
+  long i;
+  __m256i zero = _mm256_setzero_si256();
+  __m256i lo_tbl = load_table(lut->lo);
+  __m256i hi_tbl = load_table(lut->hi);
+
+  for (i = 0; i + 32 <= n; i += 32)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(s+i));
+    __m256i r = classify32(v, lo_tbl, hi_tbl);
+    unsigned int illegal =
+      (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(r,zero));
+
+    if (illegal)
+      return i + PLL_CTZ(illegal);
+  }
+
+  /* classify the tail with an overlapping vector ending at n, as short
+     lines (e.g. interleaved blocks) would otherwise be mostly scalar */
+  if (i < n && n >= 32)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(s+n-32));
+    __m256i r = classify32(v, lo_tbl, hi_tbl);
+    unsigned int illegal =
+      (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(r,zero));
+
+    return illegal ? n - 32 + PLL_CTZ(illegal) : n;
+  }
+
+  return i + kernel_legal_prefix_sse(s+i, n-i, lut);
+}
+
+void kernel_mark_columns_avx2(char ** seq,
+                              long count,
+                              long length,
+                              const kernel_lut_t * lut,
+                              unsigned char * mask)
+{
+  long i,j,t;
+  __m256i one = _mm256_set1_epi8(1);
+  __m256i lo_tbl = load_table(lut->lo);
+  __m256i hi_tbl = load_table(lut->hi);
+
+  memset(mask, 0, (size_t)length);
+
+  for (t = 0; t < length; t += KERNEL_TILE)
+  {
+    long end = MIN(t + KERNEL_TILE, length);
+
+    for (j = 0; j < count; ++j)
+    {
+      const char * s = seq[j];
+
+      for (i = t; i + 32 <= end; i += 32)
+      {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s+i));
+        __m256i m = _mm256_loadu_si256((const __m256i *)(mask+i));
+        __m256i r = _mm256_min_epu8(classify32(v,lo_tbl,hi_tbl), one);
+        _mm256_storeu_si256((__m256i *)(mask+i), _mm256_or_si256(m,r));
+      }
+      for (; i < end; ++i)
+      {
+        unsigned char c = (unsigned char)s[i];
+        if (lut->lo[c & 0xf] & lut->hi[c >> 4])
+          mask[i] = 1;
+      }
+    }
+  }
+}
+
+/* column counts are kept in bytes for batches of up to 255 sequences per
+   tile, and widened once per batch */
+void kernel_missing_counts_avx2(char ** seq,
+                                long count,
+                                long length,
+                                const kernel_lut_t * lut,
+                                unsigned int * sites,
+                                long * seqs)
+{
+  long i,j,b,t;
+  unsigned char acc[KERNEL_TILE];
+  __m256i zero = _mm256_setzero_si256();
+  __m256i one = _mm256_set1_epi8(1);
+  __m256i lo_tbl = load_table(lut->lo);
+  __m256i hi_tbl = load_table(lut->hi);
+
+  memset(sites, 0, (size_t)length * sizeof(unsigned int));
+  memset(seqs, 0, (size_t)count * sizeof(long));
+
+  for (t = 0; t < length; t += KERNEL_TILE)
+  {
+    long end = MIN(t + KERNEL_TILE, length);
+
+    for (b = 0; b < count; b += 255)
+    {
+      long batch_end = MIN(b + 255, count);
+
+      memset(acc, 0, (size_t)(end - t));
+
+      for (j = b; j < batch_end; ++j)
+      {
+        const char * s = seq[j];
+        long missing = 0;
+
+        for (i = t; i + 32 <= end; i += 32)
+        {
+          __m256i v = _mm256_loadu_si256((const __m256i *)(s+i));
+          __m256i z = _mm256_cmpeq_epi8(classify32(v,lo_tbl,hi_tbl), zero);
+          __m256i a = _mm256_loadu_si256((const __m256i *)(acc+i-t));
+
+          a = _mm256_add_epi8(a, _mm256_andnot_si256(z, one));
+          _mm256_storeu_si256((__m256i *)(acc+i-t), a);
+          missing += 32 - PLL_POPCOUNT((unsigned int)_mm256_movemask_epi8(z));
+        }
+        for (; i < end; ++i)
+        {
+          unsigned char c = (unsigned char)s[i];
+          unsigned char m = (lut->lo[c & 0xf] & lut->hi[c >> 4]) != 0;
+
+          acc[i-t] += m;
+          missing += m;
+        }
+        seqs[j] += missing;
+      }
+
+      for (i = t; i < end; ++i)
+        sites[i] += acc[i-t];
+    }
+  }
+}
+
+long kernel_compact_avx2(char * s, long length, const unsigned char * mask)
+{
+  long i,j;
+  long k = 0;
+  __m256i zero = _mm256_setzero_si256();
+
+  kernel_compact_shuffle_init();
+
+  for (i = 0; i + 32 <= length; i += 32)
+  {
+    __m256i m = _mm256_loadu_si256((const __m256i *)(mask+i));
+    unsigned int keep =
+      (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(m,zero));
+    __m256i v = _mm256_loadu_si256((const __m256i *)(s+i));
+
+    if (keep == 0xffffffff)
+    {
+      _mm256_storeu_si256((__m256i *)(s+k), v);
+      k += 32;
+      continue;
+    }
+
+    /* compact each 8-byte group; a store never passes the end of the
+       current block */
+    __m128i half[2] = { _mm256_castsi256_si128(v),
+                        _mm256_extracti128_si256(v,1) };
+    for (j = 0; j < 4; ++j)
+    {
+      unsigned int bits = (keep >> (8*j)) & 0xff;
+      __m128i x = (j & 1) ? _mm_srli_si128(half[j >> 1],8) : half[j >> 1];
+      __m128i shuf =
+        _mm_loadl_epi64((const __m128i *)kernel_compact_shuffle[bits]);
+
+      _mm_storel_epi64((__m128i *)(s+k), _mm_shuffle_epi8(x,shuf));
+      k += PLL_POPCOUNT(bits);
+    }
+  }
+
+  for (; i < length; ++i)
+    if (!mask[i])
+      s[k++] = s[i];
+
+  return k;
+}
+
+static inline __m256i encode32(__m256i v,
+                               const __m256i * tbl,
+                               long tables,
+                               __m256i hi_index)
+{
+  long t;
+  __m256i nibble = _mm256_set1_epi8(0x0f);
+  __m256i lo = _mm256_and_si256(v, nibble);
+  __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v,4), nibble);
+  __m256i idx = _mm256_shuffle_epi8(hi_index, hi);
+  __m256i r = _mm256_setzero_si256();
+
+  for (t = 0; t < tables; ++t)
+  {
+    __m256i sel = _mm256_cmpeq_epi8(idx, _mm256_set1_epi8((char)(t+1)));
+    r = _mm256_or_si256(r,
+                        _mm256_and_si256(sel, _mm256_shuffle_epi8(tbl[t],lo)));
+  }
+
+  return r;
+}
+
+void kernel_encode_avx2(const char * s,
+                        long n,
+                        const kernel_map_t * kmap,
+                        unsigned char * out)
+{
+  long i;
+  __m256i tbl[8];
+  __m256i hi_index = load_table(kmap->hi_index);
+
+  for (i = 0; i < kmap->tables; ++i)
+    tbl[i] = load_table(kmap->table[i]);
+
+  for (i = 0; i + 32 <= n; i += 32)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(s+i));
+    _mm256_storeu_si256((__m256i *)(out+i),
+                        encode32(v,tbl,kmap->tables,hi_index));
+  }
+
+  kernel_encode_cpu(s+i, n-i, kmap, out+i);
+}
+
+void kernel_site_patterns_avx2(char ** seq,
+                               long n,
+                               const kernel_map_t * kmap,
+                               unsigned short * pats)
+{
+  long i;
+  __m256i tbl[8];
+  __m256i hi_index = load_table(kmap->hi_index);
+  char * tail[4];
+
+  for (i = 0; i < kmap->tables; ++i)
+    tbl[i] = load_table(kmap->table[i]);
+
+  for (i = 0; i + 32 <= n; i += 32)
+  {
+    __m256i e0 = encode32(_mm256_loadu_si256((const __m256i *)(seq[0]+i)),
+                          tbl, kmap->tables, hi_index);
+    __m256i e1 = encode32(_mm256_loadu_si256((const __m256i *)(seq[1]+i)),
+                          tbl, kmap->tables, hi_index);
+    __m256i e2 = encode32(_mm256_loadu_si256((const __m256i *)(seq[2]+i)),
+                          tbl, kmap->tables, hi_index);
+    __m256i e3 = encode32(_mm256_loadu_si256((const __m256i *)(seq[3]+i)),
+                          tbl, kmap->tables, hi_index);
+
+    __m256i lo8 = _mm256_or_si256(e0, _mm256_slli_epi16(e1,4));
+    __m256i hi8 = _mm256_or_si256(e2, _mm256_slli_epi16(e3,4));
+
+    /* unpack works within lanes; reorder quadwords such that the low halves
+       of the two lanes hold sites 0-7 and 8-15 */
+    lo8 = _mm256_permute4x64_epi64(lo8, 0xD8);
+    hi8 = _mm256_permute4x64_epi64(hi8, 0xD8);
+
+    _mm256_storeu_si256((__m256i *)(pats+i), _mm256_unpacklo_epi8(lo8,hi8));
+    _mm256_storeu_si256((__m256i *)(pats+i+16), _mm256_unpackhi_epi8(lo8,hi8));
+  }
+
+  tail[0] = seq[0]+i; tail[1] = seq[1]+i;
+  tail[2] = seq[2]+i; tail[3] = seq[3]+i;
+  kernel_site_patterns_cpu(tail, n-i, kmap, pats+i);
+}
+
+/* sites are processed in tiles such that the three output rows stay in the
+   cache while all sequences are folded in */
+void kernel_site_states_avx2(char ** seq,
+                             long count,
+                             long length,
+                             const kernel_map_t * kmap,
+                             unsigned char * once,
+                             unsigned char * twice,
+                             unsigned char * amb)
+{
+  long i,j,t;
+  __m256i tbl[8];
+  __m256i hi_index = load_table(kmap->hi_index);
+  __m256i single_tbl = load_table(kernel_nt_single);
+  __m256i multi_tbl = load_table(kernel_nt_multi);
+
+  for (i = 0; i < kmap->tables; ++i)
+    tbl[i] = load_table(kmap->table[i]);
+
+  memset(once, 0, (size_t)length);
+  memset(twice, 0, (size_t)length);
+  memset(amb, 0, (size_t)length);
+
+  for (t = 0; t < length; t += KERNEL_TILE)
+  {
+    long end = MIN(t + KERNEL_TILE, length);
+
+    for (j = 0; j < count; ++j)
+    {
+      const char * s = seq[j];
+
+      for (i = t; i + 32 <= end; i += 32)
+      {
+        __m256i e = encode32(_mm256_loadu_si256((const __m256i *)(s+i)),
+                             tbl, kmap->tables, hi_index);
+        __m256i x = _mm256_shuffle_epi8(single_tbl, e);
+        __m256i o = _mm256_loadu_si256((const __m256i *)(once+i));
+        __m256i w = _mm256_loadu_si256((const __m256i *)(twice+i));
+        __m256i a = _mm256_loadu_si256((const __m256i *)(amb+i));
+
+        w = _mm256_or_si256(w, _mm256_and_si256(o,x));
+        o = _mm256_or_si256(o, x);
+        a = _mm256_or_si256(a, _mm256_shuffle_epi8(multi_tbl, e));
+
+        _mm256_storeu_si256((__m256i *)(once+i), o);
+        _mm256_storeu_si256((__m256i *)(twice+i), w);
+        _mm256_storeu_si256((__m256i *)(amb+i), a);
+      }
+      for (; i < end; ++i)
+      {
+        unsigned char c = (unsigned char)s[i];
+        unsigned char e = c < 128 ? kmap->full[c] : 0;
+        unsigned char x = kernel_nt_single[e];
+
+        twice[i] |= once[i] & x;
+        once[i] |= x;
+        amb[i] |= kernel_nt_multi[e];
+      }
+    }
+  }
+}
+
+/* bit b of 32 codes; the 16-bit shift moves bit b of each byte to its top
+   bit */
+static inline unsigned long plane32(__m256i e, int b)
+{
+  __m256i x;
+
+  switch (b)
+  {
+    case 0:  x = _mm256_slli_epi16(e,7); break;
+    case 1:  x = _mm256_slli_epi16(e,6); break;
+    case 2:  x = _mm256_slli_epi16(e,5); break;
+    default: x = _mm256_slli_epi16(e,4); break;
+  }
+
+  return (unsigned int)_mm256_movemask_epi8(x);
+}
+
+static inline unsigned long flag32(__m256i e, __m256i tbl)
+{
+  __m256i x = _mm256_cmpeq_epi8(_mm256_shuffle_epi8(tbl,e),
+                                _mm256_setzero_si256());
+
+  return ~(unsigned int)_mm256_movemask_epi8(x) & 0xffffffffUL;
+}
+
+void kernel_bitslice_avx2(const char * s,
+                          long n,
+                          const kernel_map_t * kmap,
+                          unsigned long * out)
+{
+  long i,b;
+  __m256i tbl[8];
+  __m256i hi_index = load_table(kmap->hi_index);
+  __m256i single_tbl = load_table(kernel_nt_single);
+  __m256i double_tbl = load_table(kernel_nt_double);
+
+  for (i = 0; i < kmap->tables; ++i)
+    tbl[i] = load_table(kmap->table[i]);
+
+  for (i = 0; i + 64 <= n; i += 64, out += 6)
+  {
+    __m256i e0 = encode32(_mm256_loadu_si256((const __m256i *)(s+i)),
+                          tbl, kmap->tables, hi_index);
+    __m256i e1 = encode32(_mm256_loadu_si256((const __m256i *)(s+i+32)),
+                          tbl, kmap->tables, hi_index);
+
+    for (b = 0; b < 4; ++b)
+      out[b] = plane32(e0,(int)b) | (plane32(e1,(int)b) << 32);
+    out[4] = flag32(e0,single_tbl) | (flag32(e1,single_tbl) << 32);
+    out[5] = flag32(e0,double_tbl) | (flag32(e1,double_tbl) << 32);
+  }
+
+  kernel_bitslice_cpu(s+i, n-i, kmap, out);
+}
+
+void kernel_allele_counts_avx2(const char * s,
+                               long n,
+                               const kernel_map_t * kmap,
+                               const unsigned char (*tbl)[16],
+                               unsigned short * counts)
+{
+  long i,a;
+  __m256i tbl_map[8];
+  __m256i tbl_copies[5];
+  __m256i hi_index = load_table(kmap->hi_index);
+
+  for (i = 0; i < kmap->tables; ++i)
+    tbl_map[i] = load_table(kmap->table[i]);
+  for (a = 0; a < 5; ++a)
+    tbl_copies[a] = load_table(tbl[a]);
+
+  for (i = 0; i + 32 <= n; i += 32)
+  {
+    __m256i e = encode32(_mm256_loadu_si256((const __m256i *)(s+i)),
+                         tbl_map, kmap->tables, hi_index);
+
+    for (a = 0; a < 5; ++a)
+    {
+      __m256i x = _mm256_shuffle_epi8(tbl_copies[a], e);
+      __m256i * c = (__m256i *)(counts + a*n + i);
+      __m256i lo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(x));
+      __m256i hi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(x,1));
+
+      _mm256_storeu_si256(c, _mm256_add_epi16(_mm256_loadu_si256(c), lo));
+      _mm256_storeu_si256(c+1, _mm256_add_epi16(_mm256_loadu_si256(c+1), hi));
+    }
+  }
+
+  /* the scalar tail works on rows of length n */
+  for (; i < n; ++i)
+  {
+    unsigned char c = (unsigned char)s[i];
+    unsigned char e = c < 128 ? kmap->full[c] & 0xf : 0;
+
+    for (a = 0; a < 5; ++a)
+      counts[a*n+i] += tbl[a][e];
+  }
+}
+
+/* Blocks of 255 vectors are encoded into a buffer and each class is then
+   counted over the buffer in 8-bit lanes, which cannot overflow within a
+   block, and summed with psadbw */
+void kernel_class_counts_avx2(const char * s,
+                              long n,
+                              const kernel_map_t * kmap,
+                              long classes,
+                              unsigned long * counts)
+{
+  long i,j,k;
+  long vectors = 0;
+  __m256i tbl[8];
+  __m256i zero = _mm256_setzero_si256();
+  __m256i hi_index = load_table(kmap->hi_index);
+  __m256i buf[255];
+
+  for (i = 0; i < kmap->tables; ++i)
+    tbl[i] = load_table(kmap->table[i]);
+
+  for (i = 0; i + 32 <= n; i += 32*vectors)
+  {
+    vectors = MIN(255, (n-i) / 32);
+
+    for (k = 0; k < vectors; ++k)
+      buf[k] = encode32(_mm256_loadu_si256((const __m256i *)(s+i+32*k)),
+                        tbl, kmap->tables, hi_index);
+
+    for (j = 0; j < classes; ++j)
+    {
+      __m256i c = _mm256_set1_epi8((char)j);
+      __m256i acc = zero;
+
+      for (k = 0; k < vectors; ++k)
+        acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(buf[k], c));
+
+      acc = _mm256_sad_epu8(acc, zero);
+      counts[j] += (unsigned long)(_mm256_extract_epi64(acc,0) +
+                                   _mm256_extract_epi64(acc,1) +
+                                   _mm256_extract_epi64(acc,2) +
+                                   _mm256_extract_epi64(acc,3));
+    }
+  }
+
+  kernel_class_counts_cpu(s+i, n-i, kmap, classes, counts);
+}
+
+/* vectors of identical sites, the common case between related sequences,
+   are skipped with a single comparison */
+void kernel_mismatch_histogram_avx2(const unsigned char * a,
+                                    const unsigned char * b,
+                                    long n,
+                                    long states,
+                                    unsigned int * counts)
+{
+  long i;
+
+  for (i = 0; i + 32 <= n; i += 32)
+  {
+    __m256i va = _mm256_loadu_si256((const __m256i *)(a+i));
+    __m256i vb = _mm256_loadu_si256((const __m256i *)(b+i));
+    __m256i eq = _mm256_cmpeq_epi8(va, vb);
+    unsigned int mask = ~(unsigned int)_mm256_movemask_epi8(eq);
+
+    while (mask)
+    {
+      long q = i + __builtin_ctz(mask);
+      counts[a[q]*states + b[q]]++;
+      mask &= mask - 1;
+    }
+  }
+
+  kernel_mismatch_histogram_cpu(a+i, b+i, n-i, states, counts);
+}
+
+/* same as the scalar reference; this file is compiled with -mpopcnt */
+void kernel_pair_diffs_avx2(const unsigned long * a,
+                            const unsigned long * b,
+                            long words,
+                            long half,
+                            long * diff4,
+                            long * sites)
+{
+  long w;
+  long d = 0;
+  long v = 0;
+
+  for (w = 0; w < words; w += 6)
+  {
+    unsigned long i0 = a[w]   & b[w];
+    unsigned long i1 = a[w+1] & b[w+1];
+    unsigned long i2 = a[w+2] & b[w+2];
+    unsigned long i3 = a[w+3] & b[w+3];
+    unsigned long s1 = i0 | i1 | i2 | i3;
+    unsigned long ss = a[w+4] & b[w+4];
+
+    d += 4*PLL_POPCOUNTL(ss & ~s1);
+    v += PLL_POPCOUNTL(ss);
+
+    if (!half) continue;
+
+    unsigned long s2 = (i0 & (i1|i2|i3)) | (i1 & (i2|i3)) | (i2 & i3);
+    unsigned long sh = (a[w+4] & b[w+5]) | (a[w+5] & b[w+4]);
+    unsigned long hh = a[w+5] & b[w+5];
+
+    d += 4*PLL_POPCOUNTL(sh) - 2*PLL_POPCOUNTL(sh & s1) +
+         4*PLL_POPCOUNTL(hh) - PLL_POPCOUNTL(hh & s1) - PLL_POPCOUNTL(hh & s2);
+    v += PLL_POPCOUNTL(sh) + PLL_POPCOUNTL(hh);
+  }
+
+  *diff4 = d;
+  *sites = v;
+}
+
+/* same as the scalar reference; this file is compiled with -mpopcnt */
+void kernel_ld_counts_avx2(const unsigned long * pi,
+                           const unsigned long * xi,
+                           const unsigned long * p,
+                           const unsigned long * x,
+                           long sites,
+                           long words,
+                           unsigned int * counts)
+{
+  long j,w;
+
+  for (j = 0; j < sites; ++j)
+  {
+    const unsigned long * pj = p + j*words;
+    const unsigned long * xj = x + j*words;
+    unsigned int n = 0, na = 0, nb = 0, nab = 0;
+
+    for (w = 0; w < words; ++w)
+    {
+      unsigned long v = pi[w] & pj[w];
+
+      n   += (unsigned int)PLL_POPCOUNTL(v);
+      na  += (unsigned int)PLL_POPCOUNTL(v & xi[w]);
+      nb  += (unsigned int)PLL_POPCOUNTL(v & xj[w]);
+      nab += (unsigned int)PLL_POPCOUNTL(v & xi[w] & xj[w]);
+    }
+
+    counts[4*j]   = n;
+    counts[4*j+1] = na;
+    counts[4*j+2] = nb;
+    counts[4*j+3] = nab;
+  }
+}
+
+void kernel_dstat_accumulate_avx2(const unsigned short * pats,
+                                  long n,
+                                  const double * abba_tbl,
+                                  const double * baba_tbl,
+                                  double * abba,
+                                  double * baba)
+{
+  long i;
+  double a[4], b[4];
+  __m256d va = _mm256_setzero_pd();
+  __m256d vb = _mm256_setzero_pd();
+
+  for (i = 0; i + 4 <= n; i += 4)
+  {
+    __m128i idx = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)(pats+i)));
+
+    va = _mm256_add_pd(va, _mm256_i32gather_pd(abba_tbl, idx, 8));
+    vb = _mm256_add_pd(vb, _mm256_i32gather_pd(baba_tbl, idx, 8));
+  }
+
+  _mm256_storeu_pd(a, va);
+  _mm256_storeu_pd(b, vb);
+
+  for (; i < n; ++i)
+  {
+    a[i & 3] += abba_tbl[pats[i]];
+    b[i & 3] += baba_tbl[pats[i]];
+  }
+
+  *abba = (a[0] + a[1]) + (a[2] + a[3]);
+  *baba = (b[0] + b[1]) + (b[2] + b[3]);
+}
+
+/* four lanes of kernel_hash_cpu in one register */
+unsigned long kernel_hash_avx2(const char * s, long n)
+{
+  long i;
+  unsigned long acc[4];
+  __m256i vacc = _mm256_loadu_si256((const __m256i *)kernel_hash_keys);
+  __m256i vkey = vacc;
+  __m256i step = _mm256_set1_epi64x((long long)KERNEL_HASH_STEP);
+
+  for (i = 0; i + 32 <= n; i += 32)
+  {
+    __m256i w = _mm256_loadu_si256((const __m256i *)(s+i));
+    __m256i x = _mm256_xor_si256(w, vkey);
+    __m256i p = _mm256_mul_epu32(x, _mm256_srli_epi64(x, 32));
+
+    vacc = _mm256_add_epi64(vacc, _mm256_add_epi64(w, p));
+    vkey = _mm256_add_epi64(vkey, step);
+  }
+
+  _mm256_storeu_si256((__m256i *)acc, vacc);
+  return kernel_hash_finish(acc, s+i, n-i, n);
+}
+
+long kernel_memeq_avx2(const char * a, const char * b, long n)
+{
+  long i;
+
+  for (i = 0; i + 32 <= n; i += 32)
+  {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(a+i));
+    __m256i y = _mm256_loadu_si256((const __m256i *)(b+i));
+
+    if ((unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x,y)) != 0xffffffff)
+      return 0;
+  }
+
+  return kernel_memeq_sse(a+i, b+i, n-i);
+}
@@ -0,0 +1,532 @@
+/*
+    Copyright (C) 2022-2023 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London, Gower Street, London WC1E 6BT, England
+*/
+
+#include "libbpptools.h"
+
+/* 128-bit kernels; compiled with -mssse3 for pshufb */
+
+/* columns processed per pass over the sequences when marking columns */
+#define KERNEL_TILE 4096
+
+/* shuffle masks that move the bytes selected by an 8-bit mask to the front;
+   also used by the AVX2 compaction kernel */
+unsigned char kernel_compact_shuffle[256][8];
+
+static pthread_once_t compact_once = PTHREAD_ONCE_INIT;
+
+static void compact_shuffle_init(void)
+{
+  long i,j,k;
+
+  for (i = 0; i < 256; ++i)
+  {
+    for (j = 0, k = 0; j < 8; ++j)
+      if (i & (1 << j))
+        kernel_compact_shuffle[i][k++] = (unsigned char)j;
+    for (; k < 8; ++k)
+      kernel_compact_shuffle[i][k] = 0x80;
+  }
+}
+
+void kernel_compact_shuffle_init(void)
+{
+  pthread_once(&compact_once, compact_shuffle_init);
+}
+
+static inline __m128i classify16(__m128i v, __m128i lo_tbl, __m128i hi_tbl)
+{
+  __m128i nibble = _mm_set1_epi8(0x0f);
+  __m128i lo = _mm_and_si128(v, nibble);
+  __m128i hi = _mm_and_si128(_mm_srli_epi16(v,4), nibble);
+
+  return _mm_and_si128(_mm_shuffle_epi8(lo_tbl,lo),
+                       _mm_shuffle_epi8(hi_tbl,hi));
+}
+
+long kernel_legal_prefix_sse(const char * s, long n, const kernel_lut_t * lut)
+{
+  long i;
+  __m128i zero = _mm_setzero_si128();
+  __m128i lo_tbl = _mm_loadu_si128((const __m128i *)lut->lo);
+  __m128i hi_tbl = _mm_loadu_si128((const __m128i *)lut->hi);
+
+  for (i = 0; i + 16 <= n; i += 16)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s+i));
+    __m128i r = classify16(v, lo_tbl, hi_tbl);
+    unsigned int illegal = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(r,zero));
+
+    if (illegal)
+      return i + PLL_CTZ(illegal);
+  }
+
+  /* overlapping vector ending at n; the bytes before i are legal */
+  if (i < n && n >= 16)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s+n-16));
+    __m128i r = classify16(v, lo_tbl, hi_tbl);
+    unsigned int illegal = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(r,zero));
+
+    return illegal ? n - 16 + PLL_CTZ(illegal) : n;
+  }
+
+  return i + kernel_legal_prefix_cpu(s+i, n-i, lut);
+}
+
+void kernel_mark_columns_sse(char ** seq,
+                             long count,
+                             long length,
+                             const kernel_lut_t * lut,
+                             unsigned char * mask)
+{
+  long i,j,t;
+  __m128i one = _mm_set1_epi8(1);
+  __m128i lo_tbl = _mm_loadu_si128((const __m128i *)lut->lo);
+  __m128i hi_tbl = _mm_loadu_si128((const __m128i *)lut->hi);
+
+  memset(mask, 0, (size_t)length);
+
+  for (t = 0; t < length; t += KERNEL_TILE)
+  {
+    long end = MIN(t + KERNEL_TILE, length);
+
+    for (j = 0; j < count; ++j)
+    {
+      const char * s = seq[j];
+
+      for (i = t; i + 16 <= end; i += 16)
+      {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s+i));
+        __m128i m = _mm_loadu_si128((const __m128i *)(mask+i));
+        __m128i r = _mm_min_epu8(classify16(v,lo_tbl,hi_tbl), one);
+        _mm_storeu_si128((__m128i *)(mask+i), _mm_or_si128(m,r));
+      }
+      for (; i < end; ++i)
+      {
+        unsigned char c = (unsigned char)s[i];
+        if (lut->lo[c & 0xf] & lut->hi[c >> 4])
+          mask[i] = 1;
+      }
+    }
+  }
+}
+
+long kernel_compact_sse(char * s, long length, const unsigned char * mask)
+{
+  long i;
+  long k = 0;
+  __m128i zero = _mm_setzero_si128();
+
+  kernel_compact_shuffle_init();
+
+  /* stores never run past the block being processed, hence in-place
+     compaction is safe */
+  for (i = 0; i + 16 <= length; i += 16)
+  {
+    __m128i m = _mm_loadu_si128((const __m128i *)(mask+i));
+    unsigned int keep = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(m,zero));
+    __m128i v = _mm_loadu_si128((const __m128i *)(s+i));
+    __m128i shuf;
+
+    if (keep == 0xffff)
+    {
+      _mm_storeu_si128((__m128i *)(s+k), v);
+      k += 16;
+      continue;
+    }
+
+    shuf = _mm_loadl_epi64((const __m128i *)kernel_compact_shuffle[keep & 0xff]);
+    _mm_storel_epi64((__m128i *)(s+k), _mm_shuffle_epi8(v,shuf));
+    k += PLL_POPCOUNT(keep & 0xff);
+
+    shuf = _mm_loadl_epi64((const __m128i *)kernel_compact_shuffle[keep >> 8]);
+    _mm_storel_epi64((__m128i *)(s+k),
+                     _mm_shuffle_epi8(_mm_srli_si128(v,8),shuf));
+    k += PLL_POPCOUNT(keep >> 8);
+  }
+
+  for (; i < length; ++i)
+    if (!mask[i])
+      s[k++] = s[i];
+
+  return k;
+}
+
+static inline __m128i encode16(__m128i v,
+                               const __m128i * tbl,
+                               long tables,
+                               __m128i hi_index)
+{
+  long t;
+  __m128i nibble = _mm_set1_epi8(0x0f);
+  __m128i lo = _mm_and_si128(v, nibble);
+  __m128i hi = _mm_and_si128(_mm_srli_epi16(v,4), nibble);
+  __m128i idx = _mm_shuffle_epi8(hi_index, hi);
+  __m128i r = _mm_setzero_si128();
+
+  for (t = 0; t < tables; ++t)
+  {
+    __m128i sel = _mm_cmpeq_epi8(idx, _mm_set1_epi8((char)(t+1)));
+    r = _mm_or_si128(r, _mm_and_si128(sel, _mm_shuffle_epi8(tbl[t],lo)));
+  }
+
+  return r;
+}
+
+void kernel_encode_sse(const char * s,
+                       long n,
+                       const kernel_map_t * kmap,
+                       unsigned char * out)
+{
+  long i;
+  __m128i tbl[8];
+  __m128i hi_index = _mm_loadu_si128((const __m128i *)kmap->hi_index);
+
+  for (i = 0; i < kmap->tables; ++i)
+    tbl[i] = _mm_loadu_si128((const __m128i *)kmap->table[i]);
+
+  for (i = 0; i + 16 <= n; i += 16)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s+i));
+    _mm_storeu_si128((__m128i *)(out+i),
+                     encode16(v,tbl,kmap->tables,hi_index));
+  }
+
+  kernel_encode_cpu(s+i, n-i, kmap, out+i);
+}
+
+void kernel_site_patterns_sse(char ** seq,
+                              long n,
+                              const kernel_map_t * kmap,
+                              unsigned short * pats)
+{
+  long i;
+  __m128i tbl[8];
+  __m128i hi_index = _mm_loadu_si128((const __m128i *)kmap->hi_index);
+  char * tail[4];
+
+  for (i = 0; i < kmap->tables; ++i)
+    tbl[i] = _mm_loadu_si128((const __m128i *)kmap->table[i]);
+
+  for (i = 0; i + 16 <= n; i += 16)
+  {
+    __m128i e0 = encode16(_mm_loadu_si128((const __m128i *)(seq[0]+i)),
+                          tbl, kmap->tables, hi_index);
+    __m128i e1 = encode16(_mm_loadu_si128((const __m128i *)(seq[1]+i)),
+                          tbl, kmap->tables, hi_index);
+    __m128i e2 = encode16(_mm_loadu_si128((const __m128i *)(seq[2]+i)),
+                          tbl, kmap->tables, hi_index);
+    __m128i e3 = encode16(_mm_loadu_si128((const __m128i *)(seq[3]+i)),
+                          tbl, kmap->tables, hi_index);
+
+    /* codes are at most 4 bits wide, shifting 16-bit lanes is safe */
+    __m128i lo8 = _mm_or_si128(e0, _mm_slli_epi16(e1,4));
+    __m128i hi8 = _mm_or_si128(e2, _mm_slli_epi16(e3,4));
+
+    _mm_storeu_si128((__m128i *)(pats+i), _mm_unpacklo_epi8(lo8,hi8));
+    _mm_storeu_si128((__m128i *)(pats+i+8), _mm_unpackhi_epi8(lo8,hi8));
+  }
+
+  tail[0] = seq[0]+i; tail[1] = seq[1]+i;
+  tail[2] = seq[2]+i; tail[3] = seq[3]+i;
+  kernel_site_patterns_cpu(tail, n-i, kmap, pats+i);
+}
+
+void kernel_site_states_sse(char ** seq,
+                            long count,
+                            long length,
+                            const kernel_map_t * kmap,
+                            unsigned char * once,
+                            unsigned char * twice,
+                            unsigned char * amb)
+{
+  long i,j,t;
+  __m128i tbl[8];
+  __m128i hi_index = _mm_loadu_si128((const __m128i *)kmap->hi_index);
+  __m128i single_tbl = _mm_loadu_si128((const __m128i *)kernel_nt_single);
+  __m128i multi_tbl = _mm_loadu_si128((const __m128i *)kernel_nt_multi);
+
+  for (i = 0; i < kmap->tables; ++i)
+    tbl[i] = _mm_loadu_si128((const __m128i *)kmap->table[i]);
+
+  memset(once, 0, (size_t)length);
+  memset(twice, 0, (size_t)length);
+  memset(amb, 0, (size_t)length);
+
+  for (t = 0; t < length; t += KERNEL_TILE)
+  {
+    long end = MIN(t + KERNEL_TILE, length);
+
+    for (j = 0; j < count; ++j)
+    {
+      const char * s = seq[j];
+
+      for (i = t; i + 16 <= end; i += 16)
+      {
+        __m128i e = encode16(_mm_loadu_si128((const __m128i *)(s+i)),
+                             tbl, kmap->tables, hi_index);
+        __m128i x = _mm_shuffle_epi8(single_tbl, e);
+        __m128i o = _mm_loadu_si128((const __m128i *)(once+i));
+        __m128i w = _mm_loadu_si128((const __m128i *)(twice+i));
+        __m128i a = _mm_loadu_si128((const __m128i *)(amb+i));
+
+        w = _mm_or_si128(w, _mm_and_si128(o,x));
+        o = _mm_or_si128(o, x);
+        a = _mm_or_si128(a, _mm_shuffle_epi8(multi_tbl, e));
+
+        _mm_storeu_si128((__m128i *)(once+i), o);
+        _mm_storeu_si128((__m128i *)(twice+i), w);
+        _mm_storeu_si128((__m128i *)(amb+i), a);
+      }
+      for (; i < end; ++i)
+      {
+        unsigned char c = (unsigned char)s[i];
+        unsigned char e = c < 128 ? kmap->full[c] : 0;
+        unsigned char x = kernel_nt_single[e];
+
+        twice[i] |= once[i] & x;
+        once[i] |= x;
+        amb[i] |= kernel_nt_multi[e];
+      }
+    }
+  }
+}
+
+static inline unsigned long plane16(__m128i e, int b)
+{
+  __m128i x;
+
+  switch (b)
+  {
+    case 0:  x = _mm_slli_epi16(e,7); break;
+    case 1:  x = _mm_slli_epi16(e,6); break;
+    case 2:  x = _mm_slli_epi16(e,5); break;
+    default: x = _mm_slli_epi16(e,4); break;
+  }
+
+  return (unsigned int)_mm_movemask_epi8(x);
+}
+
+static inline unsigned long flag16(__m128i e, __m128i tbl)
+{
+  __m128i x = _mm_cmpeq_epi8(_mm_shuffle_epi8(tbl,e), _mm_setzero_si128());
+
+  return ~(unsigned int)_mm_movemask_epi8(x) & 0xffffUL;
+}
+
+void kernel_bitslice_sse(const char * s,
+                         long n,
+                         const kernel_map_t * kmap,
+                         unsigned long * out)
+{
+  long i,j,b;
+  __m128i tbl[8];
+  __m128i hi_index = _mm_loadu_si128((const __m128i *)kmap->hi_index);
+  __m128i single_tbl = _mm_loadu_si128((const __m128i *)kernel_nt_single);
+  __m128i double_tbl = _mm_loadu_si128((const __m128i *)kernel_nt_double);
+
+  for (i = 0; i < kmap->tables; ++i)
+    tbl[i] = _mm_loadu_si128((const __m128i *)kmap->table[i]);
+
+  for (i = 0; i + 64 <= n; i += 64, out += 6)
+  {
+    memset(out, 0, 6*sizeof(unsigned long));
+
+    for (j = 0; j < 4; ++j)
+    {
+      __m128i e = encode16(_mm_loadu_si128((const __m128i *)(s+i+16*j)),
+                           tbl, kmap->tables, hi_index);
+
+      for (b = 0; b < 4; ++b)
+        out[b] |= plane16(e,(int)b) << (16*j);
+      out[4] |= flag16(e,single_tbl) << (16*j);
+      out[5] |= flag16(e,double_tbl) << (16*j);
+    }
+  }
+
+  kernel_bitslice_cpu(s+i, n-i, kmap, out);
+}
+
+void kernel_allele_counts_sse(const char * s,
+                              long n,
+                              const kernel_map_t * kmap,
+                              const unsigned char (*tbl)[16],
+                              unsigned short * counts)
+{
+  long i,a;
+  __m128i tbl_map[8];
+  __m128i tbl_copies[5];
+  __m128i zero = _mm_setzero_si128();
+  __m128i hi_index = _mm_loadu_si128((const __m128i *)kmap->hi_index);
+
+  for (i = 0; i < kmap->tables; ++i)
+    tbl_map[i] = _mm_loadu_si128((const __m128i *)kmap->table[i]);
+  for (a = 0; a < 5; ++a)
+    tbl_copies[a] = _mm_loadu_si128((const __m128i *)tbl[a]);
+
+  for (i = 0; i + 16 <= n; i += 16)
+  {
+    __m128i e = encode16(_mm_loadu_si128((const __m128i *)(s+i)),
+                         tbl_map, kmap->tables, hi_index);
+
+    for (a = 0; a < 5; ++a)
+    {
+      __m128i x = _mm_shuffle_epi8(tbl_copies[a], e);
+      __m128i * c = (__m128i *)(counts + a*n + i);
+
+      _mm_storeu_si128(c, _mm_add_epi16(_mm_loadu_si128(c),
+                                        _mm_unpacklo_epi8(x,zero)));
+      _mm_storeu_si128(c+1, _mm_add_epi16(_mm_loadu_si128(c+1),
+                                          _mm_unpackhi_epi8(x,zero)));
+    }
+  }
+
+  for (; i < n; ++i)
+  {
+    unsigned char c = (unsigned char)s[i];
+    unsigned char e = c < 128 ? kmap->full[c] & 0xf : 0;
+
+    for (a = 0; a < 5; ++a)
+      counts[a*n+i] += tbl[a][e];
+  }
+}
+
+void kernel_class_counts_sse(const char * s,
+                             long n,
+                             const kernel_map_t * kmap,
+                             long classes,
+                             unsigned long * counts)
+{
+  long i,j,k;
+  long vectors = 0;
+  __m128i tbl[8];
+  __m128i zero = _mm_setzero_si128();
+  __m128i hi_index = _mm_loadu_si128((const __m128i *)kmap->hi_index);
+  __m128i buf[255];
+
+  for (i = 0; i < kmap->tables; ++i)
+    tbl[i] = _mm_loadu_si128((const __m128i *)kmap->table[i]);
+
+  for (i = 0; i + 16 <= n; i += 16*vectors)
+  {
+    vectors = MIN(255, (n-i) / 16);
+
+    for (k = 0; k < vectors; ++k)
+      buf[k] = encode16(_mm_loadu_si128((const __m128i *)(s+i+16*k)),
+                        tbl, kmap->tables, hi_index);
+
+    for (j = 0; j < classes; ++j)
+    {
+      __m128i c = _mm_set1_epi8((char)j);
+      __m128i acc = zero;
+
+      for (k = 0; k < vectors; ++k)
+        acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(buf[k], c));
+
+      acc = _mm_sad_epu8(acc, zero);
+      counts[j] += (unsigned long)(_mm_cvtsi128_si64(acc) +
+                                   _mm_cvtsi128_si64(_mm_unpackhi_epi64(acc,
+                                                                        acc)));
+    }
+  }
+
+  kernel_class_counts_cpu(s+i, n-i, kmap, classes, counts);
+}
+
+/* vectors of identical sites, the common case between related sequences,
+   are skipped with a single comparison */
+void kernel_mismatch_histogram_sse(const unsigned char * a,
+                                   const unsigned char * b,
+                                   long n,
+                                   long states,
+                                   unsigned int * counts)
+{
+  long i;
+
+  for (i = 0; i + 16 <= n; i += 16)
+  {
+    __m128i va = _mm_loadu_si128((const __m128i *)(a+i));
+    __m128i vb = _mm_loadu_si128((const __m128i *)(b+i));
+    __m128i eq = _mm_cmpeq_epi8(va, vb);
+    unsigned int mask = ~(unsigned int)_mm_movemask_epi8(eq) & 0xffff;
+
+    while (mask)
+    {
+      long q = i + __builtin_ctz(mask);
+      counts[a[q]*states + b[q]]++;
+      mask &= mask - 1;
+    }
+  }
+
+  kernel_mismatch_histogram_cpu(a+i, b+i, n-i, states, counts);
+}
+
+void kernel_dstat_accumulate_sse(const unsigned short * pats,
+                                 long n,
+                                 const double * abba_tbl,
+                                 const double * baba_tbl,
+                                 double * abba,
+                                 double * baba)
+{
+  long i;
+  double a[4], b[4];
+  __m128d a01 = _mm_setzero_pd();
+  __m128d a23 = _mm_setzero_pd();
+  __m128d b01 = _mm_setzero_pd();
+  __m128d b23 = _mm_setzero_pd();
+
+  for (i = 0; i + 4 <= n; i += 4)
+  {
+    a01 = _mm_add_pd(a01, _mm_set_pd(abba_tbl[pats[i+1]], abba_tbl[pats[i]]));
+    a23 = _mm_add_pd(a23, _mm_set_pd(abba_tbl[pats[i+3]], abba_tbl[pats[i+2]]));
+    b01 = _mm_add_pd(b01, _mm_set_pd(baba_tbl[pats[i+1]], baba_tbl[pats[i]]));
+    b23 = _mm_add_pd(b23, _mm_set_pd(baba_tbl[pats[i+3]], baba_tbl[pats[i+2]]));
+  }
+
+  _mm_storeu_pd(a, a01); _mm_storeu_pd(a+2, a23);
+  _mm_storeu_pd(b, b01); _mm_storeu_pd(b+2, b23);
+
+  /* remaining sites continue in their lanes */
+  for (; i < n; ++i)
+  {
+    a[i & 3] += abba_tbl[pats[i]];
+    b[i & 3] += baba_tbl[pats[i]];
+  }
+
+  *abba = (a[0] + a[1]) + (a[2] + a[3]);
+  *baba = (b[0] + b[1]) + (b[2] + b[3]);
+}
+
+long kernel_memeq_sse(const char * a, const char * b, long n)
+{
+  long i;
+
+  for (i = 0; i + 16 <= n; i += 16)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i *)(a+i));
+    __m128i y = _mm_loadu_si128((const __m128i *)(b+i));
+
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(x,y)) != 0xffff)
+      return 0;
+  }
+
+  return kernel_memeq_cpu(a+i, b+i, n-i);
+}
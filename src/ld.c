@@ -0,0 +1,132 @@
+/*
+    Copyright (C) 2022-2023 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London, Gower Street, London WC1E 6BT, England
+*/
+
+
+#include "libbpptools.h"
+
+/* Linkage disequilibrium between biallelic sites, treating sequences as
+   haplotypes. For each pair of sites only the sequences with data at both
+   are used; with n of them, nA and nB carrying the first allele at either
+   site and nAB at both, D n^2 = nAB n - nA nB and
+
+     r^2 = (D n^2)^2 / (nA (n-nA) nB (n-nB))
+     D'  = |D| / Dmax
+
+   where Dmax is the largest |D| attainable with the same allele counts.
+   The counts of a site against a block of LD_BLOCK sites are obtained with
+   kernel_ld_counts, a few AND and POPCNT instructions per 64 sequences.
+   Pairs at which either site is monomorphic among those sequences are
+   undefined and skipped. */
+
+#define LD_BLOCK 256
+
+static int ld_append(ld_pair_t ** pairs,
+                     long * count,
+                     long * capacity,
+                     long site_i,
+                     long site_j,
+                     long n,
+                     double r2,
+                     double dprime)
+{
+  if (*count == *capacity)
+  {
+    long size = MAX(1024, 2 * *capacity);
+    ld_pair_t * p = (ld_pair_t *)bpp_realloc(*pairs,
+                                             (size_t)size * sizeof(ld_pair_t));
+    if (!p)
+      return BPP_FAILURE;
+    *pairs = p;
+    *capacity = size;
+  }
+
+  ld_pair_t * p = *pairs + (*count)++;
+  p->site_i = site_i;
+  p->site_j = site_j;
+  p->n = n;
+  p->r2 = r2;
+  p->dprime = dprime;
+
+  return BPP_SUCCESS;
+}
+
+/* Pairs of sites of a with r^2 of at least min_r2, or pairs of one site of
+   a and one of b if b is given, in which case both must have been created
+   over the same individuals. Sites are reported by column. Returns NULL
+   with count set to -1 if memory runs out. */
+ld_pair_t * ld_compute(const biallelic_t * a,
+                       const biallelic_t * b,
+                       double min_r2,
+                       long * count)
+{
+  long i,j,k;
+  long capacity = 0;
+  long words = a->words;
+  const biallelic_t * other = b ? b : a;
+  unsigned int counts[4*LD_BLOCK];
+  ld_pair_t * pairs = NULL;
+
+  assert(!b || b->words == a->words);
+
+  *count = 0;
+
+  for (i = 0; i < a->sites; ++i)
+  {
+    const unsigned long * pi = a->present + i*words;
+    const unsigned long * xi = a->allele + i*words;
+
+    for (j = b ? 0 : i+1; j < other->sites; j += LD_BLOCK)
+    {
+      long block = MIN(LD_BLOCK, other->sites - j);
+
+      kernel_ld_counts(pi, xi, other->present + j*words,
+                       other->allele + j*words, block, words, counts);
+
+      for (k = 0; k < block; ++k)
+      {
+        long n   = counts[4*k];
+        long na  = counts[4*k+1];
+        long nb  = counts[4*k+2];
+        long nab = counts[4*k+3];
+
+        if (!na || na == n || !nb || nb == n) continue;
+
+        double d = (double)(nab*n - na*nb);
+        double r2 = d*d / ((double)na * (n-na) * (double)nb * (n-nb));
+
+        if (r2 < min_r2) continue;
+
+        double dmax = d > 0 ? (double)MIN(na*(n-nb), (n-na)*nb) :
+                              (double)MIN(na*nb, (n-na)*(n-nb));
+
+        if (!ld_append(&pairs, count, &capacity, a->cols[i], other->cols[j+k],
+                       n, r2, fabs(d) / dmax))
+        {
+          free(pairs);
+          *count = -1;
+          return NULL;
+        }
+      }
+    }
+  }
+
+  return pairs;
+}
@@ -0,0 +1,1270 @@
+/*
+    Copyright (C) 2021-2023 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London, Gower Street, London WC1E 6BT, England
+*/
+
+#ifndef LIBBPPTOOLS_H
+#define LIBBPPTOOLS_H
+
+#include <assert.h>
+#include <fcntl.h>
+#include <search.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <limits.h>
+#include <locale.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <errno.h>
+#include <zlib.h>
+
+#ifdef _MSC_VER
+#include <pmmintrin.h>
+#include <immintrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
+#ifndef _MSC_VER
+#include <getopt.h>
+#endif
+
+#ifndef _MSC_VER
+#include <sys/time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#endif
+
+/* platform specific */
+
+#if (defined(__BORLANDC__) || defined(_MSC_VER))
+#define __THREAD __declspec(thread)
+#else
+#define __THREAD __thread
+#endif
+
+#ifdef _MSC_VER
+#define PLL_ALIGN_HEADER(X) __declspec(align(X))
+#define PLL_ALIGN_FOOTER(X)
+#else
+#define PLL_ALIGN_HEADER(X)
+#define PLL_ALIGN_FOOTER(X) __attribute__((aligned(X)))
+#endif
+
+#ifdef _MSC_VER
+#define strncasecmp _strnicmp
+#define strcasecmp _stricmp
+#endif
+
+/* constants */
+
+#define PROG_NAME "bpp-tools"
+
+#define PLL_STRING(x) #x
+#define PLL_C2S(x) PLL_STRING(x)
+
+
+#define VERSION_MAJOR 0
+#define VERSION_MINOR 1
+#define VERSION_PATCH 0
+
+#define PROG_VERSION "v" PLL_C2S(VERSION_MAJOR) "." PLL_C2S(VERSION_MINOR) "." \
+        PLL_C2S(VERSION_PATCH)
+
+#ifdef __PPC__
+
+#ifdef __LITTLE_ENDIAN__
+#define PROG_CPU "ppc64le"
+#else
+#error "Big endian ppc64 CPUs not supported"
+#endif
+
+#else
+
+#define PROG_CPU "x86_64"
+
+#endif
+
+#ifdef __APPLE__
+#define PROG_OS "osx"
+#include <sys/resource.h>
+#include <sys/sysctl.h>
+#endif
+
+#ifdef __linux__
+#define PROG_OS "linux"
+#include <sys/resource.h>
+#include <sys/sysinfo.h>
+#endif
+
+#ifdef _WIN32
+#define PROG_OS "win"
+#include <windows.h>
+#include <psapi.h>
+#endif
+
+#define PROG_ARCH PROG_OS "_" PROG_CPU
+
+#define BPP_FAILURE  0
+#define BPP_SUCCESS  1
+
+#define BUFFERALLOC 1048576
+#define ASCII_SIZE 256
+
+#define BPP_DATA_DNA                    0
+#define BPP_DATA_AA                     1
+
+#define TIMING_PHASE_OPEN               0
+#define TIMING_PHASE_SCAN               1
+#define TIMING_PHASE_PARSE              2
+#define TIMING_PHASE_PROCESS            3
+#define TIMING_PHASE_WRITE              4
+#define TIMING_PHASE_COUNT              5
+
+#define FILTER_EXTRACT                  0
+#define FILTER_REMOVE                   1
+
+#define DISTANCE_P                      0
+#define DISTANCE_JC69                   1
+#define DISTANCE_ML                     2
+
+/* key increment between the 32-byte blocks of kernel_hash */
+#define KERNEL_HASH_STEP  0x9e3779b97f4a7c15UL
+
+/* error codes */
+
+#define ERROR_FILE_OPEN                101
+#define ERROR_FILE_SEEK                102
+#define ERROR_INVALID_ARGUMENT         103
+#define ERROR_SOCKET                   104
+#define ERROR_CACHE                    105
+#define ERROR_PHYLIP_SYNTAX            106
+#define ERROR_PHYLIP_LONGSEQ           107
+#define ERROR_PHYLIP_NONALIGNED        108
+#define ERROR_PHYLIP_ILLEGALCHAR       109
+#define ERROR_PHYLIP_UNPRINTABLECHAR   110
+#define ERROR_PARSE_MORETHANEXPECTED   111
+#define ERROR_PARSE_LESSTHANEXPECTED   112
+#define ERROR_PARSE_INCORRECTFORMAT    113
+#define ERROR_FASTA_SYNTAX             114
+#define ERROR_LABEL_MISMATCH           115
+#define ERROR_VCF_SYNTAX               116
+#define ERROR_BED_SYNTAX               117
+#define ERROR_DSTAT_SEQUENCES          120
+#define ERROR_MLDIST_MODEL             121
+#define ERROR_MEMORY                   122
+#define ERROR_THREAD                   123
+#define ERROR_ARCH                     124
+
+/* libpll related definitions */
+
+#define PLL_ALIGNMENT_CPU               8
+#define PLL_ALIGNMENT_SSE              16
+#define PLL_ALIGNMENT_AVX              32
+
+#define PLL_ATTRIB_ARCH_CPU            0
+#define PLL_ATTRIB_ARCH_SSE       (1 << 0)
+#define PLL_ATTRIB_PATTERN_TIP    (1 << 4)
+
+#define PLL_ATTRIB_ARCH_AVX       (1 << 1)
+#define PLL_ATTRIB_ARCH_AVX2      (1 << 2)
+#define PLL_ATTRIB_ARCH_AVX512    (1 << 3)
+#define PLL_ATTRIB_ARCH_MASK         0xF
+
+/* structures and data types */
+
+typedef unsigned int UINT32;
+typedef unsigned short WORD;
+typedef unsigned char BYTE;
+
+typedef struct msa_s
+{
+  long count;
+  long length;
+
+  char ** sequence;
+  char ** label;
+
+  long amb_sites_count;
+  long original_length;
+
+  double * freqs;
+
+  int dtype;
+  int model;
+  int original_index;
+
+} msa_t;
+
+/* nibble tables for testing bytes against a character class */
+typedef struct kernel_lut_s
+{
+  unsigned char lo[16];
+  unsigned char hi[16];
+} kernel_lut_t;
+
+/* byte map split into 16-entry tables selected by the upper nibble */
+typedef struct kernel_map_s
+{
+  unsigned char table[8][16];
+  unsigned char hi_index[16];
+  unsigned char full[128];
+  long tables;
+} kernel_map_t;
+
+typedef struct phylip_s
+{
+  FILE * fp;
+  char * buffer;
+  size_t buffer_size;
+  size_t buffer_pos;
+  size_t buffer_end;
+  long buffer_offset;
+  int buffer_eof;
+  int buffer_failed;
+  char * line;
+  size_t line_size;
+  size_t line_newline;
+  const unsigned int * chrstatus;
+  kernel_lut_t legal;
+  long no;
+  long filesize;
+  long offset;
+  long line_offset;
+  long lineno;
+  long layout;
+  long stripped_count;
+  long stripped[256];
+} phylip_t;
+
+typedef struct list_item_s
+{
+  void * data;
+  struct list_item_s * next;
+} list_item_t;
+
+typedef struct list_s
+{
+  list_item_t * head;
+  list_item_t * tail;
+  long count;
+} list_t;
+
+
+typedef struct ht_item_s
+{
+  unsigned long key;
+  void * value;
+} ht_item_t;
+
+typedef struct hashtable_s
+{
+  unsigned long table_size;
+  unsigned long entries_count;
+  list_t ** entries;
+} hashtable_t;
+
+typedef struct pair_s
+{
+  char * label;
+  void * data;
+} pair_t;
+
+typedef struct sched_s sched_t;
+
+/* reader state of pipeline_cb_list */
+typedef struct pipeline_list_s
+{
+  msa_t ** msa_list;
+  long count;
+  long next;
+} pipeline_list_t;
+
+typedef struct filter_s
+{
+  long type;
+  long sp_count;
+  long seq_count;
+  char ** sp_tokens;
+  char ** seq_tokens;
+} filter_t;
+
+typedef struct aa_model_s
+{
+  const char * name;
+  const double * rates;     /* 190 exchangeabilities above the diagonal */
+  const double * freqs;
+} aa_model_t;
+
+typedef struct mldist_s
+{
+  double lambda[20];        /* eigenvalues of the scaled rate matrix */
+  double coef[210][20];     /* joint probability terms of each state pair */
+} mldist_t;
+
+typedef struct composition_s
+{
+  long states;
+  long count;
+  double * freqs;           /* state frequencies of each sequence */
+  long * chars;             /* characters counted in each sequence */
+  double * chi2;            /* statistic of each sequence */
+  long df;                  /* degrees of freedom of one sequence */
+  double chi2_total;
+  long df_total;
+} composition_t;
+
+typedef struct biallelic_s
+{
+  long count;               /* sequences, i.e. bits */
+  long words;               /* words per bitset */
+  long sites;
+  long * cols;              /* column of each site */
+  unsigned long * present;  /* sequences with an unambiguous nucleotide */
+  unsigned long * allele;   /* sequences with the first state */
+} biallelic_t;
+
+typedef struct ld_pair_s
+{
+  long site_i;              /* column in the first locus */
+  long site_j;              /* column in the second locus */
+  long n;                   /* sequences with data at both sites */
+  double r2;
+  double dprime;            /* |D'| */
+} ld_pair_t;
+
+typedef struct dedup_s
+{
+  hashtable_t * ht;         /* hashes of the loci seen so far */
+  long unordered;           /* hash is insensitive to the order of sequences */
+} dedup_t;
+
+typedef struct haplotypes_s
+{
+  long count;               /* distinct sequences */
+  long * map;               /* haplotype of each sequence */
+  long * first;             /* first sequence carrying each haplotype */
+  long * weight;            /* sequences carrying each haplotype */
+} haplotypes_t;
+
+typedef struct fourgamete_s
+{
+  long sequences;
+  long length;
+  long sites;               /* parsimony-informative biallelic sites */
+  long pairs;               /* pairs of sites tested */
+  long incompatible;        /* pairs showing all four gametes */
+  long rm;                  /* Hudson-Kaplan lower bound */
+  long * intervals;         /* columns of the left and right end of each
+                               of the rm disjoint intervals */
+  long * splits;            /* first column of each segment after a cut */
+} fourgamete_t;
+
+typedef struct msa_stats_s
+{
+  long sequences;
+  long length;
+  long ambiguous_sites;
+  long missing;
+  long gaps;
+  long bases;           /* unambiguous nucleotides */
+  long gc;              /* G and C among bases */
+  long segregating;     /* sites with at least two states */
+  long informative;     /* sites with at least two states seen twice */
+  long haplotypes;      /* distinct sequences */
+} msa_stats_t;
+
+/* report of msa_stats over the loci of a dataset, as tsv or json */
+typedef struct msa_stats_report_s
+{
+  FILE * fp;
+  long json;
+  long loci;
+  long cells;           /* sequences times length, summed over loci */
+  msa_stats_t total;
+} msa_stats_report_t;
+
+typedef struct diversity_s
+{
+  char * group;         /* species, NULL for all sequences */
+  long sequences;
+  long sites;           /* sites with data in at least two sequences */
+  long pairs;           /* pairs of sequences with sites in common */
+  long segregating;
+  double pi;
+  double theta_w;
+} diversity_t;
+
+typedef struct sfs_s
+{
+  long folded;
+  long species_count;
+  char ** species;
+  long * samples;           /* allele copies per species */
+  long * loci_incomplete;   /* loci with fewer copies, per species */
+  unsigned long * sites_incomplete; /* sites left out for missing copies */
+  unsigned long ** sfs;     /* samples+1 bins per species */
+  unsigned long ** joint;   /* per pair of species (0,1),(0,2),...,(1,2),...
+                               in row-major order */
+} sfs_t;
+
+typedef struct dstat_s
+{
+  char * taxa[4];
+} dstat_t;
+
+typedef struct dstat_result_s
+{
+  double abba;
+  double baba;
+  double d;
+  long sites;
+} dstat_result_t;
+
+typedef struct vcf_stats_s
+{
+  long loci;
+  long variants;
+  long skipped;     /* non-SNP records */
+  long filtered;    /* records failing FILTER */
+  long unphased;    /* unphased heterozygous genotypes */
+} vcf_stats_t;
+
+typedef struct check_error_s
+{
+  long locus;
+  long line;
+  long offset;      /* byte offset of the offending character or line */
+  char msg[200];
+} check_error_t;
+
+typedef struct check_report_s
+{
+  long loci;
+  long bytes;
+  long errors_count;
+  check_error_t * errors;
+  long stripped_count;
+  long stripped[256];
+} check_report_t;
+
+typedef struct timing_mark_s
+{
+  long wall;
+  double user;
+  double sys;
+} timing_mark_t;
+
+/* macros */
+
+#ifndef MIN
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+#endif
+#ifdef _MSC_VER
+#define SWAP(x,y) do                                                  \
+  {                                                                   \
+    size_t s = MAX(sizeof(x),sizeof(y));                              \
+    unsigned char * temp = (unsigned char *)malloc(s*sizeof(char));   \
+    memcpy(temp,&y,s);                                                \
+    memcpy(&y,&x,s);                                                  \
+    memcpy(&x,temp,s);                                                \
+    free(temp);                                                       \
+  } while(0)
+#else
+#define SWAP(x,y) do { __typeof__ (x) _t = x; x = y; y = _t; } while(0)
+#endif
+
+#ifdef _MSC_VER
+#define PLL_POPCOUNT pll_popcount
+#define PLL_POPCOUNTL pll_popcount64
+#define PLL_CTZ pll_ctz
+#define xtruncate _chsize
+#else
+#define PLL_POPCOUNT __builtin_popcount
+#define PLL_POPCOUNTL __builtin_popcountl
+#define PLL_CTZ __builtin_ctz
+#define xtruncate ftruncate
+#endif
+
+/* common data */
+
+extern __THREAD int bpp_errno;
+extern __THREAD char bpp_errmsg[200];
+
+extern const unsigned int pll_map_nt[256];
+extern const unsigned int pll_map_nt_tcag[256];
+extern const unsigned int pll_map_aa[256];
+extern const unsigned int pll_map_fasta[256];
+extern const unsigned int pll_map_amb[256];
+extern const unsigned int pll_map_validjc69[16];
+extern const unsigned int bpp_tolower_table[256];
+extern const unsigned int pll_map_nt_missing[256];
+extern const unsigned int pll_map_aa_missing[256];
+extern const aa_model_t bpp_aa_models[];
+
+extern long mmx_present;
+extern long sse_present;
+extern long sse2_present;
+extern long sse3_present;
+extern long ssse3_present;
+extern long sse41_present;
+extern long sse42_present;
+extern long popcnt_present;
+extern long avx_present;
+extern long avx2_present;
+extern long altivec_present;
+
+/* functions in maps.c */
+
+const aa_model_t * aa_model_find(const char * name);
+
+/* functions in phylip.c */
+
+phylip_t * phylip_open(const char * filename,
+                       const unsigned int * map);
+
+int phylip_rewind(phylip_t * fd);
+
+void phylip_close(phylip_t * fd);
+
+msa_t * phylip_parse_interleaved(phylip_t * fd);
+
+msa_t * phylip_parse_sequential(phylip_t * fd);
+
+msa_t ** phylip_parse_multisequential(phylip_t * fd, long * count);
+
+msa_t * phylip_parse_next(phylip_t * fd);
+
+void phylip_print(FILE * fp, const msa_t * msa);
+
+/* functions in fasta.c */
+
+msa_t * fasta_parse(const char * filename, const unsigned int * map);
+
+int fasta_import(char ** files,
+                 long count,
+                 const unsigned int * map,
+                 FILE * fp,
+                 long threads,
+                 long * individuals);
+
+void fasta_print(FILE * fp, const msa_t * msa);
+
+/* functions in vcf.c */
+
+int vcf_convert(const char * vcffile,
+                const char * reffile,
+                const char * bedfile,
+                const char * imapfile,
+                long phased,
+                FILE * fp,
+                long threads,
+                vcf_stats_t * stats);
+
+/* functions in check.c */
+
+check_report_t * check_phylip(const char * filename,
+                              const unsigned int * map,
+                              sched_t * sched);
+
+void check_report_destroy(check_report_t * report);
+
+/* functions in nexus.c */
+
+void nexus_print(FILE * fp, const msa_t * msa);
+
+/* functions in util.c */
+
+void progress_setquiet(long quiet);
+void progress_init(const char * prompt, unsigned long size);
+void progress_update(unsigned long progress);
+void progress_done(void);
+void * bpp_malloc(size_t size);
+void * bpp_calloc(size_t nmemb, size_t size);
+void * bpp_realloc(void * ptr, size_t size);
+void * bpp_aligned_alloc(size_t size, size_t alignment);
+char * bpp_strdup(const char * s);
+char * bpp_strndup(const char * s, size_t len);
+char * bpp_asprintf(const char * fmt, ...);
+char * xstrchrnul(char *s, int c);
+long bpp_ftell(FILE * fp);
+long getusec(void);
+void * pll_aligned_alloc(size_t size, size_t alignment);
+void pll_aligned_free(void * ptr);
+int xtolower(int c);
+
+/* functions in arch.c */
+
+uint64_t arch_get_memused(void);
+
+uint64_t arch_get_memtotal(void);
+
+long arch_get_cores(void);
+
+void arch_get_user_system_time(double * user_time, double * system_time);
+
+void arch_get_thread_time(double * user_time, double * system_time);
+
+void arch_srandom(long seed);
+
+long arch_random(void);
+
+/* functions in msa.c */
+
+void msa_print_phylip(FILE * fp,
+                      msa_t ** msa,
+                      long count,
+                      unsigned int ** weights);
+
+void msa_destroy(msa_t * msa);
+
+int msa_remove_ambiguous(msa_t * msa);
+
+int msa_count_ambiguous_sites(msa_t * msa, const unsigned int * map);
+
+long msa_remove_missing_sequences(msa_t * msa);
+
+long msa_filter_missing(msa_t * msa,
+                        double max_sequence,
+                        double max_site,
+                        long * sites_removed);
+
+void msa_compact_columns(msa_t * msa, const unsigned char * mask);
+
+int msa_stats(const msa_t * msa, msa_stats_t * stats);
+
+void msa_stats_begin(msa_stats_report_t * report, FILE * fp, long json);
+
+void msa_stats_add(msa_stats_report_t * report, const msa_stats_t * stats);
+
+void msa_stats_end(msa_stats_report_t * report);
+
+void msa_detect_dtype(msa_t * msa);
+
+/* functions in composition.c */
+
+double composition_pvalue(double chi2, long df);
+
+composition_t * composition_compute(msa_t * msa, const double * model_freqs);
+
+void composition_destroy(composition_t * comp);
+
+/* functions in diversity.c */
+
+diversity_t * diversity_compute(const msa_t * msa, long half, long * count);
+
+void diversity_destroy(diversity_t * div, long count);
+
+/* functions in distance.c */
+
+int distance_counts(const msa_t * msa,
+                    sched_t * sched,
+                    long * diffs,
+                    long * sites);
+
+double distance_value(long diffs, long sites, long model);
+
+/* functions in biallelic.c */
+
+biallelic_t * biallelic_create(const msa_t * msa,
+                               long informative,
+                               const long * order,
+                               long order_count);
+
+void biallelic_destroy(biallelic_t * bi);
+
+/* functions in dedup.c */
+
+dedup_t * dedup_create(long unordered);
+
+void dedup_destroy(dedup_t * d);
+
+long dedup_labels(msa_t * msa, long * dropped);
+
+unsigned long dedup_hash(const dedup_t * d, const msa_t * msa);
+
+long dedup_locus(dedup_t * d, const msa_t * msa, unsigned long hash, long index);
+
+/* functions in fourgamete.c */
+
+fourgamete_t * fourgamete_compute(const msa_t * msa);
+
+void fourgamete_destroy(fourgamete_t * fg);
+
+/* functions in haplotypes.c */
+
+haplotypes_t * haplotypes_compute(const msa_t * msa);
+
+void haplotypes_destroy(haplotypes_t * hap);
+
+/* functions in ld.c */
+
+ld_pair_t * ld_compute(const biallelic_t * a,
+                       const biallelic_t * b,
+                       double min_r2,
+                       long * count);
+
+/* functions in mldist.c */
+
+mldist_t * mldist_create(const aa_model_t * model);
+
+void mldist_destroy(mldist_t * ml);
+
+int mldist_compute(const mldist_t * ml,
+                   const msa_t * msa,
+                   sched_t * sched,
+                   double * dist);
+
+/* functions in dstat.c */
+
+dstat_t * dstat_create(const char * taxa);
+
+void dstat_destroy(dstat_t * ds);
+
+int dstat_compute(const dstat_t * ds,
+                  msa_t ** msa_list,
+                  long msa_count,
+                  sched_t * sched,
+                  dstat_result_t * result);
+
+/* functions in cache.c */
+
+msa_t ** cache_parse(const char * dir,
+                     const char * filename,
+                     int verify,
+                     long * count);
+
+/* functions in hardware.c */
+
+void cpu_features_show(void);
+
+void cpu_features_detect(void);
+
+long cpu_bestarch(void);
+
+long cpu_setarch(long arch);
+
+#ifdef _MSC_VER
+int pll_ctz(unsigned int x);
+unsigned int pll_popcount(unsigned int x);
+unsigned int pll_popcount64(unsigned long x);
+#endif
+
+/* functions in hash.c */
+
+void * hashtable_find(hashtable_t * ht,
+                      void * x,
+                      unsigned long hash,
+                      int (*cb_cmp)(void *, void *));
+
+hashtable_t * hashtable_create(unsigned long items_count);
+
+int hashtable_strcmp(void * x, void * y);
+
+int hashtable_ptrcmp(void * x, void * y);
+
+unsigned long hash_djb2a(char * s);
+
+unsigned long hash_fnv(char * s);
+
+unsigned long hash_bytes(const void * buf, size_t size, unsigned long hash);
+
+int hashtable_insert(hashtable_t * ht,
+                     void * x,
+                     unsigned long hash,
+                     int (*cb_cmp)(void *, void *));
+
+int hashtable_insert_force(hashtable_t * ht,
+                           void * x,
+                           unsigned long hash);
+
+int hashtable_grow(hashtable_t * ht);
+
+void hashtable_destroy(hashtable_t * ht, void (*cb_dealloc)(void *));
+
+int cb_cmp_pairlabel(void * a, void * b);
+
+/* functions in list.c */
+
+int list_append(list_t * list, void * data);
+
+int list_prepend(list_t * list, void * data);
+
+void list_clear(list_t * list, void (*cb_dealloc)(void *));
+
+long list_reposition_tail(list_t * list, list_item_t * item);
+long list_delitem(list_t * list, list_item_t * item, void (*cb_dealloc)(void *));
+
+/* functions in filter.c */
+
+filter_t * filter_create(long type, const char * list);
+
+void filter_destroy(filter_t * f);
+
+long filter_match(const filter_t * f, const char * label);
+
+msa_t * filter_msa(const filter_t * f, msa_t * msa);
+
+long filter_print(const filter_t * f, const msa_t * msa, FILE * fp);
+
+int filter_file(const filter_t * f,
+                const char * filename,
+                FILE * fp,
+                long threads);
+
+int filter_list(const filter_t * f,
+                msa_t ** msa_list,
+                long msa_count,
+                FILE * fp,
+                long threads);
+
+/* functions in pipeline.c */
+
+int pipeline_run(long workers,
+                 void * (*cb_read)(void *),
+                 void * read_data,
+                 void * (*cb_work)(void *, long, void *),
+                 long (*cb_write)(void *, long, void *),
+                 void * data);
+
+void * pipeline_cb_phylip(void * data);
+
+void * pipeline_cb_list(void * data);
+
+/* functions in sfs.c */
+
+sfs_t * sfs_compute(msa_t ** msa_list,
+                    long msa_count,
+                    const char * outgroup,
+                    long diploid,
+                    sched_t * sched);
+
+void sfs_destroy(sfs_t * sfs);
+
+/* functions in sched.c */
+
+sched_t * sched_create(long threads);
+
+int sched_submit(sched_t * s, void (*cb)(void *), void * arg);
+
+int sched_parallel_for(sched_t * s,
+                       long begin,
+                       long end,
+                       long grain,
+                       void (*cb)(long, long, void *),
+                       void * arg);
+
+void sched_wait(sched_t * s);
+
+long sched_worker_id(void);
+
+long sched_threads(sched_t * s);
+
+void sched_destroy(sched_t * s);
+
+/* functions in server.c */
+
+int server_run(const char * path, msa_t ** msa_list, long msa_count);
+
+/* functions in timing.c */
+
+void timing_init(void);
+
+void timing_start(timing_mark_t * mark);
+
+void timing_stop(long phase, timing_mark_t * mark, long bytes, long loci);
+
+int timing_report(long text,
+                  const char * jsonfile,
+                  const char * command,
+                  long threads);
+
+/* functions in kernel.c */
+
+void kernel_init(void);
+
+void kernel_setarch(long arch);
+
+long kernel_getarch(void);
+
+void kernel_lut_init(kernel_lut_t * lut,
+                     const unsigned int * map,
+                     unsigned int value);
+
+void kernel_map_init(kernel_map_t * kmap, const unsigned int * map);
+
+long kernel_legal_prefix(const char * s, long n, const kernel_lut_t * lut);
+
+void kernel_mark_columns(char ** seq,
+                         long count,
+                         long length,
+                         const kernel_lut_t * lut,
+                         unsigned char * mask);
+
+void kernel_missing_counts(char ** seq,
+                           long count,
+                           long length,
+                           const kernel_lut_t * lut,
+                           unsigned int * sites,
+                           long * seqs);
+
+long kernel_compact(char * s, long length, const unsigned char * mask);
+
+void kernel_encode(const char * s,
+                   long n,
+                   const kernel_map_t * kmap,
+                   unsigned char * out);
+
+void kernel_site_patterns(char ** seq,
+                          long n,
+                          const kernel_map_t * kmap,
+                          unsigned short * pats);
+
+void kernel_dstat_accumulate(const unsigned short * pats,
+                             long n,
+                             const double * abba_tbl,
+                             const double * baba_tbl,
+                             double * abba,
+                             double * baba);
+
+void kernel_site_states(char ** seq,
+                        long count,
+                        long length,
+                        const kernel_map_t * kmap,
+                        unsigned char * once,
+                        unsigned char * twice,
+                        unsigned char * amb);
+
+void kernel_bitslice(const char * s,
+                     long n,
+                     const kernel_map_t * kmap,
+                     unsigned long * out);
+
+void kernel_pair_diffs(const unsigned long * a,
+                       const unsigned long * b,
+                       long words,
+                       long half,
+                       long * diff4,
+                       long * sites);
+
+void kernel_ld_counts(const unsigned long * pi,
+                      const unsigned long * xi,
+                      const unsigned long * p,
+                      const unsigned long * x,
+                      long sites,
+                      long words,
+                      unsigned int * counts);
+
+void kernel_allele_counts(const char * s,
+                          long n,
+                          const kernel_map_t * kmap,
+                          const unsigned char (*tbl)[16],
+                          unsigned short * counts);
+
+void kernel_class_counts(const char * s,
+                         long n,
+                         const kernel_map_t * kmap,
+                         long classes,
+                         unsigned long * counts);
+
+void kernel_mismatch_histogram(const unsigned char * a,
+                               const unsigned char * b,
+                               long n,
+                               long states,
+                               unsigned int * counts);
+
+unsigned long kernel_hash(const char * s, long n);
+
+long kernel_memeq(const char * a, const char * b, long n);
+
+long kernel_legal_prefix_cpu(const char * s, long n, const kernel_lut_t * lut);
+
+void kernel_mark_columns_cpu(char ** seq,
+                             long count,
+                             long length,
+                             const kernel_lut_t * lut,
+                             unsigned char * mask);
+
+void kernel_missing_counts_cpu(char ** seq,
+                               long count,
+                               long length,
+                               const kernel_lut_t * lut,
+                               unsigned int * sites,
+                               long * seqs);
+
+long kernel_compact_cpu(char * s, long length, const unsigned char * mask);
+
+void kernel_encode_cpu(const char * s,
+                       long n,
+                       const kernel_map_t * kmap,
+                       unsigned char * out);
+
+void kernel_site_patterns_cpu(char ** seq,
+                              long n,
+                              const kernel_map_t * kmap,
+                              unsigned short * pats);
+
+void kernel_dstat_accumulate_cpu(const unsigned short * pats,
+                                 long n,
+                                 const double * abba_tbl,
+                                 const double * baba_tbl,
+                                 double * abba,
+                                 double * baba);
+
+extern const unsigned char kernel_nt_single[16];
+
+extern const unsigned char kernel_nt_multi[16];
+
+extern const unsigned char kernel_nt_double[16];
+
+void kernel_bitslice_cpu(const char * s,
+                         long n,
+                         const kernel_map_t * kmap,
+                         unsigned long * out);
+
+void kernel_pair_diffs_cpu(const unsigned long * a,
+                           const unsigned long * b,
+                           long words,
+                           long half,
+                           long * diff4,
+                           long * sites);
+
+void kernel_ld_counts_cpu(const unsigned long * pi,
+                          const unsigned long * xi,
+                          const unsigned long * p,
+                          const unsigned long * x,
+                          long sites,
+                          long words,
+                          unsigned int * counts);
+
+void kernel_site_states_cpu(char ** seq,
+                            long count,
+                            long length,
+                            const kernel_map_t * kmap,
+                            unsigned char * once,
+                            unsigned char * twice,
+                            unsigned char * amb);
+
+void kernel_allele_counts_cpu(const char * s,
+                              long n,
+                              const kernel_map_t * kmap,
+                              const unsigned char (*tbl)[16],
+                              unsigned short * counts);
+
+void kernel_class_counts_cpu(const char * s,
+                             long n,
+                             const kernel_map_t * kmap,
+                             long classes,
+                             unsigned long * counts);
+
+void kernel_mismatch_histogram_cpu(const unsigned char * a,
+                                   const unsigned char * b,
+                                   long n,
+                                   long states,
+                                   unsigned int * counts);
+
+extern const unsigned long kernel_hash_keys[4];
+
+unsigned long kernel_hash_finish(const unsigned long * acc,
+                                 const char * s,
+                                 long n,
+                                 long length);
+
+unsigned long kernel_hash_cpu(const char * s, long n);
+
+long kernel_memeq_cpu(const char * a, const char * b, long n);
+
+/* functions in kernel_sse.c */
+
+extern unsigned char kernel_compact_shuffle[256][8];
+
+void kernel_compact_shuffle_init(void);
+
+long kernel_legal_prefix_sse(const char * s, long n, const kernel_lut_t * lut);
+
+void kernel_mark_columns_sse(char ** seq,
+                             long count,
+                             long length,
+                             const kernel_lut_t * lut,
+                             unsigned char * mask);
+
+long kernel_compact_sse(char * s, long length, const unsigned char * mask);
+
+void kernel_encode_sse(const char * s,
+                       long n,
+                       const kernel_map_t * kmap,
+                       unsigned char * out);
+
+void kernel_site_patterns_sse(char ** seq,
+                              long n,
+                              const kernel_map_t * kmap,
+                              unsigned short * pats);
+
+void kernel_dstat_accumulate_sse(const unsigned short * pats,
+                                 long n,
+                                 const double * abba_tbl,
+                                 const double * baba_tbl,
+                                 double * abba,
+                                 double * baba);
+
+void kernel_site_states_sse(char ** seq,
+                            long count,
+                            long length,
+                            const kernel_map_t * kmap,
+                            unsigned char * once,
+                            unsigned char * twice,
+                            unsigned char * amb);
+
+void kernel_bitslice_sse(const char * s,
+                         long n,
+                         const kernel_map_t * kmap,
+                         unsigned long * out);
+
+void kernel_allele_counts_sse(const char * s,
+                              long n,
+                              const kernel_map_t * kmap,
+                              const unsigned char (*tbl)[16],
+                              unsigned short * counts);
+
+void kernel_class_counts_sse(const char * s,
+                             long n,
+                             const kernel_map_t * kmap,
+                             long classes,
+                             unsigned long * counts);
+
+void kernel_mismatch_histogram_sse(const unsigned char * a,
+                                   const unsigned char * b,
+                                   long n,
+                                   long states,
+                                   unsigned int * counts);
+
+long kernel_memeq_sse(const char * a, const char * b, long n);
+
+/* functions in kernel_avx.c */
+
+#ifdef HAVE_AVX
+void kernel_dstat_accumulate_avx(const unsigned short * pats,
+                                 long n,
+                                 const double * abba_tbl,
+                                 const double * baba_tbl,
+                                 double * abba,
+                                 double * baba);
+#endif
+
+/* functions in kernel_avx2.c */
+
+#ifdef HAVE_AVX2
+long kernel_legal_prefix_avx2(const char * s, long n, const kernel_lut_t * lut);
+
+void kernel_mark_columns_avx2(char ** seq,
+                              long count,
+                              long length,
+                              const kernel_lut_t * lut,
+                              unsigned char * mask);
+
+void kernel_missing_counts_avx2(char ** seq,
+                                long count,
+                                long length,
+                                const kernel_lut_t * lut,
+                                unsigned int * sites,
+                                long * seqs);
+
+long kernel_compact_avx2(char * s, long length, const unsigned char * mask);
+
+void kernel_encode_avx2(const char * s,
+                        long n,
+                        const kernel_map_t * kmap,
+                        unsigned char * out);
+
+void kernel_site_patterns_avx2(char ** seq,
+                               long n,
+                               const kernel_map_t * kmap,
+                               unsigned short * pats);
+
+void kernel_dstat_accumulate_avx2(const unsigned short * pats,
+                                  long n,
+                                  const double * abba_tbl,
+                                  const double * baba_tbl,
+                                  double * abba,
+                                  double * baba);
+
+void kernel_site_states_avx2(char ** seq,
+                             long count,
+                             long length,
+                             const kernel_map_t * kmap,
+                             unsigned char * once,
+                             unsigned char * twice,
+                             unsigned char * amb);
+
+void kernel_bitslice_avx2(const char * s,
+                          long n,
+                          const kernel_map_t * kmap,
+                          unsigned long * out);
+
+void kernel_pair_diffs_avx2(const unsigned long * a,
+                            const unsigned long * b,
+                            long words,
+                            long half,
+                            long * diff4,
+                            long * sites);
+
+void kernel_ld_counts_avx2(const unsigned long * pi,
+                           const unsigned long * xi,
+                           const unsigned long * p,
+                           const unsigned long * x,
+                           long sites,
+                           long words,
+                           unsigned int * counts);
+
+void kernel_allele_counts_avx2(const char * s,
+                               long n,
+                               const kernel_map_t * kmap,
+                               const unsigned char (*tbl)[16],
+                               unsigned short * counts);
+
+void kernel_class_counts_avx2(const char * s,
+                              long n,
+                              const kernel_map_t * kmap,
+                              long classes,
+                              unsigned long * counts);
+
+void kernel_mismatch_histogram_avx2(const unsigned char * a,
+                                    const unsigned char * b,
+                                    long n,
+                                    long states,
+                                    unsigned int * counts);
+
+unsigned long kernel_hash_avx2(const char * s, long n);
+
+long kernel_memeq_avx2(const char * a, const char * b, long n);
+#endif
+
+#endif
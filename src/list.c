@@ -19,7 +19,7 @@
     University College London, Gower Street, London WC1E 6BT, England
 */
 
-#include "bpp-tools.h"
+#include "libbpptools.h"
 
 #define DEF_LIST_APPEND   0
 #define DEF_LIST_PREPEND  1
@@ -29,7 +29,8 @@ static int list_insert(list_t * list, void * data, int where)
   if (!list) return 0;
 
   /* create list item */
-  list_item_t * item = (list_item_t *)xmalloc(sizeof(list_item_t));
+  list_item_t * item = (list_item_t *)bpp_malloc(sizeof(list_item_t));
+  if (!item) return 0;
   item->data = data;
 
   /* if list is empty */
@@ -59,14 +60,14 @@ static int list_insert(list_t * list, void * data, int where)
   return 1;
 }
 
-void list_append(list_t * list, void * data)
+int list_append(list_t * list, void * data)
 {
-  list_insert(list, data, DEF_LIST_APPEND);
+  return list_insert(list, data, DEF_LIST_APPEND);
 }
 
-void list_prepend(list_t * list, void * data)
+int list_prepend(list_t * list, void * data)
 {
-  list_insert(list, data, DEF_LIST_PREPEND);
+  return list_insert(list, data, DEF_LIST_PREPEND);
 }
 
 void list_clear(list_t * list, void (*cb_dealloc)(void *))
@@ -0,0 +1,425 @@
+/*
+    Copyright (C) 2022-2023 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London, Gower Street, London WC1E 6BT, England
+*/
+
+#include "bpp-tools.h"
+
+/* Batch mode. Each line of the manifest names an input file, an output
+   file and a command with its argument:
+
+     # input      output      command   argument
+     a.txt        a.out       extract   ^A,b
+     b.txt        b.out       remove    ^C
+     c.txt        c.dstat     dstat     a,b,c,d
+     d.txt        d/locus     explode
+
+   Each file is processed serially as one task of a shared scheduler, and
+   tasks are submitted in decreasing order of input size such that the
+   largest files start first and the small ones fill in the gaps. */
+
+#define MANIFEST_EXTRACT  0
+#define MANIFEST_REMOVE   1
+#define MANIFEST_DSTAT    2
+#define MANIFEST_EXPLODE  3
+
+typedef struct manifest_row_s
+{
+  long lineno;
+  long command;
+  long size;
+  char * input;
+  char * output;
+  filter_t * filter;
+  dstat_t * ds;
+
+  /* outcome */
+  long loci;
+  char * errmsg;
+} manifest_row_t;
+
+static const char * manifest_commands[] = {"extract","remove","dstat","explode"};
+
+/* loci source of a task, either a PHYLIP file read locus by locus or the
+   loci of a cache entry */
+typedef struct manifest_source_s
+{
+  phylip_t * fd;
+  pipeline_list_t list;
+} manifest_source_t;
+
+static int source_open(manifest_source_t * src, const char * input)
+{
+  memset(src, 0, sizeof(manifest_source_t));
+
+  if (opt_cache)
+  {
+    src->list.msa_list = cache_parse(opt_cache,
+                                     input,
+                                     opt_cache_verify,
+                                     &src->list.count);
+    if (!src->list.msa_list)
+      return BPP_FAILURE;
+    if (bpp_errno == ERROR_CACHE)
+      fprintf(stderr, "WARNING: %s\n", bpp_errmsg);
+    return BPP_SUCCESS;
+  }
+
+  src->fd = phylip_open(input, pll_map_fasta);
+  return src->fd ? BPP_SUCCESS : BPP_FAILURE;
+}
+
+/* next locus, or NULL at the end of the input or on error (bpp_errno) */
+static msa_t * source_next(manifest_source_t * src)
+{
+  bpp_errno = 0;
+
+  if (src->fd)
+    return (msa_t *)pipeline_cb_phylip((void *)src->fd);
+
+  return (msa_t *)pipeline_cb_list((void *)&src->list);
+}
+
+static void source_close(manifest_source_t * src)
+{
+  long i;
+
+  if (src->fd)
+    phylip_close(src->fd);
+
+  /* loci not consumed due to an error */
+  for (i = src->list.next; i < src->list.count; ++i)
+    msa_destroy(src->list.msa_list[i]);
+  free(src->list.msa_list);
+}
+
+static int run_filter(manifest_row_t * row, manifest_source_t * src)
+{
+  int rc;
+  msa_t * msa;
+  FILE * fp;
+
+  if (!(fp = output_create(row->output)))
+    return BPP_FAILURE;
+
+  while ((msa = source_next(src)))
+  {
+    row->loci++;
+    if ((msa = filter_msa(row->filter, msa)))
+    {
+      phylip_print(fp, msa);
+      msa_destroy(msa);
+    }
+    else if (bpp_errno)
+      break;
+  }
+
+  rc = !bpp_errno;
+  if (!output_finish(fp))
+    rc = BPP_FAILURE;
+
+  /* a failed row leaves no truncated output */
+  if (!rc)
+    output_discard(row->output);
+
+  return rc;
+}
+
+/* remove the per-locus files of a failed row */
+static void remove_exploded(manifest_row_t * row)
+{
+  long i;
+  char * filename;
+
+  for (i = 0; i < row->loci; ++i)
+  {
+    xasprintf(&filename, "%s.%ld", row->output, i);
+    output_discard(filename);
+    free(filename);
+  }
+}
+
+static int run_explode(manifest_row_t * row, manifest_source_t * src)
+{
+  msa_t * msa;
+  char * filename;
+  FILE * fp;
+
+  while ((msa = source_next(src)))
+  {
+    xasprintf(&filename, "%s.%ld", row->output, row->loci++);
+    fp = output_create(filename);
+    free(filename);
+
+    if (fp)
+    {
+      phylip_print(fp, msa);
+      if (!output_finish(fp))
+        fp = NULL;
+    }
+    msa_destroy(msa);
+
+    if (!fp)
+    {
+      remove_exploded(row);
+      return BPP_FAILURE;
+    }
+  }
+
+  if (bpp_errno)
+  {
+    remove_exploded(row);
+    return BPP_FAILURE;
+  }
+
+  return BPP_SUCCESS;
+}
+
+static int run_dstat(manifest_row_t * row, manifest_source_t * src)
+{
+  long i;
+  int rc;
+  msa_t * msa;
+  FILE * fp;
+  list_t loci;
+  list_item_t * item;
+  msa_t ** msa_list;
+  dstat_result_t result;
+
+  memset(&loci, 0, sizeof(list_t));
+  while ((msa = source_next(src)))
+    if (!list_append(&loci, (void *)msa))
+    {
+      msa_destroy(msa);
+      break;
+    }
+
+  msa_list = (msa_t **)xmalloc((size_t)(loci.count+1) * sizeof(msa_t *));
+  for (i = 0, item = loci.head; item; item = item->next)
+    msa_list[i++] = (msa_t *)(item->data);
+  row->loci = loci.count;
+
+  rc = !bpp_errno && dstat_compute(row->ds, msa_list, loci.count, NULL, &result);
+
+  if (rc && (fp = output_create(row->output)))
+  {
+    fprintf(fp, "Tree: (((%s,%s),%s),%s);\n",
+            row->ds->taxa[0], row->ds->taxa[1],
+            row->ds->taxa[2], row->ds->taxa[3]);
+    fprintf(fp, "abba: %f\n", result.abba);
+    fprintf(fp, "baba: %f\n", result.baba);
+    fprintf(fp, "D: %f\n", result.d);
+    if (!output_finish(fp))
+    {
+      output_discard(row->output);
+      rc = BPP_FAILURE;
+    }
+  }
+  else
+    rc = BPP_FAILURE;
+
+  list_clear(&loci, (void (*)(void *))msa_destroy);
+  free(msa_list);
+
+  return rc;
+}
+
+static void cb_row(void * arg)
+{
+  int rc;
+  manifest_source_t src;
+  manifest_row_t * row = (manifest_row_t *)arg;
+
+  if (!source_open(&src, row->input))
+  {
+    row->errmsg = xstrdup(bpp_errmsg);
+    return;
+  }
+
+  if (row->command == MANIFEST_DSTAT)
+    rc = run_dstat(row, &src);
+  else if (row->command == MANIFEST_EXPLODE)
+    rc = run_explode(row, &src);
+  else
+    rc = run_filter(row, &src);
+
+  if (!rc)
+    row->errmsg = xstrdup(bpp_errmsg);
+
+  source_close(&src);
+}
+
+static int cb_cmp_size(const void * a, const void * b)
+{
+  const manifest_row_t * x = *(manifest_row_t * const *)a;
+  const manifest_row_t * y = *(manifest_row_t * const *)b;
+
+  if (x->size != y->size)
+    return x->size > y->size ? -1 : 1;
+
+  /* keep manifest order for equal sizes */
+  return x->lineno < y->lineno ? -1 : (x->lineno > y->lineno);
+}
+
+/* parse one manifest line into row; returns 0 for blank and comment
+   lines */
+static long parse_row(char * line, long lineno, manifest_row_t * row)
+{
+  long i;
+  char * field[4];
+  char * save;
+  struct stat st;
+
+  for (i = 0; i < 4; ++i)
+    field[i] = strtok_r(i ? NULL : line, " \t\r\n", &save);
+
+  if (!field[0] || field[0][0] == '#')
+    return 0;
+
+  if (!field[2])
+    fatal("Manifest line %ld: expected input, output and command", lineno);
+
+  memset(row, 0, sizeof(manifest_row_t));
+  row->lineno = lineno;
+
+  for (i = 0; i < 4; ++i)
+    if (!strcasecmp(field[2], manifest_commands[i]))
+      break;
+  if (i == 4)
+    fatal("Manifest line %ld: unknown command (%s)", lineno, field[2]);
+  row->command = i;
+
+  if ((row->command == MANIFEST_EXPLODE) != !field[3] ||
+      strtok_r(NULL, " \t\r\n", &save))
+    fatal("Manifest line %ld: wrong number of arguments for %s",
+          lineno, field[2]);
+
+  if (stat(field[0], &st))
+    fatal("Manifest line %ld: unable to open file (%s)", lineno, field[0]);
+
+  row->size = (long)st.st_size;
+  row->input = xstrdup(field[0]);
+  row->output = xstrdup(field[1]);
+
+  /* check arguments before any file is processed */
+  if (row->command == MANIFEST_EXTRACT || row->command == MANIFEST_REMOVE)
+  {
+    row->filter = filter_create(row->command == MANIFEST_EXTRACT ?
+                                  FILTER_EXTRACT : FILTER_REMOVE,
+                                field[3]);
+    if (!row->filter)
+      fatal("Manifest line %ld: %s", lineno, bpp_errmsg);
+  }
+  else if (row->command == MANIFEST_DSTAT)
+  {
+    if (!(row->ds = dstat_create(field[3])))
+      fatal("Manifest line %ld: %s", lineno, bpp_errmsg);
+  }
+
+  return 1;
+}
+
+void cmd_manifest()
+{
+  long i;
+  long lineno = 0;
+  long count = 0;
+  long maxcount = 16;
+  long failed = 0;
+  char * line = NULL;
+  size_t line_size = 0;
+  FILE * fp;
+  sched_t * sched;
+  manifest_row_t * rows;
+  manifest_row_t ** order;
+  timing_mark_t mark;
+
+  fp = xopen(opt_manifest, "r");
+
+  rows = (manifest_row_t *)xmalloc((size_t)maxcount * sizeof(manifest_row_t));
+  while (getline(&line, &line_size, fp) != -1)
+  {
+    if (count == maxcount)
+    {
+      maxcount *= 2;
+      rows = (manifest_row_t *)xrealloc(rows, (size_t)maxcount *
+                                              sizeof(manifest_row_t));
+    }
+    count += parse_row(line, ++lineno, rows+count);
+  }
+  free(line);
+  fclose(fp);
+
+  if (!count)
+    fatal("Manifest %s lists no files", opt_manifest);
+
+  /* largest files first */
+  order = (manifest_row_t **)xmalloc((size_t)count * sizeof(manifest_row_t *));
+  for (i = 0; i < count; ++i)
+    order[i] = rows+i;
+  qsort(order, (size_t)count, sizeof(manifest_row_t *), cb_cmp_size);
+
+  printf("Processing %ld files with %ld threads\n", count, opt_threads);
+
+  timing_start(&mark);
+
+  sched = xsched_create(MIN(opt_threads,count));
+  for (i = 0; i < count; ++i)
+    if (!sched_submit(sched, cb_row, (void *)order[i]))
+      fatal("%s", bpp_errmsg);
+  sched_wait(sched);
+  sched_destroy(sched);
+
+  timing_stop(TIMING_PHASE_PROCESS, &mark, 0, 0);
+
+  /* report in manifest order */
+  for (i = 0; i < count; ++i)
+  {
+    manifest_row_t * row = rows+i;
+
+    if (row->errmsg)
+    {
+      fprintf(stderr, "Error in manifest line %ld (%s): %s\n",
+              row->lineno, row->input, row->errmsg);
+      failed++;
+    }
+    else if (!opt_quiet)
+      printf("%s: %s %ld loci -> %s\n",
+             row->input, manifest_commands[row->command], row->loci,
+             row->output);
+
+    if (row->filter)
+      filter_destroy(row->filter);
+    if (row->ds)
+      dstat_destroy(row->ds);
+    free(row->errmsg);
+    free(row->input);
+    free(row->output);
+  }
+
+  free(order);
+  free(rows);
+
+  /* the outputs of the rows that succeeded are kept */
+  if (failed)
+  {
+    output_commit();
+    fatal("%ld of %ld files failed", failed, count);
+  }
+}
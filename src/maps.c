@@ -19,7 +19,7 @@
     University College London, Gower Street, London WC1E 6BT, England
 */
 
-#include "bpp-tools.h"
+#include "libbpptools.h"
 
 /* maps for encoding sequences */
 
@@ -1008,3 +1008,40 @@ const double pll_aa_freqs_stmtrev[20] =
    0.1617310001, 0.0551341000, 0.0233262000, 0.0911252000, 0.0344713001,
    0.0771077000, 0.0418603001, 0.0200784000, 0.0305429000, 0.0643851996
  };
+
+/* empirical amino acid models, in the state order of pll_map_aa */
+
+const aa_model_t bpp_aa_models[] =
+ {
+   { "dayhoff",   pll_aa_rates_dayhoff,   pll_aa_freqs_dayhoff   },
+   { "lg",        pll_aa_rates_lg,        pll_aa_freqs_lg        },
+   { "dcmut",     pll_aa_rates_dcmut,     pll_aa_freqs_dcmut     },
+   { "jtt",       pll_aa_rates_jtt,       pll_aa_freqs_jtt       },
+   { "mtrev",     pll_aa_rates_mtrev,     pll_aa_freqs_mtrev     },
+   { "wag",       pll_aa_rates_wag,       pll_aa_freqs_wag       },
+   { "rtrev",     pll_aa_rates_rtrev,     pll_aa_freqs_rtrev     },
+   { "cprev",     pll_aa_rates_cprev,     pll_aa_freqs_cprev     },
+   { "vt",        pll_aa_rates_vt,        pll_aa_freqs_vt        },
+   { "blosum62",  pll_aa_rates_blosum62,  pll_aa_freqs_blosum62  },
+   { "mtmam",     pll_aa_rates_mtmam,     pll_aa_freqs_mtmam     },
+   { "mtart",     pll_aa_rates_mtart,     pll_aa_freqs_mtart     },
+   { "mtzoa",     pll_aa_rates_mtzoa,     pll_aa_freqs_mtzoa     },
+   { "pmb",       pll_aa_rates_pmb,       pll_aa_freqs_pmb       },
+   { "hivb",      pll_aa_rates_hivb,      pll_aa_freqs_hivb      },
+   { "hivw",      pll_aa_rates_hivw,      pll_aa_freqs_hivw      },
+   { "jttdcmut",  pll_aa_rates_jttdcmut,  pll_aa_freqs_jttdcmut  },
+   { "flu",       pll_aa_rates_flu,       pll_aa_freqs_flu       },
+   { "stmtrev",   pll_aa_rates_stmtrev,   pll_aa_freqs_stmtrev   },
+   { NULL, NULL, NULL }
+ };
+
+const aa_model_t * aa_model_find(const char * name)
+{
+  long i;
+
+  for (i = 0; bpp_aa_models[i].name; ++i)
+    if (!strcasecmp(bpp_aa_models[i].name, name))
+      return bpp_aa_models+i;
+
+  return NULL;
+}
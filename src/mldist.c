@@ -0,0 +1,414 @@
+/*
+    Copyright (C) 2022-2023 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London, Gower Street, London WC1E 6BT, England
+*/
+
+
+#include "libbpptools.h"
+
+/* Maximum likelihood distances between protein sequences under an empirical
+   model of maps.c. The rate matrix Q = R diag(pi), scaled to one expected
+   substitution per unit time, is similar to the symmetric matrix
+   S = diag(pi)^(1/2) R diag(pi)^(1/2) + diag(Q), which is eigendecomposed
+   once by the Jacobi method into S = U diag(lambda) U^T. The joint
+   probability of states x and y at distance t is then
+
+     pi_x P_xy(t) = sum_k sqrt(pi_x pi_y) U_xk U_yk exp(lambda_k t)
+
+   which is symmetric in x,y. For each pair of sequences the sites are
+   reduced to a 21x21 histogram of state pairs, code 0 standing for anything
+   but an unambiguous amino acid. Only the sites at which the two sequences
+   differ are visited (kernel_mismatch_histogram); the diagonal follows from
+   the state counts of each sequence, computed once, as every row of the
+   histogram sums to them. The histogram is folded to the nonzero entries of
+   its upper triangle and the log-likelihood is maximized by Newton's method
+   safeguarded by bisection. Pairs are processed in parallel. */
+
+#define ML_STATES     20
+#define ML_CODES      (ML_STATES+1)
+#define ML_ENTRIES    (ML_STATES*(ML_STATES+1)/2)
+#define ML_MAXDIST    20.0
+#define ML_TOLERANCE  1e-10
+#define ML_MAXITER    100
+#define ML_GRAIN      16
+
+typedef struct mldist_job_s
+{
+  const mldist_t * model;
+  const unsigned char * seqs;
+  const unsigned long * states;
+  long count;
+  long length;
+  double * dist;
+} mldist_job_t;
+
+static unsigned int ml_map[256];
+static kernel_map_t ml_kmap;
+static pthread_once_t ml_once = PTHREAD_ONCE_INIT;
+
+/* amino acids are encoded as 1..20 and all other characters as 0 */
+static void ml_init()
+{
+  long i;
+
+  for (i = 0; i < 256; ++i)
+    ml_map[i] = PLL_POPCOUNT(pll_map_aa[i]) == 1 ?
+                  (unsigned int)__builtin_ctz(pll_map_aa[i]) + 1 : 0;
+
+  kernel_map_init(&ml_kmap, ml_map);
+}
+
+/* eigendecomposition of the symmetric n x n matrix a by cyclic Jacobi
+   rotations; a is destroyed, eigenvalues are stored in w and eigenvectors
+   in the columns of v */
+static int jacobi(double * a, long n, double * w, double * v)
+{
+  long i,j,k,sweep;
+
+  for (i = 0; i < n; ++i)
+    for (j = 0; j < n; ++j)
+      v[i*n+j] = (i == j) ? 1 : 0;
+
+  for (sweep = 0; sweep < 100; ++sweep)
+  {
+    double off = 0;
+
+    for (i = 0; i < n; ++i)
+      for (j = i+1; j < n; ++j)
+        off += a[i*n+j] * a[i*n+j];
+
+    if (off < 1e-30)
+    {
+      for (i = 0; i < n; ++i)
+        w[i] = a[i*n+i];
+      return BPP_SUCCESS;
+    }
+
+    for (i = 0; i < n; ++i)
+      for (j = i+1; j < n; ++j)
+      {
+        if (fabs(a[i*n+j]) < 1e-300) continue;
+
+        double theta = (a[j*n+j] - a[i*n+i]) / (2*a[i*n+j]);
+        double t = (theta >= 0 ? 1 : -1) /
+                   (fabs(theta) + sqrt(theta*theta + 1));
+        double c = 1 / sqrt(t*t + 1);
+        double s = t*c;
+
+        for (k = 0; k < n; ++k)
+        {
+          double aki = a[k*n+i];
+          double akj = a[k*n+j];
+          a[k*n+i] = c*aki - s*akj;
+          a[k*n+j] = s*aki + c*akj;
+        }
+        for (k = 0; k < n; ++k)
+        {
+          double aik = a[i*n+k];
+          double ajk = a[j*n+k];
+          a[i*n+k] = c*aik - s*ajk;
+          a[j*n+k] = s*aik + c*ajk;
+        }
+        for (k = 0; k < n; ++k)
+        {
+          double vki = v[k*n+i];
+          double vkj = v[k*n+j];
+          v[k*n+i] = c*vki - s*vkj;
+          v[k*n+j] = s*vki + c*vkj;
+        }
+      }
+  }
+
+  bpp_errno = ERROR_MLDIST_MODEL;
+  snprintf(bpp_errmsg, 200, "Eigendecomposition did not converge");
+  return BPP_FAILURE;
+}
+
+mldist_t * mldist_create(const aa_model_t * model)
+{
+  long i,j,k,e;
+  double sum = 0;
+  double rate = 0;
+  double pi[ML_STATES];
+  double s[ML_STATES*ML_STATES];
+  double u[ML_STATES*ML_STATES];
+  double r[ML_STATES*ML_STATES];
+
+  for (i = 0; i < ML_STATES; ++i)
+  {
+    if (model->freqs[i] <= 0)
+    {
+      bpp_errno = ERROR_MLDIST_MODEL;
+      snprintf(bpp_errmsg, 200,
+               "Model %s has a zero amino acid frequency", model->name);
+      return NULL;
+    }
+    sum += model->freqs[i];
+  }
+
+  for (i = 0; i < ML_STATES; ++i)
+    pi[i] = model->freqs[i] / sum;
+
+  /* exchangeabilities are stored as the upper triangle in row-major order */
+  for (i = 0, k = 0; i < ML_STATES; ++i)
+  {
+    r[i*ML_STATES+i] = 0;
+    for (j = i+1; j < ML_STATES; ++j, ++k)
+      r[i*ML_STATES+j] = r[j*ML_STATES+i] = model->rates[k];
+  }
+
+  for (i = 0; i < ML_STATES; ++i)
+    for (j = 0; j < ML_STATES; ++j)
+      rate += pi[i] * r[i*ML_STATES+j] * pi[j];
+
+  for (i = 0; i < ML_STATES; ++i)
+  {
+    double diag = 0;
+
+    for (j = 0; j < ML_STATES; ++j)
+    {
+      s[i*ML_STATES+j] = sqrt(pi[i]*pi[j]) * r[i*ML_STATES+j] / rate;
+      diag += r[i*ML_STATES+j] * pi[j] / rate;
+    }
+    s[i*ML_STATES+i] = -diag;
+  }
+
+  mldist_t * ml = (mldist_t *)bpp_malloc(sizeof(mldist_t));
+  if (!ml)
+    return NULL;
+
+  if (!jacobi(s, ML_STATES, ml->lambda, u))
+  {
+    free(ml);
+    return NULL;
+  }
+
+  /* coefficients of the joint probability of each unordered state pair */
+  for (i = 0, e = 0; i < ML_STATES; ++i)
+    for (j = i; j < ML_STATES; ++j, ++e)
+      for (k = 0; k < ML_STATES; ++k)
+        ml->coef[e][k] = sqrt(pi[i]*pi[j]) * u[i*ML_STATES+k] *
+                         u[j*ML_STATES+k];
+
+  return ml;
+}
+
+void mldist_destroy(mldist_t * ml)
+{
+  free(ml);
+}
+
+/* ML distance from the histogram of state pairs of two sequences; negative
+   if undefined, i.e. no sites in common or saturated */
+static double ml_estimate(const mldist_t * ml, const unsigned int * hist)
+{
+  long i,j,k,e,m;
+  long iter;
+  long entries = 0;
+  double sites = 0;
+  double diffs = 0;
+  double lo = 0;
+  double hi = ML_MAXDIST;
+  double t;
+  double weight[ML_ENTRIES];
+  long index[ML_ENTRIES];
+
+  /* nonzero entries of the folded histogram, ignoring code 0 (missing) */
+  for (i = 1, e = 0; i < ML_CODES; ++i)
+    for (j = i; j < ML_CODES; ++j, ++e)
+    {
+      unsigned int n = hist[i*ML_CODES+j];
+
+      if (i != j)
+      {
+        n += hist[j*ML_CODES+i];
+        diffs += n;
+      }
+      if (!n) continue;
+
+      sites += n;
+      weight[entries] = n;
+      index[entries++] = e;
+    }
+
+  if (!sites)
+    return -1;
+  if (!diffs)
+    return 0;
+
+  /* start from the Poisson correction of the p-distance */
+  t = diffs < 0.95*sites ? -log(1 - diffs/sites) : 3;
+
+  for (iter = 0; iter < ML_MAXITER; ++iter)
+  {
+    double d1 = 0;
+    double d2 = 0;
+    double ex[ML_STATES];
+
+    for (k = 0; k < ML_STATES; ++k)
+      ex[k] = exp(ml->lambda[k]*t);
+
+    for (m = 0; m < entries; ++m)
+    {
+      const double * c = ml->coef[index[m]];
+      double f0 = 0;
+      double f1 = 0;
+      double f2 = 0;
+
+      for (k = 0; k < ML_STATES; ++k)
+      {
+        double x = c[k]*ex[k];
+        f0 += x;
+        f1 += ml->lambda[k]*x;
+        f2 += ml->lambda[k]*ml->lambda[k]*x;
+      }
+
+      f0 = MAX(f0, 1e-300);
+      d1 += weight[m] * f1 / f0;
+      d2 += weight[m] * (f2/f0 - (f1/f0)*(f1/f0));
+    }
+
+    /* the optimum is bracketed by [lo,hi] */
+    if (d1 > 0)
+      lo = t;
+    else
+      hi = t;
+
+    double next = t - d1/d2;
+    if (d2 >= 0 || next <= lo || next >= hi)
+      next = (lo + hi) / 2;
+
+    if (fabs(next - t) < ML_TOLERANCE * (1 + t))
+    {
+      t = next;
+      break;
+    }
+    t = next;
+  }
+
+  if (t >= ML_MAXDIST * (1 - 1e-6))
+    return -1;
+
+  return t;
+}
+
+static void cb_mldist_pairs(long begin, long end, void * arg)
+{
+  long p;
+  long i = 0;
+  long j;
+  long q = begin;
+  long x,y;
+  unsigned int hist[ML_CODES*ML_CODES];
+  mldist_job_t * job = (mldist_job_t *)arg;
+  long n = job->count;
+
+  /* begin-th pair of the upper triangle in row-major order */
+  while (q >= n-1-i)
+  {
+    q -= n-1-i;
+    ++i;
+  }
+  j = i+1+q;
+
+  for (p = begin; p < end; ++p)
+  {
+    const unsigned long * states = job->states + i*ML_CODES;
+
+    memset(hist, 0, ML_CODES*ML_CODES*sizeof(unsigned int));
+    kernel_mismatch_histogram(job->seqs + i*job->length,
+                              job->seqs + j*job->length,
+                              job->length, ML_CODES, hist);
+
+    for (x = 0; x < ML_CODES; ++x)
+    {
+      unsigned long diag = states[x];
+
+      for (y = 0; y < ML_CODES; ++y)
+        if (y != x)
+          diag -= hist[x*ML_CODES+y];
+      hist[x*ML_CODES+x] = (unsigned int)diag;
+    }
+
+    job->dist[i*n+j] = job->dist[j*n+i] = ml_estimate(job->model, hist);
+
+    if (++j == n)
+    {
+      ++i;
+      j = i+1;
+    }
+  }
+}
+
+/* Fill the count x count matrix dist with the ML distances between all
+   pairs of sequences of msa; undefined distances are negative */
+int mldist_compute(const mldist_t * ml,
+                   const msa_t * msa,
+                   sched_t * sched,
+                   double * dist)
+{
+  long i;
+  long n = msa->count;
+  long pairs = n*(n-1)/2;
+  mldist_job_t job;
+
+  pthread_once(&ml_once, ml_init);
+
+  unsigned char * seqs =
+    (unsigned char *)bpp_malloc((size_t)MAX(n*msa->length,1));
+  unsigned long * states = (unsigned long *)bpp_calloc((size_t)(n*ML_CODES),
+                                                       sizeof(unsigned long));
+  if (!seqs || !states)
+  {
+    free(seqs);
+    free(states);
+    return BPP_FAILURE;
+  }
+  for (i = 0; i < n; ++i)
+  {
+    kernel_encode(msa->sequence[i], msa->length, &ml_kmap,
+                  seqs + i*msa->length);
+    kernel_class_counts(msa->sequence[i], msa->length, &ml_kmap, ML_CODES,
+                        states + i*ML_CODES);
+  }
+
+  job.model = ml;
+  job.seqs = seqs;
+  job.states = states;
+  job.count = n;
+  job.length = msa->length;
+  job.dist = dist;
+
+  for (i = 0; i < n; ++i)
+    dist[i*n+i] = 0;
+
+  int rc = BPP_SUCCESS;
+  if (sched && pairs > ML_GRAIN)
+  {
+    rc = sched_parallel_for(sched, 0, pairs, ML_GRAIN, cb_mldist_pairs,
+                            (void *)&job);
+    sched_wait(sched);
+  }
+  else if (pairs)
+    cb_mldist_pairs(0, pairs, (void *)&job);
+
+  free(seqs);
+  free(states);
+  return rc;
+}
@@ -19,7 +19,7 @@
     University College London, Gower Street, London WC1E 6BT, England
 */
 
-#include "bpp-tools.h"
+#include "libbpptools.h"
 
 const unsigned int bpp_nt_normal[256] =
 {
@@ -51,11 +51,11 @@ static void print_pretty_phylip_dna(FILE * fp,
   long i,j;
   if (!msa) return;
 
-  fprintf(fp, "%d %d P\n", msa->count, msa->length);
+  fprintf(fp, "%ld %ld P\n", msa->count, msa->length);
   for (i = 0; i < msa->count; ++i)
   {
     fprintf(fp, "%-*s", pad, msa->label[i]);
-    for (j = 0; j < (long)(msa->length); ++j)
+    for (j = 0; j < msa->length; ++j)
     {
       /* note: prints an extra space before the sequence */
       if (j % every == 0)
@@ -86,11 +86,11 @@ static void print_pretty_phylip(FILE * fp,
     return;
   }
 
-  fprintf(fp, "%d %d P\n", msa->count, msa->length);
+  fprintf(fp, "%ld %ld P\n", msa->count, msa->length);
   for (i = 0; i < msa->count; ++i)
   {
     fprintf(fp, "%-*s", pad, msa->label[i]);
-    for (j = 0; j < (long)(msa->length); ++j)
+    for (j = 0; j < msa->length; ++j)
     {
       /* note: prints an extra space before the sequence */
       if (j % every == 0)
@@ -113,7 +113,7 @@ void msa_print_phylip(FILE * fp,
 {
   int every = 10;  /* separate data in sequence every 10 bases */
   int pad = 4;
-  int maxlen = 0;
+  long maxlen = 0;
   long i,j,k;
 
   /* find length of longest sequence label */
@@ -129,185 +129,506 @@ void msa_print_phylip(FILE * fp,
 
   for (i = 0; i < count; ++i)
   {
-    print_pretty_phylip(fp, msa[i], maxlen+pad, every, weights[i]);
+    print_pretty_phylip(fp, msa[i], (int)maxlen+pad, every, weights[i]);
     fprintf(fp,"\n");
   }
 }
 
-void msa_count_ambiguous_sites(msa_t * msa, const unsigned int * map)
+int msa_count_ambiguous_sites(msa_t * msa, const unsigned int * map)
 {
-  int i,j;
-  int amb;
+  long i;
+  kernel_lut_t lut;
+  unsigned char * mask;
 
   msa->amb_sites_count = 0;
 
-  if (msa->dtype == BPP_DATA_AA) return;
+  if (msa->dtype == BPP_DATA_AA) return BPP_SUCCESS;
   assert(msa->dtype == BPP_DATA_DNA);
 
+  kernel_lut_init(&lut, map, 1);
+
+  mask = (unsigned char *)bpp_malloc((size_t)MAX(msa->length,1));
+  if (!mask)
+    return BPP_FAILURE;
+  kernel_mark_columns(msa->sequence, msa->count, msa->length, &lut, mask);
+
   for (i = 0; i < msa->length; ++i)
+    msa->amb_sites_count += mask[i];
+
+  free(mask);
+  return BPP_SUCCESS;
+}
+
+static unsigned char * mark_ambiguous_sites(msa_t * msa,
+                                            const unsigned int * map)
+{
+  long i;
+  kernel_lut_t lut;
+  unsigned char * ambvector;
+
+  ambvector = (unsigned char *)bpp_malloc((size_t)MAX(msa->length,1));
+  if (!ambvector)
+    return NULL;
+
+  kernel_lut_init(&lut, map, 1);
+  kernel_mark_columns(msa->sequence, msa->count, msa->length, &lut, ambvector);
+
+  msa->amb_sites_count = 0;
+  for (i = 0; i < msa->length; ++i)
+    msa->amb_sites_count += ambvector[i];
+
+  return ambvector;
+}
+
+/* remove the columns marked in mask, keeping the order of the remaining
+   columns */
+void msa_compact_columns(msa_t * msa, const unsigned char * mask)
+{
+  long i;
+  long length = msa->length;
+
+  for (i = 0; i < msa->count; ++i)
   {
-    amb = 0;
-    for (j = 0; j < msa->count; ++j)
-      amb |= map[(int)(msa->sequence[j][i])];
+    length = kernel_compact(msa->sequence[i], msa->length, mask);
+    msa->sequence[i][length] = 0;
+  }
+
+  if (msa->count)
+    msa->length = length;
+}
+
+/* returns 0 if all sites are ambiguous, or if memory runs out (with
+   bpp_errno set) */
+int msa_remove_ambiguous(msa_t * msa)
+{
+  unsigned char * ambiguous;
+
+  /* get a vector indicating which sites are ambiguous */
+  if (!(ambiguous = mark_ambiguous_sites(msa,pll_map_amb)))
+    return 0;
 
-    if (amb)
-      msa->amb_sites_count++;
+  /* if all sites contain ambigous characters exit with error */
+  if (msa->amb_sites_count == msa->length)
+  {
+    free(ambiguous);
+    return 0;
   }
+
+  /* remove ambiugous sites from alignment */
+  msa_compact_columns(msa,ambiguous);
+
+  free(ambiguous);
+
+  return 1;
 }
-static int * mark_ambiguous_sites(msa_t * msa, const unsigned int * map)
+
+static kernel_lut_t dtype_lut;
+static pthread_once_t dtype_once = PTHREAD_ONCE_INIT;
+
+static void dtype_init(void)
 {
-  int i,j;
-  int amb;
-  int * ambvector = (int *)xcalloc(msa->length, sizeof(int));
+  long i;
+  unsigned int map[256];
 
-  msa->amb_sites_count = 0;
+  for (i = 0; i < 256; ++i)
+    map[i] = pll_map_nt[i] ? 1 : 0;
 
-  for (i = 0; i < msa->length; ++i)
+  kernel_lut_init(&dtype_lut, map, 1);
+}
+
+/* loci are parsed as nucleotide data; a locus is protein if any of its
+   characters is not a nucleotide code */
+void msa_detect_dtype(msa_t * msa)
+{
+  long i;
+
+  pthread_once(&dtype_once, dtype_init);
+
+  msa->dtype = BPP_DATA_DNA;
+  for (i = 0; i < msa->count; ++i)
+    if (kernel_legal_prefix(msa->sequence[i], msa->length,
+                            &dtype_lut) < msa->length)
+    {
+      msa->dtype = BPP_DATA_AA;
+      return;
+    }
+}
+
+static kernel_map_t stats_kmap;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+
+static void stats_init(void)
+{
+  kernel_map_init(&stats_kmap, pll_map_nt);
+}
+
+/* amino acid counterpart of kernel_site_states, with one bit per residue
+   in the 20-bit codes of pll_map_aa */
+static int stats_aa_sites(const msa_t * msa, msa_stats_t * stats)
+{
+  long i,j;
+  unsigned int * once;
+  unsigned int * twice;
+  unsigned char * amb;
+
+  once = (unsigned int *)bpp_calloc(2*(size_t)msa->length,
+                                    sizeof(unsigned int));
+  amb = (unsigned char *)bpp_calloc((size_t)msa->length, 1);
+  if (!once || !amb)
   {
-    amb = 0;
-    for (j = 0; j < msa->count; ++j)
-      amb |= map[(int)(msa->sequence[j][i])];
+    free(once);
+    free(amb);
+    return BPP_FAILURE;
+  }
+  twice = once + msa->length;
 
-    if (amb)
+  for (j = 0; j < msa->count; ++j)
+  {
+    const unsigned char * s = (const unsigned char *)msa->sequence[j];
+    for (i = 0; i < msa->length; ++i)
     {
-      ambvector[i] = 1;
-      msa->amb_sites_count++;
+      unsigned int code = pll_map_aa[s[i]];
+
+      if (code & (code-1))
+        amb[i] = 1;
+      else
+      {
+        twice[i] |= once[i] & code;
+        once[i] |= code;
+      }
     }
   }
 
-  return ambvector;
+  for (i = 0; i < msa->length; ++i)
+  {
+    stats->ambiguous_sites += amb[i];
+    if (once[i] & (once[i]-1))
+      stats->segregating++;
+    if (twice[i] & (twice[i]-1))
+      stats->informative++;
+  }
+
+  free(once);
+  free(amb);
+  return BPP_SUCCESS;
 }
 
-static int remove_ambiguous(msa_t * msa, int * ambiguous)
+int msa_stats(const msa_t * msa, msa_stats_t * stats)
 {
-  int i,j,k;
-  int amb_count = 0;
+  long i,j;
+  long hist[256];
+  unsigned char * once;
+  unsigned char * twice;
+  unsigned char * amb;
+  const unsigned int * map;
 
-  for (i = 0; i < msa->length; ++i)
-    amb_count += ambiguous[i];
+  static const unsigned char popcount[16] = {0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4};
 
-  /* if all sites contain ambigous characters exit with error */
-  if (amb_count == msa->length)
-    return 0;
+  memset(stats, 0, sizeof(msa_stats_t));
+  stats->sequences = msa->count;
+  stats->length = msa->length;
 
-  /* we will move all ambiguous sites to the right end of the alignment */
+  /* character composition */
+  memset(hist, 0, 256*sizeof(long));
+  for (i = 0; i < msa->count; ++i)
+  {
+    const unsigned char * s = (const unsigned char *)msa->sequence[i];
+    for (j = 0; j < msa->length; ++j)
+      hist[s[j]]++;
+  }
 
-  i = 0;  j = msa->length-1;
-  for (i = 0, j = msa->length-1; i < msa->length && j >= 0; ++i, --j)
+  map = (msa->dtype == BPP_DATA_DNA) ? pll_map_nt_missing : pll_map_aa_missing;
+  for (i = 0; i < 256; ++i)
   {
-    /* find next ambiguous site from left to right */
-    while (i < msa->length && !ambiguous[i])
-      ++i;
+    if (!hist[i]) continue;
+
+    if (map[i])
+      stats->missing += hist[i];
+
+    if (msa->dtype != BPP_DATA_DNA) continue;
+
+    unsigned int code = pll_map_nt[i] & 0xf;
+    if (kernel_nt_single[code])
+      stats->bases += hist[i];
+    if (code == 2 || code == 4)
+      stats->gc += hist[i];
+  }
+  stats->gaps = hist['-'];
+
+  haplotypes_t * hap = haplotypes_compute(msa);
+  if (!hap)
+    return BPP_FAILURE;
+  stats->haplotypes = hap->count;
+  haplotypes_destroy(hap);
+
+  if (!msa->length) return BPP_SUCCESS;
 
-    /* find next non-ambigous site from right to left */
-    while (j >= 0 && ambiguous[j])
-      --j;
+  if (msa->dtype != BPP_DATA_DNA)
+    return stats_aa_sites(msa, stats);
 
-    /* if we moved all sites containing ambiguities to the right, break */
-    if (j < i) break;
+  /* per-site nucleotide sets, folded over all sequences in one pass */
+  pthread_once(&stats_once, stats_init);
 
-    /* swap sites */
-    for (k = 0; k < msa->count; ++k)
-      SWAP(msa->sequence[k][i],msa->sequence[k][j]);
+  once = (unsigned char *)bpp_malloc(3*(size_t)msa->length);
+  if (!once)
+    return BPP_FAILURE;
+  twice = once + msa->length;
+  amb = twice + msa->length;
+  kernel_site_states(msa->sequence, msa->count, msa->length, &stats_kmap,
+                     once, twice, amb);
 
-    /* swap mark */
-    SWAP(ambiguous[j],ambiguous[i]);
+  for (i = 0; i < msa->length; ++i)
+  {
+    stats->ambiguous_sites += amb[i];
+    if (popcount[once[i]] > 1)
+      stats->segregating++;
+    if (popcount[twice[i]] > 1)
+      stats->informative++;
   }
 
-  /* all ambiguous sites should now be at the right end. We will place
-     terminating zeroes to the new sequence lengths and update the length
-     variable */
-  msa->length -= amb_count;
+  free(once);
+  return BPP_SUCCESS;
+}
 
-  for (k = 0; k < msa->count; ++k)
-    msa->sequence[k][msa->length] = 0;
+static double ratio(long a, long b)
+{
+  return b ? (double)a / b : 0;
+}
 
-  return 1;
+static void stats_print(msa_stats_report_t * report,
+                        const char * name,
+                        const msa_stats_t * s,
+                        long cells)
+{
+  if (report->json)
+    fprintf(report->fp,
+            "{ \"locus\": %s, \"sequences\": %ld, \"length\": %ld, "
+            "\"missing\": %.6f, \"gaps\": %.6f, \"ambiguous_sites\": %ld, "
+            "\"gc\": %.6f, \"segregating\": %ld, \"informative\": %ld, "
+            "\"haplotypes\": %ld }",
+            name, s->sequences, s->length, ratio(s->missing,cells),
+            ratio(s->gaps,cells), s->ambiguous_sites, ratio(s->gc,s->bases),
+            s->segregating, s->informative, s->haplotypes);
+  else
+    fprintf(report->fp, "%s\t%ld\t%ld\t%.6f\t%.6f\t%ld\t%.6f\t%ld\t%ld\t%ld\n",
+            name, s->sequences, s->length, ratio(s->missing,cells),
+            ratio(s->gaps,cells), s->ambiguous_sites, ratio(s->gc,s->bases),
+            s->segregating, s->informative, s->haplotypes);
 }
 
-int msa_remove_ambiguous(msa_t * msa)
+/* one row per locus, numbered from 1, and a last row over all loci, in
+   which counts are summed and fractions are taken over the pooled data */
+void msa_stats_begin(msa_stats_report_t * report, FILE * fp, long json)
 {
-  int * ambiguous;
-  int rc;
+  memset(report, 0, sizeof(msa_stats_report_t));
+  report->fp = fp;
+  report->json = json;
+
+  if (json)
+    fprintf(fp, "{\n  \"loci\": [");
+  else
+    fprintf(fp, "locus\tsequences\tlength\tmissing\tgaps\tambiguous_sites\t"
+                "gc\tsegregating\tinformative\thaplotypes\n");
+}
 
-  /* get a vector indicating which sites are ambiguous */
-  ambiguous = mark_ambiguous_sites(msa,pll_map_amb);
+/* loci must be added in input order */
+void msa_stats_add(msa_stats_report_t * report, const msa_stats_t * s)
+{
+  char name[32];
+  long cells = s->sequences * s->length;
+
+  snprintf(name, 32, "%ld", ++report->loci);
+  if (report->json)
+    fprintf(report->fp, "%s\n    ", report->loci > 1 ? "," : "");
+  stats_print(report, name, s, cells);
+
+  report->cells += cells;
+  report->total.sequences += s->sequences;
+  report->total.length += s->length;
+  report->total.missing += s->missing;
+  report->total.gaps += s->gaps;
+  report->total.ambiguous_sites += s->ambiguous_sites;
+  report->total.bases += s->bases;
+  report->total.gc += s->gc;
+  report->total.segregating += s->segregating;
+  report->total.informative += s->informative;
+  report->total.haplotypes += s->haplotypes;
+}
 
-  /* remove ambiugous sites from alignment */
-  rc = remove_ambiguous(msa,ambiguous);
+void msa_stats_end(msa_stats_report_t * report)
+{
+  if (report->json)
+  {
+    fprintf(report->fp, "\n  ],\n  \"total\": ");
+    stats_print(report, "null", &report->total, report->cells);
+    fprintf(report->fp, "\n}\n");
+  }
+  else
+    stats_print(report, "all", &report->total, report->cells);
+}
 
-  free(ambiguous);
+static kernel_lut_t missing_lut[2];
+static pthread_once_t missing_once = PTHREAD_ONCE_INIT;
 
-  return rc;
+static void missing_init(void)
+{
+  kernel_lut_init(missing_lut + BPP_DATA_DNA, pll_map_nt_missing, 1);
+  kernel_lut_init(missing_lut + BPP_DATA_AA, pll_map_aa_missing, 1);
 }
 
-int msa_remove_missing_sequences(msa_t * msa)
+/* per-site and per-sequence counts of missing characters (including gaps) */
+static void missing_counts(char ** seq,
+                           long count,
+                           long length,
+                           int dtype,
+                           unsigned int * sites,
+                           long * seqs)
 {
-  long i,j,k;
-  long deleted = 0;
-  const unsigned int * map;
-  char ** seq;
-  char ** label;
+  pthread_once(&missing_once, missing_init);
 
-  map = (msa->dtype == BPP_DATA_DNA) ? pll_map_nt_missing : pll_map_aa_missing;
+  kernel_missing_counts(seq, count, length,
+                        missing_lut + (dtype == BPP_DATA_DNA ?
+                                       BPP_DATA_DNA : BPP_DATA_AA),
+                        sites, seqs);
+}
 
-  /* go over the sequences and delete those that comprise of missing data */
-  for (i = 0; i < msa->count; ++i)
+/* remove the sequences marked in mask, keeping the order of the others */
+static long remove_sequences(msa_t * msa, const unsigned char * mask)
+{
+  long i,k;
+  long deleted;
+
+  for (i = 0, k = 0; i < msa->count; ++i)
   {
-    for (j = 0; j < msa->length; ++j)
-      if (!map[(int)(msa->sequence[i][j])])
-        break;
-    
-    if (j == msa->length)
+    if (mask[i])
     {
-      ++deleted;
       free(msa->sequence[i]);
       free(msa->label[i]);
-
-      msa->sequence[i] = NULL;
-      msa->label[i] = NULL;
+      continue;
     }
+
+    msa->sequence[k] = msa->sequence[i];
+    msa->label[k++] = msa->label[i];
   }
-  assert(deleted <= msa->count);
 
-  if (msa->count == deleted)
-    return -1;
+  deleted = msa->count - k;
+  msa->count = k;
 
-  /* now remove those empty records in the msa structure */
-  if (deleted)
+  return deleted;
+}
+
+/* remove sequences that comprise of missing data; returns the number of
+   sequences removed, -1 if no sequences are left, or -2 if memory runs
+   out */
+long msa_remove_missing_sequences(msa_t * msa)
+{
+  long i;
+  long deleted;
+
+  unsigned int * sites = (unsigned int *)bpp_malloc((size_t)MAX(msa->length,1) *
+                                                    sizeof(unsigned int));
+  long * seqs = (long *)bpp_malloc((size_t)MAX(msa->count,1) * sizeof(long));
+  unsigned char * mask = (unsigned char *)bpp_malloc((size_t)MAX(msa->count,1));
+
+  if (!sites || !seqs || !mask)
   {
-    seq   = (char **)xmalloc((size_t)(msa->count - deleted) * sizeof(char *));
-    label = (char **)xmalloc((size_t)(msa->count - deleted) * sizeof(char *));
+    free(sites);
+    free(seqs);
+    free(mask);
+    return -2;
+  }
 
-    /* populate new arrays */
-    for (i = 0, k = 0; i < msa->count; ++i)
-    {
-      assert((msa->sequence[i] && msa->label[i]) ||
-             (!msa->sequence[i] && !msa->label[i]));
+  missing_counts(msa->sequence, msa->count, msa->length, msa->dtype, sites,
+                 seqs);
 
-      if (msa->sequence[i])
-      {
-        seq[k]   = msa->sequence[i];
-        label[k] = msa->label[i];
+  for (i = 0; i < msa->count; ++i)
+    mask[i] = (seqs[i] == msa->length);
 
-        ++k;
-      }
-    }
+  deleted = remove_sequences(msa, mask);
 
-    /* replace */
-    free(msa->sequence);
-    free(msa->label);
-    msa->sequence = seq;
-    msa->label = label;
+  free(sites);
+  free(seqs);
+  free(mask);
+
+  return msa->count ? deleted : -1;
+}
 
-    msa->count -= deleted;
+/* remove sequences with a fraction of missing data above max_sequence, and
+   then sites with a fraction of missing data among the remaining sequences
+   above max_site; sequences and sites without any data are removed with
+   any threshold. Missing data includes gaps. Site counts are obtained in
+   the same pass as the sequence counts, by subtracting the counts of the
+   removed sequences. Returns the number of sequences removed and sets the
+   number of sites removed, or returns -1 if memory runs out */
+long msa_filter_missing(msa_t * msa,
+                        double max_sequence,
+                        double max_site,
+                        long * sites_removed)
+{
+  long i;
+  long deleted = 0;
+  long count = msa->count;
+  long length = msa->length;
+
+  unsigned int * sites = (unsigned int *)bpp_malloc((size_t)MAX(length,1) *
+                                                    sizeof(unsigned int));
+  unsigned int * removed = (unsigned int *)bpp_malloc((size_t)MAX(length,1) *
+                                                      sizeof(unsigned int));
+  long * seqs = (long *)bpp_malloc((size_t)MAX(count,1) * sizeof(long));
+  unsigned char * mask = (unsigned char *)bpp_malloc((size_t)MAX(MAX(count,
+                                                                     length),1));
+  char ** gone = (char **)bpp_malloc((size_t)MAX(count,1) * sizeof(char *));
+
+  if (!sites || !removed || !seqs || !mask || !gone)
+  {
+    deleted = -1;
+    goto l_done;
+  }
+
+  missing_counts(msa->sequence, count, length, msa->dtype, sites, seqs);
+
+  for (i = 0; i < count; ++i)
+  {
+    mask[i] = seqs[i] == length || seqs[i] > max_sequence * length;
+    if (mask[i])
+      gone[deleted++] = msa->sequence[i];
+  }
+
+  if (deleted)
+  {
+    missing_counts(gone, deleted, length, msa->dtype, removed, seqs);
+    for (i = 0; i < length; ++i)
+      sites[i] -= removed[i];
+
+    remove_sequences(msa, mask);
+    count = msa->count;
   }
+
+  *sites_removed = 0;
+  for (i = 0; i < length; ++i)
+  {
+    mask[i] = sites[i] == count || sites[i] > max_site * count;
+    *sites_removed += mask[i];
+  }
+
+  if (!count)
+    msa->length = 0;
+  else if (*sites_removed)
+    msa_compact_columns(msa, mask);
+
+l_done:
+  free(sites);
+  free(removed);
+  free(seqs);
+  free(mask);
+  free(gone);
+
   return deleted;
 }
 
 void msa_destroy(msa_t * msa)
 {
-  int i;
+  long i;
 
   if (msa->label)
   {
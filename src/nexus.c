@@ -19,41 +19,40 @@
     University College London, Gower Street, London WC1E 6BT, England
 */
 
-#include "bpp-tools.h"
 
-void cmd_explode()
+#include "libbpptools.h"
+
+/* NEXUS export. Labels are always quoted, as BPP labels contain the ^
+   punctuation character. */
+
+static void print_label(FILE * fp, const char * label)
 {
-  long i;
-  long msa_count;
-  char * filename;
-  char * outfile;
-  phylip_t * fp_in;
-  FILE * fp_out;
-  msa_t ** msa_list;
-
-  /* open phylip file */
-  fp_in = phylip_open(opt_msafile, pll_map_fasta);
-  if (!fp_in)
-    fatal("Cannot open file %s", opt_msafile);
-
-  /* read alignment */
-  msa_list = phylip_parse_multisequential(fp_in, &msa_count);
-  assert(msa_list);
-  phylip_close(fp_in);
-  
-  /* write separate files */
-  outfile = opt_outfile ? xstrdup(opt_outfile) : xstrdup(opt_msafile);
-  for (i = 0; i < msa_count; ++i)
+  fputc('\'', fp);
+  for (; *label; ++label)
   {
-    xasprintf(&filename, "%s.%ld", outfile, i);
-    fp_out = xopen(filename, "w");
-    phylip_print(fp_out, msa_list[i]);
-
-    msa_destroy(msa_list[i]);
-    free(filename);
-    fclose(fp_out);
+    /* quotes are escaped by doubling */
+    if (*label == '\'')
+      fputc('\'', fp);
+    fputc(*label, fp);
   }
+  fputc('\'', fp);
+}
 
-  free(outfile);
-  free(msa_list);
+void nexus_print(FILE * fp, const msa_t * msa)
+{
+  long i;
+
+  fprintf(fp, "#NEXUS\n\n");
+  fprintf(fp, "BEGIN DATA;\n");
+  fprintf(fp, "  DIMENSIONS NTAX=%ld NCHAR=%ld;\n", msa->count, msa->length);
+  fprintf(fp, "  FORMAT DATATYPE=%s MISSING=? GAP=-;\n",
+          msa->dtype == BPP_DATA_AA ? "PROTEIN" : "DNA");
+  fprintf(fp, "  MATRIX\n");
+  for (i = 0; i < msa->count; ++i)
+  {
+    fprintf(fp, "    ");
+    print_label(fp, msa->label[i]);
+    fprintf(fp, " %s\n", msa->sequence[i]);
+  }
+  fprintf(fp, "  ;\nEND;\n");
 }
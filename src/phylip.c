@@ -19,25 +19,48 @@
     University College London, Gower Street, London WC1E 6BT, England
 */
 
-#include "bpp-tools.h"
+#include "libbpptools.h"
 
 #define PHYLIP_SEQUENTIAL  1
 #define PHYLIP_INTERLEAVED 2
 
-static int dfa_parse(phylip_t * fd,
-                     msa_t * msa,
-                     char * p,
-                     int seqno,
-                     int offset)
+static long dfa_parse(phylip_t * fd,
+                      msa_t * msa,
+                      char * p,
+                      long seqno,
+                      long offset)
 {
-  int j = 0;
+  long j = 0;
+  long k;
   char c,m;
 
   char * seqdata = msa->sequence[seqno] + offset;
 
+  /* p always points into the current line, whose length is known */
+  char * end = fd->line + fd->line_size;
+  assert(p >= fd->line && p <= end);
+
   /* read sequence data */
-  while((c = *p++))
+  while (p < end)
   {
+    /* copy runs of legal characters in one go */
+    k = kernel_legal_prefix(p, end-p, &fd->legal);
+    if (k)
+    {
+      if (offset + j + k > msa->length)
+      {
+        bpp_errno = ERROR_PHYLIP_LONGSEQ;
+        snprintf(bpp_errmsg, 200, "Sequence %ld (%.100s) longer than expected",
+                 seqno+1, msa->label[seqno]);
+        return -1;
+      }
+      memcpy(seqdata+j, p, (size_t)k);
+      j += k;
+      p += k;
+      continue;
+    }
+
+    c = *p++;
     m = (char) fd->chrstatus[(int)c];
     switch(m)
     {
@@ -52,7 +75,7 @@ static int dfa_parse(phylip_t * fd,
         if (offset + j >= msa->length)
         {
           bpp_errno = ERROR_PHYLIP_LONGSEQ;
-          snprintf(bpp_errmsg, 200, "Sequence %d (%.100s) longer than expected",
+          snprintf(bpp_errmsg, 200, "Sequence %ld (%.100s) longer than expected",
                    seqno+1, msa->label[seqno]);
           return -1;
         }
@@ -86,74 +109,99 @@ static int dfa_parse(phylip_t * fd,
   return j;
 }
 
-static char * reallocline(phylip_t * fd, size_t newmaxsize)
+/* discard the buffered data and continue reading at byte 'offset' of the
+   file, which must be the current position of the file pointer */
+static void buffer_reset(phylip_t * fd, long offset)
 {
-  char * temp = (char *)xmalloc((size_t)newmaxsize*sizeof(char));
-
-  memcpy(temp,fd->line,fd->line_size*sizeof(char));
-  free(fd->line);
-  fd->line = temp;
-  fd->line_maxsize = newmaxsize;
-
-  return temp;
+  fd->buffer_pos = 0;
+  fd->buffer_end = 0;
+  fd->buffer_offset = offset;
+  fd->buffer_eof = 0;
+  fd->line = NULL;
+  fd->line_size = 0;
+  fd->offset = offset;
 }
 
+/* Return the next line without its newline. Data are read in large blocks
+   and lines are terminated in place, i.e. fd->line points into the block
+   buffer and is valid until the next call. The buffer is doubled only when
+   a single line does not fit, hence short lines (interleaved blocks) and
+   long lines (sequential data) are both read without per-line copies. */
 static char * getnextline(phylip_t * fd)
 {
-  size_t len = 0;
+  /* restore the newline that terminated the previous line, such that the
+     buffered data can be read again after seek_line() */
+  if (fd->line && fd->line_newline)
+    fd->line[fd->line_size] = '\n';
 
+  fd->line = NULL;
   fd->line_size = 0;
+  fd->line_offset = fd->offset;
 
-  /* read from file until newline or eof */
-  while (fgets(fd->buffer, LINEALLOC, fd->fp))
+  while (1)
   {
-    len = strlen(fd->buffer);
+    char * start = fd->buffer + fd->buffer_pos;
+    size_t avail = fd->buffer_end - fd->buffer_pos;
+    char * nl = (char *)memchr(start, '\n', avail);
 
-    if (fd->line_size + len > fd->line_maxsize)
-      if (!reallocline(fd, fd->line_maxsize + LINEALLOC))
-        return NULL;
-
-    memcpy(fd->line+fd->line_size,fd->buffer,len*sizeof(char));
-    fd->line_size += len;
-
-    if (fd->buffer[len-1] == '\n')
+    if (nl || fd->buffer_eof)
     {
-      #if 0
-      if (line_size+1 > line_maxsize)
-        reallocline(line_maxsize+1);
+      if (!avail)
+        return NULL;
 
-      line[line_size] = 0;
-      #else
-        fd->line[fd->line_size-1] = 0;
-      #endif
+      fd->line = start;
+      fd->line_size = nl ? (size_t)(nl - start) : avail;
+      fd->line_newline = nl ? 1 : 0;
+      start[fd->line_size] = 0;
 
+      fd->buffer_pos += fd->line_size + fd->line_newline;
+      fd->offset += (long)(fd->line_size + fd->line_newline);
+      fd->lineno++;
       return fd->line;
     }
-  }
 
-  if (!fd->line_size)
-  {
-    free(fd->line);
-    fd->line = NULL;
-    return NULL;
-  }
-
-  if (fd->line_size == fd->line_maxsize)
-    if (!reallocline(fd,fd->line_maxsize+1))
-      return NULL;
+    /* move the incomplete line to the front of the buffer, or double the
+       buffer if the line fills it */
+    if (fd->buffer_pos)
+    {
+      memmove(fd->buffer, start, avail);
+      fd->buffer_offset += (long)fd->buffer_pos;
+      fd->buffer_pos = 0;
+      fd->buffer_end = avail;
+    }
+    else if (fd->buffer_end + 1 == fd->buffer_size)
+    {
+      char * temp = (char *)bpp_realloc(fd->buffer, 2*fd->buffer_size);
 
-  fd->line[fd->line_size] = 0;
-  return fd->line;
+      /* a line that cannot be buffered ends the input, and the failure is
+         reported by phylip_parse_next() */
+      if (!temp)
+      {
+        fd->buffer_failed = 1;
+        return NULL;
+      }
+      fd->buffer = temp;
+      fd->buffer_size *= 2;
+    }
 
+    /* one byte is always kept free for terminating the last line */
+    size_t bytes = fread(fd->buffer + fd->buffer_end,
+                         1,
+                         fd->buffer_size - fd->buffer_end - 1,
+                         fd->fp);
+    if (!bytes)
+      fd->buffer_eof = 1;
+    fd->buffer_end += bytes;
+  }
 }
 
-static int args_getint(const char * arg, int * len)
+static long args_getlong(const char * arg, int * len)
 {
-  int temp;
+  long temp;
   *len = 0;
   
-  int ret = sscanf(arg, "%d%n", &temp, len);
-  if ((ret == 0) || (!*len)) 
+  int ret = sscanf(arg, "%ld%n", &temp, len);
+  if ((ret == 0) || (!*len) || temp < 0)
     return 0;
 
   return temp;
@@ -167,15 +215,20 @@ static int whitespace(char c)
 }
 
 
+/* parse the header of a locus; format is set to the layout given by an
+   optional S (sequential) or I (interleaved) flag after the dimensions,
+   or zero if there is none */
 static int parse_header(const char * line,
-                        int * seq_count,
-                        int * seq_len,
-                        int format)
+                        long * seq_count,
+                        long * seq_len,
+                        int * format)
 {
   int len;
 
+  *format = 0;
+
   /* read number of sequences */
-  if (!(*seq_count = args_getint(line,&len)))
+  if (!(*seq_count = args_getlong(line,&len)))
   {
     bpp_errno = ERROR_PHYLIP_SYNTAX;
     snprintf(bpp_errmsg, 200, "Invalid number of sequences in header");
@@ -185,7 +238,7 @@ static int parse_header(const char * line,
   line += len;
 
   /* read sequence length */
-  if (!(*seq_len = args_getint(line,&len)))
+  if (!(*seq_len = args_getlong(line,&len)))
   {
     bpp_errno = ERROR_PHYLIP_SYNTAX;
     snprintf(bpp_errmsg, 200, "Invalid sequence length in header");
@@ -201,32 +254,40 @@ static int parse_header(const char * line,
   if (!*line)
     return 1;
 
-  /* otherwise, continue only if interleaved format specified, otherwise die */
-  if (format == PHYLIP_SEQUENTIAL)
-    return 0;
-
-  if (*line != 's' && *line != 'S' && *line != 'i' && *line != 'I')
-    return 0;
+  /* otherwise, continue only if a format flag is specified */
+  if (*line == 's' || *line == 'S')
+    *format = PHYLIP_SEQUENTIAL;
+  else if (*line == 'i' || *line == 'I')
+    *format = PHYLIP_INTERLEAVED;
+  else
+  {
+    bpp_errno = ERROR_PHYLIP_SYNTAX;
+    snprintf(bpp_errmsg, 200, "Invalid characters after header");
+    return BPP_FAILURE;
+  }
 
   /* go through all white spaces */
+  ++line;
   while (*line && whitespace(*line)) ++line;
 
   /* if end of line then return successfully */
   if (!*line)
     return 1;
 
-  return 0;
+  bpp_errno = ERROR_PHYLIP_SYNTAX;
+  snprintf(bpp_errmsg, 200, "Invalid characters after header");
+  return BPP_FAILURE;
 }
 
 static char * parse_oneline_sequence(phylip_t * fd,
                                      msa_t * msa,
                                      char * p,
-                                     int seqno,
-                                     int offset,
-                                     int * aln_len,
+                                     long seqno,
+                                     long offset,
+                                     long * aln_len,
                                      int * error)
 {
-  int j = 0;
+  long j = 0;
 
   while (p && !j)
   {
@@ -247,7 +308,7 @@ static char * parse_oneline_sequence(phylip_t * fd,
       {
         *error = 1;
         bpp_errno = ERROR_PHYLIP_NONALIGNED;
-        snprintf(bpp_errmsg, 200, "Sequence %d (%.100s) data out of alignment",
+        snprintf(bpp_errmsg, 200, "Sequence %ld (%.100s) data out of alignment",
                  seqno+1, msa->label[seqno]); 
         return NULL;
       }
@@ -263,28 +324,55 @@ phylip_t * phylip_open(const char * filename,
                        const unsigned int * map)
 {
   int i;
+  timing_mark_t mark;
+
+  timing_start(&mark);
+  kernel_init();
 
-  phylip_t * fd = (phylip_t *)xmalloc(sizeof(phylip_t));
+  phylip_t * fd = (phylip_t *)bpp_malloc(sizeof(phylip_t));
+  if (!fd)
+    return NULL;
 
   /* allocate space */
-  fd->line = NULL;
-  fd->line_size = 0;
-  fd->line_maxsize = 0;
+  fd->buffer_size = BUFFERALLOC;
+  fd->buffer = (char *)bpp_malloc(fd->buffer_size);
+  if (!fd->buffer)
+  {
+    free(fd);
+    return NULL;
+  }
+  buffer_reset(fd, 0);
+  fd->buffer_failed = 0;
 
   fd->lineno = 0;
 
   fd->no = -1;
+  fd->layout = PHYLIP_SEQUENTIAL;
 
   fd->chrstatus = map;
+  kernel_lut_init(&fd->legal, map, 1);
 
   /* open file */
   fd->fp = fopen(filename, "r");
   if (!(fd->fp))
-    fatal("Unable to open file (%s)", filename);
+  {
+    bpp_errno = ERROR_FILE_OPEN;
+    snprintf(bpp_errmsg, 200, "Unable to open file (%.150s)", filename);
+    free(fd->buffer);
+    free(fd);
+    return NULL;
+  }
 
   /* get filesize */
   if (fseek(fd->fp, 0, SEEK_END))
-    fatal("Unable to seek in file (%s)", filename);
+  {
+    bpp_errno = ERROR_FILE_SEEK;
+    snprintf(bpp_errmsg, 200, "Unable to seek in file (%.150s)", filename);
+    fclose(fd->fp);
+    free(fd->buffer);
+    free(fd);
+    return NULL;
+  }
 
   fd->filesize = ftell(fd->fp);
 
@@ -298,15 +386,26 @@ phylip_t * phylip_open(const char * filename,
   /* cache line */
   if (!getnextline(fd))
   {
-    if (fd->line)
-      free(fd->line);
+    if (fd->buffer_failed)
+    {
+      bpp_errno = ERROR_MEMORY;
+      snprintf(bpp_errmsg, 200, "Unable to allocate enough memory.");
+    }
+    else
+    {
+      bpp_errno = ERROR_PHYLIP_SYNTAX;
+      snprintf(bpp_errmsg, 200, "File (%.150s) is empty", filename);
+    }
     fclose(fd->fp);
+    free(fd->buffer);
     free(fd);
     return NULL;
   }
 
   fd->lineno = 1;
 
+  timing_stop(TIMING_PHASE_OPEN, &mark, 0, 0);
+
   return fd;
 }
 
@@ -315,6 +414,8 @@ int phylip_rewind(phylip_t * fd)
   int i;
 
   rewind(fd->fp);
+  buffer_reset(fd, 0);
+  fd->buffer_failed = 0;
 
   /* reset stripped char frequencies */
   fd->stripped_count = 0;
@@ -322,10 +423,15 @@ int phylip_rewind(phylip_t * fd)
     fd->stripped[i] = 0;
 
   if (!getnextline(fd))
-    fatal("Unable to rewind and cache data");
+  {
+    bpp_errno = ERROR_FILE_SEEK;
+    snprintf(bpp_errmsg, 200, "Unable to rewind and cache data");
+    return BPP_FAILURE;
+  }
 
   fd->lineno = 1;
   fd->no = -1;
+  fd->layout = PHYLIP_SEQUENTIAL;
 
   return BPP_SUCCESS;
 }
@@ -333,8 +439,7 @@ int phylip_rewind(phylip_t * fd)
 void phylip_close(phylip_t * fd)
 {
   fclose(fd->fp);
-  if (fd->line)
-    free(fd->line);
+  free(fd->buffer);
   free(fd);
 }
 
@@ -347,31 +452,62 @@ static long emptyline(const char * line)
 
 msa_t * phylip_parse_interleaved(phylip_t * fd)
 {
-  int i;
-  int aln_len;
-  int sumlen;
-  int seqno;
+  long i;
+  long aln_len;
+  long sumlen;
+  long seqno;
   long headerlen;
+  int format;
 
-  msa_t * msa = (msa_t *)xmalloc(sizeof(msa_t));
+  msa_t * msa = (msa_t *)bpp_calloc(1,sizeof(msa_t));
+  if (!msa)
+    return NULL;
 
-  while (emptyline(fd->line)) getnextline(fd);
+  while (fd->line && emptyline(fd->line)) getnextline(fd);
+
+  if (!fd->line)
+  {
+    bpp_errno = ERROR_PHYLIP_SYNTAX;
+    snprintf(bpp_errmsg, 200, "Missing header");
+    free(msa);
+    return NULL;
+  }
 
   /* read header */
-  if (!parse_header(fd->line,
-                    &(msa->count),
-                    &(msa->length),
-                    PHYLIP_INTERLEAVED))
+  if (!parse_header(fd->line, &(msa->count), &(msa->length), &format))
+  {
+    free(msa);
+    return NULL;
+  }
+
+  if (format == PHYLIP_SEQUENTIAL)
+  {
+    bpp_errno = ERROR_PHYLIP_SYNTAX;
+    snprintf(bpp_errmsg, 200,
+             "Sequential locus on line %ld parsed as interleaved", fd->lineno);
+    free(msa);
     return NULL;
+  }
 
   /* allocate msa placeholders */
-  msa->sequence = (char **)xcalloc((size_t)(msa->count),sizeof(char *));
-  msa->label = (char **)xcalloc((size_t)(msa->count),sizeof(char *));
+  msa->sequence = (char **)bpp_calloc((size_t)(msa->count),sizeof(char *));
+  msa->label = (char **)bpp_calloc((size_t)(msa->count),sizeof(char *));
+  if (!msa->sequence || !msa->label)
+  {
+    msa_destroy(msa);
+    return NULL;
+  }
 
   /* allocate sequence data placeholders */
   for (i = 0; i < msa->count; ++i)
   {
-    msa->sequence[i] = (char *)xmalloc((size_t)(msa->length+1) * sizeof(char));
+    msa->sequence[i] = (char *)bpp_malloc((size_t)(msa->length+1) *
+                                          sizeof(char));
+    if (!msa->sequence[i])
+    {
+      msa_destroy(msa);
+      return NULL;
+    }
     msa->sequence[i][msa->length] = 0;
   }
 
@@ -397,7 +533,7 @@ msa_t * phylip_parse_interleaved(phylip_t * fd)
     if (seqno == msa->count)
     {
       bpp_errno = ERROR_PHYLIP_SYNTAX;
-      snprintf(bpp_errmsg, 200, "Found at least %d sequences but expected %d",
+      snprintf(bpp_errmsg, 200, "Found at least %ld sequences but expected %ld",
                seqno+1, msa->count);
       msa_destroy(msa);
       return NULL;
@@ -417,7 +553,13 @@ msa_t * phylip_parse_interleaved(phylip_t * fd)
     assert(headerlen > 0);
 
     /* store sequence header */
-    msa->label[seqno] = (char *)xmalloc((size_t)(headerlen+1)*sizeof(char));
+    msa->label[seqno] = (char *)bpp_malloc((size_t)(headerlen+1) *
+                                           sizeof(char));
+    if (!msa->label[seqno])
+    {
+      msa_destroy(msa);
+      return NULL;
+    }
     memcpy(msa->label[seqno], p, (size_t)headerlen);
     msa->label[seqno][headerlen] = 0;
 
@@ -444,7 +586,7 @@ msa_t * phylip_parse_interleaved(phylip_t * fd)
   if (seqno != msa->count)
   {
     bpp_errno = ERROR_PHYLIP_SYNTAX;
-    snprintf(bpp_errmsg, 200, "Found %d sequence(s) but expected %d",
+    snprintf(bpp_errmsg, 200, "Found %ld sequence(s) but expected %ld",
              seqno, msa->count);
     msa_destroy(msa);
     return NULL;
@@ -454,11 +596,12 @@ msa_t * phylip_parse_interleaved(phylip_t * fd)
      offset when appending data to the end of the sequences */
   sumlen = aln_len;
 
-  /* now read the remaining blocks */
+  /* now read the remaining blocks, up to the declared length such that the
+     next locus is not consumed */
   seqno = 0;
   aln_len = 0;
-  int block_count = 2;
-  while (1)
+  long block_count = 2;
+  while (sumlen < msa->length)
   {
     char * p = getnextline(fd);
 
@@ -490,14 +633,15 @@ msa_t * phylip_parse_interleaved(phylip_t * fd)
   if (seqno)
   {
     bpp_errno = ERROR_PHYLIP_SYNTAX;
-    snprintf(bpp_errmsg, 200, "Found %d sequences in block %d but expected %d",
+    snprintf(bpp_errmsg, 200, "Found %ld sequences in block %ld but expected %ld",
              seqno, block_count, msa->count);
     msa_destroy(msa);
     return NULL;
   }
   if (sumlen != msa->length)
   {
-    snprintf(bpp_errmsg, 200, "Sequence length is %d but expected %d",
+    bpp_errno = ERROR_PHYLIP_SYNTAX;
+    snprintf(bpp_errmsg, 200, "Sequence length is %ld but expected %ld",
              sumlen, msa->length);
     msa_destroy(msa);
     return NULL;
@@ -508,31 +652,62 @@ msa_t * phylip_parse_interleaved(phylip_t * fd)
 
 msa_t * phylip_parse_sequential(phylip_t * fd)
 {
-  int i,j;
+  long i,j;
   long headerlen;
+  int format;
 
-  msa_t * msa = (msa_t *)xcalloc(1,sizeof(msa_t));
+  msa_t * msa = (msa_t *)bpp_calloc(1,sizeof(msa_t));
+  if (!msa)
+    return NULL;
+
+  while (fd->line && emptyline(fd->line)) getnextline(fd);
 
-  while (emptyline(fd->line)) getnextline(fd);
+  if (!fd->line)
+  {
+    bpp_errno = ERROR_PHYLIP_SYNTAX;
+    snprintf(bpp_errmsg, 200, "Missing header");
+    free(msa);
+    return NULL;
+  }
     
   /* read header */
-  if (!parse_header(fd->line,
-                    &(msa->count),
-                    &(msa->length),
-                    PHYLIP_SEQUENTIAL))
+  if (!parse_header(fd->line, &(msa->count), &(msa->length), &format))
+  {
+    free(msa);
+    return NULL;
+  }
+
+  if (format == PHYLIP_INTERLEAVED)
+  {
+    bpp_errno = ERROR_PHYLIP_SYNTAX;
+    snprintf(bpp_errmsg, 200,
+             "Interleaved locus on line %ld parsed as sequential", fd->lineno);
+    free(msa);
     return NULL;
+  }
 
-  msa->sequence = (char **)xcalloc((size_t)(msa->count),sizeof(char *));
-  msa->label = (char **)xcalloc((size_t)(msa->count),sizeof(char *));
+  msa->sequence = (char **)bpp_calloc((size_t)(msa->count),sizeof(char *));
+  msa->label = (char **)bpp_calloc((size_t)(msa->count),sizeof(char *));
+  if (!msa->sequence || !msa->label)
+  {
+    msa_destroy(msa);
+    return NULL;
+  }
 
   for (i = 0; i < msa->count; ++i)
   {
-    msa->sequence[i] = (char *)xmalloc((size_t)(msa->length+1) * sizeof(char));
+    msa->sequence[i] = (char *)bpp_malloc((size_t)(msa->length+1) *
+                                          sizeof(char));
+    if (!msa->sequence[i])
+    {
+      msa_destroy(msa);
+      return NULL;
+    }
     msa->sequence[i][msa->length] = 0;
   }
   
   /* read sequences */
-  int seqno = 0;
+  long seqno = 0;
   while (1)
   {
     /* get next line */
@@ -551,7 +726,7 @@ msa_t * phylip_parse_sequential(phylip_t * fd)
     if (seqno == msa->count)
     {
       bpp_errno = ERROR_PHYLIP_SYNTAX;
-      snprintf(bpp_errmsg, 200, "Found at least %d sequences but expected %d",
+      snprintf(bpp_errmsg, 200, "Found at least %ld sequences but expected %ld",
                seqno+1, msa->count);
       msa_destroy(msa);
       return NULL;
@@ -571,7 +746,13 @@ msa_t * phylip_parse_sequential(phylip_t * fd)
     assert(headerlen > 0);
 
     /* store sequence header */
-    msa->label[seqno] = (char *)xmalloc((size_t)(headerlen+1)*sizeof(char));
+    msa->label[seqno] = (char *)bpp_malloc((size_t)(headerlen+1) *
+                                           sizeof(char));
+    if (!msa->label[seqno])
+    {
+      msa_destroy(msa);
+      return NULL;
+    }
     memcpy(msa->label[seqno], p, (size_t)headerlen);
     msa->label[seqno][headerlen] = 0;
 
@@ -582,7 +763,7 @@ msa_t * phylip_parse_sequential(phylip_t * fd)
     while (1)
     {
       /* read sequence data */
-      int chars_count = dfa_parse(fd,msa,p,seqno,j);
+      long chars_count = dfa_parse(fd,msa,p,seqno,j);
       if (chars_count == -1)
       {
         msa_destroy(msa);
@@ -601,7 +782,7 @@ msa_t * phylip_parse_sequential(phylip_t * fd)
       {
         bpp_errno = ERROR_PHYLIP_SYNTAX;
         snprintf(bpp_errmsg, 200,
-                 "Sequence %d (%.100s) has %d characters but expected %d",
+                 "Sequence %ld (%.100s) has %ld characters but expected %ld",
                 seqno+1,msa->label[seqno],j,msa->length);
         msa_destroy(msa);
         return NULL;
@@ -617,7 +798,7 @@ msa_t * phylip_parse_sequential(phylip_t * fd)
   if (seqno != msa->count)
   {
     bpp_errno = ERROR_PHYLIP_SYNTAX;
-    snprintf(bpp_errmsg, 200, "Found %d sequence(s) but expected %d",
+    snprintf(bpp_errmsg, 200, "Found %ld sequence(s) but expected %ld",
              seqno, msa->count);
     msa_destroy(msa);
     return NULL;
@@ -626,31 +807,217 @@ msa_t * phylip_parse_sequential(phylip_t * fd)
   return msa;
 }
 
+/* advance to the next non-blank line, or to the end of the file */
+static void skip_blank_lines(phylip_t * fd)
+{
+  char * p;
+
+  while ((p = getnextline(fd)))
+  {
+    /* skip whitespace before sequence header */
+    while (*p && whitespace(*p)) ++p;
+
+    /* stop at the first non-blank line */
+    if (*p) break;
+  }
+}
+
+/* reposition the file such that the current line is the one starting at
+   byte 'offset', which is line 'lineno' */
+static int seek_line(phylip_t * fd, long offset, long lineno)
+{
+  long buffered = fd->buffer_offset + (long)fd->buffer_end;
+
+  if (offset >= fd->buffer_offset && offset <= buffered)
+  {
+    /* still in the buffer */
+    fd->buffer_pos = (size_t)(offset - fd->buffer_offset);
+    fd->offset = offset;
+  }
+  else
+  {
+    if (fseek(fd->fp, offset, SEEK_SET))
+    {
+      bpp_errno = ERROR_FILE_SEEK;
+      snprintf(bpp_errmsg, 200, "Unable to seek in file");
+      return BPP_FAILURE;
+    }
+    buffer_reset(fd, offset);
+  }
+
+  fd->lineno = lineno-1;
+  getnextline(fd);
+
+  return BPP_SUCCESS;
+}
+
+/* report a line that could not be buffered, which otherwise looks like the
+   end of the file */
+static msa_t * buffer_failure(phylip_t * fd, msa_t * msa)
+{
+  if (!fd->buffer_failed)
+    return msa;
+
+  if (msa)
+    msa_destroy(msa);
+  bpp_errno = ERROR_MEMORY;
+  snprintf(bpp_errmsg, 200, "Unable to allocate enough memory.");
+  return NULL;
+}
+
+static msa_t * parse_layout(phylip_t * fd, long layout)
+{
+  if (layout == PHYLIP_INTERLEAVED)
+    return phylip_parse_interleaved(fd);
+
+  return phylip_parse_sequential(fd);
+}
+
+/* Parse the next locus. The layout is taken from the S/I flag of the header
+   if present. Otherwise the locus is parsed with the layout of the previous
+   locus (initially sequential), and it is accepted only if it is followed
+   by the header of another locus or by the end of the file; if not, the
+   file is repositioned at the header and the locus is parsed with the other
+   layout. If both fail, the error of the attempt that read further into the
+   file is reported, preferring the first one. */
+msa_t * phylip_parse_next(phylip_t * fd)
+{
+  int format;
+  long count, length;
+  long offset;
+  long header_offset;
+  long header_lineno;
+  long skipped = 0;
+  msa_t * msa;
+  timing_mark_t mark;
+
+  bpp_errno = 0;
+
+  /* skip blank lines before the first locus */
+  while (fd->line && emptyline(fd->line)) getnextline(fd);
+
+  /* no more loci */
+  if (!fd->line)
+    return buffer_failure(fd, NULL);
+
+  timing_start(&mark);
+  offset = fd->offset;
+  header_offset = fd->line_offset;
+  header_lineno = fd->lineno;
+
+  if (!parse_header(fd->line, &count, &length, &format))
+  {
+    char msg[200];
+
+    memcpy(msg, bpp_errmsg, 200);
+    snprintf(bpp_errmsg, 200, "%.150s on line %ld", msg, fd->lineno);
+    return NULL;
+  }
+
+  if (format)
+    msa = parse_layout(fd, format);
+  else
+  {
+    long layout = fd->layout;
+    long stripped_count = fd->stripped_count;
+    long stripped[256];
+
+    memcpy(stripped, fd->stripped, 256*sizeof(long));
+
+    msa = parse_layout(fd, layout);
+    if (msa)
+    {
+      skip_blank_lines(fd);
+      skipped = 1;
+
+      if (fd->line && !parse_header(fd->line, &count, &length, &format))
+      {
+        msa_destroy(msa);
+        msa = NULL;
+      }
+    }
+
+    if (!msa)
+    {
+      int first_errno = bpp_errno;
+      char first_errmsg[200];
+      long first_offset = fd->offset;
+
+      memcpy(first_errmsg, bpp_errmsg, 200);
+
+      /* undo the first attempt */
+      fd->stripped_count = stripped_count;
+      memcpy(fd->stripped, stripped, 256*sizeof(long));
+      if (!seek_line(fd, header_offset, header_lineno))
+        return NULL;
+
+      layout = (layout == PHYLIP_INTERLEAVED) ?
+                 PHYLIP_SEQUENTIAL : PHYLIP_INTERLEAVED;
+      skipped = 0;
+      msa = parse_layout(fd, layout);
+
+      if (!msa && fd->offset <= first_offset)
+      {
+        bpp_errno = first_errno;
+        memcpy(bpp_errmsg, first_errmsg, 200);
+      }
+    }
+
+    if (msa)
+      fd->layout = layout;
+  }
+
+  if (!msa || fd->buffer_failed)
+    return buffer_failure(fd, msa);
+
+  fd->no++;
+
+  timing_stop(TIMING_PHASE_PARSE, &mark, fd->offset - offset, 1);
+
+  if (!skipped)
+  {
+    timing_start(&mark);
+    offset = fd->offset;
+
+    skip_blank_lines(fd);
+
+    timing_stop(TIMING_PHASE_SCAN, &mark, fd->offset - offset, 0);
+  }
+
+  return msa;
+}
+
 msa_t ** phylip_parse_multisequential(phylip_t * fd, long * count)
 {
+  long i;
   long msa_slotalloc = 10;
   long msa_maxcount = 0;
-  char * p;
+  msa_t * next;
   
   *count = 0;
 
-  msa_t ** msa = (msa_t **)xmalloc(msa_maxcount*sizeof(msa_t *));
+  msa_t ** msa = (msa_t **)bpp_malloc((size_t)msa_slotalloc *
+                                      sizeof(msa_t *));
+  if (!msa)
+    return NULL;
+  msa_maxcount = msa_slotalloc;
   
-  while (1)
+  while ((next = phylip_parse_next(fd)))
   {
     if (*count == msa_maxcount)
     {
       msa_maxcount += msa_slotalloc;
-      msa_t ** temp = (msa_t **)xmalloc(msa_maxcount*sizeof(msa_t *));
-      memcpy(temp,msa,*count * sizeof(msa_t *));
-      free(msa);
+      msa_t ** temp = (msa_t **)bpp_realloc(msa, (size_t)msa_maxcount *
+                                                 sizeof(msa_t *));
+      if (!temp)
+      {
+        msa_destroy(next);
+        break;
+      }
       msa = temp;
     }
 
-    msa[*count] = phylip_parse_sequential(fd);
-    if (msa[*count] == NULL)
-      fatal("%s",bpp_errmsg);
-
+    msa[*count] = next;
     *count = *count + 1;
 
     #if 0
@@ -658,25 +1025,15 @@ msa_t ** phylip_parse_multisequential(phylip_t * fd, long * count)
        was read */
     if (*count == opt_locus_count) break;
     #endif
+  }
 
-    /* skip empty lines */
-
-    while (1)
-    {
-      /* get next line */
-      p = getnextline(fd);
-
-      /* if no more lines break */
-      if (!p) break;
-
-      /* skip whitespace before sequence header */
-      while (*p && whitespace(*p)) ++p;
-
-      /* restart loop if blank line, otherwise break */
-      if (*p) break;
-    }
-
-    if (!p) break;
+  if (bpp_errno)
+  {
+    for (i = 0; i < *count; ++i)
+      msa_destroy(msa[i]);
+    free(msa);
+    *count = 0;
+    return NULL;
   }
 
   return msa;
@@ -686,7 +1043,7 @@ void phylip_print(FILE * fp, const msa_t * msa)
 {
   long i;
 
-  fprintf(fp, "%d %d\n", msa->count, msa->length);
+  fprintf(fp, "%ld %ld\n", msa->count, msa->length);
   for (i = 0; i < msa->count; ++i)
     fprintf(fp, "%s %s\n", msa->label[i], msa->sequence[i]);
 }
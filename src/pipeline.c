@@ -0,0 +1,441 @@
+/*
+    Copyright (C) 2022-2023 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London, Gower Street, London WC1E 6BT, England
+*/
+
+#include "libbpptools.h"
+
+/* Staged pipeline: one reader thread slices the input into items (loci),
+   a pool of worker threads process items pulled from a bounded lock-free
+   multi-producer/multi-consumer queue, and the writer (the calling thread)
+   reassembles the results in input order. The reader is never allowed to
+   run more than 'window' items ahead of the writer, which bounds the
+   number of items held in memory. The write callback returns the number of
+   bytes it wrote, which is recorded in the write phase of the timing
+   report. */
+
+#define PIPELINE_CACHELINE 64
+#define PIPELINE_SPINS     64
+#define PIPELINE_YIELDS    64
+
+/* end-of-stream marker index */
+#define PIPELINE_EOS       -1
+
+typedef struct mpmc_cell_s
+{
+  size_t seq;
+  long index;
+  void * data;
+} mpmc_cell_t;
+
+typedef struct mpmc_queue_s
+{
+  mpmc_cell_t * cells;
+  size_t mask;
+  char pad0[PIPELINE_CACHELINE];
+  size_t head;
+  char pad1[PIPELINE_CACHELINE];
+  size_t tail;
+  char pad2[PIPELINE_CACHELINE];
+} mpmc_queue_t;
+
+typedef struct reorder_slot_s
+{
+  void * data;
+  long ready;
+} reorder_slot_t;
+
+typedef struct pipeline_s
+{
+  mpmc_queue_t * inq;
+  mpmc_queue_t * outq;
+
+  long workers;
+  long window;
+
+  void * (*cb_read)(void *);
+  void * read_data;
+  void * (*cb_work)(void *, long, void *);
+  void * data;
+
+  /* error reported by the read callback; bpp_errno is thread-local, hence
+     it is copied here and handed over to the calling thread */
+  int read_errno;
+  char read_errmsg[200];
+
+  /* number of items consumed by the writer; read by the reader for
+     backpressure */
+  char pad0[PIPELINE_CACHELINE];
+  long written;
+  char pad1[PIPELINE_CACHELINE];
+} pipeline_t;
+
+static void backoff(long * spins)
+{
+  struct timespec ts;
+
+  ++*spins;
+  if (*spins < PIPELINE_SPINS)
+  {
+    _mm_pause();
+  }
+  else if (*spins < PIPELINE_SPINS + PIPELINE_YIELDS)
+  {
+    sched_yield();
+  }
+  else
+  {
+    /* nothing to do for a while, stop burning cycles */
+    ts.tv_sec = 0;
+    ts.tv_nsec = 50000;
+    nanosleep(&ts, NULL);
+  }
+}
+
+static mpmc_queue_t * mpmc_create(long capacity)
+{
+  size_t i;
+  size_t size = 2;
+
+  while (size < (size_t)capacity)
+    size <<= 1;
+
+  mpmc_queue_t * q = (mpmc_queue_t *)bpp_aligned_alloc(sizeof(mpmc_queue_t),
+                                                       PIPELINE_CACHELINE);
+  if (!q)
+    return NULL;
+
+  q->cells = (mpmc_cell_t *)bpp_malloc(size * sizeof(mpmc_cell_t));
+  if (!q->cells)
+  {
+    pll_aligned_free(q);
+    return NULL;
+  }
+  for (i = 0; i < size; ++i)
+    q->cells[i].seq = i;
+
+  q->mask = size-1;
+  q->head = 0;
+  q->tail = 0;
+
+  return q;
+}
+
+static void mpmc_destroy(mpmc_queue_t * q)
+{
+  if (!q)
+    return;
+  free(q->cells);
+  pll_aligned_free(q);
+}
+
+static int mpmc_trypush(mpmc_queue_t * q, void * data, long index)
+{
+  mpmc_cell_t * cell;
+  size_t seq;
+  size_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+
+  while (1)
+  {
+    cell = q->cells + (pos & q->mask);
+    seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+
+    long diff = (long)seq - (long)pos;
+    if (diff == 0)
+    {
+      /* slot is free, try to claim it */
+      if (__atomic_compare_exchange_n(&q->head, &pos, pos+1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if (diff < 0)
+    {
+      /* queue is full */
+      return 0;
+    }
+    else
+      pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+  }
+
+  cell->data = data;
+  cell->index = index;
+  __atomic_store_n(&cell->seq, pos+1, __ATOMIC_RELEASE);
+
+  return 1;
+}
+
+static int mpmc_trypop(mpmc_queue_t * q, void ** data, long * index)
+{
+  mpmc_cell_t * cell;
+  size_t seq;
+  size_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+
+  while (1)
+  {
+    cell = q->cells + (pos & q->mask);
+    seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+
+    long diff = (long)seq - (long)(pos+1);
+    if (diff == 0)
+    {
+      /* slot is filled, try to claim it */
+      if (__atomic_compare_exchange_n(&q->tail, &pos, pos+1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if (diff < 0)
+    {
+      /* queue is empty */
+      return 0;
+    }
+    else
+      pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+  }
+
+  *data = cell->data;
+  *index = cell->index;
+  __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+
+  return 1;
+}
+
+static void mpmc_push(mpmc_queue_t * q, void * data, long index)
+{
+  long spins = 0;
+
+  while (!mpmc_trypush(q,data,index))
+    backoff(&spins);
+}
+
+static void mpmc_pop(mpmc_queue_t * q, void ** data, long * index)
+{
+  long spins = 0;
+
+  while (!mpmc_trypop(q,data,index))
+    backoff(&spins);
+}
+
+static void * pipeline_reader(void * arg)
+{
+  long i;
+  long spins;
+  void * item;
+  pipeline_t * p = (pipeline_t *)arg;
+
+  for (i = 0; ; ++i)
+  {
+    bpp_errno = 0;
+    if (!(item = p->cb_read(p->read_data)))
+    {
+      if (bpp_errno)
+      {
+        p->read_errno = bpp_errno;
+        memcpy(p->read_errmsg, bpp_errmsg, 200);
+      }
+      break;
+    }
+
+    /* backpressure: wait until the writer consumed enough items */
+    spins = 0;
+    while (i - __atomic_load_n(&p->written, __ATOMIC_ACQUIRE) >= p->window)
+      backoff(&spins);
+
+    mpmc_push(p->inq, item, i);
+  }
+
+  /* one end-of-stream marker per worker */
+  for (i = 0; i < p->workers; ++i)
+    mpmc_push(p->inq, NULL, PIPELINE_EOS);
+
+  return NULL;
+}
+
+static void * pipeline_worker(void * arg)
+{
+  long index;
+  void * item;
+  void * result;
+  timing_mark_t mark;
+  pipeline_t * p = (pipeline_t *)arg;
+
+  while (1)
+  {
+    mpmc_pop(p->inq, &item, &index);
+
+    if (index == PIPELINE_EOS)
+      break;
+
+    timing_start(&mark);
+    result = p->cb_work(item, index, p->data);
+    timing_stop(TIMING_PHASE_PROCESS, &mark, 0, 1);
+
+    mpmc_push(p->outq, result, index);
+  }
+
+  mpmc_push(p->outq, NULL, PIPELINE_EOS);
+
+  return NULL;
+}
+
+int pipeline_run(long workers,
+                 void * (*cb_read)(void *),
+                 void * read_data,
+                 void * (*cb_work)(void *, long, void *),
+                 long (*cb_write)(void *, long, void *),
+                 void * data)
+{
+  long i;
+  long index;
+  long next = 0;
+  long bytes;
+  long finished = 0;
+  long started;
+  void * result;
+  pthread_t reader;
+  pthread_t * threads;
+  timing_mark_t mark;
+  reorder_slot_t * slots;
+
+  if (workers < 1)
+    workers = 1;
+
+  pipeline_t * p = (pipeline_t *)bpp_aligned_alloc(sizeof(pipeline_t),
+                                                   PIPELINE_CACHELINE);
+  if (!p)
+    return BPP_FAILURE;
+
+  p->workers   = workers;
+  p->window    = 4*workers;
+  p->cb_read   = cb_read;
+  p->read_data = read_data;
+  p->cb_work   = cb_work;
+  p->data      = data;
+  p->written   = 0;
+  p->read_errno = 0;
+  p->inq       = mpmc_create(p->window + workers);
+  p->outq      = mpmc_create(p->window + workers);
+
+  slots = (reorder_slot_t *)bpp_calloc((size_t)p->window,
+                                       sizeof(reorder_slot_t));
+  threads = (pthread_t *)bpp_malloc((size_t)workers * sizeof(pthread_t));
+
+  if (!p->inq || !p->outq || !slots || !threads)
+  {
+    free(threads);
+    free(slots);
+    mpmc_destroy(p->inq);
+    mpmc_destroy(p->outq);
+    pll_aligned_free(p);
+    return BPP_FAILURE;
+  }
+
+  for (started = 0; started < workers; ++started)
+    if (pthread_create(threads+started, NULL, pipeline_worker, (void *)p))
+      break;
+
+  if (started < workers ||
+      pthread_create(&reader, NULL, pipeline_reader, (void *)p))
+  {
+    /* no item was read yet, stop the workers started so far */
+    for (i = 0; i < started; ++i)
+      mpmc_push(p->inq, NULL, PIPELINE_EOS);
+    for (i = 0; i < started; ++i)
+      pthread_join(threads[i], NULL);
+
+    free(threads);
+    free(slots);
+    mpmc_destroy(p->inq);
+    mpmc_destroy(p->outq);
+    pll_aligned_free(p);
+
+    bpp_errno = ERROR_THREAD;
+    snprintf(bpp_errmsg, 200, "Unable to create %s thread",
+             started < workers ? "worker" : "reader");
+    return BPP_FAILURE;
+  }
+
+  /* writer stage: emit results strictly in input order */
+  while (finished < workers)
+  {
+    mpmc_pop(p->outq, &result, &index);
+
+    if (index == PIPELINE_EOS)
+    {
+      finished++;
+      continue;
+    }
+
+    assert(index - next < p->window);
+    slots[index % p->window].data = result;
+    slots[index % p->window].ready = 1;
+
+    while (slots[next % p->window].ready)
+    {
+      reorder_slot_t * slot = slots + next % p->window;
+
+      timing_start(&mark);
+      bytes = cb_write(slot->data, next, data);
+      timing_stop(TIMING_PHASE_WRITE, &mark, bytes, 1);
+      slot->data = NULL;
+      slot->ready = 0;
+
+      ++next;
+      __atomic_store_n(&p->written, next, __ATOMIC_RELEASE);
+    }
+  }
+
+  pthread_join(reader, NULL);
+  for (i = 0; i < workers; ++i)
+    pthread_join(threads[i], NULL);
+
+  free(threads);
+  free(slots);
+  mpmc_destroy(p->inq);
+  mpmc_destroy(p->outq);
+
+  if (p->read_errno)
+  {
+    bpp_errno = p->read_errno;
+    memcpy(bpp_errmsg, p->read_errmsg, 200);
+    pll_aligned_free(p);
+    return BPP_FAILURE;
+  }
+
+  pll_aligned_free(p);
+  return BPP_SUCCESS;
+}
+
+/* read callback for PHYLIP files; parse errors end the stream and are
+   returned by pipeline_run */
+void * pipeline_cb_phylip(void * data)
+{
+  return (void *)phylip_parse_next((phylip_t *)data);
+}
+
+/* read callback for loci already in memory; ownership of each locus passes
+   to the pipeline */
+void * pipeline_cb_list(void * data)
+{
+  pipeline_list_t * reader = (pipeline_list_t *)data;
+
+  if (reader->next == reader->count)
+    return NULL;
+
+  return (void *)reader->msa_list[reader->next++];
+}
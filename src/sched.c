@@ -0,0 +1,530 @@
+/*
+    Copyright (C) 2022-2023 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London, Gower Street, London WC1E 6BT, England
+*/
+
+#include "libbpptools.h"
+
+/* Work-stealing task scheduler. Each worker owns a Chase-Lev deque: it
+   pushes and pops tasks at the bottom, while idle workers steal from the
+   top of other deques. Tasks submitted from threads that are not workers
+   of the scheduler go to a shared injection queue. Tasks may submit further
+   tasks, e.g. a per-locus task splitting a long locus into site ranges. */
+
+#define SCHED_CACHELINE     64
+#define SCHED_DEQUE_INIT  1024
+#define SCHED_SPINS        128
+
+typedef struct task_s
+{
+  void (*cb)(void *);
+  void * arg;
+} task_t;
+
+typedef struct deque_array_s
+{
+  long size;
+  task_t ** buf;
+  struct deque_array_s * prev;
+} deque_array_t;
+
+typedef struct deque_s
+{
+  long top;
+  char pad0[SCHED_CACHELINE];
+  long bottom;
+  char pad1[SCHED_CACHELINE];
+  deque_array_t * array;
+  char pad2[SCHED_CACHELINE];
+} deque_t;
+
+typedef struct range_s
+{
+  long begin;
+  long end;
+  long grain;
+  void (*cb)(long, long, void *);
+  void * arg;
+  sched_t * sched;
+} range_t;
+
+typedef struct worker_s
+{
+  long id;
+  unsigned long rng;
+  sched_t * sched;
+  pthread_t thread;
+} worker_t;
+
+struct sched_s
+{
+  long threads;
+  deque_t * deques;
+  worker_t * workers;
+
+  /* injection queue for tasks submitted from non-worker threads */
+  pthread_mutex_t inject_mutex;
+  list_t inject;
+  long inject_count;
+
+  /* sleeping workers and tasks waiting to be picked up */
+  pthread_mutex_t mutex;
+  pthread_cond_t work_cond;
+  pthread_cond_t done_cond;
+  long sleepers;
+  long queued;
+  long outstanding;
+  long shutdown;
+};
+
+static __THREAD long worker_id = -1;
+static __THREAD sched_t * worker_sched = NULL;
+
+static deque_array_t * deque_array_create(long size, deque_array_t * prev)
+{
+  deque_array_t * a = (deque_array_t *)bpp_malloc(sizeof(deque_array_t));
+  if (!a)
+    return NULL;
+
+  a->size = size;
+  a->buf = (task_t **)bpp_malloc((size_t)size * sizeof(task_t *));
+  if (!a->buf)
+  {
+    free(a);
+    return NULL;
+  }
+  a->prev = prev;
+
+  return a;
+}
+
+static int deque_push(deque_t * d, task_t * task)
+{
+  long i;
+  long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+  long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+  deque_array_t * a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+
+  if (b - t > a->size - 1)
+  {
+    /* grow; old arrays are kept until destruction as thieves may still be
+       reading from them */
+    deque_array_t * g = deque_array_create(2*a->size, a);
+    if (!g)
+      return BPP_FAILURE;
+    for (i = t; i < b; ++i)
+      g->buf[i % g->size] = __atomic_load_n(a->buf + i % a->size,
+                                            __ATOMIC_RELAXED);
+    __atomic_store_n(&d->array, g, __ATOMIC_RELEASE);
+    a = g;
+  }
+
+  __atomic_store_n(a->buf + b % a->size, task, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&d->bottom, b+1, __ATOMIC_RELAXED);
+
+  return BPP_SUCCESS;
+}
+
+static task_t * deque_pop(deque_t * d)
+{
+  task_t * task = NULL;
+  long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+  deque_array_t * a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+
+  __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  long t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+  if (t <= b)
+  {
+    task = __atomic_load_n(a->buf + b % a->size, __ATOMIC_RELAXED);
+    if (t == b)
+    {
+      /* last task, race against thieves */
+      if (!__atomic_compare_exchange_n(&d->top, &t, t+1, 0,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        task = NULL;
+      __atomic_store_n(&d->bottom, b+1, __ATOMIC_RELAXED);
+    }
+  }
+  else
+    __atomic_store_n(&d->bottom, b+1, __ATOMIC_RELAXED);
+
+  return task;
+}
+
+static task_t * deque_steal(deque_t * d)
+{
+  task_t * task;
+  long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  long b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+
+  if (t >= b)
+    return NULL;
+
+  deque_array_t * a = __atomic_load_n(&d->array, __ATOMIC_ACQUIRE);
+  task = __atomic_load_n(a->buf + t % a->size, __ATOMIC_RELAXED);
+  if (!__atomic_compare_exchange_n(&d->top, &t, t+1, 0,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    return NULL;
+
+  return task;
+}
+
+static task_t * inject_pop(sched_t * s)
+{
+  task_t * task = NULL;
+
+  pthread_mutex_lock(&s->inject_mutex);
+  if (s->inject.count)
+  {
+    task = (task_t *)(s->inject.head->data);
+    list_delitem(&s->inject, s->inject.head, NULL);
+    __atomic_sub_fetch(&s->inject_count, 1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&s->inject_mutex);
+
+  return task;
+}
+
+static task_t * find_task(worker_t * w)
+{
+  long i;
+  long victim;
+  task_t * task;
+  sched_t * s = w->sched;
+
+  /* own deque first */
+  if ((task = deque_pop(s->deques + w->id)))
+    return task;
+
+  /* then tasks submitted from outside */
+  if (__atomic_load_n(&s->inject_count, __ATOMIC_RELAXED))
+    if ((task = inject_pop(s)))
+      return task;
+
+  /* then try to steal from randomly chosen victims */
+  for (i = 0; i < 2*s->threads; ++i)
+  {
+    w->rng = w->rng * 6364136223846793005UL + 1442695040888963407UL;
+    victim = (long)((w->rng >> 33) % (unsigned long)s->threads);
+    if (victim == w->id)
+      continue;
+
+    if ((task = deque_steal(s->deques + victim)))
+      return task;
+  }
+
+  return NULL;
+}
+
+static void task_done(sched_t * s)
+{
+  if (!__atomic_sub_fetch(&s->outstanding, 1, __ATOMIC_SEQ_CST))
+  {
+    pthread_mutex_lock(&s->mutex);
+    pthread_cond_broadcast(&s->done_cond);
+    pthread_mutex_unlock(&s->mutex);
+  }
+}
+
+static void run_task(sched_t * s, task_t * task)
+{
+  __atomic_sub_fetch(&s->queued, 1, __ATOMIC_SEQ_CST);
+
+  task->cb(task->arg);
+  free(task);
+
+  task_done(s);
+}
+
+static void * sched_worker(void * arg)
+{
+  long idle = 0;
+  long stop;
+  task_t * task;
+  worker_t * w = (worker_t *)arg;
+  sched_t * s = w->sched;
+
+  worker_id = w->id;
+  worker_sched = s;
+
+  while (1)
+  {
+    if ((task = find_task(w)))
+    {
+      run_task(s, task);
+      idle = 0;
+      continue;
+    }
+
+    if (++idle < SCHED_SPINS)
+    {
+      _mm_pause();
+      continue;
+    }
+
+    /* no work found for a while, sleep until new tasks are queued */
+    pthread_mutex_lock(&s->mutex);
+    __atomic_add_fetch(&s->sleepers, 1, __ATOMIC_SEQ_CST);
+    while (!__atomic_load_n(&s->queued, __ATOMIC_SEQ_CST) && !s->shutdown)
+      pthread_cond_wait(&s->work_cond, &s->mutex);
+    __atomic_sub_fetch(&s->sleepers, 1, __ATOMIC_SEQ_CST);
+    stop = s->shutdown && !__atomic_load_n(&s->queued, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&s->mutex);
+
+    if (stop)
+      break;
+
+    idle = 0;
+  }
+
+  return NULL;
+}
+
+/* stops the first started workers and frees the scheduler */
+static void sched_stop(sched_t * s, long started)
+{
+  long i;
+
+  pthread_mutex_lock(&s->mutex);
+  s->shutdown = 1;
+  pthread_cond_broadcast(&s->work_cond);
+  pthread_mutex_unlock(&s->mutex);
+
+  for (i = 0; i < started; ++i)
+    pthread_join(s->workers[i].thread, NULL);
+
+  for (i = 0; i < s->threads; ++i)
+  {
+    deque_array_t * a = s->deques[i].array;
+    while (a)
+    {
+      deque_array_t * prev = a->prev;
+      free(a->buf);
+      free(a);
+      a = prev;
+    }
+  }
+
+  pthread_mutex_destroy(&s->inject_mutex);
+  pthread_mutex_destroy(&s->mutex);
+  pthread_cond_destroy(&s->work_cond);
+  pthread_cond_destroy(&s->done_cond);
+
+  pll_aligned_free(s->deques);
+  free(s->workers);
+  free(s);
+}
+
+sched_t * sched_create(long threads)
+{
+  long i;
+
+  if (threads < 1)
+    threads = 1;
+
+  sched_t * s = (sched_t *)bpp_calloc(1, sizeof(sched_t));
+  if (!s)
+    return NULL;
+
+  s->deques = (deque_t *)bpp_aligned_alloc((size_t)threads * sizeof(deque_t),
+                                           SCHED_CACHELINE);
+  s->workers = (worker_t *)bpp_malloc((size_t)threads * sizeof(worker_t));
+  if (!s->deques || !s->workers)
+  {
+    pll_aligned_free(s->deques);
+    free(s->workers);
+    free(s);
+    return NULL;
+  }
+
+  pthread_mutex_init(&s->inject_mutex, NULL);
+  pthread_mutex_init(&s->mutex, NULL);
+  pthread_cond_init(&s->work_cond, NULL);
+  pthread_cond_init(&s->done_cond, NULL);
+
+  for (i = 0; i < threads; ++i)
+  {
+    s->deques[i].top = 0;
+    s->deques[i].bottom = 0;
+    s->deques[i].array = deque_array_create(SCHED_DEQUE_INIT, NULL);
+    if (!s->deques[i].array)
+      break;
+  }
+  s->threads = i;
+  if (i < threads)
+  {
+    sched_stop(s, 0);
+    return NULL;
+  }
+
+  for (i = 0; i < threads; ++i)
+  {
+    s->workers[i].id = i;
+    s->workers[i].rng = (unsigned long)i + 1;
+    s->workers[i].sched = s;
+    if (pthread_create(&s->workers[i].thread,
+                       NULL,
+                       sched_worker,
+                       (void *)(s->workers+i)))
+    {
+      sched_stop(s, i);
+      bpp_errno = ERROR_THREAD;
+      snprintf(bpp_errmsg, 200, "Unable to create worker thread");
+      return NULL;
+    }
+  }
+
+  return s;
+}
+
+int sched_submit(sched_t * s, void (*cb)(void *), void * arg)
+{
+  int ok;
+  task_t * task = (task_t *)bpp_malloc(sizeof(task_t));
+
+  if (!task)
+    return BPP_FAILURE;
+
+  task->cb = cb;
+  task->arg = arg;
+
+  __atomic_add_fetch(&s->outstanding, 1, __ATOMIC_SEQ_CST);
+
+  if (worker_sched == s)
+  {
+    /* submitted from one of our workers, push on its own deque */
+    ok = deque_push(s->deques + worker_id, task);
+  }
+  else
+  {
+    pthread_mutex_lock(&s->inject_mutex);
+    ok = list_append(&s->inject, task);
+    if (ok)
+      __atomic_add_fetch(&s->inject_count, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&s->inject_mutex);
+  }
+
+  if (!ok)
+  {
+    free(task);
+    task_done(s);
+    return BPP_FAILURE;
+  }
+
+  __atomic_add_fetch(&s->queued, 1, __ATOMIC_SEQ_CST);
+
+  /* wake up sleeping workers */
+  if (__atomic_load_n(&s->sleepers, __ATOMIC_SEQ_CST))
+  {
+    pthread_mutex_lock(&s->mutex);
+    pthread_cond_broadcast(&s->work_cond);
+    pthread_mutex_unlock(&s->mutex);
+  }
+
+  return BPP_SUCCESS;
+}
+
+static void range_task(void * arg)
+{
+  range_t * r = (range_t *)arg;
+
+  /* keep splitting off the upper half for thieves until the range is small
+     enough to process; if memory runs out the rest is processed here */
+  while (r->end - r->begin > r->grain)
+  {
+    long mid = r->begin + (r->end - r->begin) / 2;
+
+    range_t * upper = (range_t *)bpp_malloc(sizeof(range_t));
+    if (!upper)
+      break;
+    memcpy(upper, r, sizeof(range_t));
+    upper->begin = mid;
+    if (!sched_submit(r->sched, range_task, (void *)upper))
+    {
+      free(upper);
+      break;
+    }
+
+    r->end = mid;
+  }
+
+  r->cb(r->begin, r->end, r->arg);
+  free(r);
+}
+
+int sched_parallel_for(sched_t * s,
+                       long begin,
+                       long end,
+                       long grain,
+                       void (*cb)(long, long, void *),
+                       void * arg)
+{
+  if (end <= begin)
+    return BPP_SUCCESS;
+
+  range_t * r = (range_t *)bpp_malloc(sizeof(range_t));
+  if (!r)
+    return BPP_FAILURE;
+
+  r->begin = begin;
+  r->end = end;
+  r->grain = grain < 1 ? 1 : grain;
+  r->cb = cb;
+  r->arg = arg;
+  r->sched = s;
+
+  if (!sched_submit(s, range_task, (void *)r))
+  {
+    free(r);
+    return BPP_FAILURE;
+  }
+
+  return BPP_SUCCESS;
+}
+
+void sched_wait(sched_t * s)
+{
+  /* must not be called from a worker; it would wait for its own task */
+  assert(worker_sched != s);
+
+  pthread_mutex_lock(&s->mutex);
+  while (__atomic_load_n(&s->outstanding, __ATOMIC_SEQ_CST))
+    pthread_cond_wait(&s->done_cond, &s->mutex);
+  pthread_mutex_unlock(&s->mutex);
+}
+
+long sched_worker_id()
+{
+  return worker_id;
+}
+
+long sched_threads(sched_t * s)
+{
+  return s->threads;
+}
+
+void sched_destroy(sched_t * s)
+{
+  sched_wait(s);
+  sched_stop(s, s->threads);
+}
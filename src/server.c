@@ -0,0 +1,492 @@
+/*
+    Copyright (C) 2022-2023 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London, Gower Street, London WC1E 6BT, England
+*/
+
+#include "libbpptools.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Resident query server. The dataset is parsed once and shared read-only
+   between connections; each connection is served by its own thread and
+   sends one request per line:
+
+     extract LIST      sequences matching LIST, as PHYLIP
+     remove LIST       sequences not matching LIST, as PHYLIP
+     stats             one TSV row per locus
+     dstat A,B,C,D     D-statistic of the quartet
+     quit              close the connection
+     shutdown          close the connection and stop the server
+
+   Each reply is either "OK <bytes>\n" followed by exactly <bytes> bytes of
+   payload, or a single line "ERR <message>\n". */
+
+typedef struct server_s
+{
+  int fd;
+  msa_t ** msa_list;
+  long msa_count;
+
+  /* sockets of the open connections, -1 for unused slots */
+  int * clients;
+  long clients_max;
+
+  /* number of connection threads still running */
+  long active;
+  long stop;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+} server_t;
+
+typedef struct server_conn_s
+{
+  int fd;
+  long slot;
+  server_t * server;
+} server_conn_t;
+
+static int write_all(int fd, const char * buf, size_t size)
+{
+  while (size)
+  {
+    ssize_t n = send(fd, buf, size, MSG_NOSIGNAL);
+    if (n < 0)
+      return 0;
+    buf += n;
+    size -= (size_t)n;
+  }
+
+  return 1;
+}
+
+static int reply_error(int fd, const char * msg)
+{
+  char line[256];
+
+  snprintf(line, 256, "ERR %s\n", msg);
+  return write_all(fd, line, strlen(line));
+}
+
+static int reply_ok(int fd, const char * payload, size_t size)
+{
+  char line[64];
+
+  snprintf(line, 64, "OK %zu\n", size);
+  return write_all(fd, line, strlen(line)) && write_all(fd, payload, size);
+}
+
+static int req_filter(server_t * server, long type, const char * list, FILE * fp)
+{
+  long i;
+  long kept = 0;
+  filter_t * filter;
+
+  if (!(filter = filter_create(type, list)))
+    return BPP_FAILURE;
+
+  for (i = 0; i < server->msa_count; ++i)
+  {
+    long printed = filter_print(filter, server->msa_list[i], fp);
+
+    if (printed < 0)
+    {
+      filter_destroy(filter);
+      return BPP_FAILURE;
+    }
+    if (printed)
+      kept++;
+  }
+
+  filter_destroy(filter);
+
+  if (!kept)
+  {
+    bpp_errno = ERROR_INVALID_ARGUMENT;
+    snprintf(bpp_errmsg, 200, "No sequences selected");
+    return BPP_FAILURE;
+  }
+
+  return BPP_SUCCESS;
+}
+
+static int req_stats(server_t * server, FILE * fp)
+{
+  long i;
+  msa_stats_t stats;
+  msa_stats_report_t report;
+
+  /* same report as --stats tsv */
+  msa_stats_begin(&report, fp, 0);
+  for (i = 0; i < server->msa_count; ++i)
+  {
+    if (!msa_stats(server->msa_list[i], &stats))
+      return BPP_FAILURE;
+    msa_stats_add(&report, &stats);
+  }
+  msa_stats_end(&report);
+
+  return BPP_SUCCESS;
+}
+
+/* dstat_compute picks the sequences of the quartet from the shared loci,
+   such that the dataset is not copied */
+static int req_dstat(server_t * server, const char * taxa, FILE * fp)
+{
+  int rc = BPP_FAILURE;
+  dstat_t * ds;
+  dstat_result_t result;
+
+  if (!(ds = dstat_create(taxa)))
+    return BPP_FAILURE;
+
+  if (dstat_compute(ds, server->msa_list, server->msa_count, NULL, &result))
+  {
+    fprintf(fp, "Tree: (((%s,%s),%s),%s);\n",
+            ds->taxa[0], ds->taxa[1], ds->taxa[2], ds->taxa[3]);
+    fprintf(fp, "abba: %f\n", result.abba);
+    fprintf(fp, "baba: %f\n", result.baba);
+    fprintf(fp, "D: %f\n", result.d);
+    fprintf(fp, "sites: %ld\n", result.sites);
+    rc = BPP_SUCCESS;
+  }
+
+  dstat_destroy(ds);
+
+  return rc;
+}
+
+static void server_stop(server_t * server)
+{
+  long i;
+
+  pthread_mutex_lock(&server->mutex);
+  if (!server->stop)
+  {
+    server->stop = 1;
+
+    /* wakes up the thread blocked in accept() */
+    shutdown(server->fd, SHUT_RDWR);
+
+    /* idle connections see end of input after their current request */
+    for (i = 0; i < server->clients_max; ++i)
+      if (server->clients[i] != -1)
+        shutdown(server->clients[i], SHUT_RD);
+  }
+  pthread_mutex_unlock(&server->mutex);
+}
+
+static void * server_conn(void * arg)
+{
+  char * line = NULL;
+  size_t line_size = 0;
+  ssize_t len;
+  server_conn_t * conn = (server_conn_t *)arg;
+  server_t * server = conn->server;
+  int fd = conn->fd;
+  long slot = conn->slot;
+  FILE * in;
+
+  free(conn);
+
+  if (!(in = fdopen(fd, "r")))
+  {
+    close(fd);
+    goto l_done;
+  }
+
+  while ((len = getline(&line, &line_size, in)) != -1)
+  {
+    char * payload = NULL;
+    size_t payload_size = 0;
+    char * arg;
+    int ok;
+
+    /* strip line terminators */
+    while (len && (line[len-1] == '\n' || line[len-1] == '\r'))
+      line[--len] = 0;
+
+    /* split command and argument */
+    arg = line + strcspn(line, " \t");
+    if (*arg)
+    {
+      *arg++ = 0;
+      arg += strspn(arg, " \t");
+    }
+
+    if (!strcmp(line, "quit"))
+      break;
+
+    if (!strcmp(line, "shutdown"))
+    {
+      reply_ok(fd, "", 0);
+      server_stop(server);
+      break;
+    }
+
+    FILE * fp = open_memstream(&payload, &payload_size);
+
+    bpp_errno = 0;
+    if (!fp)
+    {
+      bpp_errno = ERROR_MEMORY;
+      snprintf(bpp_errmsg, 200, "Unable to allocate enough memory.");
+      ok = BPP_FAILURE;
+    }
+    else if (!strcmp(line, "extract") && *arg)
+      ok = req_filter(server, FILTER_EXTRACT, arg, fp);
+    else if (!strcmp(line, "remove") && *arg)
+      ok = req_filter(server, FILTER_REMOVE, arg, fp);
+    else if (!strcmp(line, "stats") && !*arg)
+      ok = req_stats(server, fp);
+    else if (!strcmp(line, "dstat") && *arg)
+      ok = req_dstat(server, arg, fp);
+    else
+    {
+      bpp_errno = ERROR_INVALID_ARGUMENT;
+      snprintf(bpp_errmsg, 200, "Invalid request (%s)", line);
+      ok = BPP_FAILURE;
+    }
+
+    if (fp)
+      fclose(fp);
+
+    ok = ok ? reply_ok(fd, payload, payload_size) : reply_error(fd, bpp_errmsg);
+    free(payload);
+
+    /* client went away */
+    if (!ok)
+      break;
+  }
+
+  free(line);
+  fclose(in);
+
+l_done:
+  pthread_mutex_lock(&server->mutex);
+  server->clients[slot] = -1;
+  if (!--server->active)
+    pthread_cond_signal(&server->cond);
+  pthread_mutex_unlock(&server->mutex);
+
+  return NULL;
+}
+
+/* remove a socket left by a server that is no longer running; anything
+   else at 'path', including the socket of a running server, is an error */
+static int remove_stale_socket(const char * path,
+                               const struct sockaddr_un * addr)
+{
+  int fd;
+  int rc;
+  struct stat st;
+
+  if (lstat(path, &st))
+  {
+    if (errno == ENOENT)
+      return BPP_SUCCESS;
+
+    bpp_errno = ERROR_SOCKET;
+    snprintf(bpp_errmsg, 200, "Unable to access %s (%s)",
+             path, strerror(errno));
+    return BPP_FAILURE;
+  }
+
+  if (!S_ISSOCK(st.st_mode))
+  {
+    bpp_errno = ERROR_SOCKET;
+    snprintf(bpp_errmsg, 200, "%s exists and is not a socket", path);
+    return BPP_FAILURE;
+  }
+
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+  {
+    bpp_errno = ERROR_SOCKET;
+    snprintf(bpp_errmsg, 200, "Unable to create socket (%s)", strerror(errno));
+    return BPP_FAILURE;
+  }
+
+  rc = connect(fd, (const struct sockaddr *)addr, sizeof(struct sockaddr_un));
+  close(fd);
+
+  if (rc == -1 && errno == ECONNREFUSED && !unlink(path))
+    return BPP_SUCCESS;
+
+  bpp_errno = ERROR_SOCKET;
+  if (rc == -1)
+    snprintf(bpp_errmsg, 200, "Unable to replace socket %s (%s)",
+             path, strerror(errno));
+  else
+    snprintf(bpp_errmsg, 200, "Socket %s in use by a running server", path);
+  return BPP_FAILURE;
+}
+
+/* serve queries on the Unix domain socket 'path' until a shutdown request
+   is received; the loci are not modified and remain owned by the caller */
+int server_run(const char * path, msa_t ** msa_list, long msa_count)
+{
+  long i,j;
+  int fd;
+  int accept_errno = 0;
+  struct sockaddr_un addr;
+  server_t server;
+  pthread_attr_t attr;
+
+  if (strlen(path) >= sizeof(addr.sun_path))
+  {
+    bpp_errno = ERROR_SOCKET;
+    snprintf(bpp_errmsg, 200, "Socket path too long (%s)", path);
+    return BPP_FAILURE;
+  }
+
+  memset(&addr, 0, sizeof(struct sockaddr_un));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  server.clients_max = 16;
+  server.clients = (int *)bpp_malloc((size_t)server.clients_max*sizeof(int));
+  if (!server.clients)
+    return BPP_FAILURE;
+  for (i = 0; i < server.clients_max; ++i)
+    server.clients[i] = -1;
+
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+  {
+    bpp_errno = ERROR_SOCKET;
+    snprintf(bpp_errmsg, 200, "Unable to create socket (%s)", strerror(errno));
+    free(server.clients);
+    return BPP_FAILURE;
+  }
+
+  if (!remove_stale_socket(path, &addr))
+  {
+    free(server.clients);
+    close(fd);
+    return BPP_FAILURE;
+  }
+
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_un)) == -1 ||
+      listen(fd, SOMAXCONN) == -1)
+  {
+    bpp_errno = ERROR_SOCKET;
+    snprintf(bpp_errmsg, 200, "Unable to listen on socket %s (%s)",
+             path, strerror(errno));
+    free(server.clients);
+    close(fd);
+    return BPP_FAILURE;
+  }
+
+  /* the loci are shared by all clients and not modified once served */
+  for (i = 0; i < msa_count; ++i)
+    msa_detect_dtype(msa_list[i]);
+
+  server.fd = fd;
+  server.msa_list = msa_list;
+  server.msa_count = msa_count;
+  server.active = 0;
+  server.stop = 0;
+  pthread_mutex_init(&server.mutex, NULL);
+  pthread_cond_init(&server.cond, NULL);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  while (1)
+  {
+    pthread_t thread;
+    int client = accept(fd, NULL, NULL);
+
+    if (client == -1)
+    {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      accept_errno = errno;
+      break;
+    }
+
+    /* a connection that cannot be served is dropped, the server keeps
+       running */
+    server_conn_t * conn = (server_conn_t *)bpp_malloc(sizeof(server_conn_t));
+    if (!conn)
+    {
+      close(client);
+      continue;
+    }
+    conn->fd = client;
+    conn->server = &server;
+
+    pthread_mutex_lock(&server.mutex);
+    for (i = 0; i < server.clients_max; ++i)
+      if (server.clients[i] == -1)
+        break;
+    if (i == server.clients_max)
+    {
+      int * clients = (int *)bpp_realloc(server.clients,
+                                         2*(size_t)server.clients_max *
+                                         sizeof(int));
+      if (!clients)
+      {
+        pthread_mutex_unlock(&server.mutex);
+        free(conn);
+        close(client);
+        continue;
+      }
+      server.clients = clients;
+      server.clients_max = 2*server.clients_max;
+      for (j = i; j < server.clients_max; ++j)
+        server.clients[j] = -1;
+    }
+    server.clients[i] = client;
+    conn->slot = i;
+    server.active++;
+    pthread_mutex_unlock(&server.mutex);
+
+    if (pthread_create(&thread, &attr, server_conn, (void *)conn))
+    {
+      pthread_mutex_lock(&server.mutex);
+      server.clients[i] = -1;
+      server.active--;
+      pthread_mutex_unlock(&server.mutex);
+      free(conn);
+      close(client);
+    }
+  }
+
+  /* wait for requests in progress */
+  pthread_mutex_lock(&server.mutex);
+  while (server.active)
+    pthread_cond_wait(&server.cond, &server.mutex);
+  pthread_mutex_unlock(&server.mutex);
+
+  free(server.clients);
+  pthread_attr_destroy(&attr);
+  pthread_cond_destroy(&server.cond);
+  pthread_mutex_destroy(&server.mutex);
+  close(fd);
+  unlink(path);
+
+  if (!server.stop)
+  {
+    bpp_errno = ERROR_SOCKET;
+    snprintf(bpp_errmsg, 200, "Unable to accept connection (%s)",
+             strerror(accept_errno));
+    return BPP_FAILURE;
+  }
+
+  return BPP_SUCCESS;
+}
@@ -0,0 +1,449 @@
+/*
+    Copyright (C) 2022-2023 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London, Gower Street, London WC1E 6BT, England
+*/
+
+
+#include "libbpptools.h"
+
+/* Site frequency spectra per ^species and joint spectra for each pair of
+   species, summed over loci. Allele copies are counted for all sites of a
+   locus at once, one sequence at a time, into per-species counters (see
+   kernel_allele_counts). Sites with more than two nucleotides are ignored,
+   and a species contributes a site only if all its copies are known, such
+   that the sample size of each species is fixed; it is the largest number
+   of copies of the species found in a locus. Loci with fewer copies of a
+   species contribute no sites to its spectrum or to its joint spectra;
+   such loci and the sites left out are counted per species, so that the
+   caller can report them. Sequences are haploid, or
+   unphased diploid if 'diploid' is set, in which case two-fold ambiguities
+   are heterozygotes. The unfolded spectrum counts copies of the derived
+   allele, i.e. the allele not carried by the outgroup, and uses only sites
+   at which the outgroup is known and monomorphic. Loci are processed in
+   parallel and each worker adds to its own histograms, which are summed
+   at the end. */
+
+typedef struct sfs_ctx_s
+{
+  sfs_t * sfs;
+  msa_t ** msa_list;
+  long outgroup;        /* species index of the outgroup, -1 if folded */
+  long groups;          /* species including the outgroup */
+  long total;           /* bins of all histograms of one thread */
+  long * offset;        /* histogram offsets, species then pairs */
+  long incomplete;      /* offset of the per-species incomplete site counts */
+  unsigned long * hist;
+  const unsigned char (*tbl)[16];
+  long failed;          /* set if memory ran out while processing a locus */
+} sfs_ctx_t;
+
+static kernel_map_t sfs_kmap;
+static unsigned char sfs_haploid[5][16];
+static unsigned char sfs_diploid[5][16];
+static pthread_once_t sfs_once = PTHREAD_ONCE_INIT;
+
+static void sfs_init()
+{
+  long a,e;
+
+  kernel_map_init(&sfs_kmap, pll_map_nt);
+
+  for (e = 0; e < 16; ++e)
+  {
+    long copies = PLL_POPCOUNT((unsigned int)e);
+
+    for (a = 0; a < 4; ++a)
+    {
+      if (!(e & (1 << a))) continue;
+
+      if (copies == 1)
+      {
+        sfs_haploid[a][e] = 1;
+        sfs_diploid[a][e] = 2;
+      }
+      else if (copies == 2)
+        sfs_diploid[a][e] = 1;
+    }
+    sfs_haploid[4][e] = copies == 1;
+    sfs_diploid[4][e] = (copies == 1 || copies == 2) ? 2 : 0;
+  }
+}
+
+static long species_index(char ** names, long count, const char * label)
+{
+  long i;
+  const char * tag = strchr(label, '^');
+
+  if (!tag) return -1;
+
+  for (i = 0; i < count; ++i)
+    if (!strcmp(names[i], tag+1))
+      return i;
+
+  return -1;
+}
+
+/* pick the smaller of (k1,k2) and (n1-k1,n2-k2) */
+static void fold_pair(long * k1, long * k2, long n1, long n2)
+{
+  long f1 = n1 - *k1;
+  long f2 = n2 - *k2;
+
+  if (f1 + f2 < *k1 + *k2 || (f1 + f2 == *k1 + *k2 && f1 < *k1))
+  {
+    *k1 = f1;
+    *k2 = f2;
+  }
+}
+
+static int sfs_locus(sfs_ctx_t * ctx, const msa_t * msa, unsigned long * hist)
+{
+  long i,j,s,t,a;
+  long p;
+  sfs_t * sfs = ctx->sfs;
+  long n = msa->length;
+  long species = sfs->species_count;
+  long * k = (long *)bpp_malloc(2*(size_t)species * sizeof(long));
+
+  unsigned short * counts =
+    (unsigned short *)bpp_calloc((size_t)MAX(ctx->groups * 5 * n,1),
+                                 sizeof(unsigned short));
+  if (!k || !counts)
+  {
+    free(k);
+    free(counts);
+    return BPP_FAILURE;
+  }
+  long * complete = k + species;
+
+  for (i = 0; i < msa->count; ++i)
+  {
+    s = species_index(sfs->species, ctx->groups, msa->label[i]);
+    if (s < 0) continue;
+
+    kernel_allele_counts(msa->sequence[i], n, &sfs_kmap, ctx->tbl,
+                         counts + s*5*n);
+  }
+
+  for (j = 0; j < n; ++j)
+  {
+    unsigned int mask = 0;
+    long derived;
+
+    for (s = 0; s < ctx->groups; ++s)
+      for (a = 0; a < 4; ++a)
+        if (counts[(s*5+a)*n+j])
+          mask |= 1u << a;
+
+    if (!mask || PLL_POPCOUNT(mask) > 2) continue;
+
+    if (ctx->outgroup >= 0)
+    {
+      unsigned int anc = 0;
+
+      for (a = 0; a < 4; ++a)
+        if (counts[(ctx->outgroup*5+a)*n+j])
+          anc |= 1u << a;
+      if (PLL_POPCOUNT(anc) != 1) continue;
+
+      mask &= ~anc;
+    }
+    else
+    {
+      /* folded: either allele will do, take the second one */
+      mask &= mask - 1;
+    }
+    derived = mask ? PLL_CTZ(mask) : -1;
+
+    for (s = 0; s < species; ++s)
+    {
+      complete[s] = counts[(s*5+4)*n+j] == sfs->samples[s];
+      k[s] = derived < 0 ? 0 : counts[(s*5+derived)*n+j];
+
+      if (!complete[s])
+      {
+        hist[ctx->incomplete + s]++;
+        continue;
+      }
+
+      if (sfs->folded)
+        hist[ctx->offset[s] + MIN(k[s], sfs->samples[s] - k[s])]++;
+      else
+        hist[ctx->offset[s] + k[s]]++;
+    }
+
+    for (s = 0, p = species; s < species; ++s)
+      for (t = s+1; t < species; ++t, ++p)
+      {
+        long k1 = k[s];
+        long k2 = k[t];
+
+        if (!complete[s] || !complete[t]) continue;
+
+        if (sfs->folded)
+          fold_pair(&k1, &k2, sfs->samples[s], sfs->samples[t]);
+
+        hist[ctx->offset[p] + k1*(sfs->samples[t]+1) + k2]++;
+      }
+  }
+
+  free(k);
+  free(counts);
+
+  return BPP_SUCCESS;
+}
+
+static void cb_sfs_loci(long begin, long end, void * arg)
+{
+  long i;
+  sfs_ctx_t * ctx = (sfs_ctx_t *)arg;
+  long id = MAX(sched_worker_id(), 0);
+  unsigned long * hist = ctx->hist + id*ctx->total;
+
+  for (i = begin; i < end; ++i)
+    if (!sfs_locus(ctx, ctx->msa_list[i], hist))
+    {
+      __atomic_store_n(&ctx->failed, 1, __ATOMIC_RELAXED);
+      return;
+    }
+}
+
+/* Folded spectra if outgroup is NULL, otherwise unfolded; the outgroup is
+   not part of the result */
+sfs_t * sfs_compute(msa_t ** msa_list,
+                    long msa_count,
+                    const char * outgroup,
+                    long diploid,
+                    sched_t * sched)
+{
+  long i,j,s,t,p;
+  long groups = 0;
+  long threads = sched ? sched_threads(sched) : 1;
+  long * seqs = NULL;
+  char ** names = NULL;
+  sfs_t * sfs = NULL;
+  sfs_ctx_t ctx;
+
+  pthread_once(&sfs_once, sfs_init);
+  memset(&ctx, 0, sizeof(sfs_ctx_t));
+  ctx.outgroup = -1;
+
+  /* collect species in order of first appearance, outgroup last */
+  for (i = 0; i < msa_count; ++i)
+    for (j = 0; j < msa_list[i]->count; ++j)
+    {
+      char * tag = strchr(msa_list[i]->label[j], '^');
+
+      if (!tag || (outgroup && !strcmp(tag+1, outgroup))) continue;
+      if (species_index(names, groups, msa_list[i]->label[j]) >= 0) continue;
+
+      char ** list = (char **)bpp_realloc(names,
+                                          (size_t)(groups+2) * sizeof(char *));
+      if (!list)
+        goto l_unwind;
+      names = list;
+      if (!(names[groups] = bpp_strdup(tag+1)))
+        goto l_unwind;
+      groups++;
+    }
+
+  if (!groups)
+  {
+    free(names);
+    bpp_errno = ERROR_INVALID_ARGUMENT;
+    snprintf(bpp_errmsg, 200, "No sequences with ^species tags found");
+    return NULL;
+  }
+
+  if (!(sfs = (sfs_t *)bpp_calloc(1, sizeof(sfs_t))))
+    goto l_unwind;
+  sfs->folded = !outgroup;
+  sfs->species_count = groups;
+  sfs->species = names;
+  sfs->samples = (long *)bpp_calloc((size_t)groups, sizeof(long));
+  sfs->loci_incomplete = (long *)bpp_calloc((size_t)groups, sizeof(long));
+  if (!sfs->samples || !sfs->loci_incomplete)
+    goto l_unwind;
+
+  ctx.sfs = sfs;
+  ctx.msa_list = msa_list;
+  ctx.groups = groups;
+  ctx.tbl = diploid ? sfs_diploid : sfs_haploid;
+
+  if (outgroup)
+  {
+    if (!(names[groups] = bpp_strdup(outgroup)))
+      goto l_unwind;
+    ctx.outgroup = groups;
+    ctx.groups = groups+1;
+  }
+
+  /* sample sizes */
+  seqs = (long *)bpp_calloc((size_t)MAX(msa_count*ctx.groups,1),
+                            sizeof(long));
+  if (!seqs)
+    goto l_unwind;
+  long outgroup_found = 0;
+  for (i = 0; i < msa_count; ++i)
+  {
+    long * n = seqs + i*ctx.groups;
+
+    for (j = 0; j < msa_list[i]->count; ++j)
+      if ((s = species_index(names, ctx.groups, msa_list[i]->label[j])) >= 0)
+        n[s] += diploid ? 2 : 1;
+
+    for (s = 0; s < groups; ++s)
+      sfs->samples[s] = MAX(sfs->samples[s], n[s]);
+    if (outgroup && n[groups])
+      outgroup_found = 1;
+  }
+  for (i = 0; i < msa_count; ++i)
+    for (s = 0; s < groups; ++s)
+      if (seqs[i*ctx.groups+s] < sfs->samples[s])
+        sfs->loci_incomplete[s]++;
+
+  if (outgroup && !outgroup_found)
+  {
+    bpp_errno = ERROR_INVALID_ARGUMENT;
+    snprintf(bpp_errmsg, 200, "Outgroup species %s not found", outgroup);
+    goto l_unwind;
+  }
+
+  /* one histogram per species followed by one per pair of species */
+  long pairs = groups*(groups-1)/2;
+  if (!(ctx.offset = (long *)bpp_malloc((size_t)(groups+pairs) *
+                                        sizeof(long))))
+    goto l_unwind;
+  for (s = 0; s < groups; ++s)
+  {
+    ctx.offset[s] = ctx.total;
+    ctx.total += sfs->samples[s] + 1;
+  }
+  for (s = 0, p = groups; s < groups; ++s)
+    for (t = s+1; t < groups; ++t, ++p)
+    {
+      ctx.offset[p] = ctx.total;
+      ctx.total += (sfs->samples[s] + 1) * (sfs->samples[t] + 1);
+    }
+  ctx.incomplete = ctx.total;
+  ctx.total += groups;
+
+  ctx.hist = (unsigned long *)bpp_calloc((size_t)(threads*ctx.total),
+                                         sizeof(unsigned long));
+  if (!ctx.hist)
+    goto l_unwind;
+
+  if (sched && msa_count > 1)
+  {
+    if (!sched_parallel_for(sched, 0, msa_count, 1, cb_sfs_loci,
+                            (void *)&ctx))
+      ctx.failed = 1;
+    sched_wait(sched);
+  }
+  else
+    cb_sfs_loci(0, msa_count, (void *)&ctx);
+
+  if (ctx.failed)
+  {
+    bpp_errno = ERROR_MEMORY;
+    snprintf(bpp_errmsg, 200, "Unable to allocate enough memory.");
+    goto l_unwind;
+  }
+
+  /* reduce the per-thread histograms */
+  for (i = 1; i < threads; ++i)
+    for (j = 0; j < ctx.total; ++j)
+      ctx.hist[j] += ctx.hist[i*ctx.total+j];
+
+  sfs->sfs = (unsigned long **)bpp_calloc((size_t)groups,
+                                          sizeof(unsigned long *));
+  sfs->joint = (unsigned long **)bpp_calloc((size_t)MAX(pairs,1),
+                                            sizeof(unsigned long *));
+  if (!sfs->sfs || !sfs->joint)
+    goto l_unwind;
+  for (s = 0; s < groups+pairs; ++s)
+  {
+    long size = (s+1 < groups+pairs ? ctx.offset[s+1] : ctx.incomplete) -
+                ctx.offset[s];
+    unsigned long * h = (unsigned long *)bpp_malloc((size_t)size *
+                                                    sizeof(unsigned long));
+    if (!h)
+      goto l_unwind;
+
+    memcpy(h, ctx.hist + ctx.offset[s], (size_t)size * sizeof(unsigned long));
+    if (s < groups)
+      sfs->sfs[s] = h;
+    else
+      sfs->joint[s-groups] = h;
+  }
+
+  sfs->sites_incomplete = (unsigned long *)bpp_malloc((size_t)groups *
+                                                      sizeof(unsigned long));
+  if (!sfs->sites_incomplete)
+    goto l_unwind;
+  memcpy(sfs->sites_incomplete, ctx.hist + ctx.incomplete,
+         (size_t)groups * sizeof(unsigned long));
+
+  if (outgroup)
+    free(names[groups]);
+  free(seqs);
+  free(ctx.hist);
+  free(ctx.offset);
+
+  return sfs;
+
+l_unwind:
+  if (ctx.outgroup >= 0)
+    free(names[groups]);
+  if (sfs)
+    sfs_destroy(sfs);
+  else
+  {
+    for (i = 0; i < groups; ++i)
+      free(names[i]);
+    free(names);
+  }
+  free(seqs);
+  free(ctx.hist);
+  free(ctx.offset);
+  return NULL;
+}
+
+void sfs_destroy(sfs_t * sfs)
+{
+  long i;
+  long pairs = sfs->species_count*(sfs->species_count-1)/2;
+
+  for (i = 0; i < sfs->species_count; ++i)
+  {
+    free(sfs->species[i]);
+    if (sfs->sfs)
+      free(sfs->sfs[i]);
+  }
+  for (i = 0; sfs->joint && i < pairs; ++i)
+    free(sfs->joint[i]);
+
+  free(sfs->species);
+  free(sfs->samples);
+  free(sfs->loci_incomplete);
+  if (sfs->sites_incomplete) free(sfs->sites_incomplete);
+  if (sfs->sfs) free(sfs->sfs);
+  if (sfs->joint) free(sfs->joint);
+  free(sfs);
+}
@@ -0,0 +1,212 @@
+/*
+    Copyright (C) 2022-2023 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London, Gower Street, London WC1E 6BT, England
+*/
+
+#include "libbpptools.h"
+
+/* Per-phase instrumentation. Phases may run concurrently on several threads
+   (e.g. workers of the pipeline), hence times are accumulated per thread and
+   summed atomically. Nothing is recorded unless timing_init() was called. */
+
+typedef struct phase_stats_s
+{
+  long calls;
+  long wall;      /* microseconds */
+  long user;      /* microseconds */
+  long sys;       /* microseconds */
+  long bytes;
+  long loci;
+} phase_stats_t;
+
+static const char * phase_names[TIMING_PHASE_COUNT] =
+{
+  "open", "scan", "parse", "process", "write"
+};
+
+static long timing_active = 0;
+static long timing_start_wall;
+static double timing_start_user;
+static double timing_start_sys;
+static phase_stats_t phase_stats[TIMING_PHASE_COUNT];
+
+void timing_init()
+{
+  memset(phase_stats, 0, TIMING_PHASE_COUNT*sizeof(phase_stats_t));
+
+  timing_start_wall = getusec();
+  arch_get_user_system_time(&timing_start_user, &timing_start_sys);
+
+  timing_active = 1;
+}
+
+void timing_start(timing_mark_t * mark)
+{
+  if (!timing_active) return;
+
+  mark->wall = getusec();
+  arch_get_thread_time(&mark->user, &mark->sys);
+}
+
+void timing_stop(long phase, timing_mark_t * mark, long bytes, long loci)
+{
+  double user, sys;
+  phase_stats_t * p = phase_stats + phase;
+
+  if (!timing_active) return;
+
+  assert(phase >= 0 && phase < TIMING_PHASE_COUNT);
+
+  long wall = getusec();
+  arch_get_thread_time(&user, &sys);
+
+  __atomic_add_fetch(&p->calls, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&p->wall, wall - mark->wall, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&p->user, (long)((user - mark->user)*1e6),
+                     __ATOMIC_RELAXED);
+  __atomic_add_fetch(&p->sys, (long)((sys - mark->sys)*1e6),
+                     __ATOMIC_RELAXED);
+  __atomic_add_fetch(&p->bytes, bytes, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&p->loci, loci, __ATOMIC_RELAXED);
+}
+
+static double rate(long count, long usec)
+{
+  return usec > 0 ? count / (usec / 1e6) : 0;
+}
+
+static void json_print_string(FILE * fp, const char * s)
+{
+  fputc('"', fp);
+  for (; *s; ++s)
+  {
+    if (*s == '"' || *s == '\\')
+      fprintf(fp, "\\%c", *s);
+    else if ((unsigned char)*s < 0x20)
+      fprintf(fp, "\\u%04x", (unsigned int)(unsigned char)*s);
+    else
+      fputc(*s, fp);
+  }
+  fputc('"', fp);
+}
+
+static void report_text(FILE * fp, long wall, double user, double sys)
+{
+  long i;
+
+  fprintf(fp, "\nTiming report (phase times are summed over threads)\n");
+  fprintf(fp, "%-8s %7s %10s %10s %10s %12s %10s %12s\n",
+          "Phase", "Calls", "Wall(s)", "User(s)", "Sys(s)",
+          "Loci", "MB/s", "Loci/s");
+  for (i = 0; i < TIMING_PHASE_COUNT; ++i)
+  {
+    phase_stats_t * p = phase_stats + i;
+
+    if (!p->calls) continue;
+
+    fprintf(fp, "%-8s %7ld %10.3f %10.3f %10.3f %12ld %10.2f %12.1f\n",
+            phase_names[i], p->calls, p->wall/1e6, p->user/1e6, p->sys/1e6,
+            p->loci, rate(p->bytes,p->wall) / (1024*1024),
+            rate(p->loci,p->wall));
+  }
+  fprintf(fp, "Total: %.3fs wall, %.3fs user, %.3fs sys, %.1f MB peak RSS\n",
+          wall/1e6, user, sys, arch_get_memused() / (1024.0*1024.0));
+}
+
+static void report_json(FILE * fp,
+                        long wall,
+                        double user,
+                        double sys,
+                        const char * command,
+                        long threads)
+{
+  long i;
+  long first = 1;
+
+  fprintf(fp, "{\n");
+  fprintf(fp, "  \"program\": \"%s\",\n", PROG_NAME);
+  fprintf(fp, "  \"version\": \"%s\",\n", PROG_VERSION);
+  fprintf(fp, "  \"arch\": \"%s\",\n", PROG_ARCH);
+  fprintf(fp, "  \"command\": ");
+  json_print_string(fp, command ? command : "");
+  fprintf(fp, ",\n");
+  fprintf(fp, "  \"threads\": %ld,\n", threads);
+  fprintf(fp, "  \"wall\": %.6f,\n", wall/1e6);
+  fprintf(fp, "  \"user\": %.6f,\n", user);
+  fprintf(fp, "  \"sys\": %.6f,\n", sys);
+  fprintf(fp, "  \"peak_rss\": %" PRIu64 ",\n", arch_get_memused());
+  fprintf(fp, "  \"phases\": [");
+  for (i = 0; i < TIMING_PHASE_COUNT; ++i)
+  {
+    phase_stats_t * p = phase_stats + i;
+
+    if (!p->calls) continue;
+
+    fprintf(fp, "%s\n    { \"name\": \"%s\", \"calls\": %ld, "
+                "\"wall\": %.6f, \"user\": %.6f, \"sys\": %.6f, "
+                "\"bytes\": %ld, \"loci\": %ld, "
+                "\"mb_per_sec\": %.3f, \"loci_per_sec\": %.3f }",
+            first ? "" : ",",
+            phase_names[i], p->calls, p->wall/1e6, p->user/1e6, p->sys/1e6,
+            p->bytes, p->loci, rate(p->bytes,p->wall) / (1024*1024),
+            rate(p->loci,p->wall));
+    first = 0;
+  }
+  fprintf(fp, "\n  ]\n}\n");
+}
+
+int timing_report(long text,
+                  const char * jsonfile,
+                  const char * command,
+                  long threads)
+{
+  double user, sys;
+
+  if (!timing_active) return BPP_SUCCESS;
+
+  long wall = getusec() - timing_start_wall;
+  arch_get_user_system_time(&user, &sys);
+  user -= timing_start_user;
+  sys  -= timing_start_sys;
+
+  if (text)
+    report_text(stderr, wall, user, sys);
+
+  if (jsonfile)
+  {
+    FILE * fp = fopen(jsonfile, "w");
+    if (!fp)
+    {
+      bpp_errno = ERROR_FILE_OPEN;
+      snprintf(bpp_errmsg, 200, "Unable to open file (%.150s)", jsonfile);
+      return BPP_FAILURE;
+    }
+    report_json(fp, wall, user, sys, command, threads);
+    int ok = !ferror(fp);
+    ok = !fclose(fp) && ok;
+    if (!ok)
+    {
+      bpp_errno = ERROR_FILE_OPEN;
+      snprintf(bpp_errmsg, 200, "Unable to write file (%.150s)", jsonfile);
+      return BPP_FAILURE;
+    }
+  }
+
+  return BPP_SUCCESS;
+}
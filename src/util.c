@@ -19,27 +19,27 @@
     University College London, Gower Street, London WC1E 6BT, England
 */
 
-#include "bpp-tools.h"
+#include "libbpptools.h"
 
 static const char * progress_prompt;
 static unsigned long progress_next;
 static unsigned long progress_size;
 static unsigned long progress_chunk;
 static const unsigned long progress_granularity = 200;
+static long progress_quiet = 0;
 
-void fatal(const char * format, ...)
+/* error state of the library functions, see bpp_errno */
+__THREAD int bpp_errno;
+__THREAD char bpp_errmsg[200] = {0};
+
+void progress_setquiet(long quiet)
 {
-  va_list argptr;
-  va_start(argptr, format);
-  vfprintf(stderr, format, argptr);
-  va_end(argptr);
-  fprintf(stderr, "\n");
-  exit(1);
+  progress_quiet = quiet;
 }
 
 void progress_init(const char * prompt, unsigned long size)
 {
-  if (!opt_quiet)
+  if (!progress_quiet)
   {
     progress_prompt = prompt;
     progress_size = size;
@@ -52,7 +52,7 @@ void progress_init(const char * prompt, unsigned long size)
 
 void progress_update(unsigned long progress)
 {
-  if (!opt_quiet)
+  if (!progress_quiet)
   {
     if (progress >= progress_next)
     {
@@ -65,36 +65,102 @@ void progress_update(unsigned long progress)
 
 void progress_done()
 {
-  if (!opt_quiet)
+  if (!progress_quiet)
     fprintf(stderr, "  \r%s %.0f%%\n", progress_prompt, 100.0);
 }
 
-void * xmalloc(size_t size)
+#ifdef _MSC_VER
+static int vasprintf(char **strp, const char *fmt, va_list ap)
+{
+  int len = _vscprintf(fmt, ap);
+  if (len == -1) return -1;
+
+  size_t size = (size_t)len+1;
+
+  char * str = (char *)malloc(size);
+  if (!str) return -1;
+
+  int r = vsprintf_s(str, len + 1, fmt, ap);
+  if (r == -1)
+  {
+    free(str);
+    return -1;
+  }
+
+  *strp = str;
+  return r;
+}
+
+int xasprintf(char ** strp, const char * fmt, ...)
 {
-  void * t;
-  t = malloc(size);
-  if (!t)
-    fatal("Unable to allocate enough memory.");
+  va_list ap;
+  va_start(ap,fmt);
+  int r = vasprintf(strp,fmt,ap);
+  va_end(ap);
+  return r;
+}
+#endif
+
+/* allocation helpers of the library, which set bpp_errno and return NULL
+   instead of exiting when memory runs out */
 
-  return t;
+static void * alloc_failed(void)
+{
+  bpp_errno = ERROR_MEMORY;
+  snprintf(bpp_errmsg, 200, "Unable to allocate enough memory.");
+  return NULL;
 }
 
-void * xcalloc(size_t nmemb, size_t size)
+void * bpp_malloc(size_t size)
 {
-  void * t;
-  t = calloc(nmemb,size);
-  if (!t)
-    fatal("Unable to allocate enough memory.");
+  void * t = malloc(size);
+  return t ? t : alloc_failed();
+}
 
-  return t;
+void * bpp_calloc(size_t nmemb, size_t size)
+{
+  void * t = calloc(nmemb,size);
+  return t ? t : alloc_failed();
 }
 
-void * xrealloc(void *ptr, size_t size)
+/* on failure ptr is left allocated */
+void * bpp_realloc(void * ptr, size_t size)
 {
   void * t = realloc(ptr, size);
-  if (!t)
-    fatal("Unable to allocate enough memory.");
-  return t;
+  return t ? t : alloc_failed();
+}
+
+void * bpp_aligned_alloc(size_t size, size_t alignment)
+{
+  void * t = pll_aligned_alloc(size, alignment);
+  return t ? t : alloc_failed();
+}
+
+char * bpp_strdup(const char * s)
+{
+  return bpp_strndup(s, strlen(s));
+}
+
+char * bpp_strndup(const char * s, size_t len)
+{
+  char * p = (char *)bpp_malloc(len+1);
+  if (!p)
+    return NULL;
+  memcpy(p,s,len);
+  p[len] = 0;
+  return p;
+}
+
+char * bpp_asprintf(const char * fmt, ...)
+{
+  va_list ap;
+  char * s;
+
+  va_start(ap,fmt);
+  int r = vasprintf(&s,fmt,ap);
+  va_end(ap);
+
+  return r < 0 ? alloc_failed() : s;
 }
 
 char * xstrchrnul(char *s, int c)
@@ -107,38 +173,20 @@ char * xstrchrnul(char *s, int c)
     return (char *)s + strlen(s);
 }
 
-char * xstrdup(const char * s)
+/* position of fp, or 0 if the stream is not seekable (e.g. a pipe) */
+long bpp_ftell(FILE * fp)
 {
-  size_t len = strlen(s);
-  char * p = (char *)xmalloc(len+1);
-  return strcpy(p,s);
-}
+  long pos = ftell(fp);
 
-char * xstrndup(const char * s, size_t len)
-{
-  char * p = (char *)xmalloc(len+1);
-  strncpy(p,s,len);
-  p[len] = 0;
-  return p;
+  return pos < 0 ? 0 : pos;
 }
 
-#if 0
 long getusec(void)
 {
   struct timeval tv;
   if(gettimeofday(&tv,0) != 0) return 0;
   return tv.tv_sec * 1000000 + tv.tv_usec;
 }
-#endif
-
-FILE * xopen(const char * filename, const char * mode)
-{
-  FILE * out = fopen(filename, mode);
-  if (!out)
-    fatal("Cannot open file %s", filename);
-
-  return out;
-}
 
 void * pll_aligned_alloc(size_t size, size_t alignment)
 {
@@ -163,38 +211,6 @@ void pll_aligned_free(void * ptr)
 #endif
 }
 
-#ifdef _MSC_VER
-static int vasprintf(char **strp, const char *fmt, va_list ap)
-{
-  int len = _vscprintf(fmt, ap);
-  if (len == -1) return -1;
-
-  size_t size = (size_t)len+1;
-
-  char * str = (char *)malloc(size);
-  if (!str) return -1;
-
-  int r = vsprintf_s(str, len + 1, fmt, ap);
-  if (r == -1)
-  {
-    free(str);
-    return -1;
-  }
-
-  *strp = str;
-  return r;
-}
-
-int xasprintf(char ** strp, const char * fmt, ...)
-{
-  va_list ap;
-  va_start(ap,fmt);
-  int r = vasprintf(strp,fmt,ap);
-  va_end(ap);
-  return r;
-}
-#endif
-
 int xtolower(int c)
 {
   if (c < 0 || c >= 256) return c;
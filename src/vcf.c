@@ -0,0 +1,1115 @@
+/*
+    Copyright (C) 2022-2023 Tomas Flouri
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+    Department of Genetics, Evolution and Environment,
+    University College London, Gower Street, London WC1E 6BT, England
+*/
+
+
+#include "libbpptools.h"
+
+/* VCF to BPP loci conversion. The reference FASTA is read one chromosome
+   at a time; for each chromosome, the VCF records that fall in the BED
+   intervals of that chromosome are collected, and the loci are then built
+   in parallel by the pipeline workers and written in order. Hence memory
+   is bounded by one chromosome and its variants within intervals. The VCF
+   must be sorted and list chromosomes in reference order. Input files may
+   be gzipped. */
+
+typedef struct gzline_s
+{
+  gzFile fp;
+  const char * filename;
+  char * line;
+  size_t size;
+  size_t maxsize;
+  long lineno;
+  int failed;     /* the line buffer could not grow */
+} gzline_t;
+
+typedef struct interval_s
+{
+  char * chrom;
+  long start;     /* 0-based, inclusive */
+  long end;       /* 0-based, exclusive */
+  long lineno;
+  long done;
+} interval_t;
+
+typedef struct individual_s
+{
+  char * name;
+  char * species;
+} individual_t;
+
+typedef struct variant_s
+{
+  long pos;       /* 0-based */
+  long offset;    /* index of the first allele in genotypes */
+} variant_t;
+
+typedef struct vcf_job_s
+{
+  /* intervals, sorted by chromosome and start */
+  interval_t * intervals;
+  long intervals_count;
+
+  /* sample individuals used, in VCF order */
+  individual_t * samples;
+  long samples_count;
+  long * sample_map;        /* VCF sample index to used sample or -1 */
+  long vcf_samples;
+
+  /* current chromosome */
+  char * chrom;
+  char * ref;
+  long ref_length;
+  long ref_maxlength;
+
+  /* variants within intervals of the current chromosome; each variant has
+     two alleles (bases) per used sample */
+  variant_t * variants;
+  long variants_count;
+  long variants_maxcount;
+  char * genotypes;
+  long genotypes_maxsize;
+
+  long phased;
+  long failed;
+  FILE * fp;
+  vcf_stats_t * stats;
+
+  /* intervals of the current chromosome, the first one that may contain
+     the next VCF record, and the next one handed to the pipeline */
+  long first;
+  long last;
+  long sweep;
+  long next;
+} vcf_job_t;
+
+static char * gz_getline(gzline_t * r)
+{
+  size_t len;
+
+  r->size = 0;
+  while (1)
+  {
+    if (r->maxsize - r->size < 2)
+    {
+      size_t maxsize = r->maxsize ? 2*r->maxsize : 4096;
+      char * line = (char *)bpp_realloc(r->line, maxsize);
+
+      /* callers tell the end of the file from a failure by r->failed */
+      if (!line)
+      {
+        r->failed = 1;
+        return NULL;
+      }
+      r->line = line;
+      r->maxsize = maxsize;
+    }
+
+    if (!gzgets(r->fp, r->line + r->size,
+                (int)MIN(r->maxsize - r->size, INT_MAX)))
+      break;
+
+    len = strlen(r->line + r->size);
+    r->size += len;
+
+    if (len && r->line[r->size-1] == '\n')
+      break;
+  }
+
+  if (!r->size)
+    return NULL;
+
+  /* strip newline and carriage return */
+  while (r->size && (r->line[r->size-1] == '\n' || r->line[r->size-1] == '\r'))
+    r->line[--r->size] = 0;
+
+  r->lineno++;
+  return r->line;
+}
+
+static int gz_open(gzline_t * r, const char * filename)
+{
+  memset(r, 0, sizeof(gzline_t));
+
+  r->filename = filename;
+  if (!(r->fp = gzopen(filename, "r")))
+  {
+    bpp_errno = ERROR_FILE_OPEN;
+    snprintf(bpp_errmsg, 200, "Unable to open file (%.150s)", filename);
+    return BPP_FAILURE;
+  }
+  gzbuffer(r->fp, 1 << 18);
+
+  return BPP_SUCCESS;
+}
+
+static void gz_close(gzline_t * r)
+{
+  if (r->fp)
+    gzclose(r->fp);
+  free(r->line);
+}
+
+static int blank(const char * s)
+{
+  while (*s && isspace((unsigned char)*s)) ++s;
+  return !*s;
+}
+
+static int cb_interval_cmp(const void * a, const void * b)
+{
+  const interval_t * x = (const interval_t *)a;
+  const interval_t * y = (const interval_t *)b;
+  int rc = strcmp(x->chrom, y->chrom);
+
+  if (rc) return rc;
+  if (x->start != y->start) return x->start < y->start ? -1 : 1;
+  if (x->end != y->end) return x->end < y->end ? -1 : 1;
+
+  return 0;
+}
+
+static int load_bed(vcf_job_t * job, const char * filename)
+{
+  long maxcount = 1024;
+  char * line;
+  gzline_t r;
+
+  if (!gz_open(&r, filename))
+    return BPP_FAILURE;
+
+  job->intervals = (interval_t *)bpp_malloc((size_t)maxcount *
+                                            sizeof(interval_t));
+  if (!job->intervals)
+  {
+    gz_close(&r);
+    return BPP_FAILURE;
+  }
+
+  while ((line = gz_getline(&r)))
+  {
+    char chrom[256];
+    long start, end;
+
+    if (blank(line) || line[0] == '#' || !strncmp(line, "track", 5) ||
+        !strncmp(line, "browser", 7))
+      continue;
+
+    if (sscanf(line, "%255s %ld %ld", chrom, &start, &end) != 3 ||
+        start < 0 || end <= start)
+    {
+      bpp_errno = ERROR_BED_SYNTAX;
+      snprintf(bpp_errmsg, 200, "Invalid interval on line %ld of %.150s",
+               r.lineno, filename);
+      gz_close(&r);
+      return BPP_FAILURE;
+    }
+
+    if (job->intervals_count == maxcount)
+    {
+      interval_t * temp = (interval_t *)bpp_realloc(job->intervals,
+                                                    (size_t)(2*maxcount) *
+                                                    sizeof(interval_t));
+      if (!temp)
+      {
+        gz_close(&r);
+        return BPP_FAILURE;
+      }
+      job->intervals = temp;
+      maxcount *= 2;
+    }
+
+    interval_t * iv = job->intervals + job->intervals_count;
+    if (!(iv->chrom = bpp_strdup(chrom)))
+    {
+      gz_close(&r);
+      return BPP_FAILURE;
+    }
+    job->intervals_count++;
+    iv->start = start;
+    iv->end = end;
+    iv->lineno = r.lineno;
+    iv->done = 0;
+  }
+  gz_close(&r);
+
+  if (r.failed)
+    return BPP_FAILURE;
+
+  if (!job->intervals_count)
+  {
+    bpp_errno = ERROR_BED_SYNTAX;
+    snprintf(bpp_errmsg, 200, "No intervals in %.150s", filename);
+    return BPP_FAILURE;
+  }
+
+  qsort(job->intervals, (size_t)job->intervals_count, sizeof(interval_t),
+        cb_interval_cmp);
+
+  return BPP_SUCCESS;
+}
+
+static void imap_destroy(individual_t * imap, long count)
+{
+  long i;
+
+  for (i = 0; i < count; ++i)
+  {
+    free(imap[i].name);
+    free(imap[i].species);
+  }
+  free(imap);
+}
+
+/* Imap rows are 'individual species' pairs, as in BPP */
+static individual_t * load_imap(const char * filename, long * count)
+{
+  long maxcount = 64;
+  char * line;
+  gzline_t r;
+  individual_t * imap;
+
+  if (!gz_open(&r, filename))
+    return NULL;
+
+  imap = (individual_t *)bpp_malloc((size_t)maxcount*sizeof(individual_t));
+  *count = 0;
+  if (!imap)
+  {
+    gz_close(&r);
+    return NULL;
+  }
+
+  while ((line = gz_getline(&r)))
+  {
+    char name[256], species[256];
+
+    if (blank(line) || line[0] == '#')
+      continue;
+
+    if (sscanf(line, "%255s %255s", name, species) != 2)
+    {
+      bpp_errno = ERROR_PARSE_INCORRECTFORMAT;
+      snprintf(bpp_errmsg, 200, "Invalid Imap entry on line %ld of %.150s",
+               r.lineno, filename);
+      goto failure;
+    }
+
+    if (*count == maxcount)
+    {
+      individual_t * temp;
+
+      temp = (individual_t *)bpp_realloc(imap, (size_t)(2*maxcount) *
+                                               sizeof(individual_t));
+      if (!temp)
+        goto failure;
+      imap = temp;
+      maxcount *= 2;
+    }
+    imap[*count].name = bpp_strdup(name);
+    imap[*count].species = bpp_strdup(species);
+    (*count)++;
+    if (!imap[*count-1].name || !imap[*count-1].species)
+      goto failure;
+  }
+  gz_close(&r);
+
+  if (r.failed)
+  {
+    imap_destroy(imap, *count);
+    *count = 0;
+    return NULL;
+  }
+
+  return imap;
+
+failure:
+  imap_destroy(imap, *count);
+  *count = 0;
+  gz_close(&r);
+  return NULL;
+}
+
+static int cb_cmp_name(void * x, void * y)
+{
+  return !strcmp(((individual_t *)x)->name, (char *)y);
+}
+
+/* parse the #CHROM line and select the samples listed in the Imap */
+static int parse_samples(vcf_job_t * job,
+                         char * line,
+                         individual_t * imap,
+                         long imap_count,
+                         const char * filename)
+{
+  long i,k;
+  long field = 0;
+  char * s;
+  char * saveptr = NULL;
+  long * found = (long *)bpp_calloc((size_t)imap_count, sizeof(long));
+  hashtable_t * ht = hashtable_create((unsigned long)imap_count);
+
+  if (!found || !ht)
+    goto failure;
+
+  for (i = 0; i < imap_count; ++i)
+  {
+    unsigned long hash = hash_fnv(imap[i].name);
+
+    if (hashtable_find(ht, imap[i].name, hash, cb_cmp_name))
+    {
+      bpp_errno = ERROR_PARSE_INCORRECTFORMAT;
+      snprintf(bpp_errmsg, 200, "Individual %.100s listed twice in Imap",
+               imap[i].name);
+      goto failure;
+    }
+    if (!hashtable_insert_force(ht, imap+i, hash))
+      goto failure;
+  }
+
+  job->sample_map = NULL;
+  job->vcf_samples = 0;
+  job->samples = (individual_t *)bpp_malloc((size_t)imap_count *
+                                            sizeof(individual_t));
+  if (!job->samples)
+    goto failure;
+
+  for (s = strtok_r(line, "\t", &saveptr); s; s = strtok_r(NULL, "\t", &saveptr))
+  {
+    if (field++ < 9) continue;
+
+    long * map = (long *)bpp_realloc(job->sample_map,
+                                     (size_t)(job->vcf_samples+1) *
+                                     sizeof(long));
+    if (!map)
+      goto failure;
+    job->sample_map = map;
+    job->sample_map[job->vcf_samples] = -1;
+
+    individual_t * ind = (individual_t *)hashtable_find(ht, s, hash_fnv(s),
+                                                        cb_cmp_name);
+    if (ind)
+    {
+      k = ind - imap;
+      if (found[k])
+      {
+        bpp_errno = ERROR_VCF_SYNTAX;
+        snprintf(bpp_errmsg, 200, "Sample %.80s listed twice in %.80s",
+                 s, filename);
+        goto failure;
+      }
+      found[k] = 1;
+      job->sample_map[job->vcf_samples] = job->samples_count;
+      job->samples[job->samples_count].name = ind->name;
+      job->samples[job->samples_count].species = ind->species;
+      job->samples_count++;
+    }
+    job->vcf_samples++;
+  }
+
+  for (i = 0; i < imap_count; ++i)
+    if (!found[i])
+    {
+      bpp_errno = ERROR_VCF_SYNTAX;
+      snprintf(bpp_errmsg, 200, "Individual %.80s of Imap not found in %.80s",
+               imap[i].name, filename);
+      goto failure;
+    }
+
+  hashtable_destroy(ht, NULL);
+  free(found);
+  return BPP_SUCCESS;
+
+failure:
+  if (ht)
+    hashtable_destroy(ht, NULL);
+  free(found);
+  return BPP_FAILURE;
+}
+
+/* set the range of intervals on the current chromosome */
+static void find_intervals(vcf_job_t * job)
+{
+  long lo = 0;
+  long hi = job->intervals_count;
+
+  while (lo < hi)
+  {
+    long mid = (lo+hi)/2;
+    if (strcmp(job->intervals[mid].chrom, job->chrom) < 0)
+      lo = mid+1;
+    else
+      hi = mid;
+  }
+
+  job->first = lo;
+  for (hi = lo; hi < job->intervals_count; ++hi)
+    if (strcmp(job->intervals[hi].chrom, job->chrom))
+      break;
+  job->last = hi;
+}
+
+/* Reference reader; the header of the next chromosome is kept in the line
+   buffer between calls */
+static int ref_next(gzline_t * r, vcf_job_t * job)
+{
+  long store;
+  char * line = r->size ? r->line : NULL;
+
+  free(job->chrom);
+  job->chrom = NULL;
+  job->ref_length = 0;
+
+  /* find the next header */
+  if (!line)
+    while ((line = gz_getline(r)) && blank(line));
+
+  if (!line)
+    return r->failed ? -1 : 0;
+
+  if (line[0] != '>')
+  {
+    bpp_errno = ERROR_FASTA_SYNTAX;
+    snprintf(bpp_errmsg, 200, "Expected '>' on line %ld of %.150s",
+             r->lineno, r->filename);
+    return -1;
+  }
+
+  /* chromosome name is the first word of the header */
+  char * end = line+1;
+  while (*end && !isspace((unsigned char)*end)) ++end;
+  if (!(job->chrom = bpp_strndup(line+1, (size_t)(end-line-1))))
+    return -1;
+
+  /* only chromosomes with intervals are kept in memory */
+  find_intervals(job);
+  store = job->last > job->first;
+
+  while ((line = gz_getline(r)) && line[0] != '>')
+  {
+    if (!store) continue;
+
+    if (job->ref_length + (long)r->size + 1 > job->ref_maxlength)
+    {
+      long maxlength = MAX(2*job->ref_maxlength,
+                           job->ref_length + (long)r->size + 1);
+      char * ref = (char *)bpp_realloc(job->ref, (size_t)maxlength);
+
+      if (!ref)
+        return -1;
+      job->ref = ref;
+      job->ref_maxlength = maxlength;
+    }
+
+    char * p;
+    for (p = line; *p; ++p)
+      if (!isspace((unsigned char)*p))
+        job->ref[job->ref_length++] = (char)toupper((unsigned char)*p);
+  }
+
+  if (r->failed)
+    return -1;
+
+  /* keep the next header, if any, in the line buffer */
+  if (!line)
+    r->size = 0;
+
+  return 1;
+}
+
+/* return the next field of a tab-separated line and advance *s */
+static char * next_field(char ** s)
+{
+  char * field = *s;
+  char * tab;
+
+  if (!field) return NULL;
+
+  tab = strchr(field, '\t');
+  if (tab)
+  {
+    *tab = 0;
+    *s = tab+1;
+  }
+  else
+    *s = NULL;
+
+  return field;
+}
+
+/* return 1 if the 0-based position is within an interval of the current
+   chromosome */
+static long in_interval(vcf_job_t * job, long pos)
+{
+  long k;
+
+  /* intervals that end before pos cannot contain later positions either */
+  while (job->sweep < job->last && job->intervals[job->sweep].end <= pos)
+    ++job->sweep;
+
+  for (k = job->sweep; k < job->last && job->intervals[k].start <= pos; ++k)
+    if (job->intervals[k].end > pos)
+      return 1;
+
+  return 0;
+}
+
+/* parse the genotypes of a VCF record (after the FORMAT column) into two
+   bases per used sample */
+static int parse_genotypes(vcf_job_t * job,
+                           char * s,
+                           long gt_index,
+                           const char * alleles,
+                           long alleles_count,
+                           gzline_t * r)
+{
+  long i,j;
+  char * g = job->genotypes + job->variants_count*2*job->samples_count;
+
+  for (i = 0; i < job->vcf_samples; ++i)
+  {
+    char * field = next_field(&s);
+    long k = job->sample_map[i];
+
+    if (!field)
+    {
+      bpp_errno = ERROR_VCF_SYNTAX;
+      snprintf(bpp_errmsg, 200, "Missing genotypes on line %ld of %.150s",
+               r->lineno, r->filename);
+      return BPP_FAILURE;
+    }
+
+    if (k < 0) continue;
+
+    /* move to the GT subfield */
+    for (j = 0; j < gt_index && field; ++j)
+      field = strchr(field, ':') ? strchr(field, ':')+1 : NULL;
+
+    char a[2] = {'N','N'};
+    long n = 0;
+    long unphased = 0;
+    while (field && *field && *field != ':' && n < 2)
+    {
+      if (*field == '.')
+      {
+        a[n++] = 'N';
+        ++field;
+      }
+      else if (isdigit((unsigned char)*field))
+      {
+        long allele = strtol(field, &field, 10);
+        if (allele >= alleles_count)
+        {
+          bpp_errno = ERROR_VCF_SYNTAX;
+          snprintf(bpp_errmsg, 200, "Invalid allele %ld on line %ld of "
+                   "%.120s", allele, r->lineno, r->filename);
+          return BPP_FAILURE;
+        }
+        a[n++] = alleles[allele];
+      }
+      else
+      {
+        bpp_errno = ERROR_VCF_SYNTAX;
+        snprintf(bpp_errmsg, 200, "Invalid genotype on line %ld of %.150s",
+                 r->lineno, r->filename);
+        return BPP_FAILURE;
+      }
+
+      if (*field == '/')
+        unphased = 1;
+      if (*field == '/' || *field == '|')
+        ++field;
+    }
+
+    /* haploid calls */
+    if (n == 1)
+      a[1] = a[0];
+
+    if (unphased && a[0] != a[1])
+      job->stats->unphased++;
+
+    g[2*k]   = a[0];
+    g[2*k+1] = a[1];
+  }
+
+  return BPP_SUCCESS;
+}
+
+/* parse a VCF record of the current chromosome; records outside intervals,
+   non-SNPs and filtered records are skipped */
+static int parse_record(vcf_job_t * job, char * line, gzline_t * r)
+{
+  long i;
+  long pos;
+  long gt_index;
+  long alleles_count;
+  char alleles[64];
+  char * s = line;
+  char * field;
+
+  next_field(&s);   /* CHROM */
+  field = next_field(&s);
+  if (!field || (pos = atol(field)) < 1)
+  {
+    bpp_errno = ERROR_VCF_SYNTAX;
+    snprintf(bpp_errmsg, 200, "Invalid position on line %ld of %.150s",
+             r->lineno, r->filename);
+    return BPP_FAILURE;
+  }
+  --pos;
+
+  if (job->variants_count && pos < job->variants[job->variants_count-1].pos)
+  {
+    bpp_errno = ERROR_VCF_SYNTAX;
+    snprintf(bpp_errmsg, 200, "Records not sorted by position on line %ld of "
+             "%.120s", r->lineno, r->filename);
+    return BPP_FAILURE;
+  }
+
+  if (!in_interval(job, pos))
+    return BPP_SUCCESS;
+
+  if (pos >= job->ref_length)
+  {
+    bpp_errno = ERROR_VCF_SYNTAX;
+    snprintf(bpp_errmsg, 200, "Position %ld of %.50s on line %ld of %.60s is "
+             "beyond the reference", pos+1, job->chrom, r->lineno,
+             r->filename);
+    return BPP_FAILURE;
+  }
+
+  char * id = next_field(&s);
+  char * ref = next_field(&s);
+  char * alt = next_field(&s);
+  char * qual = next_field(&s);
+  char * filter = next_field(&s);
+  char * info = next_field(&s);
+  char * format = next_field(&s);
+
+  (void) id;
+  (void) qual;
+  (void) info;
+
+  if (!format)
+  {
+    bpp_errno = ERROR_VCF_SYNTAX;
+    snprintf(bpp_errmsg, 200, "Missing columns on line %ld of %.150s",
+             r->lineno, r->filename);
+    return BPP_FAILURE;
+  }
+
+  if (strcmp(filter, "PASS") && strcmp(filter, "."))
+  {
+    job->stats->filtered++;
+    return BPP_SUCCESS;
+  }
+
+  /* single nucleotide variants only */
+  if (strlen(ref) != 1)
+  {
+    job->stats->skipped++;
+    return BPP_SUCCESS;
+  }
+
+  alleles[0] = (char)toupper((unsigned char)ref[0]);
+  alleles_count = 1;
+  if (strcmp(alt, "."))
+  {
+    char * a;
+    for (a = alt; *a; a += (a[1] == ',') ? 2 : 1)
+    {
+      if ((a[1] && a[1] != ',') || alleles_count == 64)
+      {
+        job->stats->skipped++;
+        return BPP_SUCCESS;
+      }
+      alleles[alleles_count++] = (*a == '*') ? '-' : (char)toupper((unsigned char)*a);
+      if (!a[1]) break;
+    }
+  }
+
+  if (alleles[0] != job->ref[pos])
+  {
+    bpp_errno = ERROR_VCF_SYNTAX;
+    snprintf(bpp_errmsg, 200, "REF allele %c on line %ld of %.80s differs "
+             "from reference base %c", alleles[0], r->lineno, r->filename,
+             job->ref[pos]);
+    return BPP_FAILURE;
+  }
+
+  /* locate the GT key */
+  gt_index = 0;
+  for (i = 0; format[i]; ++i)
+  {
+    if (!strncmp(format+i, "GT", 2) && (format[i+2] == ':' || !format[i+2]) &&
+        (!i || format[i-1] == ':'))
+      break;
+    if (format[i] == ':')
+      ++gt_index;
+  }
+  if (!format[i])
+  {
+    bpp_errno = ERROR_VCF_SYNTAX;
+    snprintf(bpp_errmsg, 200, "No GT field on line %ld of %.150s",
+             r->lineno, r->filename);
+    return BPP_FAILURE;
+  }
+
+  /* make space for the variant */
+  if (job->variants_count == job->variants_maxcount)
+  {
+    long maxcount = job->variants_maxcount ? 2*job->variants_maxcount : 1024;
+    variant_t * variants;
+    char * genotypes;
+
+    variants = (variant_t *)bpp_realloc(job->variants,
+                                        (size_t)maxcount * sizeof(variant_t));
+    if (!variants)
+      return BPP_FAILURE;
+    job->variants = variants;
+
+    genotypes = (char *)bpp_realloc(job->genotypes,
+                                    (size_t)(maxcount * 2 *
+                                             job->samples_count));
+    if (!genotypes)
+      return BPP_FAILURE;
+    job->genotypes = genotypes;
+    job->variants_maxcount = maxcount;
+  }
+
+  if (!parse_genotypes(job, s, gt_index, alleles, alleles_count, r))
+    return BPP_FAILURE;
+
+  job->variants[job->variants_count].pos = pos;
+  job->variants[job->variants_count].offset =
+    job->variants_count * 2 * job->samples_count;
+  job->variants_count++;
+  job->stats->variants++;
+
+  return BPP_SUCCESS;
+}
+
+static char iupac(char a, char b)
+{
+  if (a == b) return a;
+  if (a == 'N' || b == 'N' || a == '-' || b == '-') return 'N';
+
+  if (a > b) { char t = a; a = b; b = t; }
+
+  if (a == 'A' && b == 'C') return 'M';
+  if (a == 'A' && b == 'G') return 'R';
+  if (a == 'A' && b == 'T') return 'W';
+  if (a == 'C' && b == 'G') return 'S';
+  if (a == 'C' && b == 'T') return 'Y';
+  if (a == 'G' && b == 'T') return 'K';
+
+  return 'N';
+}
+
+static void * cb_read(void * data)
+{
+  vcf_job_t * job = (vcf_job_t *)data;
+
+  if (job->next == job->last)
+    return NULL;
+
+  return (void *)(job->intervals + job->next++);
+}
+
+/* build the locus of an interval from the reference and the variants */
+static void * cb_locus(void * item, long index, void * data)
+{
+  long i,j,k;
+  interval_t * iv = (interval_t *)item;
+  vcf_job_t * job = (vcf_job_t *)data;
+  long ploidy = job->phased ? 2 : 1;
+  long lo, hi;
+
+  (void) index;
+
+  /* the writer reports a missing locus as an allocation failure */
+  msa_t * msa = (msa_t *)bpp_calloc(1,sizeof(msa_t));
+  if (!msa)
+    return NULL;
+  msa->count = job->samples_count * ploidy;
+  msa->length = iv->end - iv->start;
+  msa->label = (char **)bpp_calloc((size_t)msa->count, sizeof(char *));
+  msa->sequence = (char **)bpp_calloc((size_t)msa->count, sizeof(char *));
+  if (!msa->label || !msa->sequence)
+  {
+    msa_destroy(msa);
+    return NULL;
+  }
+
+  for (i = 0; i < job->samples_count; ++i)
+    for (j = 0; j < ploidy; ++j)
+    {
+      k = i*ploidy + j;
+      if (job->phased)
+        msa->label[k] = bpp_asprintf("%s_%ld^%s", job->samples[i].name, j+1,
+                                     job->samples[i].species);
+      else
+        msa->label[k] = bpp_asprintf("%s^%s", job->samples[i].name,
+                                     job->samples[i].species);
+
+      msa->sequence[k] = (char *)bpp_malloc((size_t)msa->length+1);
+      if (!msa->label[k] || !msa->sequence[k])
+      {
+        msa_destroy(msa);
+        return NULL;
+      }
+      memcpy(msa->sequence[k], job->ref + iv->start, (size_t)msa->length);
+      msa->sequence[k][msa->length] = 0;
+    }
+
+  /* first variant in the interval */
+  lo = 0; hi = job->variants_count;
+  while (lo < hi)
+  {
+    long mid = (lo+hi)/2;
+    if (job->variants[mid].pos < iv->start)
+      lo = mid+1;
+    else
+      hi = mid;
+  }
+
+  for (; lo < job->variants_count && job->variants[lo].pos < iv->end; ++lo)
+  {
+    const variant_t * v = job->variants + lo;
+    const char * g = job->genotypes + v->offset;
+    long site = v->pos - iv->start;
+
+    for (i = 0; i < job->samples_count; ++i)
+    {
+      if (job->phased)
+      {
+        msa->sequence[2*i][site]   = g[2*i];
+        msa->sequence[2*i+1][site] = g[2*i+1];
+      }
+      else
+        msa->sequence[i][site] = iupac(g[2*i], g[2*i+1]);
+    }
+  }
+
+  return (void *)msa;
+}
+
+static long cb_write(void * result, long index, void * data)
+{
+  long bytes = 0;
+  msa_t * msa = (msa_t *)result;
+  vcf_job_t * job = (vcf_job_t *)data;
+
+  (void) index;
+
+  if (!msa)
+  {
+    job->failed = 1;
+    return 0;
+  }
+
+  /* after a failure the remaining loci are only released */
+  if (!job->failed)
+  {
+    bytes = bpp_ftell(job->fp);
+    if (job->stats->loci)
+      fprintf(job->fp, "\n");
+    phylip_print(job->fp, msa);
+    bytes = bpp_ftell(job->fp) - bytes;
+    job->stats->loci++;
+  }
+
+  msa_destroy(msa);
+
+  return bytes;
+}
+
+/* return 1 if the VCF record is on the current chromosome */
+static long same_chrom(const char * line, const char * chrom)
+{
+  size_t len = strlen(chrom);
+
+  return !strncmp(line, chrom, len) && line[len] == '\t';
+}
+
+/* process the chromosomes of the reference in turn */
+static int convert_chromosomes(vcf_job_t * job,
+                               gzline_t * vcf,
+                               gzline_t * ref,
+                               long threads)
+{
+  long i;
+  int rc;
+  char * line = gz_getline(vcf);
+
+  if (vcf->failed)
+    return BPP_FAILURE;
+
+  while ((rc = ref_next(ref, job)) == 1)
+  {
+    if (job->first == job->last)
+    {
+      /* skip any records of a chromosome without intervals */
+      while (line && same_chrom(line, job->chrom))
+        line = gz_getline(vcf);
+      if (vcf->failed)
+        return BPP_FAILURE;
+      continue;
+    }
+
+    for (i = job->first; i < job->last; ++i)
+      if (job->intervals[i].end > job->ref_length)
+      {
+        bpp_errno = ERROR_BED_SYNTAX;
+        snprintf(bpp_errmsg, 200, "Interval on line %ld of BED file exceeds "
+                 "the length (%ld) of %.100s", job->intervals[i].lineno,
+                 job->ref_length, job->chrom);
+        return BPP_FAILURE;
+      }
+
+    /* collect the variants within intervals */
+    job->sweep = job->first;
+    job->variants_count = 0;
+    while (line && same_chrom(line, job->chrom))
+    {
+      if (!parse_record(job, line, vcf))
+        return BPP_FAILURE;
+      line = gz_getline(vcf);
+    }
+    if (vcf->failed)
+      return BPP_FAILURE;
+
+    /* build and write the loci of this chromosome */
+    job->next = job->first;
+    if (!pipeline_run(threads, cb_read, (void *)job,
+                      cb_locus, cb_write, (void *)job))
+      return BPP_FAILURE;
+    if (job->failed)
+    {
+      bpp_errno = ERROR_MEMORY;
+      snprintf(bpp_errmsg, 200, "Unable to allocate enough memory.");
+      return BPP_FAILURE;
+    }
+
+    for (i = job->first; i < job->last; ++i)
+      job->intervals[i].done = 1;
+  }
+
+  if (rc < 0)
+    return BPP_FAILURE;
+
+  if (line)
+  {
+    char * tab = xstrchrnul(line, '\t');
+    *tab = 0;
+    bpp_errno = ERROR_VCF_SYNTAX;
+    snprintf(bpp_errmsg, 200, "Chromosome %.50s on line %ld of %.50s is not "
+             "in the reference or not in reference order",
+             line, vcf->lineno, vcf->filename);
+    return BPP_FAILURE;
+  }
+
+  for (i = 0; i < job->intervals_count; ++i)
+    if (!job->intervals[i].done)
+    {
+      bpp_errno = ERROR_BED_SYNTAX;
+      snprintf(bpp_errmsg, 200, "Chromosome %.100s of BED line %ld not found "
+               "in the reference", job->intervals[i].chrom,
+               job->intervals[i].lineno);
+      return BPP_FAILURE;
+    }
+
+  return BPP_SUCCESS;
+}
+
+/* convert the VCF records of the individuals listed in the Imap to one locus
+   per BED interval, written in reference order */
+int vcf_convert(const char * vcffile,
+                const char * reffile,
+                const char * bedfile,
+                const char * imapfile,
+                long phased,
+                FILE * fp,
+                long threads,
+                vcf_stats_t * stats)
+{
+  long i;
+  long imap_count = 0;
+  int rc = BPP_FAILURE;
+  char * line;
+  individual_t * imap = NULL;
+  vcf_job_t job;
+  gzline_t vcf;
+  gzline_t ref;
+
+  memset(&job, 0, sizeof(vcf_job_t));
+  memset(&vcf, 0, sizeof(gzline_t));
+  memset(&ref, 0, sizeof(gzline_t));
+  memset(stats, 0, sizeof(vcf_stats_t));
+  job.phased = phased;
+  job.fp = fp;
+  job.stats = stats;
+
+  if (!load_bed(&job, bedfile))
+    goto cleanup;
+
+  if (!(imap = load_imap(imapfile, &imap_count)))
+    goto cleanup;
+
+  if (!gz_open(&vcf, vcffile) || !gz_open(&ref, reffile))
+    goto cleanup;
+
+  /* VCF header */
+  while ((line = gz_getline(&vcf)) && !strncmp(line, "##", 2));
+  if (vcf.failed)
+    goto cleanup;
+  if (!line || strncmp(line, "#CHROM", 6))
+  {
+    bpp_errno = ERROR_VCF_SYNTAX;
+    snprintf(bpp_errmsg, 200, "Missing #CHROM header in %.150s", vcffile);
+    goto cleanup;
+  }
+
+  if (!parse_samples(&job, line, imap, imap_count, vcffile))
+    goto cleanup;
+
+  rc = convert_chromosomes(&job, &vcf, &ref, threads);
+
+cleanup:
+  gz_close(&vcf);
+  gz_close(&ref);
+
+  for (i = 0; i < job.intervals_count; ++i)
+    free(job.intervals[i].chrom);
+  free(job.intervals);
+
+  if (imap)
+    imap_destroy(imap, imap_count);
+
+  free(job.samples);
+  free(job.sample_map);
+  free(job.chrom);
+  free(job.ref);
+  free(job.variants);
+  free(job.genotypes);
+
+  return rc;
+}
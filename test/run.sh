@@ -0,0 +1,530 @@
+#!/bin/sh
+#
+# Copyright (C) 2022-2023 Tomas Flouri
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Affero General Public License as
+# published by the Free Software Foundation, either version 3 of the
+# License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Affero General Public License for more details.
+#
+# You should have received a copy of the GNU Affero General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+# Contact: Tomas Flouri <t.flouris@ucl.ac.uk>,
+# Department of Genetics, Evolution and Environment,
+# University College London, Gower Street, London WC1E 6BT, England
+
+# Regression tests: runs bpp-tools on the small datasets in data/ and checks
+# the results that earlier bugs got wrong. Invoked by "make check" in src/.
+#
+# Usage: run.sh [path to bpp-tools]
+
+PROG=${1:-../src/bpp-tools}
+DATA=$(cd "$(dirname "$0")" && pwd)/data
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+failed=0
+
+pass()
+{
+  echo "PASS $1"
+}
+
+fail()
+{
+  echo "FAIL $1"
+  failed=$((failed+1))
+}
+
+# print the value of a "key: value" line of the output
+value()
+{
+  sed -n "s/^$1: *//p" | head -n 1
+}
+
+# compare the output of a test with the expected text
+same()
+{
+  if [ "$1" = "$2" ]; then
+    pass "$3"
+  else
+    fail "$3"
+    printf "expected:\n%s\ngot:\n%s\n" "$2" "$1"
+  fi
+}
+
+# swapping P1 and P2 must flip the sign of D
+test_dstat_order()
+{
+  d1=$($PROG --msa $DATA/dstat.phy --dstat ^S1,^S2,^S3,^S4 | value D)
+  d2=$($PROG --msa $DATA/dstat.phy --dstat ^S2,^S1,^S3,^S4 | value D)
+  if [ -n "$d1" ] && [ -n "$d2" ] &&
+     awk -v a="$d1" -v b="$d2" 'BEGIN { exit !(a != 0 && a == -b) }'; then
+    pass "dstat: P1/P2 swap flips D ($d1, $d2)"
+  else
+    fail "dstat: P1/P2 swap flips D ($d1, $d2)"
+  fi
+
+  if $PROG --msa $DATA/dstat.phy --dstat ^X,^Y,^Z,^W > /dev/null 2>&1; then
+    fail "dstat: unknown taxa rejected"
+  else
+    pass "dstat: unknown taxa rejected"
+  fi
+}
+
+# a cache that cannot be written must not fail the command, and a changed
+# input must replace its cache entry
+test_cache()
+{
+  touch $TMP/notadir
+  d=$($PROG --msa $DATA/dstat.phy --cache $TMP/notadir \
+            --dstat ^S1,^S2,^S3,^S4 2> /dev/null | value D)
+  if [ -n "$d" ]; then
+    pass "cache: unwritable cache directory only warns"
+  else
+    fail "cache: unwritable cache directory only warns"
+  fi
+
+  d=$($PROG --msa $DATA/dstat.phy --cache $TMP/missing/cache \
+            --dstat ^S1,^S2,^S3,^S4 2> /dev/null | value D)
+  if [ -n "$d" ]; then
+    pass "cache: uncreatable cache directory only warns"
+  else
+    fail "cache: uncreatable cache directory only warns"
+  fi
+
+  cp $DATA/dstat.phy $TMP/input.phy
+  $PROG --msa $TMP/input.phy --cache $TMP/cache \
+        --dstat ^S1,^S2,^S3,^S4 > /dev/null 2>&1
+  head -n 5 $DATA/dstat.phy > $TMP/input.phy
+  abba=$($PROG --msa $TMP/input.phy --cache $TMP/cache \
+               --dstat ^S1,^S2,^S3,^S4 2> /dev/null | value abba)
+  entries=$(ls $TMP/cache | wc -l)
+  if [ "$abba" = "2.000000" ] && [ $entries -eq 1 ]; then
+    pass "cache: changed input replaces its entry"
+  else
+    fail "cache: changed input replaces its entry (abba=$abba, $entries entries)"
+  fi
+}
+
+# identical sequences are at distance 0, not -0
+test_jc69_identical()
+{
+  out=$($PROG --msa $DATA/identical.phy --distances jc69 2> /dev/null)
+  if [ -n "$out" ] && ! echo "$out" | grep -q -- "-0\.0"; then
+    pass "distances: jc69 of identical sequences is 0"
+  else
+    fail "distances: jc69 of identical sequences is 0"
+  fi
+}
+
+# c differs from a and b at 1 of 8 sites: p = 0.125 and
+# JC69 = -3/4 ln(1 - 4/3 * 0.125) = 0.136741
+test_distances_values()
+{
+  for m in "p 0.125000" "jc69 0.136741"; do
+    set -- $m
+    out=$($PROG --msa $DATA/identical.phy --distances $1 2> /dev/null |
+          sed -n 4p)
+    same "$out" "c^C        $2 $2 0.000000" "distances: $1 of a known pair"
+  done
+}
+
+# LG distances of protein.phy, whose sequences differ at 1 or 2 of 12
+# sites. The expected values were obtained separately by maximizing the
+# likelihood sum log(pi_x P_xy(t)) with P(t) = exp(Qt) computed by a
+# Taylor series with scaling and squaring instead of an eigendecomposition
+test_mldist_values()
+{
+  out=$($PROG --msa $DATA/protein.phy --distances lg 2> /dev/null)
+  expected=$(printf "%s\n" 3 \
+    "p1^A       0.000000 0.086455 0.166218" \
+    "p2^B       0.086455 0.000000 0.269428" \
+    "p3^C       0.166218 0.269428 0.000000")
+  same "$out" "$expected" "distances: lg of known protein pairs"
+}
+
+# NEXUS export states the data type of each locus
+test_export_nexus()
+{
+  $PROG --msa $DATA/protein.phy --export nexus --out $TMP/protein \
+        > /dev/null 2>&1
+  $PROG --msa $DATA/dstat.phy --export nexus --out $TMP/dna > /dev/null 2>&1
+  if grep -q "DATATYPE=PROTEIN" $TMP/protein.0.nex 2> /dev/null &&
+     grep -q "DATATYPE=DNA" $TMP/dna.0.nex 2> /dev/null; then
+    pass "export: nexus data type of protein and DNA loci"
+  else
+    fail "export: nexus data type of protein and DNA loci"
+  fi
+}
+
+# the stats request of the server prints the same report as --stats tsv
+test_server_stats()
+{
+  if ! command -v python3 > /dev/null; then
+    echo "SKIP server: stats request matches --stats (no python3)"
+    return
+  fi
+
+  $PROG --msa $DATA/dstat.phy --serve $TMP/sock > /dev/null 2>&1 &
+  pid=$!
+  for i in 1 2 3 4 5 6 7 8 9 10; do
+    [ -S $TMP/sock ] && break
+    sleep 0.5
+  done
+
+  python3 - $TMP/sock > $TMP/server.tsv << 'EOF'
+import socket, sys
+s = socket.socket(socket.AF_UNIX)
+s.connect(sys.argv[1])
+s.sendall(b"stats\n")
+f = s.makefile("rb")
+size = int(f.readline().split()[1])
+sys.stdout.write(f.read(size).decode())
+EOF
+
+  # the socket of the running server is not taken over
+  if $PROG --msa $DATA/dstat.phy --serve $TMP/sock > /dev/null 2>&1; then
+    fail "server: socket of a running server is refused"
+  else
+    pass "server: socket of a running server is refused"
+  fi
+
+  kill $pid 2> /dev/null
+  wait $pid 2> /dev/null
+
+  $PROG --msa $DATA/dstat.phy --stats tsv --out $TMP/cli.tsv > /dev/null 2>&1
+  if [ -s $TMP/cli.tsv ] && cmp -s $TMP/server.tsv $TMP/cli.tsv; then
+    pass "server: stats request matches --stats"
+  else
+    fail "server: stats request matches --stats"
+  fi
+
+  # a file at the socket path is left alone
+  echo data > $TMP/notsock
+  if ! $PROG --msa $DATA/dstat.phy --serve $TMP/notsock > /dev/null 2>&1 &&
+     [ "$(cat $TMP/notsock)" = "data" ]; then
+    pass "server: existing file at the socket path is kept"
+  else
+    fail "server: existing file at the socket path is kept"
+  fi
+}
+
+# protein loci are scored with amino acid codes, not as nucleotides
+test_stats_protein()
+{
+  row=$($PROG --msa $DATA/protein.phy --stats tsv 2> /dev/null | grep "^1	")
+  if [ "$row" = "1	3	12	0.000000	0.000000	0	0.000000	3	0	3" ]; then
+    pass "stats: protein locus"
+  else
+    fail "stats: protein locus ($row)"
+  fi
+}
+
+# loci in which a species has fewer copies than its sample size are
+# reported instead of silently left out
+test_sfs_incomplete()
+{
+  err=$($PROG --msa $DATA/sfs.phy --sfs folded 2>&1 > /dev/null)
+  if echo "$err" | grep -q "species A .* 1 of 2 loci" &&
+     ! echo "$err" | grep -q "species B"; then
+    pass "sfs: loci with fewer copies are reported"
+  else
+    fail "sfs: loci with fewer copies are reported"
+  fi
+}
+
+# sites 1, 2 and 4 are monomorphic. Folded per species, A has minor
+# allele count 1 at sites 3, 5 and 6 and B at site 3. Jointly, the minor
+# alleles over all sequences fall at (A,B) = (1,1), (2,0) and (1,0). With
+# the ancestral state of B, site 3 is left out and A carries 2 derived
+# alleles at site 5 and 1 at site 6
+test_sfs_values()
+{
+  out=$($PROG --msa $DATA/spectrum.phy --sfs folded 2> /dev/null)
+  expected=$(printf "%s\t%s\t%s\n" species samples counts \
+    A 3 "3 3 0 0" B 2 "5 1 0" A,B 3,2 "3 0 0 1 1 0 1 0 0 0 0 0")
+  same "$out" "$expected" "sfs: folded spectra of a known locus"
+
+  out=$($PROG --msa $DATA/spectrum.phy --sfs unfolded --outgroup B \
+              2> /dev/null)
+  expected=$(printf "%s\t%s\t%s\n" species samples counts A 3 "3 1 1 0")
+  same "$out" "$expected" "sfs: unfolded spectrum of a known locus"
+}
+
+# --min-seqs and --min-sites take positive integers only
+test_min_options()
+{
+  ok=1
+  for v in abc -1 0 2x; do
+    for opt in --min-seqs --min-sites; do
+      if $PROG --msa $DATA/dstat.phy --filter-missing $opt $v \
+               --out $TMP/min.phy > /dev/null 2>&1; then
+        ok=0
+      fi
+    done
+  done
+  if [ $ok -eq 1 ]; then
+    pass "filter-missing: invalid --min-seqs and --min-sites rejected"
+  else
+    fail "filter-missing: invalid --min-seqs and --min-sites rejected"
+  fi
+
+  ok=1
+  for v in abc 0.5x nan 1.5 -0.1; do
+    for opt in --seq-missing --site-missing; do
+      if $PROG --msa $DATA/dstat.phy --filter-missing $opt $v \
+               --out $TMP/min.phy > /dev/null 2>&1; then
+        ok=0
+      fi
+    done
+  done
+  if [ $ok -eq 1 ]; then
+    pass "filter-missing: invalid --seq-missing and --site-missing rejected"
+  else
+    fail "filter-missing: invalid --seq-missing and --site-missing rejected"
+  fi
+
+  if $PROG --msa $DATA/dstat.phy --ld tsv --ld-min-r2 foo \
+           --out $TMP/ld.tsv > /dev/null 2>&1; then
+    fail "ld: invalid --ld-min-r2 rejected"
+  else
+    pass "ld: invalid --ld-min-r2 rejected"
+  fi
+}
+
+# a parse error in the middle of the input leaves no output behind
+test_no_partial_output()
+{
+  mkdir $TMP/partial
+  for c in "--extract ^S1" "--explode" "--filter-missing" "--stats tsv"; do
+    $PROG --msa $DATA/truncated.phy $c --out $TMP/partial/out \
+          > /dev/null 2>&1 && echo "unexpected success ($c)"
+  done
+  printf "%s\n%s\n" \
+         "$DATA/truncated.phy $TMP/partial/m.phy extract ^S1" \
+         "$DATA/truncated.phy $TMP/partial/m explode" > $TMP/manifest.txt
+  $PROG --manifest $TMP/manifest.txt > /dev/null 2>&1
+
+  left=$(ls $TMP/partial | tr '\n' ' ')
+  if [ -z "$left" ]; then
+    pass "output: failed commands leave no output"
+  else
+    fail "output: failed commands leave no output ($left)"
+  fi
+}
+
+# outputs that are not regular files are written in place, and replaced
+# regular files keep their mode
+test_output_targets()
+{
+  mkdir $TMP/targets
+  : > $TMP/targets/real
+  ln -s real $TMP/targets/link
+  $PROG --msa $DATA/dstat.phy --stats tsv --out $TMP/targets/link \
+        > /dev/null 2>&1
+  mkfifo $TMP/targets/fifo
+  cat $TMP/targets/fifo > $TMP/targets/fifo.out &
+  $PROG --msa $DATA/dstat.phy --stats tsv --out $TMP/targets/fifo \
+        > /dev/null 2>&1
+  wait
+  echo old > $TMP/targets/mode.tsv
+  chmod 640 $TMP/targets/mode.tsv
+  $PROG --msa $DATA/dstat.phy --stats tsv --out $TMP/targets/mode.tsv \
+        > /dev/null 2>&1
+
+  if [ -L $TMP/targets/link ] && [ -s $TMP/targets/real ] &&
+     [ -p $TMP/targets/fifo ] && [ -s $TMP/targets/fifo.out ] &&
+     [ "$(stat -c %a $TMP/targets/mode.tsv)" = "640" ] &&
+     [ "$(head -c 5 $TMP/targets/mode.tsv)" = "locus" ]; then
+    pass "output: links, pipes and file modes are kept"
+  else
+    fail "output: links, pipes and file modes are kept"
+  fi
+}
+
+# a manifest row whose output cannot be written fails on its own, while the
+# outputs of the other rows are kept
+test_manifest_outputs()
+{
+  mkdir $TMP/man
+  printf "%s\n%s\n" \
+         "$DATA/dstat.phy $TMP/man/ok.phy extract ^S1" \
+         "$DATA/dstat.phy /dev/full extract ^S1" > $TMP/man/manifest.txt
+  err=$($PROG --manifest $TMP/man/manifest.txt 2>&1 > /dev/null)
+  rc=$?
+
+  if [ $rc -ne 0 ] && echo "$err" | grep -q "manifest line 2" &&
+     ! echo "$err" | grep -q "manifest line 1" && [ -s $TMP/man/ok.phy ] &&
+     [ -z "$(ls $TMP/man | grep tmp)" ]; then
+    pass "manifest: write errors fail the row only"
+  else
+    fail "manifest: write errors fail the row only"
+  fi
+}
+
+# results written to stdout start with the data, not with the banner
+test_stdout_results()
+{
+  tsv=$($PROG --msa $DATA/dstat.phy --stats tsv 2> /dev/null | head -c 5)
+  json=$($PROG --msa $DATA/dstat.phy --stats json 2> /dev/null | head -c 1)
+  if [ "$tsv" = "locus" ] && [ "$json" = "{" ]; then
+    pass "output: banner is not written to stdout"
+  else
+    fail "output: banner is not written to stdout"
+  fi
+}
+
+# pairwise differences 1,2,3,1,2,1 over 6 pairs and 10 sites give
+# pi = 10/60; 3 segregating sites with a_4 = 11/6 give theta_w = 18/110;
+# each species is a single pair differing at one site
+test_diversity_values()
+{
+  out=$($PROG --msa $DATA/diversity.phy --diversity 2> /dev/null)
+  expected=$(printf "%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n" \
+    locus group sequences sites pairs pi segregating theta_w \
+    1 all 4 10 6 0.166667 3 0.163636 \
+    1 A 2 10 1 0.100000 1 0.100000 \
+    1 B 2 10 1 0.100000 1 0.100000)
+  same "$out" "$expected" "diversity: pi and theta_w of a known locus"
+}
+
+# pooled counts A,C,G,T are 6,4,3,3 of 16. Against the expected counts
+# 3,2,1.5,1.5 per sequence, a (4,2,1,1) and b (2,2,2,2) both give
+# chi2 = 1/3 + 0 + 1/6 + 1/6 on 3 degrees of freedom, whose p-value is
+# erfc(sqrt(x/2)) + sqrt(2x/pi) exp(-x/2)
+test_composition_values()
+{
+  out=$($PROG --msa $DATA/composition.phy --composition pooled 2> /dev/null)
+  expected=$(printf "%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n" \
+    locus sequence datatype chars freqs chi2 df pvalue \
+    1 all dna 16 0.375000,0.250000,0.187500,0.187500 1.333333 3 0.721233 \
+    1 a^A dna 8 0.500000,0.250000,0.125000,0.125000 0.666667 3 0.881015 \
+    1 b^A dna 8 0.250000,0.250000,0.250000,0.250000 0.666667 3 0.881015)
+  same "$out" "$expected" "composition: frequencies and test of a known locus"
+}
+
+# sites 1-4 split the sequences as ab|cd, ac|bd, ab|cd, ac|bd, and site 5
+# is monomorphic. The pairs (1,2), (1,4), (2,3) and (3,4) show all four
+# gametes; the minimal intervals 1-2, 2-3 and 3-4 are disjoint, so Rm = 3
+test_four_gamete_values()
+{
+  out=$($PROG --msa $DATA/fourgamete.phy --four-gamete 2> /dev/null)
+  expected=$(printf "%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n" \
+    locus sequences length informative pairs incompatible rm intervals \
+    splits 1 4 5 4 6 4 3 1-2,2-3,3-4 2,3,4)
+  same "$out" "$expected" "four-gamete: Rm of a known locus"
+}
+
+# over sequences a,b,c,d the sites of locus 1 carry the minor allele in
+# d, cd and bd. For sites 1 and 2, D = 1/4 - 1/4 * 1/2 = 1/8, so
+# r2 = D^2 / (1/4 * 3/4 * 1/2 * 1/2) = 1/3 and D' = D / min(1/8, 3/8) = 1;
+# site 1 and 3 likewise, while sites 2 and 3 are independent. The site of
+# locus 2 lists the sequences in another order and equals site 3
+test_ld_values()
+{
+  out=$($PROG --msa $DATA/ld.phy --ld tsv --ld-between 2> /dev/null)
+  expected=$(printf "%s\t%s\t%s\t%s\t%s\t%s\t%s\n" \
+    locus1 site1 locus2 site2 n r2 dprime \
+    1 1 1 2 4 0.333333 1.000000 \
+    1 1 1 3 4 0.333333 1.000000 \
+    1 2 1 3 4 0.000000 0.000000 \
+    1 1 2 1 4 0.333333 1.000000 \
+    1 2 2 1 4 0.000000 0.000000 \
+    1 3 2 1 4 1.000000 1.000000)
+  same "$out" "$expected" "ld: r2 and D' of known site pairs"
+
+  out=$($PROG --msa $DATA/ld.phy --ld tsv --ld-between --ld-min-r2 0.5 \
+              2> /dev/null | tail -n +2)
+  same "$out" "$(printf "1\t3\t2\t1\t4\t1.000000\t1.000000")" \
+       "ld: --ld-min-r2 keeps the pairs above the threshold"
+}
+
+# a, b and d share one sequence and c and e another; haplotypes are
+# numbered in order of first occurrence and represented by that sequence
+test_haplotypes_values()
+{
+  out=$($PROG --msa $DATA/haplotypes.phy --collapse-haplotypes \
+              --haplotypes $TMP/hap.phy 2> /dev/null)
+  expected=$(printf "%s\t%s\t%s\t%s\n" \
+    locus sequence haplotype multiplicity \
+    1 a^A 1 3 1 b^A 1 3 1 c^B 2 2 1 d^B 1 3 1 e^B 2 2)
+  same "$out" "$expected" "haplotypes: map of a known locus"
+  same "$(cat $TMP/hap.phy)" "$(printf "2 6\na^A ACGTAC\nc^B ACGTTC")" \
+       "haplotypes: unique haplotypes of a known locus"
+}
+
+# locus 1 repeats sequence a, which leaves it equal to locus 2; locus 3
+# lists the same sequences in another order and is a duplicate only when
+# the order is ignored
+test_dedup_values()
+{
+  $PROG --msa $DATA/dedup.phy --dedup ordered --out $TMP/ordered.phy \
+        > /dev/null 2>&1
+  $PROG --msa $DATA/dedup.phy --dedup unordered --out $TMP/unordered.phy \
+        > /dev/null 2>&1
+  same "$(cat $TMP/ordered.phy)" \
+       "$(printf "3 4\na^A ACGT\nb^A ACGA\nc^B ACCT\n%s\n%s\n%s\n%s" \
+                 "3 4" "b^A ACGA" "a^A ACGT" "c^B ACCT")" \
+       "dedup: ordered duplicates of known loci"
+  same "$(cat $TMP/unordered.phy)" \
+       "$(printf "3 4\na^A ACGT\nb^A ACGA\nc^B ACCT")" \
+       "dedup: unordered duplicates of known loci"
+}
+
+# nucleotide analyses reject protein loci with the number of the locus, and
+# tests against an amino acid model reject nucleotide loci
+test_protein_rejected()
+{
+  for c in "--diversity" "--distances p" "--distances jc69" \
+           "--four-gamete" "--ld tsv" "--sfs folded"; do
+    err=$($PROG --msa $DATA/protein4.phy $c --out $TMP/protein.out 2>&1)
+    if [ $? -ne 0 ] && echo "$err" | grep -q "Locus 1 is not a nucleotide"; then
+      pass "protein loci rejected by $c"
+    else
+      fail "protein loci rejected by $c"
+    fi
+  done
+
+  err=$($PROG --msa $DATA/dstat.phy --composition lg --out $TMP/comp.out 2>&1)
+  if [ $? -ne 0 ] && echo "$err" | grep -q "Locus 1 is not a protein"; then
+    pass "nucleotide loci rejected by --composition lg"
+  else
+    fail "nucleotide loci rejected by --composition lg"
+  fi
+}
+
+test_dstat_order
+test_cache
+test_jc69_identical
+test_distances_values
+test_mldist_values
+test_export_nexus
+test_server_stats
+test_stats_protein
+test_sfs_incomplete
+test_sfs_values
+test_min_options
+test_no_partial_output
+test_output_targets
+test_manifest_outputs
+test_stdout_results
+test_protein_rejected
+test_diversity_values
+test_composition_values
+test_four_gamete_values
+test_ld_values
+test_haplotypes_values
+test_dedup_values
+
+if [ $failed -gt 0 ]; then
+  echo "$failed test(s) failed"
+  exit 1
+fi
+echo "All tests passed"